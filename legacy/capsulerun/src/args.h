@@ -33,19 +33,38 @@ struct MainArgs {
 
   // options
   const char *dir;
+  int fmp4;
+  int raw;
+  int segment_seconds;
+  int segment_mb;
+  int max_disk_mb;
+  int direct_io;
+  int sync_mb;
   const char *pix_fmt;
   int crf;
+  const char *rc;
+  int bitrate;
+  int bufsize;
+  int adaptive_quality;
+  int max_crf;
   int no_audio;
   int size_divider;
   int fps;
+  const char *drop_policy;
   bool gpu_color_conv;
   int threads;
   int debug_av;
   int gop_size;
   int max_b_frames;
   int buffered_frames;
+  int shm_budget;
   const char *priority;
   const char *x264_preset;
+  const char *colorspace;
+  const char *colorconv;
+  const char *bench_colorconv;
+  int replay;
+  int replay_spill;
 
   const char *pipe;
   int headless;
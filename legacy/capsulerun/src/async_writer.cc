@@ -0,0 +1,341 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+
+#include "async_writer.h"
+
+#if defined(WIN32)
+#pragma warning(push, 0)
+#endif // WIN32
+extern "C" {
+    #include <libavformat/avio.h>
+    #include <libavutil/mem.h>
+}
+#if defined(WIN32)
+#pragma warning(pop)
+#endif // WIN32
+
+#include <microprofile.h>
+
+#include <lab/io.h>
+#include <lab/memory.h>
+
+#include <errno.h>
+#include <string.h>
+
+#if defined(LAB_WINDOWS)
+#include <io.h> // _commit, _fileno
+#else // LAB_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#endif // !LAB_WINDOWS
+
+#include <algorithm>
+
+#include "logging.h"
+
+namespace capsule {
+
+// what O_DIRECT wants offsets, sizes & buffers aligned to
+static const int64_t kDirectAlign = 4096;
+// libavformat's own buffer, we copy out of it as soon as it's full
+static const int kAvioBufferSize = 64 * 1024;
+
+AsyncWriter::AsyncWriter(const AsyncWriterOptions &options) :
+  options_(options),
+  queue_(options.num_buffers),
+  free_(options.num_buffers) {}
+
+AsyncWriter *AsyncWriter::Open(const std::string &path, const AsyncWriterOptions &options) {
+  auto writer = new AsyncWriter(options);
+  if (!writer->OpenFile(path)) {
+    delete writer;
+    return nullptr;
+  }
+
+  // page-aligned, as O_DIRECT wants it
+  size_t buffer_size = (options.buffer_size + kDirectAlign - 1) / kDirectAlign * kDirectAlign;
+  writer->options_.buffer_size = buffer_size;
+  writer->chunks_.resize(options.num_buffers);
+  for (auto &chunk: writer->chunks_) {
+    chunk.data = reinterpret_cast<uint8_t*>(lab::memory::AllocLarge(buffer_size));
+    if (!chunk.data) {
+      Log("AsyncWriter: could not allocate buffers");
+      delete writer;
+      return nullptr;
+    }
+    chunk.size = 0;
+    writer->free_.Push(&chunk);
+  }
+
+  auto avio_buffer = reinterpret_cast<unsigned char*>(av_malloc(kAvioBufferSize));
+  writer->avio_ = avio_alloc_context(avio_buffer, kAvioBufferSize, 1 /* write */, writer,
+    nullptr, WritePacket, Seek);
+  if (!writer->avio_) {
+    Log("AsyncWriter: could not allocate I/O context");
+    av_free(avio_buffer);
+    delete writer;
+    return nullptr;
+  }
+
+  Log("AsyncWriter: %d buffers of %.1f MiB%s", options.num_buffers,
+    (double) buffer_size / (1024.0 * 1024.0), writer->options_.direct ? ", direct I/O" : "");
+  writer->thread_ = std::thread(&AsyncWriter::Run, writer);
+  return writer;
+}
+
+AsyncWriter::~AsyncWriter() {
+  if (!closed_) {
+    Close();
+  }
+  if (avio_) {
+    av_freep(&avio_->buffer);
+    av_freep(&avio_);
+  }
+  for (auto &chunk: chunks_) {
+    if (chunk.data) {
+      lab::memory::FreeLarge(chunk.data, options_.buffer_size);
+    }
+  }
+}
+
+bool AsyncWriter::OpenFile(const std::string &path) {
+#if defined(LAB_WINDOWS)
+  options_.direct = false;
+  file_ = lab::io::Fopen(path, "wb");
+  return file_ != nullptr;
+#else // LAB_WINDOWS
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  if (options_.direct) {
+#if defined(O_DIRECT)
+    // a second descriptor, for whatever isn't aligned
+    direct_fd_ = open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+    if (direct_fd_ < 0) {
+      Log("AsyncWriter: direct I/O not available for %s (%s), going through the page cache",
+        path.c_str(), strerror(errno));
+      options_.direct = false;
+    }
+#else // O_DIRECT
+    Log("AsyncWriter: direct I/O not available on %s", lab::kPlatform);
+    options_.direct = false;
+#endif // !O_DIRECT
+  }
+  return true;
+#endif // !LAB_WINDOWS
+}
+
+int AsyncWriter::WritePacket(void *opaque, uint8_t *buf, int buf_size) {
+  auto writer = reinterpret_cast<AsyncWriter*>(opaque);
+  return writer->Write(buf, (size_t) buf_size);
+}
+
+int64_t AsyncWriter::Seek(void *opaque, int64_t offset, int whence) {
+  auto writer = reinterpret_cast<AsyncWriter*>(opaque);
+
+  int64_t target;
+  switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+      return writer->size_;
+    case SEEK_SET:
+      target = offset;
+      break;
+    case SEEK_CUR:
+      target = writer->pos_ + offset;
+      break;
+    case SEEK_END:
+      target = writer->size_ + offset;
+      break;
+    default:
+      return AVERROR(EINVAL);
+  }
+
+  if (target != writer->pos_) {
+    // the next chunk starts there
+    writer->Submit();
+    writer->pos_ = target;
+  }
+  return target;
+}
+
+int AsyncWriter::Write(const uint8_t *buf, size_t size) {
+  int written = (int) size;
+  while (size > 0) {
+    if (!cur_ && !NextChunk()) {
+      return AVERROR(EIO);
+    }
+
+    size_t n = std::min(size, cur_->capacity - cur_->size);
+    memcpy(cur_->data + cur_->size, buf, n);
+    cur_->size += n;
+    buf += n;
+    size -= n;
+    pos_ += (int64_t) n;
+    size_ = std::max(size_, pos_);
+
+    if (cur_->size == cur_->capacity) {
+      Submit();
+    }
+  }
+
+  if (failed_.load(std::memory_order_relaxed)) {
+    return AVERROR(EIO);
+  }
+  return written;
+}
+
+bool AsyncWriter::NextChunk() {
+  // blocks while every buffer is in flight - that's the backpressure
+  if (!free_.Pop(cur_)) {
+    return false;
+  }
+
+  cur_->size = 0;
+  cur_->offset = pos_;
+  cur_->capacity = options_.buffer_size;
+  if (options_.direct) {
+    // end on an aligned offset, so the next one can go direct
+    cur_->capacity -= (size_t) (pos_ % kDirectAlign);
+  }
+  return true;
+}
+
+void AsyncWriter::Submit() {
+  if (!cur_) {
+    return;
+  }
+
+  if (cur_->size > 0) {
+    queue_.Push(cur_);
+    MICROPROFILE_COUNTER_SET("encoder/queue/write", queue_.Depth());
+  } else {
+    free_.Push(cur_);
+  }
+  cur_ = nullptr;
+}
+
+void AsyncWriter::Flush() {
+  avio_flush(avio_);
+  Submit();
+}
+
+bool AsyncWriter::Close() {
+  // Open may have given up half-way: then there's no I/O context to
+  // flush, no thread to wait on, and the file is only there to close.
+  bool started = thread_.joinable();
+  if (started) {
+    Flush();
+    queue_.Close();
+    thread_.join();
+  }
+
+  bool ok = started && !failed_.load() && Sync();
+#if defined(LAB_WINDOWS)
+  if (file_ && fclose(file_) != 0) {
+    ok = false;
+  }
+  file_ = nullptr;
+#else // LAB_WINDOWS
+  if (direct_fd_ >= 0) {
+    close(direct_fd_);
+    direct_fd_ = -1;
+  }
+  if (fd_ >= 0 && close(fd_) != 0) {
+    ok = false;
+  }
+  fd_ = -1;
+#endif // !LAB_WINDOWS
+
+  closed_ = true;
+  return ok;
+}
+
+void AsyncWriter::Run() {
+  MicroProfileOnThreadCreate("encoder-write");
+
+  Chunk *chunk;
+  while (queue_.Pop(chunk)) {
+    MICROPROFILE_COUNTER_SET("encoder/queue/write", queue_.Depth());
+
+    // after a failure, keep going through the motions so the producer
+    // isn't stuck waiting on a buffer - it'll find out from Write.
+    if (!failed_.load(std::memory_order_relaxed)) {
+      if (!WriteChunk(chunk)) {
+        Log("AsyncWriter: could not write %" PRIdS " bytes at %" PRId64 ": %s",
+          chunk->size, chunk->offset, strerror(errno));
+        failed_.store(true, std::memory_order_relaxed);
+      } else if (options_.sync_bytes > 0) {
+        unsynced_ += (int64_t) chunk->size;
+        if (unsynced_ >= options_.sync_bytes && !Sync()) {
+          Log("AsyncWriter: could not sync: %s", strerror(errno));
+          failed_.store(true, std::memory_order_relaxed);
+        }
+      }
+    }
+    free_.Push(chunk);
+  }
+}
+
+bool AsyncWriter::WriteChunk(const Chunk *chunk) {
+#if defined(LAB_WINDOWS)
+  return _fseeki64(file_, chunk->offset, SEEK_SET) == 0 &&
+    fwrite(chunk->data, 1, chunk->size, file_) == chunk->size;
+#else // LAB_WINDOWS
+  int fd = fd_;
+  if (direct_fd_ >= 0 && chunk->offset % kDirectAlign == 0 &&
+      (int64_t) chunk->size % kDirectAlign == 0) {
+    fd = direct_fd_;
+  }
+
+  const uint8_t *data = chunk->data;
+  size_t size = chunk->size;
+  int64_t offset = chunk->offset;
+  while (size > 0) {
+    ssize_t n = pwrite(fd, data, size, (off_t) offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += n;
+    size -= (size_t) n;
+    offset += n;
+  }
+  return true;
+#endif // !LAB_WINDOWS
+}
+
+bool AsyncWriter::Sync() {
+  unsynced_ = 0;
+#if defined(LAB_WINDOWS)
+  return fflush(file_) == 0 && _commit(_fileno(file_)) == 0;
+#elif defined(LAB_LINUX)
+  return fdatasync(fd_) == 0;
+#else
+  return fsync(fd_) == 0;
+#endif
+}
+
+} // namespace capsule
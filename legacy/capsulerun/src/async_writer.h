@@ -0,0 +1,135 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <lab/platform.h>
+
+#include "bounded_queue.h"
+
+struct AVIOContext;
+
+namespace capsule {
+
+struct AsyncWriterOptions {
+  // size of each buffer, and how many of them may be in flight
+  size_t buffer_size;
+  int num_buffers;
+  // linux only: bypass the page cache for whole, aligned buffers
+  bool direct;
+  // flush to disk every that many bytes, 0 to only do it when closing
+  int64_t sync_bytes;
+};
+
+/**
+ * Writes a file from a thread of its own, so whoever's producing data
+ * never waits on the disk - unless every buffer is already in flight.
+ *
+ * Data is gathered in large, page-aligned buffers, which are queued for
+ * the writer thread once full (or on Flush, or when seeking). They're
+ * written in order, at the offset they were started at, so seeking back
+ * to patch something up works as expected.
+ *
+ * Avio returns an AVIOContext for libavformat to mux into. Everything but
+ * the writer thread must happen on one thread.
+ */
+class AsyncWriter {
+  public:
+    // nullptr if the file can't be opened for writing
+    static AsyncWriter *Open(const std::string &path, const AsyncWriterOptions &options);
+    ~AsyncWriter();
+
+    AVIOContext *Avio() { return avio_; }
+    // hands whatever's buffered over to the writer thread
+    void Flush();
+    // writes everything out, syncs and closes the file. returns false if
+    // any of it failed.
+    bool Close();
+
+    // buffers waiting on the writer thread
+    size_t Depth() const { return queue_.Depth(); }
+    size_t Capacity() const { return queue_.Capacity(); }
+    size_t TakePeak() { return queue_.TakePeak(); }
+    // bytes written so far, buffered or not
+    int64_t Size() const { return size_; }
+
+  private:
+    struct Chunk {
+      uint8_t *data;
+      // bytes in data, and how many fit this time around, see NextChunk
+      size_t size;
+      size_t capacity;
+      int64_t offset;
+    };
+
+    explicit AsyncWriter(const AsyncWriterOptions &options);
+    bool OpenFile(const std::string &path);
+
+    static int WritePacket(void *opaque, uint8_t *buf, int buf_size);
+    static int64_t Seek(void *opaque, int64_t offset, int whence);
+    int Write(const uint8_t *buf, size_t size);
+    bool NextChunk();
+    void Submit();
+
+    void Run();
+    bool WriteChunk(const Chunk *chunk);
+    bool Sync();
+
+    AsyncWriterOptions options_;
+
+#if defined(LAB_WINDOWS)
+    FILE *file_ = nullptr;
+#else
+    int fd_ = -1;
+    // same file, opened with O_DIRECT
+    int direct_fd_ = -1;
+#endif // !LAB_WINDOWS
+
+    std::vector<Chunk> chunks_;
+    // full buffers, in file order
+    BoundedQueue<Chunk*> queue_;
+    // empty ones, the writer gives them back once written
+    BoundedQueue<Chunk*> free_;
+
+    // producer side
+    Chunk *cur_ = nullptr;
+    int64_t pos_ = 0;
+    int64_t size_ = 0;
+    AVIOContext *avio_ = nullptr;
+
+    // writer side
+    std::thread thread_;
+    int64_t unsynced_ = 0;
+    std::atomic<bool> failed_{false};
+    bool closed_ = false;
+};
+
+} // namespace capsule
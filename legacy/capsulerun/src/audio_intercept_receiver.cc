@@ -28,17 +28,18 @@
 
 #include <string.h> // memset, memcpy
 
+#include <chrono>
+#include <thread>
+
 // #define DebugLog(...) Log(__VA_ARGS__)
 #define DebugLog(...)
 
 namespace capsule {
 namespace audio {
 
-AudioInterceptReceiver::AudioInterceptReceiver(Connection *conn, const messages::AudioSetup &as) {
+AudioInterceptReceiver::AudioInterceptReceiver(const messages::AudioSetup &as, shoom::Shm *shm) {
   memset(&afmt_, 0, sizeof(afmt_));
 
-  conn_ = conn;
-
   Log("AudioInterceptReceiver: initializing with %d channels, %d rate, sample format %s",
     as.channels(),
     as.rate(),
@@ -49,28 +50,34 @@ AudioInterceptReceiver::AudioInterceptReceiver(Connection *conn, const messages:
   afmt_.rate = as.rate();
   afmt_.format = as.format();
 
-  auto shm_path = as.shmem()->path()->str();  
-  auto shm = new shoom::Shm(shm_path, static_cast<size_t>(as.shmem()->size()));
-  int ret = shm->Open();
-  if (ret != shoom::kOK) {
-    Log("AudioInterceptReceiver: Could not open shared memory area: code %d", ret);
+  if (!shm) {
+    Log("AudioInterceptReceiver: no shared memory area, no audio");
     return;
   }
 
   shm_ = shm;
+  if ((int64_t) shm_->Size() < audio_ring::kHeaderSize) {
+    Log("AudioInterceptReceiver: shared memory area too small for a ring header");
+    return;
+  }
+  ring_ = reinterpret_cast<audio_ring::Header*>(shm_->Data());
 
   int64_t sample_size = (SampleWidth(afmt_.format) / 8);
-  frame_size_ = afmt_.channels * sample_size;
-
-  int64_t buffered_seconds = 4;
-  num_frames_ = afmt_.rate * buffered_seconds;
+  int64_t frame_size = afmt_.channels * sample_size;
+  if (!audio_ring::Valid(ring_) || ring_->frame_size != frame_size ||
+      (int64_t) shm_->Size() < audio_ring::kHeaderSize + (int64_t) ring_->capacity * frame_size) {
+    Log("AudioInterceptReceiver: invalid audio ring header");
+    return;
+  }
 
-  buffer_ = (char*) calloc(num_frames_, frame_size_);
+  ring_signal::Open(&signal_, ring_->signal_name);
 
+  Log("AudioInterceptReceiver: reading %u-frame ring", ring_->capacity);
   initialized_ = true;
 }
 
 AudioInterceptReceiver::~AudioInterceptReceiver() {
+  ring_signal::Close(&signal_);
   if (shm_) {
     delete shm_;
   }
@@ -86,73 +93,50 @@ int AudioInterceptReceiver::ReceiveFormat(encoder::AudioFormat *afmt) {
   return 0;
 }
 
-void AudioInterceptReceiver::FramesCommitted(int64_t offset, int64_t frames) {
-  DebugLog("AudioInterceptReceiver: frames committed: %d offset, %d frames", offset, frames);
-  std::lock_guard<std::mutex> lock(buffer_mutex_);
-
-  int64_t remain_frames = frames;
-  while (remain_frames > 0) {
-    int64_t write_frames = remain_frames;
-    int64_t avail_frames = num_frames_ - commit_index_;
-
-    if (write_frames > avail_frames) {
-      write_frames = avail_frames;
-    }
-
-    DebugLog("AudioInterceptReceiver: storing %d frames at %d", write_frames, commit_index_);
-    char *src = (char*) shm_->Data() + (offset * frame_size_);
-    char *dst = buffer_ + (commit_index_ * frame_size_);
-    memcpy(dst, src, write_frames * frame_size_);
-
-    commit_index_ += write_frames;
-    remain_frames -= write_frames;
-    offset += write_frames;
-
-    if (commit_index_ == num_frames_) {
-      // wrap around!
-      DebugLog("AudioInterceptReceiver: commit wrap!");
-      commit_index_ = 0;
-    }
+void *AudioInterceptReceiver::ReceiveFrames(int64_t *frames_received) {
+  *frames_received = 0;
+
+  if (!initialized_) {
+    return nullptr;
   }
-}
 
-void *AudioInterceptReceiver::ReceiveFrames(int64_t *frames_received) {
-  std::lock_guard<std::mutex> lock(buffer_mutex_);
+  // the encoder is done with whatever we handed out last time
+  if (pending_frames_ > 0) {
+    audio_ring::Consume(ring_, pending_frames_);
+    pending_frames_ = 0;
+  }
 
-  *frames_received = 0;
+  uint32_t overruns = ring_->overruns.load(std::memory_order_relaxed);
+  if (overruns != overruns_) {
+    Log("AudioInterceptReceiver: %u frames dropped by libcapsule so far, ring full", overruns);
+    overruns_ = overruns;
+  }
 
-  if (sent_index_ == num_frames_) {
-    // wrap!
-    DebugLog("AudioInterceptReceiver: sent wrap! sent_index = %" PRId64
-      ", num_frames = %" PRId64 ", commit_index = %" PRId64,
-        sent_index_, num_frames_, commit_index_);
-    sent_index_ = 0;
+  uint32_t index;
+  uint32_t avail_frames = audio_ring::Peek(ring_, &index);
+  if (avail_frames == 0) {
+    return nullptr;
   }
 
-  if (sent_index_ != commit_index_) {
-    int64_t avail_frames;
-    if (commit_index_ < sent_index_) {
-      // commit_index_ has wrapped around, send everything till the end of the buffer
-      avail_frames = num_frames_ - sent_index_;
-      DebugLog("AudioInterceptReceiver: sent clear, %d frames available", avail_frames);
-    } else {
-      avail_frames = commit_index_ - sent_index_;
-    }
-
-    *frames_received = avail_frames;
-    DebugLog("AudioInterceptReceiver: received %" PRId64 " frames from %" PRId64,
-      avail_frames, sent_index_);
-
-    char *ret = buffer_ + (sent_index_ * frame_size_);
-    sent_index_ += avail_frames;
-    return ret;
+  DebugLog("AudioInterceptReceiver: received %u frames from %u", avail_frames, index);
+  *frames_received = avail_frames;
+  pending_frames_ = avail_frames;
+  return audio_ring::Data(ring_) + (int64_t) index * ring_->frame_size;
+}
+
+void AudioInterceptReceiver::WaitFrames(int timeout_ms) {
+  if (!initialized_) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+    return;
   }
 
-  return nullptr;
+  audio_ring::Wait(ring_, timeout_ms, &signal_);
 }
 
 void AudioInterceptReceiver::Stop() {
-  // stub
+  if (initialized_) {
+    audio_ring::Wake(ring_, &signal_);
+  }
 }
 
 }
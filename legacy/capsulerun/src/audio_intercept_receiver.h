@@ -22,11 +22,9 @@
 #pragma once
 
 #include <capsule/messages_generated.h>
-
-#include <mutex>
+#include <capsule/audio_ring.h>
 
 #include "audio_receiver.h"
-#include "connection.h"
 #include "encoder.h"
 #include <shoom.h>
 
@@ -35,27 +33,24 @@ namespace audio {
 
 class AudioInterceptReceiver : public AudioReceiver {
   public:
-    AudioInterceptReceiver(Connection *conn, const messages::AudioSetup &as);
+    // takes ownership of shm, which may be null if it couldn't be opened
+    AudioInterceptReceiver(const messages::AudioSetup &as, shoom::Shm *shm);
     virtual ~AudioInterceptReceiver() override;
 
-    virtual void FramesCommitted(int64_t offset, int64_t frames) override;
     virtual int ReceiveFormat(encoder::AudioFormat *afmt) override;
     virtual void *ReceiveFrames(int64_t *frames_received) override;
+    virtual void WaitFrames(int timeout_ms) override;
     virtual void Stop() override;
 
   private:
-    Connection *conn_ = nullptr;
     encoder::AudioFormat afmt_;
     shoom::Shm *shm_ = nullptr;
+    audio_ring::Header *ring_ = nullptr;
+    ring_signal::Signal signal_;
 
-    int num_frames_ = 0;
-    int64_t frame_size_ = 0;
-    int64_t commit_index_ = 0;
-    int64_t sent_index_ = 0;
-    int64_t processed_index_ = 0;
-    char *buffer_ = nullptr;
-
-    std::mutex buffer_mutex_;
+    // handed out by the last ReceiveFrames, released on the next one
+    uint32_t pending_frames_ = 0;
+    uint32_t overruns_ = 0;
 
     bool initialized_ = false;
 };
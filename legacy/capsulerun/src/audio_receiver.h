@@ -23,18 +23,27 @@
 
 #include "encoder.h"
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
 namespace capsule {
 namespace audio {
 
+// how often receivers that can't tell when frames come in get polled
+static const int kAudioPollMs = 5;
+
 class AudioReceiver {
   public:
     virtual ~AudioReceiver() {};
 
     virtual int ReceiveFormat(encoder::AudioFormat *afmt) = 0;
     virtual void *ReceiveFrames(int64_t *frames_received) = 0;
-    virtual void FramesCommitted(int64_t, int64_t) {
-      // muffin
-    };
+    // blocks until ReceiveFrames has something to return, or for at most
+    // timeout_ms. must be called from the same thread as ReceiveFrames.
+    virtual void WaitFrames(int timeout_ms) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(std::min(timeout_ms, kAudioPollMs)));
+    }
     virtual void Stop() = 0;
 };
 
@@ -0,0 +1,114 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "band_pool.h"
+
+namespace capsule {
+
+BandPool::BandPool(int num_threads) {
+  next_band_ = 0;
+  for (int i = 1; i < num_threads; i++) {
+    workers_.emplace_back(&BandPool::Work, this);
+  }
+}
+
+BandPool::~BandPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  start_.notify_all();
+  for (auto &worker: workers_) {
+    worker.join();
+  }
+}
+
+void BandPool::Run(int num_bands, const std::function<void(int)> &fn) {
+  if (workers_.empty()) {
+    for (int band = 0; band < num_bands; band++) {
+      fn(band);
+    }
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // stragglers from the last job may still be on their way out
+    done_.wait(lock, [this] { return active_ == 0; });
+    fn_ = &fn;
+    num_bands_ = num_bands;
+    next_band_ = 0;
+    pending_ = num_bands;
+    generation_++;
+  }
+  start_.notify_all();
+
+  int done = Drain();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  pending_ -= done;
+  // fn lives on our caller's stack, nobody may touch it once we return
+  done_.wait(lock, [this] { return pending_ == 0 && active_ == 0; });
+}
+
+void BandPool::Work() {
+  uint64_t seen = 0;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_.wait(lock, [&] { return stopped_ || generation_ != seen; });
+      if (stopped_) {
+        return;
+      }
+      seen = generation_;
+      active_++;
+    }
+
+    int done = Drain();
+
+    bool finished;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_ -= done;
+      active_--;
+      finished = (pending_ == 0 && active_ == 0);
+    }
+    if (finished) {
+      done_.notify_all();
+    }
+  }
+}
+
+int BandPool::Drain() {
+  int done = 0;
+  while (true) {
+    int band = next_band_.fetch_add(1);
+    if (band >= num_bands_) {
+      break;
+    }
+    (*fn_)(band);
+    done++;
+  }
+  return done;
+}
+
+} // namespace capsule
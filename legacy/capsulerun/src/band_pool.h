@@ -0,0 +1,74 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace capsule {
+
+/**
+ * A fixed set of worker threads that split a job into numbered bands.
+ * The thread calling Run works on bands too, so a pool of one thread
+ * spawns nothing and just runs everything inline.
+ *
+ * Run may only be called from one thread at a time.
+ */
+class BandPool {
+  public:
+    explicit BandPool(int num_threads);
+    ~BandPool();
+
+    // calls fn(band) for every band in [0, num_bands), in no particular
+    // order, and returns once they're all done.
+    void Run(int num_bands, const std::function<void(int)> &fn);
+
+    int NumThreads() const { return (int) workers_.size() + 1; }
+
+  private:
+    void Work();
+    // takes bands until there are none left, returns how many it did
+    int Drain();
+
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+
+    // current job, only changes while no worker is active
+    const std::function<void(int)> *fn_ = nullptr;
+    int num_bands_ = 0;
+    std::atomic<int> next_band_;
+
+    // guarded by mutex_
+    uint64_t generation_ = 0;
+    int pending_ = 0;
+    int active_ = 0;
+    bool stopped_ = false;
+};
+
+} // namespace capsule
@@ -0,0 +1,146 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <chrono>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+
+namespace capsule {
+
+/**
+ * A FIFO between two threads, which blocks producers once capacity items
+ * are waiting, so a slow consumer holds up the producer instead of letting
+ * items pile up.
+ *
+ * Once closed, pushes fail and pops drain what's left, then fail.
+ */
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+  bool Push(T const &data) {
+    {
+      std::unique_lock<std::mutex> lock(guard_);
+      while (queue_.size() >= capacity_ && !closed_) {
+        not_full_.wait(lock);
+      }
+      if (closed_) {
+        return false;
+      }
+
+      queue_.push(data);
+      if (queue_.size() > peak_) {
+        peak_ = queue_.size();
+      }
+    }
+    not_empty_.notify_one();
+    return true;
+  }
+
+  bool Pop(T &value) {
+    {
+      std::unique_lock<std::mutex> lock(guard_);
+      while (queue_.empty() && !closed_) {
+        not_empty_.wait(lock);
+      }
+      if (queue_.empty()) {
+        return false;
+      }
+
+      value = queue_.front();
+      queue_.pop();
+    }
+    not_full_.notify_one();
+    return true;
+  }
+
+  // doesn't block: returns false if there's nothing to pop right now
+  bool TryPop(T &value) {
+    {
+      std::lock_guard<std::mutex> lock(guard_);
+      if (queue_.empty()) {
+        return false;
+      }
+
+      value = queue_.front();
+      queue_.pop();
+    }
+    not_full_.notify_one();
+    return true;
+  }
+
+  // blocks until there's something to pop, the queue is closed, or
+  // timeout_ms went by
+  void WaitFor(int timeout_ms) {
+    std::unique_lock<std::mutex> lock(guard_);
+    not_empty_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] {
+      return !queue_.empty() || closed_;
+    });
+  }
+
+  // closed, and nothing's left to pop
+  bool Drained() const {
+    std::lock_guard<std::mutex> lock(guard_);
+    return closed_ && queue_.empty();
+  }
+
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(guard_);
+      closed_ = true;
+    }
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  size_t Depth() const {
+    std::lock_guard<std::mutex> lock(guard_);
+    return queue_.size();
+  }
+
+  size_t Capacity() const {
+    return capacity_;
+  }
+
+  // deepest the queue got since the last call
+  size_t TakePeak() {
+    std::lock_guard<std::mutex> lock(guard_);
+    size_t peak = peak_;
+    peak_ = queue_.size();
+    return peak;
+  }
+
+private:
+  std::queue<T> queue_;
+  const size_t capacity_;
+  size_t peak_ = 0;
+  bool closed_ = false;
+  mutable std::mutex guard_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+} // namespace capsule
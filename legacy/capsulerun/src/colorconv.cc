@@ -0,0 +1,263 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "colorconv.h"
+#include "colorconv_kernels.h"
+
+#include <lab/env.h>
+#include <lab/platform.h>
+
+#include <math.h>
+
+#if defined(CAPSULE_COLORCONV_X86)
+#if defined(_MSC_VER)
+#include <intrin.h> // __cpuid, __cpuidex, _xgetbv
+#else // _MSC_VER
+#include <cpuid.h>  // __get_cpuid, __get_cpuid_count
+#endif // !_MSC_VER
+#endif // CAPSULE_COLORCONV_X86
+
+#include "logging.h"
+
+namespace capsule {
+namespace colorconv {
+
+#if defined(CAPSULE_COLORCONV_X86)
+// see colorconv_*.cc
+extern const Kernels kKernelsSSE2;
+extern const Kernels kKernelsAVX2;
+extern const Kernels kKernelsAVX512;
+#endif // CAPSULE_COLORCONV_X86
+
+static const Kernels kKernelsScalar = {
+  kIsaScalar,
+  LumaRowScalar,
+  Chroma420RowScalar,
+  Chroma444RowScalar,
+};
+
+#if defined(CAPSULE_COLORCONV_X86)
+
+static void Cpuid(int leaf, int subleaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+  int r[4];
+  __cpuidex(r, leaf, subleaf);
+  for (int i = 0; i < 4; i++) {
+    regs[i] = (unsigned int) r[i];
+  }
+#else // _MSC_VER
+  regs[0] = regs[1] = regs[2] = regs[3] = 0;
+  __get_cpuid_count((unsigned int) leaf, (unsigned int) subleaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif // !_MSC_VER
+}
+
+// which register states the OS saves on context switches
+static uint64_t Xgetbv() {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else // _MSC_VER
+  uint32_t lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((uint64_t) hi << 32) | lo;
+#endif // !_MSC_VER
+}
+
+static Isa DetectIsa() {
+  unsigned int regs[4];
+  Cpuid(0, 0, regs);
+  unsigned int max_leaf = regs[0];
+
+  Cpuid(1, 0, regs);
+  bool sse2 = (regs[3] & (1u << 26)) != 0;
+  bool osxsave = (regs[2] & (1u << 27)) != 0;
+  bool avx = (regs[2] & (1u << 28)) != 0;
+  if (!sse2) {
+    return kIsaScalar;
+  }
+
+  // AVX state (xmm, ymm) and AVX-512 state (opmask, zmm) enabled by the OS
+  uint64_t xcr0 = osxsave ? Xgetbv() : 0;
+  bool os_avx = (xcr0 & 0x6) == 0x6;
+  bool os_avx512 = (xcr0 & 0xe6) == 0xe6;
+
+  if (!avx || !os_avx || max_leaf < 7) {
+    return kIsaSSE2;
+  }
+
+  Cpuid(7, 0, regs);
+  bool avx2 = (regs[1] & (1u << 5)) != 0;
+  bool avx512f = (regs[1] & (1u << 16)) != 0;
+  bool avx512bw = (regs[1] & (1u << 30)) != 0;
+
+  if (avx512f && avx512bw && os_avx512) {
+    return kIsaAVX512;
+  }
+  if (avx2) {
+    return kIsaAVX2;
+  }
+  return kIsaSSE2;
+}
+
+#else // CAPSULE_COLORCONV_X86
+
+static Isa DetectIsa() {
+  return kIsaScalar;
+}
+
+#endif // !CAPSULE_COLORCONV_X86
+
+static Isa ParseIsa(const std::string &name, Isa fallback) {
+  if (name == "scalar") {
+    return kIsaScalar;
+  } else if (name == "sse2") {
+    return kIsaSSE2;
+  } else if (name == "avx2") {
+    return kIsaAVX2;
+  } else if (name == "avx512") {
+    return kIsaAVX512;
+  }
+  return fallback;
+}
+
+const char *IsaName(Isa isa) {
+  switch (isa) {
+    case kIsaSSE2: return "sse2";
+    case kIsaAVX2: return "avx2";
+    case kIsaAVX512: return "avx512";
+    default: return "scalar";
+  }
+}
+
+static const Kernels &KernelsFor(Isa isa) {
+  static const Isa detected = DetectIsa();
+  if (isa > detected) {
+    isa = detected;
+  }
+
+  switch (isa) {
+#if defined(CAPSULE_COLORCONV_X86)
+    case kIsaAVX512: return kKernelsAVX512;
+    case kIsaAVX2: return kKernelsAVX2;
+    case kIsaSSE2: return kKernelsSSE2;
+#endif // CAPSULE_COLORCONV_X86
+    default: return kKernelsScalar;
+  }
+}
+
+// Q15, with the coefficients for R, G and B placed in input byte order.
+// scale maps full-range to limited range (219 or 224 steps).
+static Row MakeRow(double r, double g, double b, double scale, InputFormat in) {
+  int16_t qr = (int16_t) lround(r * scale * 32768.0);
+  int16_t qb = (int16_t) lround(b * scale * 32768.0);
+  int16_t qg = (int16_t) lround(g * scale * 32768.0);
+
+  Row row;
+  if (in == kInputBGRA) {
+    row.c[0] = qb;
+    row.c[1] = qg;
+    row.c[2] = qr;
+  } else {
+    row.c[0] = qr;
+    row.c[1] = qg;
+    row.c[2] = qb;
+  }
+  return row;
+}
+
+// Chroma rows must sum to exactly zero, or grays pick up a tint
+static Row MakeChromaRow(double r, double b, double scale, InputFormat in) {
+  Row row = MakeRow(r, 0.0, b, scale, in);
+  int16_t g = (int16_t) -(row.c[0] + row.c[2]);
+  row.c[1] = g;
+  return row;
+}
+
+static Coefs MakeCoefs(Matrix matrix, InputFormat in) {
+  double kr = 0.299;
+  double kb = 0.114;
+  if (matrix == kMatrixBT709) {
+    kr = 0.2126;
+    kb = 0.0722;
+  }
+  double kg = 1.0 - kr - kb;
+
+  const double luma_scale = 219.0 / 255.0;
+  const double chroma_scale = 224.0 / 255.0;
+
+  Coefs k;
+  k.y = MakeRow(kr, kg, kb, luma_scale, in);
+  // U = (B - Y) / (2 * (1 - kb)), V = (R - Y) / (2 * (1 - kr))
+  k.u = MakeChromaRow(-kr / (2.0 * (1.0 - kb)), 0.5, chroma_scale, in);
+  k.v = MakeChromaRow(0.5, -kb / (2.0 * (1.0 - kr)), chroma_scale, in);
+  return k;
+}
+
+Converter::Converter(InputFormat in, OutputFormat out, Matrix matrix, int width, int height, Isa max_isa) :
+  out_(out),
+  width_(width),
+  height_(height) {
+  coefs_ = MakeCoefs(matrix, in);
+
+  // for benchmarking & debugging
+  max_isa = ParseIsa(lab::env::Get("CAPSULE_COLORCONV_ISA"), max_isa);
+  kernels_ = KernelsFor(max_isa);
+}
+
+void Converter::Convert(const uint8_t *src, int src_linesize, bool vflip,
+                        uint8_t *const dst[], const int dst_linesize[],
+                        int y_begin, int y_end) const {
+  // bottom-up frames: walk the source backwards
+  auto row = [&](int y) {
+    int sy = vflip ? (height_ - 1 - y) : y;
+    return src + (int64_t) sy * src_linesize;
+  };
+
+  for (int y = y_begin; y < y_end; y += 2) {
+    const uint8_t *s0 = row(y);
+    const uint8_t *s1 = row(y + 1);
+
+    kernels_.luma(s0, dst[0] + (int64_t) y * dst_linesize[0], width_, &coefs_);
+    kernels_.luma(s1, dst[0] + (int64_t) (y + 1) * dst_linesize[0], width_, &coefs_);
+
+    switch (out_) {
+      case kOutputYUV420P: {
+        int64_t cy = y / 2;
+        kernels_.chroma420(s0, s1, dst[1] + cy * dst_linesize[1], dst[2] + cy * dst_linesize[2], width_, &coefs_);
+        break;
+      }
+      case kOutputNV12: {
+        int64_t cy = y / 2;
+        kernels_.chroma420(s0, s1, dst[1] + cy * dst_linesize[1], nullptr, width_, &coefs_);
+        break;
+      }
+      case kOutputYUV444P: {
+        for (int i = 0; i < 2; i++) {
+          int64_t cy = y + i;
+          kernels_.chroma444(i ? s1 : s0, dst[1] + cy * dst_linesize[1], dst[2] + cy * dst_linesize[2], width_, &coefs_);
+        }
+        break;
+      }
+    }
+  }
+}
+
+} // namespace colorconv
+} // namespace capsule
@@ -0,0 +1,114 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace capsule {
+namespace colorconv {
+
+enum InputFormat {
+  kInputBGRA = 0,
+  kInputRGBA,
+};
+
+enum OutputFormat {
+  kOutputYUV420P = 0,
+  kOutputNV12,
+  kOutputYUV444P,
+};
+
+enum Matrix {
+  kMatrixBT601 = 0,
+  kMatrixBT709,
+};
+
+enum Isa {
+  kIsaScalar = 0,
+  kIsaSSE2,
+  kIsaAVX2,
+  kIsaAVX512,
+};
+
+// Fixed-point (Q15) coefficients for one of Y, U or V, in input byte
+// order: out = c[0] * byte0 + c[1] * byte1 + c[2] * byte2 + offset
+struct Row {
+  int16_t c[3];
+};
+
+struct Coefs {
+  Row y;
+  Row u;
+  Row v;
+};
+
+// Convert one row of pixels to luma
+typedef void (*LumaRowFunc)(const uint8_t *src, uint8_t *dst_y, int width, const Coefs *k);
+// Convert two rows of pixels to one row of 2x2-subsampled chroma, planar (dst_v
+// non-null) or interleaved (dst_v null, as in NV12)
+typedef void (*ChromaRow420Func)(const uint8_t *src0, const uint8_t *src1, uint8_t *dst_u, uint8_t *dst_v, int width, const Coefs *k);
+// Convert one row of pixels to full-resolution chroma
+typedef void (*ChromaRow444Func)(const uint8_t *src, uint8_t *dst_u, uint8_t *dst_v, int width, const Coefs *k);
+
+struct Kernels {
+  Isa isa;
+  LumaRowFunc luma;
+  ChromaRow420Func chroma420;
+  ChromaRow444Func chroma444;
+};
+
+/**
+ * Converts packed 8-bit RGB frames to limited-range YUV, without swscale.
+ *
+ * Kernels are picked once, at construction, for the best instruction set
+ * the CPU supports, up to max_isa (CAPSULE_COLORCONV_ISA=scalar|sse2|avx2|avx512
+ * overrides that).
+ * Every kernel produces the exact same output as the scalar one. Bottom-up
+ * frames are flipped as part of the conversion, by walking rows backwards.
+ *
+ * Width and height must be even.
+ */
+class Converter {
+  public:
+    Converter(InputFormat in, OutputFormat out, Matrix matrix, int width, int height,
+              Isa max_isa = kIsaAVX512);
+
+    // converts rows [y_begin, y_end) of the output, both must be even.
+    // dst/dst_linesize are laid out like AVFrame's data/linesize.
+    void Convert(const uint8_t *src, int src_linesize, bool vflip,
+                 uint8_t *const dst[], const int dst_linesize[],
+                 int y_begin, int y_end) const;
+
+    Isa GetIsa() const { return kernels_.isa; }
+
+  private:
+    OutputFormat out_;
+    int width_;
+    int height_;
+    Coefs coefs_;
+    Kernels kernels_;
+};
+
+const char *IsaName(Isa isa);
+
+} // namespace colorconv
+} // namespace capsule
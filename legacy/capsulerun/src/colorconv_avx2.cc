@@ -0,0 +1,71 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+// Built with -mavx2 (or the MSVC equivalent), see CMakeLists.txt
+
+#include "colorconv_kernels.h"
+
+#include <immintrin.h>
+
+namespace capsule {
+namespace colorconv {
+
+struct AVX2 {
+  typedef __m256i V;
+  static const int kPixels = 8;
+
+  static inline V Load(const uint8_t *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+  static inline void Store(uint8_t *p, V a) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), a); }
+  static inline void StoreLow(uint8_t *p, V a) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(a)); }
+  static inline void StoreHigh(uint8_t *p, V a) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_extracti128_si256(a, 1)); }
+
+  static inline V Set1_32(int32_t x) { return _mm256_set1_epi32(x); }
+  static inline V Zero() { return _mm256_setzero_si256(); }
+
+  static inline V And(V a, V b) { return _mm256_and_si256(a, b); }
+  static inline V Or(V a, V b) { return _mm256_or_si256(a, b); }
+  static inline V Add16(V a, V b) { return _mm256_add_epi16(a, b); }
+  static inline V Add32(V a, V b) { return _mm256_add_epi32(a, b); }
+  static inline V Madd16(V a, V b) { return _mm256_madd_epi16(a, b); }
+
+  template <int n> static inline V Srli32(V a) { return _mm256_srli_epi32(a, n); }
+  template <int n> static inline V Srai32(V a) { return _mm256_srai_epi32(a, n); }
+  template <int n> static inline V Slli16(V a) { return _mm256_slli_epi16(a, n); }
+
+  static inline V Unpacklo16(V a, V b) { return _mm256_unpacklo_epi16(a, b); }
+  static inline V Unpackhi16(V a, V b) { return _mm256_unpackhi_epi16(a, b); }
+
+  static inline V Packs32InLane(V a, V b) { return _mm256_packs_epi32(a, b); }
+  // packs work per 128-bit lane, which leaves 64-bit blocks in
+  // a0 b0 a1 b1 order: put them back as a0 a1 b0 b1
+  static inline V Packs32(V a, V b) { return _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8); }
+  static inline V Packus16(V a, V b) { return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8); }
+};
+
+extern const Kernels kKernelsAVX2 = {
+  kIsaAVX2,
+  LumaRow<AVX2>,
+  Chroma420Row<AVX2>,
+  Chroma444Row<AVX2>,
+};
+
+} // namespace colorconv
+} // namespace capsule
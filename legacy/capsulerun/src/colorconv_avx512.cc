@@ -0,0 +1,77 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+// Built with -mavx512f -mavx512bw (or the MSVC equivalent), see CMakeLists.txt
+
+#include "colorconv_kernels.h"
+
+// gcc 12's avx512 headers trip -Wmaybe-uninitialized on _mm512_undefined_*
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif // __GNUC__ && !__clang__
+
+#include <immintrin.h>
+
+namespace capsule {
+namespace colorconv {
+
+struct AVX512 {
+  typedef __m512i V;
+  static const int kPixels = 16;
+
+  static inline V Load(const uint8_t *p) { return _mm512_loadu_si512(p); }
+  static inline void Store(uint8_t *p, V a) { _mm512_storeu_si512(p, a); }
+  static inline void StoreLow(uint8_t *p, V a) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm512_castsi512_si256(a)); }
+  static inline void StoreHigh(uint8_t *p, V a) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm512_extracti64x4_epi64(a, 1)); }
+
+  static inline V Set1_32(int32_t x) { return _mm512_set1_epi32(x); }
+  static inline V Zero() { return _mm512_setzero_si512(); }
+
+  static inline V And(V a, V b) { return _mm512_and_si512(a, b); }
+  static inline V Or(V a, V b) { return _mm512_or_si512(a, b); }
+  static inline V Add16(V a, V b) { return _mm512_add_epi16(a, b); }
+  static inline V Add32(V a, V b) { return _mm512_add_epi32(a, b); }
+  static inline V Madd16(V a, V b) { return _mm512_madd_epi16(a, b); }
+
+  template <int n> static inline V Srli32(V a) { return _mm512_srli_epi32(a, n); }
+  template <int n> static inline V Srai32(V a) { return _mm512_srai_epi32(a, n); }
+  template <int n> static inline V Slli16(V a) { return _mm512_slli_epi16(a, n); }
+
+  static inline V Unpacklo16(V a, V b) { return _mm512_unpacklo_epi16(a, b); }
+  static inline V Unpackhi16(V a, V b) { return _mm512_unpackhi_epi16(a, b); }
+
+  static inline V Packs32InLane(V a, V b) { return _mm512_packs_epi32(a, b); }
+  // packs work per 128-bit lane, which leaves 64-bit blocks in
+  // a0 b0 a1 b1 a2 b2 a3 b3 order: put them back as a0..a3 b0..b3
+  static inline V Unshuffle(V a) { return _mm512_permutexvar_epi64(_mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7), a); }
+  static inline V Packs32(V a, V b) { return Unshuffle(_mm512_packs_epi32(a, b)); }
+  static inline V Packus16(V a, V b) { return Unshuffle(_mm512_packus_epi16(a, b)); }
+};
+
+extern const Kernels kKernelsAVX512 = {
+  kIsaAVX512,
+  LumaRow<AVX512>,
+  Chroma420Row<AVX512>,
+  Chroma444Row<AVX512>,
+};
+
+} // namespace colorconv
+} // namespace capsule
@@ -0,0 +1,148 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "colorconv_bench.h"
+#include "colorconv.h"
+#include "conversion_stage.h"
+
+#if defined(WIN32)
+#pragma warning(push, 0)
+#endif // WIN32
+extern "C" {
+    #include <libavutil/imgutils.h>
+    #include <libswscale/swscale.h>
+}
+#if defined(WIN32)
+#pragma warning(pop)
+#endif // WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "logging.h"
+
+namespace capsule {
+namespace colorconv {
+
+static const int kBenchFrames = 120;
+
+static double MillisPerFrame(std::chrono::steady_clock::time_point start) {
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  return (double) us / 1000.0 / (double) kBenchFrames;
+}
+
+int Bench(const char *size) {
+  int width = 0;
+  int height = 0;
+  if (!size || sscanf(size, "%dx%d", &width, &height) != 2 ||
+      width <= 0 || height <= 0 || width % 2 != 0 || height % 2 != 0) {
+    Log("Invalid benchmark size %s, expected even WIDTHxHEIGHT (e.g. 2560x1440)", size ? size : "(null)");
+    return 1;
+  }
+
+  int linesize = width * 4;
+  std::vector<uint8_t> src((size_t) linesize * height);
+  srand(1);
+  for (auto &b : src) {
+    b = (uint8_t) (rand() & 0xff);
+  }
+
+  struct Target {
+    OutputFormat out;
+    AVPixelFormat av;
+    const char *name;
+  };
+  const Target targets[] = {
+    {kOutputYUV420P, AV_PIX_FMT_YUV420P, "yuv420p"},
+    {kOutputNV12, AV_PIX_FMT_NV12, "nv12"},
+    {kOutputYUV444P, AV_PIX_FMT_YUV444P, "yuv444p"},
+  };
+
+  Log("Color conversion benchmark: %dx%d bgra, vflip, %d frames", width, height, kBenchFrames);
+
+  for (auto &t : targets) {
+    uint8_t *dst[4];
+    int dst_linesize[4];
+    if (av_image_alloc(dst, dst_linesize, width, height, t.av, 32) < 0) {
+      Log("Could not allocate output picture");
+      return 1;
+    }
+
+    // same flags & flip as the encoder's swscale path
+    auto sws = sws_getContext(width, height, AV_PIX_FMT_BGRA, width, height, t.av,
+                              SWS_BILINEAR | SWS_ACCURATE_RND | SWS_BITEXACT, 0, 0, 0);
+    if (!sws) {
+      Log("Could not initialize swscale");
+      av_freep(&dst[0]);
+      return 1;
+    }
+    const uint8_t *sws_in[1] = {src.data() + (size_t) linesize * (height - 1)};
+    int sws_linesize[1] = {-linesize};
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kBenchFrames; i++) {
+      sws_scale(sws, sws_in, sws_linesize, 0, height, dst, dst_linesize);
+    }
+    double sws_ms = MillisPerFrame(start);
+    sws_freeContext(sws);
+    Log("%8s %8s: %7.3f ms/frame", t.name, "swscale", sws_ms);
+
+    for (int isa = kIsaScalar; isa <= kIsaAVX512; isa++) {
+      Converter conv(kInputBGRA, t.out, kMatrixBT601, width, height, (Isa) isa);
+      if (conv.GetIsa() != (Isa) isa) {
+        // not supported by this CPU
+        continue;
+      }
+
+      start = std::chrono::steady_clock::now();
+      for (int i = 0; i < kBenchFrames; i++) {
+        conv.Convert(src.data(), linesize, true, dst, dst_linesize, 0, height);
+      }
+      double ms = MillisPerFrame(start);
+      Log("%8s %8s: %7.3f ms/frame (%.1fx swscale)", t.name, IsaName((Isa) isa), ms, sws_ms / ms);
+    }
+
+    // best kernels, banded across every core
+    Converter conv(kInputBGRA, t.out, kMatrixBT601, width, height);
+    int num_threads = std::max(1, (int) std::thread::hardware_concurrency());
+    ConversionStage stage(&conv, width, height, linesize, num_threads);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kBenchFrames; i++) {
+      stage.Convert(src.data(), true, dst, dst_linesize);
+    }
+    double ms = MillisPerFrame(start);
+    Log("%8s %8s: %7.3f ms/frame (%.1fx swscale), %d threads, %d bands",
+      t.name, IsaName(conv.GetIsa()), ms, sws_ms / ms, stage.NumThreads(), stage.NumBands());
+
+    av_freep(&dst[0]);
+  }
+
+  return 0;
+}
+
+} // namespace colorconv
+} // namespace capsule
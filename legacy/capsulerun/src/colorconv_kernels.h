@@ -0,0 +1,249 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+// Color conversion kernels, written once against a small set of vector
+// operations and instantiated for each instruction set by colorconv_*.cc,
+// which are built with the matching compiler flags. Everything in here is
+// static so that each instantiation stays in its own translation unit.
+//
+// All math is exact integer math (Q15 coefficients, 32-bit accumulators),
+// so the vector kernels and the scalar ones below agree bit for bit.
+//
+// A vector set S provides:
+//   V                        vector type
+//   kPixels                  32-bit pixels per V
+//   Load, Store              unaligned, full vector
+//   StoreLow, StoreHigh      unaligned, half a vector
+//   Set1_32, Zero
+//   And, Or, Add16, Add32, Madd16
+//   Srli32<n>, Srai32<n>, Slli16<n>
+//   Unpacklo16, Unpackhi16   within 128-bit lanes
+//   Packs32InLane            within 128-bit lanes
+//   Packs32, Packus16        across the whole vector, in element order
+
+#include "colorconv.h"
+
+namespace capsule {
+namespace colorconv {
+
+// rounding + offset for Y (16..235) and chroma (16..240, centered on 128)
+static const int32_t kLumaOffset = (16 << 15) + (1 << 14);
+static const int32_t kChromaOffset = (128 << 15) + (1 << 14);
+// 420 chroma is computed on the sum of 2x2 pixels, hence 2 more bits
+static const int32_t kChroma420Offset = (128 << 17) + (1 << 16);
+
+/////////////////////////////////
+// scalar
+/////////////////////////////////
+
+static inline uint8_t ClampByte(int32_t x) {
+  return (uint8_t) (x < 0 ? 0 : (x > 255 ? 255 : x));
+}
+
+static inline int32_t DotRow(const Row &r, int32_t a, int32_t b, int32_t c) {
+  return r.c[0] * a + r.c[1] * b + r.c[2] * c;
+}
+
+static void LumaRowScalar(const uint8_t *src, uint8_t *dst_y, int width, const Coefs *k) {
+  for (int x = 0; x < width; x++) {
+    const uint8_t *p = src + x * 4;
+    dst_y[x] = ClampByte((DotRow(k->y, p[0], p[1], p[2]) + kLumaOffset) >> 15);
+  }
+}
+
+static void Chroma420RowScalar(const uint8_t *src0, const uint8_t *src1,
+                               uint8_t *dst_u, uint8_t *dst_v, int width, const Coefs *k) {
+  for (int x = 0; x < width; x += 2) {
+    const uint8_t *p = src0 + x * 4;
+    const uint8_t *q = src1 + x * 4;
+    int32_t a = p[0] + p[4] + q[0] + q[4];
+    int32_t b = p[1] + p[5] + q[1] + q[5];
+    int32_t c = p[2] + p[6] + q[2] + q[6];
+    uint8_t u = ClampByte((DotRow(k->u, a, b, c) + kChroma420Offset) >> 17);
+    uint8_t v = ClampByte((DotRow(k->v, a, b, c) + kChroma420Offset) >> 17);
+    if (dst_v) {
+      dst_u[x / 2] = u;
+      dst_v[x / 2] = v;
+    } else {
+      dst_u[x] = u;
+      dst_u[x + 1] = v;
+    }
+  }
+}
+
+static void Chroma444RowScalar(const uint8_t *src, uint8_t *dst_u, uint8_t *dst_v,
+                               int width, const Coefs *k) {
+  for (int x = 0; x < width; x++) {
+    const uint8_t *p = src + x * 4;
+    dst_u[x] = ClampByte((DotRow(k->u, p[0], p[1], p[2]) + kChromaOffset) >> 15);
+    dst_v[x] = ClampByte((DotRow(k->v, p[0], p[1], p[2]) + kChromaOffset) >> 15);
+  }
+}
+
+/////////////////////////////////
+// vector
+/////////////////////////////////
+
+// coefficients, in the layout Madd16 wants them
+template <class S>
+struct VecRow {
+  typename S::V c01;
+  typename S::V c2;
+};
+
+template <class S>
+static inline VecRow<S> MakeVecRow(const Row &r) {
+  VecRow<S> out;
+  out.c01 = S::Set1_32((int32_t) (((uint32_t) (uint16_t) r.c[1] << 16) | (uint16_t) r.c[0]));
+  out.c2 = S::Set1_32((int32_t) (uint16_t) r.c[2]);
+  return out;
+}
+
+// Byte n of each pixel of p0 then p1, as 16-bit values
+template <class S, int kShift>
+static inline typename S::V Channel16(typename S::V p0, typename S::V p1) {
+  auto mask = S::Set1_32(0xff);
+  return S::Packs32(S::And(S::template Srli32<kShift>(p0), mask), S::And(S::template Srli32<kShift>(p1), mask));
+}
+
+// r.c[0] * a + r.c[1] * b + r.c[2] * c, offset then shifted, as 16-bit
+// values in the same order as a, b and c
+template <class S, int kShift>
+static inline typename S::V Dot16(typename S::V a, typename S::V b, typename S::V c,
+                                  const VecRow<S> &r, typename S::V offset) {
+  auto zero = S::Zero();
+  auto lo = S::Add32(S::Madd16(S::Unpacklo16(a, b), r.c01), S::Madd16(S::Unpacklo16(c, zero), r.c2));
+  auto hi = S::Add32(S::Madd16(S::Unpackhi16(a, b), r.c01), S::Madd16(S::Unpackhi16(c, zero), r.c2));
+  lo = S::template Srai32<kShift>(S::Add32(lo, offset));
+  hi = S::template Srai32<kShift>(S::Add32(hi, offset));
+  return S::Packs32InLane(lo, hi);
+}
+
+template <class S>
+static void LumaRow(const uint8_t *src, uint8_t *dst_y, int width, const Coefs *k) {
+  const int n = S::kPixels;
+  auto ky = MakeVecRow<S>(k->y);
+  auto offset = S::Set1_32(kLumaOffset);
+
+  int x = 0;
+  for (; x + 4 * n <= width; x += 4 * n) {
+    const uint8_t *p = src + x * 4;
+    auto p0 = S::Load(p);
+    auto p1 = S::Load(p + 4 * n);
+    auto p2 = S::Load(p + 8 * n);
+    auto p3 = S::Load(p + 12 * n);
+
+    auto ya = Dot16<S, 15>(Channel16<S, 0>(p0, p1), Channel16<S, 8>(p0, p1), Channel16<S, 16>(p0, p1), ky, offset);
+    auto yb = Dot16<S, 15>(Channel16<S, 0>(p2, p3), Channel16<S, 8>(p2, p3), Channel16<S, 16>(p2, p3), ky, offset);
+    S::Store(dst_y + x, S::Packus16(ya, yb));
+  }
+
+  LumaRowScalar(src + x * 4, dst_y + x, width - x, k);
+}
+
+// Sums of 2x2 blocks of byte n, for 2 * kPixels pixels of two rows, as
+// 32-bit values
+template <class S, int kShift>
+static inline typename S::V Sum2x2(typename S::V p0, typename S::V p1,
+                                   typename S::V q0, typename S::V q1) {
+  auto ones = S::Set1_32(0x00010001);
+  return S::Madd16(S::Add16(Channel16<S, kShift>(p0, p1), Channel16<S, kShift>(q0, q1)), ones);
+}
+
+template <class S>
+static void Chroma420Row(const uint8_t *src0, const uint8_t *src1,
+                         uint8_t *dst_u, uint8_t *dst_v, int width, const Coefs *k) {
+  const int n = S::kPixels;
+  auto ku = MakeVecRow<S>(k->u);
+  auto kv = MakeVecRow<S>(k->v);
+  auto offset = S::Set1_32(kChroma420Offset);
+
+  int x = 0;
+  for (; x + 4 * n <= width; x += 4 * n) {
+    const uint8_t *p = src0 + x * 4;
+    const uint8_t *q = src1 + x * 4;
+    auto p0 = S::Load(p);
+    auto p1 = S::Load(p + 4 * n);
+    auto p2 = S::Load(p + 8 * n);
+    auto p3 = S::Load(p + 12 * n);
+    auto q0 = S::Load(q);
+    auto q1 = S::Load(q + 4 * n);
+    auto q2 = S::Load(q + 8 * n);
+    auto q3 = S::Load(q + 12 * n);
+
+    // 2 * kPixels chroma samples
+    auto a = S::Packs32(Sum2x2<S, 0>(p0, p1, q0, q1), Sum2x2<S, 0>(p2, p3, q2, q3));
+    auto b = S::Packs32(Sum2x2<S, 8>(p0, p1, q0, q1), Sum2x2<S, 8>(p2, p3, q2, q3));
+    auto c = S::Packs32(Sum2x2<S, 16>(p0, p1, q0, q1), Sum2x2<S, 16>(p2, p3, q2, q3));
+
+    auto u = Dot16<S, 17>(a, b, c, ku, offset);
+    auto v = Dot16<S, 17>(a, b, c, kv, offset);
+    if (dst_v) {
+      auto uv = S::Packus16(u, v);
+      S::StoreLow(dst_u + x / 2, uv);
+      S::StoreHigh(dst_v + x / 2, uv);
+    } else {
+      // u and v are both in 0..255, so this interleaves them
+      S::Store(dst_u + x, S::Or(u, S::template Slli16<8>(v)));
+    }
+  }
+
+  if (dst_v) {
+    Chroma420RowScalar(src0 + x * 4, src1 + x * 4, dst_u + x / 2, dst_v + x / 2, width - x, k);
+  } else {
+    Chroma420RowScalar(src0 + x * 4, src1 + x * 4, dst_u + x, nullptr, width - x, k);
+  }
+}
+
+template <class S>
+static void Chroma444Row(const uint8_t *src, uint8_t *dst_u, uint8_t *dst_v,
+                         int width, const Coefs *k) {
+  const int n = S::kPixels;
+  auto ku = MakeVecRow<S>(k->u);
+  auto kv = MakeVecRow<S>(k->v);
+  auto offset = S::Set1_32(kChromaOffset);
+
+  int x = 0;
+  for (; x + 4 * n <= width; x += 4 * n) {
+    const uint8_t *p = src + x * 4;
+    auto p0 = S::Load(p);
+    auto p1 = S::Load(p + 4 * n);
+    auto p2 = S::Load(p + 8 * n);
+    auto p3 = S::Load(p + 12 * n);
+
+    auto a0 = Channel16<S, 0>(p0, p1);
+    auto b0 = Channel16<S, 8>(p0, p1);
+    auto c0 = Channel16<S, 16>(p0, p1);
+    auto a1 = Channel16<S, 0>(p2, p3);
+    auto b1 = Channel16<S, 8>(p2, p3);
+    auto c1 = Channel16<S, 16>(p2, p3);
+
+    S::Store(dst_u + x, S::Packus16(Dot16<S, 15>(a0, b0, c0, ku, offset), Dot16<S, 15>(a1, b1, c1, ku, offset)));
+    S::Store(dst_v + x, S::Packus16(Dot16<S, 15>(a0, b0, c0, kv, offset), Dot16<S, 15>(a1, b1, c1, kv, offset)));
+  }
+
+  Chroma444RowScalar(src + x * 4, dst_u + x, dst_v + x, width - x, k);
+}
+
+} // namespace colorconv
+} // namespace capsule
@@ -0,0 +1,70 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+// Built with -msse2 (or the MSVC equivalent), see CMakeLists.txt
+
+#include "colorconv_kernels.h"
+
+#include <emmintrin.h>
+
+namespace capsule {
+namespace colorconv {
+
+struct SSE2 {
+  typedef __m128i V;
+  static const int kPixels = 4;
+
+  static inline V Load(const uint8_t *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+  static inline void Store(uint8_t *p, V a) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), a); }
+  static inline void StoreLow(uint8_t *p, V a) { _mm_storel_epi64(reinterpret_cast<__m128i*>(p), a); }
+  static inline void StoreHigh(uint8_t *p, V a) { _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_srli_si128(a, 8)); }
+
+  static inline V Set1_32(int32_t x) { return _mm_set1_epi32(x); }
+  static inline V Zero() { return _mm_setzero_si128(); }
+
+  static inline V And(V a, V b) { return _mm_and_si128(a, b); }
+  static inline V Or(V a, V b) { return _mm_or_si128(a, b); }
+  static inline V Add16(V a, V b) { return _mm_add_epi16(a, b); }
+  static inline V Add32(V a, V b) { return _mm_add_epi32(a, b); }
+  static inline V Madd16(V a, V b) { return _mm_madd_epi16(a, b); }
+
+  template <int n> static inline V Srli32(V a) { return _mm_srli_epi32(a, n); }
+  template <int n> static inline V Srai32(V a) { return _mm_srai_epi32(a, n); }
+  template <int n> static inline V Slli16(V a) { return _mm_slli_epi16(a, n); }
+
+  static inline V Unpacklo16(V a, V b) { return _mm_unpacklo_epi16(a, b); }
+  static inline V Unpackhi16(V a, V b) { return _mm_unpackhi_epi16(a, b); }
+
+  // a single lane, so in-lane is in-order
+  static inline V Packs32InLane(V a, V b) { return _mm_packs_epi32(a, b); }
+  static inline V Packs32(V a, V b) { return _mm_packs_epi32(a, b); }
+  static inline V Packus16(V a, V b) { return _mm_packus_epi16(a, b); }
+};
+
+extern const Kernels kKernelsSSE2 = {
+  kIsaSSE2,
+  LumaRow<SSE2>,
+  Chroma420Row<SSE2>,
+  Chroma444Row<SSE2>,
+};
+
+} // namespace colorconv
+} // namespace capsule
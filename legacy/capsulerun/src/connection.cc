@@ -22,10 +22,11 @@
 #include "connection.h"
 
 #if defined(LAB_LINUX)
-#include <sys/stat.h> // for mode constants
-#include <fcntl.h>    // for O_* constants
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>    // for errno
+#include <string.h>   // memset, strncpy
 #include <unistd.h>   // unlink
-#include <signal.h>   // signal, SIGPIPE
 #elif defined(LAB_MACOS)
 #include <sys/stat.h> // for mode constants
 #include <fcntl.h>    // for O_* constants
@@ -66,7 +67,40 @@ static HANDLE CreatePipe(
   return handle;
 }
 
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+
+static int CreateListenSocket (
+  std::string sock_path
+) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (sock_path.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strncpy(addr.sun_path, sock_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return -1;
+  }
+
+  // remove previous socket if any
+  unlink(sock_path.c_str());
+
+  if (bind(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(sock, 1) != 0) {
+    int err = errno;
+    close(sock);
+    errno = err;
+    return -1;
+  }
+
+  return sock;
+}
+
+#else // LAB_MACOS
 
 static int CreateFifo (
     std::string fifo_path
@@ -86,12 +120,16 @@ static int OpenFifo (
   return open(path.c_str(), flags);
 }
 
-#endif // !LAB_WINDOWS
+#endif
 
 Connection::Connection(std::string pipe_name) {
   pipe_name_ = pipe_name;
+#if defined(LAB_LINUX)
+  sock_path_ = lab::paths::PipePath(pipe_name + ".sock");
+#else // LAB_LINUX
   r_path_ = lab::paths::PipePath(pipe_name + ".runread");
   w_path_ = lab::paths::PipePath(pipe_name + ".runwrite");
+#endif // !LAB_LINUX
 
 #if defined(LAB_WINDOWS)
   pipe_r_ = CreatePipe(r_path_, PIPE_ACCESS_INBOUND);
@@ -104,7 +142,15 @@ Connection::Connection(std::string pipe_name) {
     Log("Could not create write pipe, bailing out...");
     exit(1);
   }
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+  // listen right away, so libcapsule can connect as soon as
+  // it knows our name
+  listen_sock_ = CreateListenSocket(sock_path_);
+  if (listen_sock_ < 0) {
+    Log("Could not listen on %s (errno %d)", sock_path_.c_str(), errno);
+    exit(1);
+  }
+#else // LAB_MACOS
   // ignore SIGPIPE - those will get disconnected when
   // the game shuts down, and that's okay.
   signal(SIGPIPE, SIG_IGN);
@@ -136,7 +182,21 @@ void Connection::Connect() {
   if (!success) {
     return;
   }
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+  do {
+    sock_ = accept4(listen_sock_, nullptr, nullptr, SOCK_CLOEXEC);
+  } while (sock_ < 0 && errno == EINTR);
+
+  // one client per connection, don't leave anything behind in /tmp
+  close(listen_sock_);
+  listen_sock_ = -1;
+  unlink(sock_path_.c_str());
+
+  if (sock_ < 0) {
+    Log("Could not accept on %s (errno %d)", sock_path_.c_str(), errno);
+    return;
+  }
+#else // LAB_MACOS
   fifo_r_ = OpenFifo(r_path_, O_RDONLY);
   if (!fifo_r_) {
     return;
@@ -156,6 +216,12 @@ void Connection::Close() {
 #if defined(LAB_WINDOWS)
   CloseHandle(pipe_r_);
   CloseHandle(pipe_w_);
+#elif defined(LAB_LINUX)
+  if (sock_ >= 0) {
+    shutdown(sock_, SHUT_RDWR);
+    close(sock_);
+    sock_ = -1;
+  }
 #else
   close(fifo_r_);
   close(fifo_w_);
@@ -169,12 +235,14 @@ void Connection::Write(const flatbuffers::FlatBufferBuilder &builder) {
 
 #if defined(LAB_WINDOWS)
   lab::packet::Hwrite(builder, pipe_w_);
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+  lab::packet::Send(builder, sock_);
+#else // LAB_MACOS
   lab::packet::Write(builder, fifo_w_);
-#endif // !LAB_WINDOWS
+#endif
 }
 
-char *Connection::Read() {
+char *Connection::Read(std::vector<int> *fds) {
   if (!connected_) {
     return nullptr;
   }
@@ -183,9 +251,11 @@ char *Connection::Read() {
 
 #if defined(LAB_WINDOWS)
   result = lab::packet::Hread(pipe_r_);
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+  result = lab::packet::Recv(sock_, fds);
+#else // LAB_MACOS
   result = lab::packet::Read(fifo_r_);
-#endif // !LAB_WINDOWS
+#endif
 
   if (!result) {
     connected_ = false;
@@ -23,6 +23,8 @@
 
 #include <lab/packet.h>
 
+#include <vector>
+
 namespace capsule {
 
 class Connection {
@@ -32,22 +34,31 @@ class Connection {
     void Close();
 
     void Write(const flatbuffers::FlatBufferBuilder &builder);
-    char *Read();
+    // file descriptors passed along with the packet, if any, are
+    // appended to fds (linux only), the caller must close them
+    char *Read(std::vector<int> *fds = nullptr);
 
     bool IsConnected() { return connected_; };
     std::string GetPipeName() { return pipe_name_; };
 
   private:
     std::string pipe_name_;
+#if defined(LAB_WINDOWS)
     std::string r_path_;
     std::string w_path_;
-#if defined(LAB_WINDOWS)
     HANDLE pipe_r_ = INVALID_HANDLE_VALUE;
     HANDLE pipe_w_ = INVALID_HANDLE_VALUE;
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+    // a single SOCK_SEQPACKET unix socket, libcapsule connects to it
+    std::string sock_path_;
+    int listen_sock_ = -1;
+    int sock_ = -1;
+#else // LAB_MACOS
+    std::string r_path_;
+    std::string w_path_;
     int fifo_r_ = 0;
     int fifo_w_ = 0;
-#endif // !LAB_WINDOWS
+#endif
 
     bool connected_ = false;
 };
@@ -0,0 +1,53 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "conversion_stage.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+namespace capsule {
+namespace colorconv {
+
+ConversionStage::ConversionStage(const Converter *conv, int width, int height, int src_linesize, int num_threads) :
+  conv_(conv),
+  pool_(num_threads),
+  height_(height),
+  src_linesize_(src_linesize) {
+  // worst case (4:4:4) we write three bytes per pixel
+  int row_bytes = std::abs(src_linesize) + width * 3;
+  band_rows_ = std::max(2, (kBandBytes / row_bytes) & ~1);
+  band_rows_ = std::min(band_rows_, height_);
+  num_bands_ = (height_ + band_rows_ - 1) / band_rows_;
+}
+
+void ConversionStage::Convert(const uint8_t *src, bool vflip,
+                              uint8_t *const dst[], const int dst_linesize[]) {
+  pool_.Run(num_bands_, [&](int band) {
+    int y_begin = band * band_rows_;
+    int y_end = std::min(y_begin + band_rows_, height_);
+    conv_->Convert(src, src_linesize_, vflip, dst, dst_linesize, y_begin, y_end);
+  });
+}
+
+} // namespace colorconv
+} // namespace capsule
@@ -0,0 +1,64 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include "band_pool.h"
+#include "colorconv.h"
+
+namespace capsule {
+namespace colorconv {
+
+// Cache budget for one band: a conservative L2 size, most x86 cores have
+// at least that much.
+static const int kBandBytes = 256 * 1024;
+
+/**
+ * Runs a Converter over horizontal bands of each frame, concurrently, on
+ * a BandPool.
+ *
+ * Bands are a whole number of row pairs, so 4:2:0 chroma rows never
+ * straddle two of them, and are sized so that a band's source and
+ * destination rows fit in kBandBytes. Flipped frames just have each band
+ * read from the mirrored source rows, which are contiguous too.
+ */
+class ConversionStage {
+  public:
+    ConversionStage(const Converter *conv, int width, int height, int src_linesize, int num_threads);
+
+    void Convert(const uint8_t *src, bool vflip,
+                 uint8_t *const dst[], const int dst_linesize[]);
+
+    int NumBands() const { return num_bands_; }
+    int NumThreads() const { return pool_.NumThreads(); }
+    int BandRows() const { return band_rows_; }
+
+  private:
+    const Converter *conv_;
+    BandPool pool_;
+    int height_;
+    int src_linesize_;
+    int band_rows_;
+    int num_bands_;
+};
+
+} // namespace colorconv
+} // namespace capsule
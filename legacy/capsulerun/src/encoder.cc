@@ -46,16 +46,25 @@ extern "C" {
 #endif // WIN32
 
 #include <microprofile.h>
-#include <lab/env.h>
 
+#include <limits.h>
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <thread>
 
+#include "bounded_queue.h"
+#include "colorconv.h"
+#include "conversion_stage.h"
 #include "fps_counter.h"
 #include "logging.h"
+#include "output.h"
+#include "quality_controller.h"
+#include "replay_buffer.h"
+#include "spool_codec.h"
 
 MICROPROFILE_DEFINE(EncoderMain, "Encoder", "Main", MP_WHITE);
-MICROPROFILE_DEFINE(EncoderCycle, "Encoder", "Cycle", MP_WHITE);
 
 MICROPROFILE_DEFINE(EncoderReceiveVideoFrame, "Encoder", "VRecv", MP_AQUAMARINE3);
 MICROPROFILE_DEFINE(EncoderScale, "Encoder", "VScale", MP_THISTLE3);
@@ -72,6 +81,18 @@ MICROPROFILE_DEFINE(EncoderWriteAudioPkt, "Encoder", "AMux2", MP_BROWN4);
 namespace capsule {
 namespace encoder {
 
+// Opaque for the AVBufferRef wrapping a lent frame
+struct LentFrame {
+  Params *params;
+  int slot;
+};
+
+static void ReleaseLentFrame(void *opaque, uint8_t * /*data*/) {
+  auto lent = reinterpret_cast<LentFrame*>(opaque);
+  lent->params->release_video_frame(lent->params->private_data, lent->slot);
+  delete lent;
+}
+
 AVSampleFormat SampleFormatToAv(messages::SampleFmt fmt) {
   switch (fmt) {
     case messages::SampleFmt_U8:
@@ -90,12 +111,584 @@ AVSampleFormat SampleFormatToAv(messages::SampleFmt fmt) {
   }
 }
 
+// Encoding is split into stages, each on its own thread, handing their
+// output to the next one through a bounded queue. A full queue blocks
+// whoever feeds it, so throughput is that of the slowest stage rather than
+// the sum of all of them, and a stall (slow disk, audio encode) only backs
+// up the stages before it.
+//
+//   receive -> convert -> encode video -> mux (on Run's thread)
+//                         encode audio ---^
+
+// lent frames each hold a ring slot, don't keep many of them waiting
+static const size_t kConvertQueueSize = 2;
+// converted frames, from the frame pool
+static const size_t kEncodeQueueSize = 3;
+// compressed packets, small but plenty
+static const size_t kMuxQueueSize = 256;
+
+// frames encoded between two quality adjustments
+static const int kQualityWindow = 30;
+
+// output buffers, and how many may wait on the disk
+static const size_t kWriteBufferSize = 4 * 1024 * 1024;
+static const int kWriteBuffers = 8;
+
+// samples per frame, in raw mode
+static const int kRawAudioFrameSize = 1024;
+
+// alignment of converted frames' planes and lines
+static const int kFrameAlign = 32;
+
+// receivers wake us up when frames come in, this is only how long it
+// may take to notice we're done
+static const int kStopCheckMs = 100;
+
+struct Pipeline {
+  Pipeline() :
+    convert_queue(kConvertQueueSize),
+    encode_queue(kEncodeQueueSize),
+    mux_queue(kMuxQueueSize) {}
+
+  MainArgs *args = nullptr;
+  Params *params = nullptr;
+  VideoFormat vfmt_in;
+  AudioFormat afmt_in;
+
+  AVFormatContext *oc = nullptr;
+  AVStream *video_st = nullptr;
+  AVStream *audio_st = nullptr;
+  AVCodecContext *vc = nullptr;
+  AVCodecContext *ac = nullptr;
+  // where packets end up, unless in replay mode
+  Output *output = nullptr;
+
+  // frames are converted with either of these, into frames from
+  // frame_pool - unless they come in converted already.
+  colorconv::ConversionStage *conv_stage = nullptr;
+  SwsContext *sws = nullptr;
+  AVBufferPool *frame_pool = nullptr;
+
+  SwrContext *swr = nullptr;
+  AVFrame *aframe = nullptr;
+
+  // only with --adaptive-quality
+  QualityController *quality = nullptr;
+
+  BoundedQueue<VideoFrame> convert_queue;
+  BoundedQueue<AVFrame*> encode_queue;
+  BoundedQueue<AVPacket*> mux_queue;
+
+  // set once the video receiver is drained, the audio stage follows suit
+  std::atomic<bool> video_done{false};
+  // encoders still feeding mux_queue, the last one closes it
+  std::atomic<int> mux_producers{0};
+};
+
+// Queues up whatever packets the encoder has for us, for muxing
+static void DrainPackets(Pipeline *p, AVCodecContext *c, AVStream *st) {
+  while (true) {
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt) {
+      Log("Could not allocate packet");
+      exit(1);
+    }
+
+    int ret = avcodec_receive_packet(c, pkt);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+      av_packet_free(&pkt);
+      return;
+    } else if (ret < 0) {
+      Log("Error encoding a%s frame", c == p->vc ? " video" : "n audio");
+      exit(1);
+    }
+
+    av_packet_rescale_ts(pkt, c->time_base, st->time_base);
+    pkt->stream_index = st->index;
+    p->mux_queue.Push(pkt);
+  }
+}
+
+static void DoneProducing(Pipeline *p) {
+  if (--p->mux_producers == 0) {
+    p->mux_queue.Close();
+  }
+}
+
+static void ReceiveVideo(Pipeline *p) {
+  MicroProfileOnThreadCreate("encoder-receive");
+
+  auto params = p->params;
+  // frames aren't copied in, they're lent by the receiver, see VideoFrame
+  const int64_t buffer_size = p->vfmt_in.frame_size;
+
+  int64_t first_timestamp = -1;
+  int64_t last_timestamp = 0;
+  FPSCounter fps_counter;
+
+  while (true) {
+    VideoFrame frame;
+    int64_t read;
+    {
+      MICROPROFILE_SCOPE(EncoderReceiveVideoFrame);
+      read = params->receive_video_frame(params->private_data, &frame);
+    }
+
+    if (read < 0) {
+      // all read out
+      break;
+    } else if (read < buffer_size) {
+      // got no frame
+      params->wait_video_frame(params->private_data, kStopCheckMs);
+      continue;
+    }
+
+    if (first_timestamp < 0) {
+      first_timestamp = frame.timestamp;
+    }
+    frame.timestamp -= first_timestamp;
+
+    auto delta = frame.timestamp - last_timestamp;
+    last_timestamp = frame.timestamp;
+    if (fps_counter.TickDelta(delta)) {
+      // peak queue depths since last time
+      int write_peak = 0, write_capacity = 0;
+      if (p->output) {
+        p->output->TakeWritePeak(&write_peak, &write_capacity);
+      }
+      Log("FPS: %.2f, queues: convert %d/%d, encode %d/%d, mux %d/%d, write %d/%d",
+        fps_counter.Fps(),
+        (int) p->convert_queue.TakePeak(), (int) p->convert_queue.Capacity(),
+        (int) p->encode_queue.TakePeak(), (int) p->encode_queue.Capacity(),
+        (int) p->mux_queue.TakePeak(), (int) p->mux_queue.Capacity(),
+        write_peak, write_capacity);
+    }
+
+    p->convert_queue.Push(frame);
+  }
+
+  p->video_done = true;
+  p->convert_queue.Close();
+}
+
+static void ConvertVideo(Pipeline *p) {
+  MicroProfileOnThreadCreate("encoder-convert");
+
+  auto params = p->params;
+  auto vc = p->vc;
+  auto &vfmt_in = p->vfmt_in;
+  int height = vfmt_in.height;
+
+  VideoFrame frame_in;
+  while (p->convert_queue.Pop(frame_in)) {
+    MICROPROFILE_COUNTER_SET("encoder/queue/convert", p->convert_queue.Depth());
+
+    AVFrame *vframe = av_frame_alloc();
+    if (!vframe) {
+      Log("could not allocate video frame");
+      exit(1);
+    }
+    vframe->format = vc->pix_fmt;
+    vframe->width = vc->width;
+    vframe->height = vc->height;
+
+    {
+      MICROPROFILE_SCOPE(EncoderScale);
+      if (p->frame_pool) {
+        vframe->buf[0] = av_buffer_pool_get(p->frame_pool);
+        if (!vframe->buf[0]) {
+          Log("Could not allocate raw picture buffer");
+          exit(1);
+        }
+        av_image_fill_arrays(vframe->data, vframe->linesize, vframe->buf[0]->data,
+          vc->pix_fmt, vc->width, vc->height, kFrameAlign);
+
+        if (p->conv_stage) {
+          // flips as it goes
+          p->conv_stage->Convert(frame_in.data, vfmt_in.vflip, vframe->data, vframe->linesize);
+        } else {
+          // packed RGB, or planes converted on the GPU in raw mode.
+          // swscale reads four of each, whatever the format.
+          int sws_linesize[4] = {0};
+          const uint8_t *sws_in[4] = {nullptr};
+          int num_planes = video::NumPlanes(vfmt_in.format);
+          for (int i = 0; i < num_planes; i++) {
+            const uint8_t *plane = frame_in.data + vfmt_in.offset[i];
+            int plane_linesize = (int) vfmt_in.linesize[i];
+            if (vfmt_in.vflip) {
+              // specify negative stride to flip
+              int64_t rows = video::PlaneHeight(vfmt_in.format, i, height);
+              sws_in[i] = plane + plane_linesize * (rows - 1);
+              sws_linesize[i] = -plane_linesize;
+            } else {
+              sws_in[i] = plane;
+              sws_linesize[i] = plane_linesize;
+            }
+          }
+          sws_scale(p->sws, sws_in, sws_linesize, 0, height, vframe->data, vframe->linesize);
+        }
+
+        // converted into vframe, the receiver can have it back
+        params->release_video_frame(params->private_data, frame_in.slot);
+      } else {
+        // hand the frame to the encoder as-is, as a refcounted buffer:
+        // it takes its own reference instead of copying, and the slot
+        // goes back to the receiver once the last one is gone.
+        auto lent = new LentFrame{params, frame_in.slot};
+        vframe->buf[0] = av_buffer_create(
+          const_cast<uint8_t*>(frame_in.data), (int) vfmt_in.frame_size,
+          ReleaseLentFrame, lent, AV_BUFFER_FLAG_READONLY
+        );
+        if (!vframe->buf[0]) {
+          Log("Could not wrap video frame");
+          exit(1);
+        }
+
+        int num_planes = video::NumPlanes(vfmt_in.format);
+        for (int i = 0; i < num_planes; i++) {
+          vframe->data[i] = vframe->buf[0]->data + vfmt_in.offset[i];
+          vframe->linesize[i] = (int) vfmt_in.linesize[i];
+        }
+      }
+    }
+
+    vframe->pts = frame_in.timestamp;
+    p->encode_queue.Push(vframe);
+  }
+
+  p->encode_queue.Close();
+}
+
+// Feeds how we've been doing to the quality controller, and applies
+// whatever it comes up with. libx264 picks up a new crf on the next frame.
+static void AdjustQuality(Pipeline *p, double encode_ms) {
+  VideoStats stats;
+  p->params->receive_video_stats(p->params->private_data, &stats);
+
+  QualitySample sample;
+  sample.backlog = stats.backlog;
+  sample.capacity = stats.capacity;
+  sample.skipped = stats.skipped;
+  sample.encode_ms = encode_ms;
+  sample.frame_ms = 1000.0 / (double) (p->args->fps > 0 ? p->args->fps : 60);
+
+  int crf = p->quality->Crf();
+  if (p->quality->Update(sample) != crf) {
+    av_opt_set_double(p->vc->priv_data, "crf", (double) p->quality->Crf(), 0);
+  }
+}
+
+static void EncodeVideo(Pipeline *p) {
+  MicroProfileOnThreadCreate("encoder-video");
+
+  int ret;
+  AVFrame *vframe;
+  double window_ms = 0.0;
+  int window_frames = 0;
+  while (p->encode_queue.Pop(vframe)) {
+    MICROPROFILE_COUNTER_SET("encoder/queue/encode", p->encode_queue.Depth());
+    auto encode_start = std::chrono::steady_clock::now();
+
+    {
+      MICROPROFILE_SCOPE(EncoderSendVideoFrame);
+      ret = avcodec_send_frame(p->vc, vframe);
+    }
+    // drop our reference, the encoder has its own if it needs one. the
+    // buffer goes back to its pool (or the receiver) once that's gone too.
+    av_frame_free(&vframe);
+    if (ret < 0) {
+      Log("Error encoding video frame");
+      exit(1);
+    }
+
+    {
+      MICROPROFILE_SCOPE(EncoderRecvVideoPkt);
+      DrainPackets(p, p->vc, p->video_st);
+    }
+
+    if (p->quality) {
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - encode_start;
+      window_ms += elapsed.count();
+      if (++window_frames == kQualityWindow) {
+        AdjustQuality(p, window_ms / (double) window_frames);
+        window_ms = 0.0;
+        window_frames = 0;
+      }
+    }
+  }
+
+  // delayed video frames
+  ret = avcodec_send_frame(p->vc, NULL);
+  if (ret < 0) {
+    Log("couldn't flush video codec");
+    exit(1);
+  }
+  DrainPackets(p, p->vc, p->video_st);
+
+  DoneProducing(p);
+}
+
+static void EncodeAudio(Pipeline *p) {
+  MicroProfileOnThreadCreate("encoder-audio");
+
+  auto params = p->params;
+  auto ac = p->ac;
+  auto aframe = p->aframe;
+  auto &afmt_in = p->afmt_in;
+
+  int ret;
+  int64_t anext_pts = 0;
+
+  int64_t samples_received = 0;
+  int64_t samples_used = 0;
+  int64_t samples_filled = 0;
+  int64_t sample_width = afmt_in.channels * audio::SampleWidth(afmt_in.format) / 8;
+  uint8_t *sample_buf = reinterpret_cast<uint8_t*>(malloc(aframe->nb_samples * sample_width));
+  char *in_samples = nullptr;
+
+  while (true) {
+    // checked before draining, so whatever came in before video
+    // ended still makes it in
+    bool last_pass = p->video_done;
+
+    while (true) {
+      int64_t samples_needed = aframe->nb_samples;
+      bool underrun = false;
+
+      while (samples_filled < samples_needed) {
+        if (samples_used >= samples_received) {
+          samples_used = 0;
+
+          {
+            MICROPROFILE_SCOPE(EncoderReceiveAudioFrames);
+            in_samples = (char *) params->receive_audio_frames(params->private_data, &samples_received);
+          }
+          if (samples_received == 0) {
+            underrun = true;
+            break;
+          }
+        }
+
+        {
+          MICROPROFILE_SCOPE(EncoderResample);
+          int64_t samples_copied = samples_needed - samples_filled;
+          int64_t samples_avail = samples_received - samples_used;
+          if (samples_copied > samples_avail) {
+            samples_copied = samples_avail;
+          }
+
+          DebugLog("Copying %" PRId64 " samples (%" PRId64 " needed, %" PRId64 " filled, %" PRId64 " received, %" PRId64 " used)", samples_copied,
+            samples_needed, samples_filled, samples_received, samples_used);
+          memcpy(sample_buf + (samples_filled * sample_width), in_samples + (samples_used * sample_width), samples_copied * sample_width);
+
+          samples_used += samples_copied;
+          samples_filled += samples_copied;
+        }
+      }
+
+      if (underrun) {
+        // we'll get more frames next time, no biggie
+        break;
+      }
+
+      ret = av_frame_make_writable(aframe);
+      if (ret < 0) {
+        Log("Could not make audio frame writable");
+        exit(1);
+      }
+
+      DebugLog("swr_delay: %d", swr_get_delay(p->swr, afmt_in.rate));
+
+      const uint8_t* src_data[] = { sample_buf };
+      ret = swr_convert(
+        p->swr,
+        aframe->data,
+        aframe->nb_samples,
+        src_data,
+        aframe->nb_samples
+      );
+      if (ret < 0) {
+        Log("Failed to convert samples: code %d (%x)", ret, ret);
+        exit(1);
+      }
+
+      aframe->pts = anext_pts;
+      anext_pts += aframe->nb_samples;
+
+      samples_filled = 0;
+
+      {
+        MICROPROFILE_SCOPE(EncoderSendAudioFrames);
+        ret = avcodec_send_frame(ac, aframe);
+      }
+      if (ret < 0) {
+        const int err_string_size = 16 * 1024;
+        char err_string[err_string_size];
+        err_string[0] = '\0';
+        av_strerror(ret, err_string, err_string_size);
+        Log("Error encoding audio frame: error %d (%x) - %s", ret, ret, err_string);
+        exit(1);
+      }
+
+      {
+        MICROPROFILE_SCOPE(EncoderRecvAudioPkt);
+        DrainPackets(p, ac, p->audio_st);
+      }
+    }
+
+    if (last_pass) {
+      break;
+    }
+    params->wait_audio_frames(params->private_data, kStopCheckMs);
+  }
+
+  // delayed audio frames
+  ret = avcodec_send_frame(ac, NULL);
+  if (ret < 0) {
+    Log("couldn't flush audio codec");
+    exit(1);
+  }
+  DrainPackets(p, ac, p->audio_st);
+
+  free(sample_buf);
+  DoneProducing(p);
+}
+
+static void Mux(Pipeline *p) {
+  AVPacket *pkt;
+  while (p->mux_queue.Pop(pkt)) {
+    MICROPROFILE_COUNTER_SET("encoder/queue/mux", p->mux_queue.Depth());
+
+    if (p->params->replay) {
+      p->params->replay->Add(pkt);
+      continue;
+    }
+
+    bool ok;
+    bool is_video = (pkt->stream_index == p->video_st->index);
+    // the output takes ownership of the packet
+    if (is_video) {
+      MICROPROFILE_SCOPE(EncoderWriteVideoPkt);
+      ok = p->output->Write(pkt);
+    } else {
+      MICROPROFILE_SCOPE(EncoderWriteAudioPkt);
+      ok = p->output->Write(pkt);
+    }
+    if (!ok) {
+      Log("Error while writing %s frame", is_video ? "video" : "audio");
+      exit(1);
+    }
+  }
+}
+
+// Sets up x264 as asked. Returns a quality controller if adaptive quality
+// is on, nullptr otherwise.
+static QualityController *ConfigureH264(MainArgs *args, AVCodecContext *vc) {
+  vc->gop_size = 120;
+  if (args->gop_size) {
+    vc->gop_size = args->gop_size;
+  }
+
+  vc->max_b_frames = 16;
+  if (args->max_b_frames) {
+    vc->max_b_frames = args->max_b_frames;
+  }
+
+  int crf = 20;
+  if (args->crf != -1) {
+    if (args->crf >= 0 && args->crf <= 51) {
+      if (args->crf < 18 || args->crf > 28) {
+        Log("Warning: sane crf values lie within 18-28, using crf %d at your own risks", args->crf);
+      }
+      crf = args->crf;
+    } else {
+      Log("Invalid crf value %d (must be in the 0-51 range), ignoring", args->crf);
+    }
+  }
+
+  // rate control. crf (the default) keeps quality constant and lets
+  // the bitrate follow, capped-crf does the same but never goes over
+  // --bitrate, cbr sticks to --bitrate, cqp is a fixed quantizer.
+  const char *rc = args->rc ? args->rc : "crf";
+  if (strcmp(rc, "crf") && strcmp(rc, "capped-crf") && strcmp(rc, "cbr") && strcmp(rc, "cqp")) {
+    Log("Invalid rate control mode %s, using crf", rc);
+    rc = "crf";
+  }
+  bool vbv = !strcmp(rc, "capped-crf") || !strcmp(rc, "cbr");
+  if (vbv && args->bitrate <= 0) {
+    Log("Rate control mode %s needs --bitrate, using crf", rc);
+    rc = "crf";
+    vbv = false;
+  }
+
+  if (vbv) {
+    // in bits per second, x264 wants the VBV in kbit and converts back
+    int64_t bitrate = (int64_t) args->bitrate * 1000;
+    vc->rc_max_rate = bitrate;
+    // one second of video by default for cbr, so the bitrate holds
+    // over short spans, a bit more leeway for capped-crf
+    int64_t bufsize = args->bufsize > 0 ? (int64_t) args->bufsize * 1000 : bitrate;
+    if (args->bufsize <= 0 && !strcmp(rc, "capped-crf")) {
+      bufsize *= 2;
+    }
+    vc->rc_buffer_size = (int) std::min<int64_t>(bufsize, INT_MAX);
+    if (!strcmp(rc, "cbr")) {
+      vc->bit_rate = bitrate;
+    }
+  }
+
+  if (!strcmp(rc, "cbr")) {
+    Log("Rate control: cbr at %d kbit/s, %d kbit buffer", args->bitrate, vc->rc_buffer_size / 1000);
+  } else if (!strcmp(rc, "cqp")) {
+    Log("Rate control: cqp %d", crf);
+    av_opt_set_int(vc->priv_data, "qp", crf, 0);
+  } else if (vbv) {
+    Log("Rate control: crf %d, at most %d kbit/s, %d kbit buffer", crf, args->bitrate, vc->rc_buffer_size / 1000);
+    av_opt_set_double(vc->priv_data, "crf", (double) crf, 0);
+  } else {
+    Log("Rate control: crf %d", crf);
+    av_opt_set_double(vc->priv_data, "crf", (double) crf, 0);
+  }
+
+  QualityController *quality = nullptr;
+  if (args->adaptive_quality && (!strcmp(rc, "cbr") || !strcmp(rc, "cqp"))) {
+    Log("Adaptive quality needs crf or capped-crf rate control, disabling");
+  } else if (args->adaptive_quality) {
+    // crf is the one rate control setting x264 can change mid-stream
+    // without new SPS/PPS.
+    int max_crf = args->max_crf ? args->max_crf : std::min(crf + 10, 51);
+    if (max_crf < crf || max_crf > 51) {
+      Log("Invalid max crf %d (must be in the %d-51 range), ignoring", max_crf, crf);
+      max_crf = std::min(crf + 10, 51);
+    }
+    Log("Adaptive quality: crf %d to %d", crf, max_crf);
+    quality = new QualityController(crf, max_crf);
+  }
+
+  if (vc->pix_fmt == AV_PIX_FMT_YUV444P) {
+    Log("Warning: can't use baseline because yuv444p colorspace selected. Encoding will take more CPU.");
+  } else {
+    vc->profile = FF_PROFILE_H264_BASELINE;
+  }
+
+  const char *preset = "ultrafast";
+  if (args->x264_preset) {
+    preset = args->x264_preset;
+  }
+  av_opt_set(vc->priv_data, "preset", preset, AV_OPT_SEARCH_CHILDREN);
+
+  return quality;
+}
+
 void Run(MainArgs *args, Params *params) {
   MicroProfileOnThreadCreate("encoder");
   MICROPROFILE_SCOPE(EncoderMain);
 
   int ret;
 
+  // replay mode keeps encoded packets around, it needs them small
+  bool raw = args->raw && !params->replay;
+
   av_register_all();
 
   if (args->debug_av) {
@@ -112,19 +705,12 @@ void Run(MainArgs *args, Params *params) {
   int width = (int) vfmt_in.width;
   int height = (int) vfmt_in.height;
   int components = 4;
-  int linesize = vfmt_in.pitch;
+  int linesize = vfmt_in.linesize[0];
 
-  Log("video resolution: %dx%d, format %d, vflip %d, pitch %d (%d computed)",
-    width, height, (int) vfmt_in.format, (int) vfmt_in.vflip,
+  Log("video resolution: %dx%d, format %s, vflip %d, pitch %d (%d computed)",
+    width, height, messages::EnumNamePixFmt(vfmt_in.format), (int) vfmt_in.vflip,
     (int) linesize, (int) (width * components));
 
-  const int64_t buffer_size = height * linesize;
-  uint8_t *buffer = (uint8_t*) malloc(buffer_size);
-  if (!buffer) {
-    Log("could not allocate buffer");
-    exit(1);
-  }
-
   // receive audio format info
   AudioFormat afmt_in;
   memset(&afmt_in, 0, sizeof(afmt_in));
@@ -140,26 +726,29 @@ void Run(MainArgs *args, Params *params) {
   }
 
   AVFormatContext *oc = nullptr;
+  Output *output = nullptr;
   AVOutputFormat *fmt = nullptr;
 
   AVStream *video_st = nullptr;
   AVStream *audio_st = nullptr;
 
-  AVCodecID vcodec_id = AV_CODEC_ID_H264;
-  AVCodecID acodec_id = AV_CODEC_ID_AAC;
+  // raw mode spools lossless video and PCM audio to a .mkv, for
+  // Transcode to turn into the usual H.264/AAC .mp4 later.
+  AVCodecID vcodec_id = raw ? AV_CODEC_ID_FFV1 : AV_CODEC_ID_H264;
+  AVCodecID acodec_id = raw ? AV_CODEC_ID_PCM_F32LE : AV_CODEC_ID_AAC;
   AVCodec *vcodec = nullptr;
   AVCodec *acodec = nullptr;
   AVCodecContext *vc = nullptr;
   AVCodecContext *ac = nullptr;
 
-  AVFrame *vframe, *aframe;
+  AVFrame *aframe = nullptr;
 
   struct SwsContext *sws;
-  struct SwrContext *swr;
+  struct SwrContext *swr = nullptr;
 
-  const char *output_path = "capsule.mp4";
+  std::string output_name = params->output_name ? params->output_name : TimestampedName("capsule");
 
-  fmt = av_guess_format("mp4", NULL, NULL);
+  fmt = av_guess_format(raw ? "matroska" : "mp4", NULL, NULL);
 
   // allocate output media context
   avformat_alloc_output_context2(&oc, fmt, NULL, NULL);
@@ -169,12 +758,8 @@ void Run(MainArgs *args, Params *params) {
   }
   oc->oformat = fmt;
 
-  /* open the output file, if needed */
-  ret = avio_open(&oc->pb, output_path, AVIO_FLAG_WRITE);
-  if (ret < 0) {
-      Log("Could not open '%s'", output_path);
-      exit(1);
-  }
+  // oc is never written to: it only holds the streams that replay saves,
+  // or the output's files, are modelled after.
 
   // video stream
   video_st = avformat_new_stream(oc, NULL);
@@ -218,30 +803,53 @@ void Run(MainArgs *args, Params *params) {
       vc->pix_fmt = AV_PIX_FMT_YUV420P;
     } else if (0 == strcmp(args->pix_fmt, "yuv444p")) {
       vc->pix_fmt = AV_PIX_FMT_YUV444P;
+    } else if (0 == strcmp(args->pix_fmt, "nv12")) {
+      vc->pix_fmt = AV_PIX_FMT_NV12;
     } else {
       Log("Unknown pix_fmt specified: %s - using default", args->pix_fmt);
     }
   }
 
   bool do_swscale = true;
-  if (vfmt_in.format == messages::PixFmt_YUV444P) {
-    Log("GPU color conversion enabled, ignoring user output settings and picking yuv444p");
-    vc->pix_fmt = AV_PIX_FMT_YUV444P;
-    do_swscale = false;
+  switch (vfmt_in.format) {
+    case messages::PixFmt_YUV444P:
+      vc->pix_fmt = AV_PIX_FMT_YUV444P;
+      do_swscale = false;
+      break;
+    case messages::PixFmt_YUV420P:
+      vc->pix_fmt = AV_PIX_FMT_YUV420P;
+      do_swscale = false;
+      break;
+    case messages::PixFmt_NV12:
+      vc->pix_fmt = AV_PIX_FMT_NV12;
+      do_swscale = false;
+      break;
+    default:
+      break;
+  }
+  if (!do_swscale) {
+    Log("GPU color conversion enabled, ignoring user output settings and picking %s",
+      messages::EnumNamePixFmt(vfmt_in.format));
   }
 
-  // temporarily disabled codepath as we're going to try gpu scalign or nothing
-  int divider = 1;
-  // if (args->divider != 0) {
-  //   if (args->divider == 2 || args->divider == 4) {
-  //     divider = args->divider;
-  //   } else {
-  //     Log("Invalid size divider %d: must be 2 or 4. Ignoring...", args->divider);
-  //   }
-  // }
+  // frames converted on the GPU, that swscale only repacks
+  bool repack = false;
+  if (raw && vc->pix_fmt == AV_PIX_FMT_NV12) {
+    // FFV1 only does planar formats
+    if (!do_swscale) {
+      // the GPU converter couldn't do yuv420p
+      Log("Raw mode: repacking nv12 frames to yuv420p");
+      repack = true;
+      do_swscale = true;
+    } else {
+      Log("Raw mode: spooling yuv420p instead of nv12");
+    }
+    vc->pix_fmt = AV_PIX_FMT_YUV420P;
+  }
 
-  int out_width = width / divider;
-  int out_height = height / divider;
+  // size_divider is applied on the GPU, by libcapsule
+  int out_width = width;
+  int out_height = height;
 
   // resolution must be a multiple of two
   if (out_width % 2 != 0) {
@@ -259,36 +867,8 @@ void Run(MainArgs *args, Params *params) {
   video_st->time_base = AVRational{1,1000000};
   vc->time_base = video_st->time_base;
 
-  vc->gop_size = 120;
-  if (args->gop_size) {
-    vc->gop_size = args->gop_size;
-  }
-
-  vc->max_b_frames = 16;
-  if (args->max_b_frames) {
-    vc->max_b_frames = args->max_b_frames;
-  }
-
-  vc->rc_buffer_size = 0;
-
-  // H264
-  int crf = 20;
-  if (args->crf != -1) {
-    if (args->crf >= 0 && args->crf <= 51) {
-      if (args->crf < 18 || args->crf > 28) {
-        Log("Warning: sane crf values lie within 18-28, using crf %d at your own risks", args->crf);
-      }
-      crf = args->crf;
-    } else {
-      Log("Invalid crf value %d (must be in the 0-51 range), ignoring", args->crf);
-    }
-  }
-
-  vc->qmin = crf;
-  vc->qmax = crf;
-
-  // multithreading
-  vc->thread_count = 1;
+  // multithreading. FFV1 slices are cheap to spread over every core.
+  vc->thread_count = raw ? std::max(1, (int) std::thread::hardware_concurrency()) : 1;
   if (args->threads) {
     if (args->threads > 0 && args->threads <= 32) {
       vc->thread_count = args->threads;
@@ -297,24 +877,32 @@ void Run(MainArgs *args, Params *params) {
     }
   }
 
-  if (vc->thread_count > 1) {
+  if (vc->thread_count > 1 && raw) {
+    Log("Activating slice-level threading with %d threads", vc->thread_count);
+    vc->thread_type = FF_THREAD_SLICE;
+  } else if (vc->thread_count > 1) {
     Log("Activating frame-level threading with %d threads", vc->thread_count);
     vc->thread_type = FF_THREAD_FRAME;
   }
 
-  vc->flags |= CODEC_FLAG_GLOBAL_HEADER;
-
-  if (vc->pix_fmt == AV_PIX_FMT_YUV444P) {
-    Log("Warning: can't use baseline because yuv444p colorspace selected. Encoding will take more CPU.");
+  QualityController *quality = nullptr;
+  if (raw) {
+    Log("Raw mode: spooling lossless video, encoding once capture is over");
+    ConfigureSpool(vc);
   } else {
-    vc->profile = FF_PROFILE_H264_BASELINE;
+    quality = ConfigureH264(args, vc);
   }
 
-  const char *preset = "ultrafast";
-  if (args->x264_preset) {
-    preset = args->x264_preset;
+  vc->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+  // only applies when we do color conversion, the GPU path has its own
+  bool bt709 = args->colorspace && 0 == strcmp(args->colorspace, "bt709");
+  if (do_swscale && !repack) {
+    vc->colorspace = bt709 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+    vc->color_primaries = bt709 ? AVCOL_PRI_BT709 : AVCOL_PRI_SMPTE170M;
+    vc->color_trc = bt709 ? AVCOL_TRC_BT709 : AVCOL_TRC_SMPTE170M;
+    vc->color_range = AVCOL_RANGE_MPEG;
   }
-  av_opt_set(vc->priv_data, "preset", preset, AV_OPT_SEARCH_CHILDREN);
 
   ret = avcodec_open2(vc, vcodec, NULL);
   if (ret < 0) {
@@ -342,8 +930,12 @@ void Run(MainArgs *args, Params *params) {
         exit(1);
     }
 
-    ac->bit_rate = 128000;
-    ac->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    if (raw) {
+      ac->sample_fmt = AV_SAMPLE_FMT_FLT;
+    } else {
+      ac->bit_rate = 128000;
+      ac->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    }
     ac->sample_rate = afmt_in.rate;
     ac->channels = afmt_in.channels;
     ac->channel_layout = AV_CH_LAYOUT_STEREO;
@@ -364,16 +956,6 @@ void Run(MainArgs *args, Params *params) {
     }
   }
 
-  // video frame
-  vframe = av_frame_alloc();
-  if (!vframe) {
-    Log("could not allocate video frame");
-    exit(1);
-  }
-  vframe->format = vc->pix_fmt;
-  vframe->width = vc->width;
-  vframe->height = vc->height;
-
   AVPixelFormat vpix_fmt;
   switch (vfmt_in.format) {
     case messages::PixFmt_RGBA:
@@ -383,8 +965,13 @@ void Run(MainArgs *args, Params *params) {
       vpix_fmt = AV_PIX_FMT_BGRA;
       break;
     case messages::PixFmt_YUV444P:
+    case messages::PixFmt_YUV420P:
       // no conversion actually required
-      vpix_fmt = AV_PIX_FMT_YUV444P;
+      vpix_fmt = vc->pix_fmt;
+      break;
+    case messages::PixFmt_NV12:
+      // same, unless raw mode repacks it
+      vpix_fmt = AV_PIX_FMT_NV12;
       break;
     default:
       Log("Unknown/unsupported video format %d, bailing out", vfmt_in.format);
@@ -402,7 +989,8 @@ void Run(MainArgs *args, Params *params) {
     aframe->format = ac->sample_fmt;
     aframe->channel_layout = ac->channel_layout;
     aframe->sample_rate = ac->sample_rate;
-    aframe->nb_samples = ac->frame_size;
+    // PCM takes any number of samples per frame
+    aframe->nb_samples = ac->frame_size ? ac->frame_size : kRawAudioFrameSize;
 
     ret = av_frame_get_buffer(aframe, 0);
     if (ret < 0) {
@@ -411,69 +999,88 @@ void Run(MainArgs *args, Params *params) {
     }
   }
 
-  // TODO: just use vfmt specs instead of handling vflip here
-  int sws_linesize[1];
-  uint8_t *sws_in[1];
+  sws = nullptr;
+  colorconv::Converter *conv = nullptr;
+  colorconv::ConversionStage *conv_stage = nullptr;
+  AVBufferPool *frame_pool = nullptr;
 
   if (do_swscale) {
-    // initialize swscale context
-    sws = sws_getContext(
-      // input
-      width, height, vpix_fmt,
-      // output
-      vframe->width, vframe->height, vc->pix_fmt,
-      // ???
-      0, 0, 0, 0
-    );
-
-    int vflip = vfmt_in.vflip;
-
-    if (vflip) {
-      sws_in[0] = buffer + linesize*(height-1);
-      sws_linesize[0] = -linesize;
-    } else {
-      // specify negative stride to flip
-      sws_in[0] = buffer;
-      sws_linesize[0] = linesize;
-    }
-
-    // FIXME: just messing around
-    bool misalign_planes = lab::env::Get("MISALIGN_PLANES") == "1";
-    if (misalign_planes) {
-      Log("Purposefully misaligning planes to confirm suspicions about x264 performance");
-      size_t frame_buffer_size = vc->width * 4 * vc->height;
-      uint8_t *frame_buffer = (uint8_t *) malloc(frame_buffer_size);
-      vframe->data[0] = frame_buffer;
-      vframe->data[1] = frame_buffer + vc->width;
-      vframe->data[2] = frame_buffer + vc->width * 2;
-      vframe->linesize[0] = vc->width * 4;
-      vframe->linesize[1] = vc->width * 4;
-      vframe->linesize[2] = vc->width * 4;
+    // our own kernels don't scale, and only know about packed RGB
+    bool use_colorconv = !(args->colorconv && 0 == strcmp(args->colorconv, "swscale")) &&
+      vc->width == width && vc->height == height &&
+      (vpix_fmt == AV_PIX_FMT_RGBA || vpix_fmt == AV_PIX_FMT_BGRA);
+
+    colorconv::OutputFormat conv_out = colorconv::kOutputYUV420P;
+    switch (vc->pix_fmt) {
+      case AV_PIX_FMT_YUV420P:
+        conv_out = colorconv::kOutputYUV420P;
+        break;
+      case AV_PIX_FMT_NV12:
+        conv_out = colorconv::kOutputNV12;
+        break;
+      case AV_PIX_FMT_YUV444P:
+        conv_out = colorconv::kOutputYUV444P;
+        break;
+      default:
+        use_colorconv = false;
+        break;
+    }
+
+    if (use_colorconv) {
+      conv = new colorconv::Converter(
+        vpix_fmt == AV_PIX_FMT_RGBA ? colorconv::kInputRGBA : colorconv::kInputBGRA,
+        conv_out,
+        bt709 ? colorconv::kMatrixBT709 : colorconv::kMatrixBT601,
+        width, height
+      );
+
+      // same thread budget as the video encoder, since we run before it
+      // and not alongside it
+      int conv_threads = args->threads;
+      if (conv_threads <= 0 || conv_threads > 32) {
+        conv_threads = std::max(1, (int) std::thread::hardware_concurrency());
+      }
+      conv_stage = new colorconv::ConversionStage(conv, width, height, linesize, conv_threads);
+      Log("Color conversion: %s kernels, %s, %d threads, %d bands of %d rows",
+        colorconv::IsaName(conv->GetIsa()), bt709 ? "bt709" : "bt601",
+        conv_stage->NumThreads(), conv_stage->NumBands(), conv_stage->BandRows());
     } else {
-      /* the image can be allocated by any means and av_image_alloc() is
-      * just the most convenient way if av_malloc() is to be used */
-      ret = av_image_alloc(
-          vframe->data,
-          vframe->linesize,
-          vc->width,
-          vc->height,
-          vc->pix_fmt,
-          32 /* alignment */
+      // initialize swscale context. exact rounding, so results don't
+      // depend on which of its code paths swscale picks.
+      sws = sws_getContext(
+        // input
+        width, height, vpix_fmt,
+        // output
+        vc->width, vc->height, vc->pix_fmt,
+        SWS_BILINEAR | SWS_ACCURATE_RND | SWS_BITEXACT, 0, 0, 0
       );
-      if (ret < 0) {
-        Log("Could not allocate raw picture buffer");
+      if (!sws) {
+        Log("Could not initialize swscale");
         exit(1);
       }
+      if (repack) {
+        // yuv on both sides, limited range: nothing to convert
+        Log("Color conversion: swscale, repacking only");
+      } else {
+        // swscale defaults to bt601 on both sides, limited range on output
+        const int *coefs = sws_getCoefficients(bt709 ? SWS_CS_ITU709 : SWS_CS_ITU601);
+        sws_setColorspaceDetails(sws, coefs, 1, coefs, 0, 0, 1 << 16, 1 << 16);
+        Log("Color conversion: swscale, %s", bt709 ? "bt709" : "bt601");
+      }
+    }
+
+    // converted frames are in flight between the convert and encode
+    // stages, so they come from a pool instead of a single buffer.
+    ret = av_image_get_buffer_size(vc->pix_fmt, vc->width, vc->height, kFrameAlign);
+    if (ret < 0) {
+      Log("Could not compute raw picture size");
+      exit(1);
+    }
+    frame_pool = av_buffer_pool_init(ret, av_buffer_allocz);
+    if (!frame_pool) {
+      Log("Could not allocate raw picture pool");
+      exit(1);
     }
-  } else {
-    // FIXME: use vfmt offsets & linesizes instead of computing them here
-    // this assumes a horizontal format, see https://twitter.com/fasterthanlime/status/839086194919161857
-    vframe->data[0] = buffer;
-    vframe->data[1] = buffer + width;
-    vframe->data[2] = buffer + width * 2;
-    vframe->linesize[0] = width * 4;
-    vframe->linesize[1] = width * 4;
-    vframe->linesize[2] = width * 4;
   }
 
   // initialize swrescale context
@@ -513,339 +1120,114 @@ void Run(MainArgs *args, Params *params) {
   }
 
 
-  av_dump_format(oc, 0, output_path, 1);
-
-  // write stream header, if any
-  ret = avformat_write_header(oc, NULL);
-  if (ret < 0) {
-    printf("Error occured when opening output file\n");
-    exit(1);
-  }
-
-  vframe->pts = 0;
-  int vnext_pts = 0;
-  int anext_pts = 0;
-
-  int last_frame = 0;
-  int64_t timestamp = 0;
-  int64_t first_timestamp = -1;
-  int64_t last_timestamp = 0;
-  FPSCounter fps_counter;
-
-  int64_t samples_received = 0;
-  int64_t samples_used = 0;
-  int64_t sample_width = 0;
-  uint8_t *sample_buf = nullptr;
-  if (params->has_audio) {
-    sample_width = afmt_in.channels * audio::SampleWidth(afmt_in.format) / 8;
-    sample_buf = reinterpret_cast<uint8_t*>(malloc(aframe->nb_samples * sample_width));
-  }
-
-  int64_t samples_filled = 0;
-
-  while (true) {
-    MICROPROFILE_SCOPE(EncoderCycle);
-
-    int64_t read;
-
-    {
-      MICROPROFILE_SCOPE(EncoderReceiveVideoFrame);
-      read = params->receive_video_frame(params->private_data, buffer, buffer_size, &timestamp);
-    }
-
-    if (read < buffer_size) {
-      if (read < 0) {
-        // all read out
-        last_frame = true;
-      } else {
-        // got no frame
-        std::this_thread::sleep_for(std::chrono::microseconds(1000000 / 60));
-      }
-    } else {
-      if (first_timestamp < 0) {
-        first_timestamp = timestamp;
-      }
-      timestamp -= first_timestamp;
-
-      auto delta = timestamp - last_timestamp;
-      last_timestamp = timestamp;
-      if (fps_counter.TickDelta(delta)) {
-        Log("FPS: %.2f", fps_counter.Fps());
-      }
-
-      {
-        MICROPROFILE_SCOPE(EncoderScale);
-        if (do_swscale) {
-          sws_scale(sws, sws_in, sws_linesize, 0, height, vframe->data, vframe->linesize);
-        } else {
-          // muffin
-        }
-      }
-
-      vnext_pts = timestamp;
-      vframe->pts = vnext_pts;
-
-      // write video frame
-      {
-        MICROPROFILE_SCOPE(EncoderSendVideoFrame);
-        ret = avcodec_send_frame(vc, vframe);
-      }
-      if (ret < 0) {
-          Log("Error encoding video frame");
-          exit(1);
-      }
-
-      while (ret >= 0) {
-        AVPacket vpkt;
-        av_init_packet(&vpkt);
-
-        {
-          MICROPROFILE_SCOPE(EncoderRecvVideoPkt);
-          ret = avcodec_receive_packet(vc, &vpkt);
-        }
-        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-            Log("Error encoding a video frame");
-            exit(1);
-        } else if (ret >= 0) {
-            // printf(">> vpkt timestamp before rescaling = %d, %.4f secs\n", (int) vpkt.pts, ((double) vpkt.pts) / 1000000.0);
-            av_packet_rescale_ts(&vpkt, vc->time_base, video_st->time_base);
-            // printf(">>                after  rescaling = %d, %.4f secs\n", (int) vpkt.pts, ((double) vpkt.pts) / 1000000.0);
-            vpkt.stream_index = video_st->index;
-
-            /* Write the compressed frame to the media file. */
-            {
-              MICROPROFILE_SCOPE(EncoderWriteVideoPkt);
-              ret = av_interleaved_write_frame(oc, &vpkt);
-            }
-            if (ret < 0) {
-                Log("Error while writing video frame");
-                exit(1);
-            }
-        }
-      }
-    }
+  av_dump_format(oc, 0, output_name.c_str(), 1);
 
+  if (params->replay) {
+    // the muxer hasn't touched the time bases, since there's no header
+    params->replay->AddStream(video_st->index, video_st->codecpar,
+      video_st->time_base.num, video_st->time_base.den);
     if (params->has_audio) {
-      while (true) {
-        char *in_samples;
-        int64_t samples_needed = aframe->nb_samples;
-        bool underrun = false;
-
-        while (samples_filled < samples_needed) {
-          if (samples_used >= samples_received) {
-            samples_used = 0;
-
-            {
-              MICROPROFILE_SCOPE(EncoderReceiveAudioFrames);
-              in_samples = (char *) params->receive_audio_frames(params->private_data, &samples_received);
-            }
-            if (samples_received == 0) {
-              underrun = true;
-              break;
-            }
-          }
-
-          {
-            MICROPROFILE_SCOPE(EncoderResample);
-            int64_t samples_copied = samples_needed - samples_filled;
-            int64_t samples_avail = samples_received - samples_used;
-            if (samples_copied > samples_avail) {
-              samples_copied = samples_avail;
-            }
-
-            DebugLog("Copying %" PRId64 " samples (%" PRId64 " needed, %" PRId64 " filled, %" PRId64 " received, %" PRId64 " used)", samples_copied,
-              samples_needed, samples_filled, samples_received, samples_used);
-            memcpy(sample_buf + (samples_filled * sample_width), in_samples + (samples_used * sample_width), samples_copied * sample_width);
-
-            samples_used += samples_copied;
-            samples_filled += samples_copied;
-          }
-        }
-
-        if (underrun) {
-          // we'll get more frames next time, no biggie
-          break;
-        }
-
-        ret = av_frame_make_writable(aframe);
-        if (ret < 0) {
-          Log("Could not make audio frame writable");
-          exit(1);
-        }
-
-        DebugLog("swr_delay: %d", swr_get_delay(swr, afmt_in.rate));
-
-        const uint8_t* src_data[] = { sample_buf };
-        ret = swr_convert(
-          swr,
-          aframe->data,
-          aframe->nb_samples,
-          src_data,
-          aframe->nb_samples
-        );
-        if (ret < 0) {
-          Log("Failed to convert samples: code %d (%x)", ret, ret);
-          exit(1);
-        }
-
-        aframe->pts = anext_pts;
-        anext_pts += aframe->nb_samples;
-
-        samples_filled = 0;
-
-        {
-          MICROPROFILE_SCOPE(EncoderSendAudioFrames);
-          ret = avcodec_send_frame(ac, aframe);
-        }
-        if (ret < 0) {
-          const int err_string_size = 16 * 1024;
-          char err_string[err_string_size];
-          err_string[0] = '\0';
-          av_strerror(ret, err_string, err_string_size);
-          Log("Error encoding audio frame: error %d (%x) - %s", ret, ret, err_string);
-          exit(1);
-        }
-
-        while (ret >= 0) {
-          AVPacket apkt;
-          av_init_packet(&apkt);
-          {
-            MICROPROFILE_SCOPE(EncoderRecvAudioPkt);
-            ret = avcodec_receive_packet(ac, &apkt);
-          }
-
-          if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-              Log("Error encoding an audio frame");
-              exit(1);
-          } else if (ret >= 0) {
-              av_packet_rescale_ts(&apkt, ac->time_base, audio_st->time_base);
-              apkt.stream_index = audio_st->index;
-              /* Write the compressed audio frame to the media file. */
-              {
-                MICROPROFILE_SCOPE(EncoderWriteAudioPkt);
-                ret = av_interleaved_write_frame(oc, &apkt);
-              }
-              if (ret < 0) {
-                  Log("Error while writing audio frame");
-                  exit(1);
-              }
-          }
-        }
-      }
-
-      // printf("Copied %d audio frames\n", audio_frames_copied);
-
-      while (ret >= 0) {
-        AVPacket apkt;
-        av_init_packet(&apkt);
-        {
-          MICROPROFILE_SCOPE(EncoderRecvAudioPkt);
-          ret = avcodec_receive_packet(ac, &apkt);
-        }
-
-        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-            Log("Error encoding an audio frame");
-            exit(1);
-        } else if (ret >= 0) {
-            av_packet_rescale_ts(&apkt, ac->time_base, audio_st->time_base);
-            apkt.stream_index = audio_st->index;
-            /* Write the compressed audio frame to the media file. */
-            {
-              MICROPROFILE_SCOPE(EncoderWriteAudioPkt);
-              ret = av_interleaved_write_frame(oc, &apkt);
-            }
-            if (ret < 0) {
-                Log("Error while writing audio frame\n");
-                exit(1);
-            }
-        }
-      }
+      params->replay->AddStream(audio_st->index, audio_st->codecpar,
+        audio_st->time_base.num, audio_st->time_base.den);
+    }
+  } else {
+    // written from threads of their own, so a slow disk doesn't hold
+    // up muxing (and everything before it).
+    OutputOptions output_opts;
+    output_opts.dir = args->dir;
+    output_opts.base = output_name;
+    // the moov atom goes first, then a fragment per GOP: nothing's left
+    // to do at the end, and a partial file is still playable.
+    output_opts.fmp4 = args->fmp4 != 0;
+    output_opts.writer.buffer_size = kWriteBufferSize;
+    output_opts.writer.num_buffers = kWriteBuffers;
+    output_opts.writer.direct = args->direct_io != 0;
+    output_opts.writer.sync_bytes = (int64_t) args->sync_mb * 1024 * 1024;
+    output_opts.segment_us = (int64_t) args->segment_seconds * 1000000;
+    output_opts.segment_bytes = (int64_t) args->segment_mb * 1024 * 1024;
+    output_opts.budget_bytes = (int64_t) args->max_disk_mb * 1024 * 1024;
+    output_opts.extension = "mp4";
+    if (raw) {
+      // the spool is a single file, those apply to what it's encoded to
+      output_opts.extension = "mkv";
+      output_opts.fmp4 = false;
+      output_opts.segment_us = 0;
+      output_opts.segment_bytes = 0;
+      output_opts.budget_bytes = 0;
     }
 
-    if (last_frame) {
-      break;
+    output = new Output(oc, video_st->index, output_opts);
+    if (!output->Open()) {
+      Log("Error occured when opening output file");
+      exit(1);
     }
   }
 
-  // delayed video frames
-  ret = avcodec_send_frame(vc, NULL);
-  if (ret < 0) {
-    Log("couldn't flush video codec\n");
-    exit(1);
+  Pipeline p;
+  p.args = args;
+  p.params = params;
+  p.vfmt_in = vfmt_in;
+  p.afmt_in = afmt_in;
+  p.oc = oc;
+  p.video_st = video_st;
+  p.audio_st = audio_st;
+  p.vc = vc;
+  p.ac = ac;
+  p.conv_stage = conv_stage;
+  p.sws = sws;
+  p.frame_pool = frame_pool;
+  p.swr = swr;
+  p.aframe = aframe;
+  p.quality = quality;
+  p.output = output;
+  p.mux_producers = params->has_audio ? 2 : 1;
+
+  std::thread receive_thread(ReceiveVideo, &p);
+  std::thread convert_thread(ConvertVideo, &p);
+  std::thread encode_thread(EncodeVideo, &p);
+  std::thread audio_thread;
+  if (params->has_audio) {
+    audio_thread = std::thread(EncodeAudio, &p);
   }
 
-  while (ret >= 0) {
-    AVPacket vpkt;
-    av_init_packet(&vpkt);
-    ret = avcodec_receive_packet(vc, &vpkt);
+  // this thread muxes, until both encoders are flushed
+  Mux(&p);
 
-    if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-        Log("Error encoding a video frame\n");
-        exit(1);
-    } else if (ret >= 0) {
-        // printf(">> vpkt timestamp before rescaling = %d, %.4f secs\n", (int) vpkt.pts, ((double) vpkt.pts) / 1000000.0);
-        av_packet_rescale_ts(&vpkt, vc->time_base, video_st->time_base);
-        // printf(">>                after  rescaling = %d, %.4f secs\n", (int) vpkt.pts, ((double) vpkt.pts) / 1000000.0);
-        vpkt.stream_index = video_st->index;
-        /* Write the compressed frame to the media file. */
-        ret = av_interleaved_write_frame(oc, &vpkt);
-        if (ret < 0) {
-            Log("Error while writing video frame\n");
-            exit(1);
-        }
-    }
+  receive_thread.join();
+  convert_thread.join();
+  encode_thread.join();
+  if (audio_thread.joinable()) {
+    audio_thread.join();
   }
 
-  // delayed audio frames
-  if (params->has_audio) {
-    ret = avcodec_send_frame(ac, NULL);
-    if (ret < 0) {
-      Log("couldn't flush audio codec\n");
-      exit(1);
-    }
-
-    while (ret >= 0) {
-      AVPacket apkt;
-      av_init_packet(&apkt);
-      ret = avcodec_receive_packet(ac, &apkt);
-
-      if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-          Log("Error encoding a audio frame\n");
-          exit(1);
-      } else if (ret >= 0) {
-          av_packet_rescale_ts(&apkt, ac->time_base, audio_st->time_base);
-          apkt.stream_index = audio_st->index;
-          /* Write the compressed frame to the media file. */
-          ret = av_interleaved_write_frame(oc, &apkt);
-          if (ret < 0) {
-              Log("Error while writing audio frame\n");
-              exit(1);
-          }
+  if (output) {
+    // writes trailers, waits for the disk
+    if (!output->Close()) {
+      Log("Error while writing output");
+    } else if (params->notify_output) {
+      for (auto &path: output->Paths()) {
+        params->notify_output(params->private_data, path.c_str());
       }
     }
-  }
-
-  // Write format trailer if any
-  ret = av_write_trailer(oc);
-  if (ret < 0) {
-    printf("failed to write trailer\n");
-    exit(1);
+    delete output;
   }
 
   avcodec_close(vc);
-  if (do_swscale) {
-    av_freep(&vframe->data[0]);
-  } else {
-    // don't free, we're just messing with avframe buffers
+  delete conv_stage;
+  delete quality;
+  delete conv;
+  if (sws) {
+    sws_freeContext(sws);
   }
-  av_frame_free(&vframe);
+  // frames still out keep the pool alive until they're freed
+  av_buffer_pool_uninit(&frame_pool);
 
   if (params->has_audio) {
     avcodec_close(ac);
     av_frame_free(&aframe);
+    swr_free(&swr);
   }
 
-  avio_close(oc->pb);
   avformat_free_context(oc);
 
   // FIXME: seems to crash atm.
@@ -23,18 +23,43 @@
 
 #include <lab/types.h>
 #include <capsule/messages_generated.h>
+#include <capsule/video_math.h>
 
 #include "args.h"
 
 namespace capsule {
 namespace encoder {
 
+class ReplayBuffer;
+
 struct VideoFormat {
   int width;
   int height;
   messages::PixFmt format;
   bool vflip;
-  int64_t pitch;
+  // per-plane, relative to the start of a frame
+  int64_t offset[video::kMaxPlanes];
+  int64_t linesize[video::kMaxPlanes];
+  // number of bytes spanned by all planes
+  int64_t frame_size;
+};
+
+// A frame lent out by the video receiver: data points to frame_size bytes,
+// which stay valid until the frame is given back with VideoFrameReleaser.
+struct VideoFrame {
+  const uint8_t *data;
+  int64_t timestamp;
+  // identifies the frame to the receiver
+  int slot;
+};
+
+// How well the encoder is keeping up with capture
+struct VideoStats {
+  // frames captured but not done with yet, out of how many fit
+  int backlog;
+  int capacity;
+  // frames capture had to skip so far, for lack of room
+  uint32_t skipped;
 };
 
 struct AudioFormat {
@@ -44,20 +69,47 @@ struct AudioFormat {
 };
 
 typedef int (*VideoFormatReceiver)(void *private_data, VideoFormat *vfmt);
-typedef int64_t (*VideoFrameReceiver)(void *private_data, uint8_t *buffer, size_t buffer_size, int64_t *timestamp);
+// returns frame_size if a frame was received, 0 if none is ready yet, or
+// a negative value once the receiver is stopped and drained
+typedef int64_t (*VideoFrameReceiver)(void *private_data, VideoFrame *frame);
+// may be called from any thread
+typedef void (*VideoFrameReleaser)(void *private_data, int slot);
+// blocks until VideoFrameReceiver has something new to return, or for at
+// most timeout_ms
+typedef void (*VideoFrameWaiter)(void *private_data, int timeout_ms);
+// may be called from any thread
+typedef void (*VideoStatsReceiver)(void *private_data, VideoStats *stats);
 
 typedef int (*AudioFormatReceiver)(void *private_data, AudioFormat *afmt);
 typedef void* (*AudioFramesReceiver)(void *private_data, int64_t *num_frames);
+// blocks until AudioFramesReceiver has something to return, or for at
+// most timeout_ms
+typedef void (*AudioFramesWaiter)(void *private_data, int timeout_ms);
+
+// called for every file that was written in full, once they all are
+typedef void (*OutputNotifier)(void *private_data, const char *path);
 
 struct Params {
   void *private_data;
 
   VideoFormatReceiver receive_video_format;
   VideoFrameReceiver receive_video_frame;
+  VideoFrameReleaser release_video_frame;
+  VideoFrameWaiter wait_video_frame;
+  VideoStatsReceiver receive_video_stats;
 
   bool has_audio;
   AudioFormatReceiver receive_audio_format;
   AudioFramesReceiver receive_audio_frames;
+  AudioFramesWaiter wait_audio_frames;
+
+  // when set, packets go there instead of to a file
+  ReplayBuffer *replay;
+
+  // what output files are named after, a timestamped name if null
+  const char *output_name;
+  // optional
+  OutputNotifier notify_output;
 };
 
 void Run(MainArgs *args, Params *params);
@@ -144,6 +144,7 @@ bool PulseReceiver::ReadFromPa() {
     buffer_state_[commit_index_] = kBufferStateCommitted;
     commit_index_ = (commit_index_ + 1) % kAudioNbBuffers;
   }
+  notifier_.Notify();
 
   return true;
 }
@@ -182,7 +183,13 @@ void *PulseReceiver::ReceiveFrames(int64_t *frames_received) {
   }
 }
 
+void PulseReceiver::WaitFrames(int timeout_ms) {
+  notifier_.Wait(timeout_ms);
+}
+
 void PulseReceiver::Stop() {
+  notifier_.Notify();
+
   {
     std::lock_guard<std::mutex> lock(pa_mutex_);
     if (ctx_) {
@@ -26,6 +26,7 @@
 
 #include "../audio_receiver.h"
 #include "../encoder.h"
+#include "../notifier.h"
 #include "pulse_dynamic.h"
 
 namespace capsule {
@@ -47,6 +48,7 @@ class PulseReceiver : public AudioReceiver {
 
     virtual int ReceiveFormat(encoder::AudioFormat *afmt) override;
     virtual void *ReceiveFrames(int64_t *frames_received) override;
+    virtual void WaitFrames(int timeout_ms) override;
     virtual void Stop() override;
 
   private:
@@ -67,6 +69,8 @@ class PulseReceiver : public AudioReceiver {
     std::thread *pa_thread_ = nullptr;
     std::mutex buffer_mutex_;
     std::mutex pa_mutex_;
+    // signaled by the read thread, once a buffer is committed
+    Notifier notifier_;
 
     bool overrun_ = false;
     bool initialized_ = false;
@@ -36,6 +36,7 @@
 
 #include "argparse.h"
 #include "runner.h"
+#include "colorconv_bench.h"
 #include "logging.h"
 
 #if defined(LAB_WINDOWS)
@@ -85,29 +86,52 @@ int main (int argc, char **argv) {
   args.crf = -1;
   args.size_divider = 1;
   args.fps = 60;
+  args.drop_policy = "oldest-wins";
+  args.colorspace = "bt601";
+  args.colorconv = "auto";
 
   struct argparse_option options[] = {
     OPT_HELP(),
     OPT_GROUP("Basic options"),
     OPT_STRING('d', "dir", &args.dir, "where to output .mp4 videos (defaults to current directory)"),
+    OPT_BOOLEAN(0, "fmp4", &args.fmp4, "write fragmented mp4, which stays playable if recording is interrupted"),
+    OPT_INTEGER(0, "segment-seconds", &args.segment_seconds, "start a new file every that many seconds, on the next keyframe"),
+    OPT_INTEGER(0, "segment-mb", &args.segment_mb, "start a new file every that many MiB, on the next keyframe"),
+    OPT_INTEGER(0, "max-disk-mb", &args.max_disk_mb, "delete the oldest segments to stay under that many MiB (segments default to a quarter of that)"),
+    OPT_BOOLEAN(0, "raw", &args.raw, "spool lossless video while the game runs, and only encode it once it exits"),
     OPT_STRING(0, "pipe", &args.pipe, "named pipe to listen on (defaults to unique name)"),
     OPT_BOOLEAN(0, "headless", &args.headless, "do not launch a process, just connect to pipe and behave as an encoder"),
     OPT_GROUP("Video options"),
     OPT_INTEGER(0, "crf", &args.crf, "output quality. sane values range from 18 (~visually lossless) to 28 (fast but looks bad)"),
+    OPT_STRING(0, "rc", &args.rc, "rate control: crf (default, constant quality), capped-crf (crf, up to --bitrate), cbr (--bitrate), or cqp (constant quantizer)"),
+    OPT_INTEGER(0, "bitrate", &args.bitrate, "target (cbr) or maximum (capped-crf) video bitrate, in kbit/s"),
+    OPT_INTEGER(0, "bufsize", &args.bufsize, "rate control buffer, in kbit (default: 1 second at --bitrate for cbr, 2 for capped-crf)"),
+    OPT_BOOLEAN(0, "adaptive-quality", &args.adaptive_quality, "lower quality while the encoder can't keep up, instead of skipping frames"),
+    OPT_INTEGER(0, "max-crf", &args.max_crf, "lowest quality adaptive quality may go down to (default: crf + 10)"),
     OPT_INTEGER(0, "size_divider", &args.size_divider, "size divider: default 1, accepted values 2 or 4"),
     OPT_INTEGER('r', "fps", &args.fps, "maximum frames per second (default: 60)"),
+    OPT_STRING(0, "drop-policy", &args.drop_policy, "when falling behind: oldest-wins (default, stop capturing until there's room), newest-wins (skip frames that are waiting), or even (lower the framerate)"),
     OPT_GROUP("Audio options"),
     OPT_BOOLEAN(0, "no-audio", &args.no_audio, "don't record audio"),
+    OPT_GROUP("Replay options"),
+    OPT_INTEGER(0, "replay", &args.replay, "capture all the time, keep the last SECONDS encoded, and save them when the hotkey is pressed"),
+    OPT_BOOLEAN(0, "replay-spill", &args.replay_spill, "keep replay packets in temporary files instead of RAM"),
     OPT_GROUP("Advanced options"),
-    OPT_STRING(0, "pix_fmt", &args.pix_fmt, "pixel format: yuv420p (default, compatible), or yuv444p"),
-    OPT_INTEGER(0, "threads", &args.threads, "number of threads used to encode video"),
+    OPT_STRING(0, "pix_fmt", &args.pix_fmt, "pixel format: yuv420p (default, compatible), nv12, or yuv444p"),
+    OPT_INTEGER(0, "threads", &args.threads, "number of threads used to convert & encode video (default: 1 for encoding, all cores for conversion)"),
     OPT_BOOLEAN(0, "debug-av", &args.debug_av, "let video encoder be verbose"),
     OPT_INTEGER(0, "gop-size", &args.gop_size, "default: 120"),
     OPT_INTEGER(0, "max-b-frames", &args.max_b_frames, "default: 16"),
     OPT_INTEGER(0, "buffered-frames", &args.buffered_frames, "default: 60"),
+    OPT_INTEGER(0, "shm-budget", &args.shm_budget, "shared memory for in-flight frames, in MiB (default: 3 frames)"),
+    OPT_BOOLEAN(0, "direct-io", &args.direct_io, "write output with O_DIRECT, bypassing the page cache (linux only)"),
+    OPT_INTEGER(0, "sync-mb", &args.sync_mb, "flush output to disk every that many MiB (default: only at the end)"),
     OPT_BOOLEAN(0, "gpu-color-conv", &args.gpu_color_conv, "do color conversion on the GPU (experimental)"),
     OPT_STRING(0, "priority", &args.priority, "above-normal or high (windows only)"),
     OPT_STRING(0, "x264-preset", &args.x264_preset, "slower, slow, medium, fast, faster, veryfast, ultrafast (default ultrafast)"),
+    OPT_STRING(0, "colorspace", &args.colorspace, "YUV matrix: bt601 (default) or bt709"),
+    OPT_STRING(0, "colorconv", &args.colorconv, "RGB to YUV conversion: auto (default, SIMD when possible) or swscale"),
+    OPT_STRING(0, "bench-colorconv", &args.bench_colorconv, "benchmark color conversion at WIDTHxHEIGHT against swscale, then exit"),
     OPT_END(),
   };
   struct argparse argparse;
@@ -121,6 +145,10 @@ int main (int argc, char **argv) {
   );
   argc = argparse_parse(&argparse, argc, (const char **) argv);
 
+  if (args.bench_colorconv) {
+    return capsule::colorconv::Bench(args.bench_colorconv);
+  }
+
   const int num_positional_args = 1;
   if (argc < num_positional_args) {
     if (!args.headless) {
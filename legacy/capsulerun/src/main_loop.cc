@@ -25,10 +25,17 @@
 
 #include "logging.h"
 #include "audio_intercept_receiver.h"
+#include "output.h"
+#include "spool_codec.h"
+#include "spool_reader.h"
 
 #include <thread>
 #include <algorithm>
 
+#if defined(LAB_LINUX)
+#include <unistd.h> // close
+#endif // LAB_LINUX
+
 MICROPROFILE_DEFINE(MainLoopMain, "MainLoop", "Main", 0xff0000);
 MICROPROFILE_DEFINE(MainLoopCycle, "MainLoop", "Cycle", 0xff00ff38);
 MICROPROFILE_DEFINE(MainLoopRead, "MainLoop", "Read", 0xff00ff00);
@@ -51,13 +58,14 @@ void MainLoop::PollConnection (Connection *conn) {
 
   if (conn->IsConnected()) {
     while (true) {
-      char *buf = conn->Read();
+      std::vector<int> fds;
+      char *buf = conn->Read(&fds);
       if (!buf) {
         // done polling queue!
         break;
       }
 
-      LoopMessage msg{conn, buf};
+      LoopMessage msg{conn, buf, fds};
       queue_.Push(msg);
     }
   } else {
@@ -100,7 +108,11 @@ void MainLoop::Run () {
       auto pkt = messages::GetPacket(buf);
       switch (pkt->message_type()) {
         case messages::Message_HotkeyPressed: {
-          CaptureFlip();
+          if (args_->replay > 0) {
+            SaveReplay();
+          } else {
+            CaptureFlip();
+          }
           break;
         }
         case messages::Message_CaptureStop: {
@@ -109,27 +121,18 @@ void MainLoop::Run () {
         }
         case messages::Message_VideoSetup: {
           auto vs = pkt->message_as_VideoSetup();
-          StartSession(vs, conn);
-          break;
-        }
-        case messages::Message_VideoFrameCommitted: {
-          auto vfc = pkt->message_as_VideoFrameCommitted();
-          if (session_ && session_->video_) {
-            session_->video_->FrameCommitted(vfc->index(), vfc->timestamp());
-          }
-          break;
-        }
-        case messages::Message_AudioFramesCommitted: {
-          auto afc = pkt->message_as_AudioFramesCommitted();
-          if (session_ && session_->audio_) {
-            session_->audio_->FramesCommitted(afc->offset(), afc->frames());
-          }
+          StartSession(vs, conn, msg.fds);
           break;
         }
         case messages::Message_SawBackend: {
           auto sb = pkt->message_as_SawBackend();
           Log("MainLoop::Run: saw backend %s at %s", EnumNameBackend(sb->backend()), conn->GetPipeName().c_str());
           best_conn_ = conn;
+          if (args_->replay > 0 && !replay_started_) {
+            // replay mode captures all the time
+            replay_started_ = true;
+            CaptureStart();
+          }
           break;
         }
         default: {
@@ -139,12 +142,27 @@ void MainLoop::Run () {
       }
     }
     delete[] buf;
+
+#if defined(LAB_LINUX)
+    // anything StartSession didn't take ownership of
+    for (int fd: msg.fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+#endif // LAB_LINUX
+    msg.fds.clear();
   }
 
   Log("MainLoop::Run: ending session...");
   EndSession();  
   Log("MainLoop::Run: joining session...");
   JoinSessions();
+
+  if (args_->raw && !args_->replay) {
+    Log("MainLoop::Run: transcoding spools...");
+    TranscodeSpools();
+  }
 }
 
 void MainLoop::CaptureFlip () {
@@ -156,9 +174,26 @@ void MainLoop::CaptureFlip () {
   }
 }
 
+void MainLoop::SaveReplay () {
+  if (!session_) {
+    Log("MainLoop::SaveReplay: no session yet");
+    return;
+  }
+
+  session_->SaveReplay(encoder::UniquePath(args_->dir, encoder::TimestampedName("capsule-replay")));
+}
+
 void MainLoop::CaptureStart () {
   flatbuffers::FlatBufferBuilder builder(1024);
-  auto cps = messages::CreateCaptureStart(builder, args_->fps, args_->size_divider, args_->gpu_color_conv);
+  // only a hint for backends that do color conversion on the GPU
+  auto pix_fmt = encoder::GpuPixFmt(args_);
+
+  uint64_t shm_budget = 0;
+  if (args_->shm_budget > 0) {
+    shm_budget = (uint64_t) args_->shm_budget * 1024 * 1024;
+  }
+
+  auto cps = messages::CreateCaptureStart(builder, args_->fps, args_->size_divider, args_->gpu_color_conv, pix_fmt, shm_budget);
   auto opkt = messages::CreatePacket(builder, messages::Message_CaptureStart, cps.Union());
   builder.Finish(opkt);
 
@@ -196,6 +231,17 @@ void MainLoop::JoinSessions () {
   Log("MainLoop::join_sessions: joined all sessions!");
 }
 
+void MainLoop::TranscodeSpools () {
+  // one at a time: the encoder uses all the cores it's given already
+  for (Session *session: old_sessions_) {
+    for (auto &path: session->outputs_) {
+      if (!encoder::Transcode(args_, path)) {
+        Log("MainLoop::TranscodeSpools: could not transcode %s", path.c_str());
+      }
+    }
+  }
+}
+
 void MainLoop::CaptureStop () {
   EndSession();
 
@@ -210,7 +256,46 @@ void MainLoop::CaptureStop () {
   }
 }
 
-void MainLoop::StartSession (const messages::VideoSetup *vs, Connection *conn) {
+// libcapsule decides whether areas are on hugetlbfs, but if they're not,
+// we can still ask for transparent huge pages on our side of the mapping.
+// Either way, fault everything in before the first frame shows up.
+static const int kShmFlags = shoom::kFlagHugePages | shoom::kFlagPrefault;
+
+// Opens a shared memory area sent by libcapsule, either by name or, on linux,
+// as a memfd passed along with the message. Takes ownership of the fd.
+static shoom::Shm *OpenShmem (const messages::Shmem *shmem, std::vector<int> &fds) {
+  auto shm = new shoom::Shm(shmem->path()->str(), static_cast<size_t>(shmem->size()));
+
+  int ret;
+  int fd_index = shmem->fd_index();
+  if (fd_index >= 0) {
+#if defined(LAB_LINUX)
+    if (fd_index >= (int) fds.size() || fds[fd_index] < 0) {
+      Log("Shared memory fd %d missing from message", fd_index);
+      delete shm;
+      return nullptr;
+    }
+    // writable, we advance the ring's read cursor as we consume
+    ret = shm->OpenFd(fds[fd_index], true, kShmFlags);
+    fds[fd_index] = -1;
+#else // LAB_LINUX
+    Log("Got shared memory fd %d, but fd passing is linux-only", fd_index);
+    delete shm;
+    return nullptr;
+#endif // !LAB_LINUX
+  } else {
+    ret = shm->OpenReadWrite(kShmFlags);
+  }
+
+  if (ret != shoom::kOK) {
+    Log("Could not open shared memory area %s: code %d", shmem->path()->c_str(), ret);
+    delete shm;
+    return nullptr;
+  }
+  return shm;
+}
+
+void MainLoop::StartSession (const messages::VideoSetup *vs, Connection *conn, std::vector<int> &fds) {
   if (session_) {
     Log("Already got a session, ignoring request from %s", conn->GetPipeName().c_str());
     return;
@@ -228,18 +313,41 @@ void MainLoop::StartSession (const messages::VideoSetup *vs, Connection *conn) {
   vfmt.height = vs->height();
   vfmt.format = vs->pix_fmt();
   vfmt.vflip = vs->vflip();
-  
-  // TODO: support offset (for planar formats)
 
-  // TODO: support multiple linesizes (for planar formats)
+  int num_planes = video::NumPlanes(vfmt.format);
+  auto offset_vec = vs->offset();
   auto linesize_vec = vs->linesize();
-  vfmt.pitch = linesize_vec->Get(0);
+  if (num_planes == 0 || !offset_vec || !linesize_vec ||
+      (int) offset_vec->size() != num_planes ||
+      (int) linesize_vec->size() != num_planes) {
+    Log("Invalid plane layout for %s, ignoring request from %s",
+      messages::EnumNamePixFmt(vfmt.format), conn->GetPipeName().c_str());
+    return;
+  }
 
-  auto shm_path = vs->shmem()->path()->str();  
-  auto shm = new shoom::Shm(shm_path, static_cast<size_t>(vs->shmem()->size()));
-  int ret = shm->Open();
-  if (ret != shoom::kOK) {
-    Log("Could not open shared memory area: code %d", ret);
+  for (int i = 0; i < num_planes; i++) {
+    vfmt.offset[i] = offset_vec->Get(i);
+    vfmt.linesize[i] = linesize_vec->Get(i);
+  }
+  vfmt.frame_size = video::FrameSize(vfmt.format, vfmt.height, vfmt.offset, vfmt.linesize);
+
+  int num_buffers = (int) vs->num_buffers();
+  if ((int64_t) vs->shmem()->size() < shm_ring::kHeaderSize + vfmt.frame_size * num_buffers) {
+    Log("Shared memory area too small for %d frames, ignoring request from %s",
+      num_buffers, conn->GetPipeName().c_str());
+    return;
+  }
+  Log("Video ring: %d frames of %" PRId64 " bytes", num_buffers, vfmt.frame_size);
+
+  auto shm = OpenShmem(vs->shmem(), fds);
+  if (!shm) {
+    return;
+  }
+
+  auto ring = reinterpret_cast<shm_ring::Header*>(shm->Data());
+  if (!shm_ring::Valid(ring) || (int) ring->num_slots != num_buffers) {
+    Log("Invalid video ring header, ignoring request from %s", conn->GetPipeName().c_str());
+    delete shm;
     return;
   }
 
@@ -248,7 +356,15 @@ void MainLoop::StartSession (const messages::VideoSetup *vs, Connection *conn) {
     num_buffered_frames = args_->buffered_frames;
   }
 
-  auto video = new video::VideoReceiver(conn, vfmt, shm, num_buffered_frames);
+  auto drop_policy = shm_ring::kDropPolicyOldestWins;
+  if (0 == strcmp(args_->drop_policy, "newest-wins")) {
+    drop_policy = shm_ring::kDropPolicyNewestWins;
+  } else if (0 == strcmp(args_->drop_policy, "even")) {
+    drop_policy = shm_ring::kDropPolicyEven;
+  } else if (0 != strcmp(args_->drop_policy, "oldest-wins")) {
+    Log("Unknown drop policy %s, using oldest-wins", args_->drop_policy);
+  }
+  auto video = new video::VideoReceiver(vfmt, shm, num_buffered_frames, drop_policy, args_->fps);
 
   audio::AudioReceiver *audio = nullptr;
   if (args_->no_audio) {
@@ -256,7 +372,7 @@ void MainLoop::StartSession (const messages::VideoSetup *vs, Connection *conn) {
   } else {
     auto as = vs->audio();
     if (as) {
-      audio = new audio::AudioInterceptReceiver(conn, *as);
+      audio = new audio::AudioInterceptReceiver(*as, OpenShmem(as->shmem(), fds));
     } else if (audio_receiver_factory_) {
       Log("No audio intercept (or disabled), trying factory");
       audio = audio_receiver_factory_();
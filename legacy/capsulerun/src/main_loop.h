@@ -44,6 +44,8 @@ typedef audio::AudioReceiver * (*AudioReceiverFactory)();
 struct LoopMessage {
   Connection *conn;
   char *buf;
+  // passed along with buf, closed once it's been processed
+  std::vector<int> fds;
 };
 
 class MainLoop {
@@ -60,11 +62,13 @@ class MainLoop {
   private:
     void EndSession();
     void JoinSessions();
+    void TranscodeSpools();
     void PollConnection(Connection *conn);
 
     void CaptureStart();
     void CaptureStop();
-    void StartSession(const messages::VideoSetup *vs, Connection *conn);
+    void SaveReplay();
+    void StartSession(const messages::VideoSetup *vs, Connection *conn, std::vector<int> &fds);
 
     MainArgs *args_;
     LockingQueue<LoopMessage> queue_;
@@ -76,6 +80,9 @@ class MainLoop {
     std::vector<Session *> old_sessions_;
 
     Connection *best_conn_ = nullptr;
+
+    // replay mode
+    bool replay_started_ = false;
 };
 
 } // namespace capsule
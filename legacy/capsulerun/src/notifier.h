@@ -0,0 +1,62 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+namespace capsule {
+
+/**
+ * Lets one thread sleep until another has something for it. A
+ * notification that comes in while nobody is waiting isn't lost:
+ * the next Wait returns right away.
+ */
+class Notifier {
+public:
+  void Notify() {
+    {
+      std::lock_guard<std::mutex> lock(guard_);
+      pending_ = true;
+    }
+    signal_.notify_one();
+  }
+
+  // returns false if timeout_ms went by without a notification
+  bool Wait(int timeout_ms) {
+    std::unique_lock<std::mutex> lock(guard_);
+    if (!pending_) {
+      signal_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return pending_; });
+    }
+    bool notified = pending_;
+    pending_ = false;
+    return notified;
+  }
+
+private:
+  bool pending_ = false;
+  std::mutex guard_;
+  std::condition_variable signal_;
+};
+
+} // namespace capsule
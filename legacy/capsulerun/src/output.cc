@@ -0,0 +1,357 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "output.h"
+
+#if defined(WIN32)
+#pragma warning(push, 0)
+#endif // WIN32
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavutil/dict.h>
+}
+#if defined(WIN32)
+#pragma warning(pop)
+#endif // WIN32
+
+#include <lab/platform.h>
+#include <lab/io.h>
+#include <lab/strings.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#include "logging.h"
+
+namespace capsule {
+namespace encoder {
+
+static const AVRational kMicroseconds = {1, 1000000};
+// segments waiting to be deleted before EnforceBudget blocks
+static const size_t kMaxRemovals = 16;
+// how many segments fit in the disk budget, when their size isn't set
+static const int64_t kSegmentsPerBudget = 4;
+
+std::string TimestampedName(const std::string &prefix) {
+  time_t now = time(nullptr);
+  struct tm local;
+#if defined(LAB_WINDOWS)
+  localtime_s(&local, &now);
+#else // LAB_WINDOWS
+  localtime_r(&now, &local);
+#endif // !LAB_WINDOWS
+
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+  return prefix + "-" + stamp;
+}
+
+static bool FileExists(const std::string &path) {
+  FILE *f = lab::io::Fopen(path, "rb");
+  if (!f) {
+    return false;
+  }
+  fclose(f);
+  return true;
+}
+
+static bool RemoveFile(const std::string &path) {
+#if defined(LAB_WINDOWS)
+  return _wremove(lab::strings::ToWide(path).c_str()) == 0;
+#else // LAB_WINDOWS
+  return remove(path.c_str()) == 0;
+#endif // !LAB_WINDOWS
+}
+
+std::string UniquePath(const std::string &dir, const std::string &name, const std::string &ext) {
+  // two sessions may start within the same second
+  std::string path = dir + "/" + name + "." + ext;
+  for (int n = 2; FileExists(path); n++) {
+    path = dir + "/" + name + "-" + std::to_string(n) + "." + ext;
+  }
+  return path;
+}
+
+Output::Output(AVFormatContext *tmpl, int video_index, const OutputOptions &options) :
+  tmpl_(tmpl),
+  video_index_(video_index),
+  options_(options),
+  removals_(kMaxRemovals) {
+  segmented_ = options.segment_us > 0 || options.segment_bytes > 0;
+  if (!segmented_ && options.budget_bytes > 0) {
+    // a single file can't be trimmed to fit
+    options_.segment_bytes = options.budget_bytes / kSegmentsPerBudget;
+    segmented_ = true;
+    Log("Output: disk budget without segments, starting a new file every %.1f MiB",
+      (double) options_.segment_bytes / (1024.0 * 1024.0));
+  }
+}
+
+Output::~Output() {
+  if (cur_ || !done_.empty() || remover_.joinable()) {
+    Close();
+  }
+}
+
+bool Output::Open() {
+  File *file = OpenFile(0);
+  if (!file) {
+    failed_ = true;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(cur_mutex_);
+  cur_ = file;
+  return true;
+}
+
+bool Output::Write(AVPacket *pkt) {
+  if (!cur_) {
+    av_packet_free(&pkt);
+    return false;
+  }
+
+  AVRational tb = tmpl_->streams[pkt->stream_index]->time_base;
+  bool keyframe = pkt->stream_index == video_index_ && (pkt->flags & AV_PKT_FLAG_KEY);
+
+  if (keyframe && segmented_) {
+    int64_t dts_us = av_rescale_q(pkt->dts, tb, kMicroseconds);
+    bool roll = (options_.segment_us > 0 && dts_us - cur_->start_us >= options_.segment_us) ||
+                (options_.segment_bytes > 0 && cur_->writer->Size() >= options_.segment_bytes);
+    if (roll) {
+      File *next = OpenFile(dts_us);
+      if (!next) {
+        failed_ = true;
+        av_packet_free(&pkt);
+        return false;
+      }
+
+      File *prev = cur_;
+      {
+        std::lock_guard<std::mutex> lock(cur_mutex_);
+        cur_ = next;
+      }
+      FinishFile(prev);
+      done_.push_back(prev);
+    }
+    EnforceBudget();
+  }
+
+  // audio encoded just before a rollover may end up slightly negative,
+  // libavformat shifts the whole file to make up for it.
+  int64_t shift = av_rescale_q(cur_->start_us, kMicroseconds, tb);
+  if (pkt->pts != AV_NOPTS_VALUE) {
+    pkt->pts -= shift;
+  }
+  if (pkt->dts != AV_NOPTS_VALUE) {
+    pkt->dts -= shift;
+  }
+  av_packet_rescale_ts(pkt, tb, cur_->oc->streams[pkt->stream_index]->time_base);
+
+  int ret = av_interleaved_write_frame(cur_->oc, pkt);
+  av_packet_free(&pkt);
+  if (ret < 0) {
+    Log("Output: could not write frame to %s", cur_->path.c_str());
+    failed_ = true;
+    return false;
+  }
+
+  if (keyframe && options_.fmp4) {
+    // the muxer closes the previous fragment once it sees a video
+    // keyframe, so it's only complete after the write: let it reach
+    // the disk now.
+    cur_->writer->Flush();
+  }
+  return true;
+}
+
+bool Output::Close() {
+  if (cur_) {
+    File *last = cur_;
+    {
+      std::lock_guard<std::mutex> lock(cur_mutex_);
+      cur_ = nullptr;
+    }
+    FinishFile(last);
+    done_.push_back(last);
+  }
+
+  bool ok = !failed_;
+  for (auto file: done_) {
+    if (!JoinFile(file)) {
+      ok = false;
+    }
+    paths_.push_back(file->path);
+    delete file;
+  }
+  done_.clear();
+
+  removals_.Close();
+  if (remover_.joinable()) {
+    remover_.join();
+  }
+  return ok;
+}
+
+void Output::TakeWritePeak(int *peak, int *capacity) {
+  std::lock_guard<std::mutex> lock(cur_mutex_);
+  if (!cur_) {
+    *peak = 0;
+    *capacity = 0;
+    return;
+  }
+  *peak = static_cast<int>(cur_->writer->TakePeak());
+  *capacity = static_cast<int>(cur_->writer->Capacity());
+}
+
+std::string Output::NextPath() {
+  std::string name = options_.base;
+  if (segmented_) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "-%04d", ++num_segments_);
+    name += suffix;
+  }
+
+  return UniquePath(options_.dir, name, options_.extension);
+}
+
+Output::File *Output::OpenFile(int64_t start_us) {
+  auto file = new File();
+  file->path = NextPath();
+  file->start_us = start_us;
+
+  avformat_alloc_output_context2(&file->oc, tmpl_->oformat, nullptr, file->path.c_str());
+  if (!file->oc) {
+    Log("Output: could not allocate context for %s", file->path.c_str());
+    delete file;
+    return nullptr;
+  }
+
+  for (unsigned int i = 0; i < tmpl_->nb_streams; i++) {
+    AVStream *st = avformat_new_stream(file->oc, nullptr);
+    if (!st || avcodec_parameters_copy(st->codecpar, tmpl_->streams[i]->codecpar) < 0) {
+      Log("Output: could not set up stream %u of %s", i, file->path.c_str());
+      avformat_free_context(file->oc);
+      delete file;
+      return nullptr;
+    }
+    st->time_base = tmpl_->streams[i]->time_base;
+  }
+
+  file->writer = AsyncWriter::Open(file->path, options_.writer);
+  if (!file->writer) {
+    Log("Output: could not open %s for writing", file->path.c_str());
+    avformat_free_context(file->oc);
+    delete file;
+    return nullptr;
+  }
+  file->oc->pb = file->writer->Avio();
+
+  AVDictionary *opts = nullptr;
+  if (options_.fmp4) {
+    av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+  }
+  int ret = avformat_write_header(file->oc, &opts);
+  av_dict_free(&opts);
+  if (ret < 0) {
+    Log("Output: could not write header for %s", file->path.c_str());
+    file->writer->Close();
+    delete file->writer;
+    file->oc->pb = nullptr;
+    avformat_free_context(file->oc);
+    delete file;
+    return nullptr;
+  }
+
+  Log("Output: writing to %s%s", file->path.c_str(), options_.fmp4 ? " (fragmented)" : "");
+  return file;
+}
+
+void Output::FinishFile(File *file) {
+  // the trailer may seek back to patch up the header, which the writer
+  // takes care of. only waiting on the disk is left to the closer.
+  if (av_write_trailer(file->oc) < 0) {
+    Log("Output: could not write trailer for %s", file->path.c_str());
+    file->ok = false;
+  }
+  file->size = file->writer->Size();
+
+  file->closer = std::thread([file] {
+    if (!file->writer->Close()) {
+      file->ok = false;
+    }
+  });
+}
+
+bool Output::JoinFile(File *file) {
+  if (file->closer.joinable()) {
+    file->closer.join();
+  }
+  if (file->writer) {
+    delete file->writer;
+    file->writer = nullptr;
+  }
+  if (file->oc) {
+    file->oc->pb = nullptr;
+    avformat_free_context(file->oc);
+    file->oc = nullptr;
+  }
+  return file->ok;
+}
+
+void Output::EnforceBudget() {
+  if (options_.budget_bytes <= 0) {
+    return;
+  }
+
+  int64_t total = cur_->writer->Size();
+  for (auto file: done_) {
+    total += file->size;
+  }
+
+  while (total > options_.budget_bytes && !done_.empty()) {
+    File *oldest = done_.front();
+    done_.pop_front();
+    total -= oldest->size;
+
+    // it may still be closing, which we don't want to wait on here
+    if (!remover_.joinable()) {
+      remover_ = std::thread(&Output::RunRemover, this);
+    }
+    removals_.Push(oldest);
+  }
+}
+
+void Output::RunRemover() {
+  File *file;
+  while (removals_.Pop(file)) {
+    JoinFile(file);
+    if (RemoveFile(file->path)) {
+      Log("Output: removed %s to stay within disk budget", file->path.c_str());
+    } else {
+      Log("Output: could not remove %s", file->path.c_str());
+    }
+    delete file;
+  }
+}
+
+} // namespace encoder
+} // namespace capsule
@@ -0,0 +1,136 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_writer.h"
+#include "bounded_queue.h"
+
+struct AVFormatContext;
+struct AVPacket;
+
+namespace capsule {
+namespace encoder {
+
+// Returns prefix-YYYYMMDD-HHMMSS, in local time
+std::string TimestampedName(const std::string &prefix);
+// Returns dir/name.ext, or dir/name-2.ext etc. if that's taken already
+std::string UniquePath(const std::string &dir, const std::string &name,
+  const std::string &ext = "mp4");
+
+struct OutputOptions {
+  // files go in dir, named after base
+  std::string dir;
+  std::string base;
+  // without the dot, matching tmpl's format
+  std::string extension;
+  bool fmp4;
+  AsyncWriterOptions writer;
+
+  // a new segment is started on the first keyframe past either of
+  // these, 0 for no limit. no limits at all means a single file.
+  int64_t segment_us;
+  int64_t segment_bytes;
+  // segments are deleted, oldest first, to keep this session's files
+  // under that size. 0 for no limit. without segment limits, segments
+  // are a quarter of that.
+  int64_t budget_bytes;
+};
+
+/**
+ * Where the mux stage's packets end up: a single .mp4, or a series of
+ * segments, each of which starts on a keyframe and is a standalone file,
+ * with timestamps starting at 0.
+ *
+ * Files are muxed with the streams of a template context, which is
+ * never written to itself. Segments are finished up on a thread of their
+ * own, so rolling over doesn't hold up muxing, and those over the disk
+ * budget are deleted from another one.
+ *
+ * Everything but TakeWritePeak must be called from the same thread.
+ */
+class Output {
+  public:
+    // tmpl's streams must have their codec parameters filled in
+    Output(AVFormatContext *tmpl, int video_index, const OutputOptions &options);
+    ~Output();
+
+    // opens the first file, returns false on error
+    bool Open();
+    // takes ownership of pkt, whose timestamps are in tmpl's time bases
+    bool Write(AVPacket *pkt);
+    // finishes the current file, waits for all of them to be written
+    bool Close();
+
+    // see AsyncWriter, for the file being written right now
+    void TakeWritePeak(int *peak, int *capacity);
+
+    // once closed: the files that were written and are still around,
+    // oldest first
+    const std::vector<std::string> &Paths() const { return paths_; }
+
+  private:
+    struct File {
+      std::string path;
+      AVFormatContext *oc = nullptr;
+      AsyncWriter *writer = nullptr;
+      int64_t start_us = 0;
+      int64_t size = 0;
+      std::thread closer;
+      bool ok = true;
+    };
+
+    std::string NextPath();
+    File *OpenFile(int64_t start_us);
+    void FinishFile(File *file);
+    bool JoinFile(File *file);
+    void EnforceBudget();
+    void RunRemover();
+
+    AVFormatContext *tmpl_;
+    int video_index_;
+    OutputOptions options_;
+    bool segmented_;
+    int num_segments_ = 0;
+
+    File *cur_ = nullptr;
+    // finished, oldest first. still being closed, maybe.
+    std::deque<File*> done_;
+    // over budget, waiting on their closer to be deleted
+    BoundedQueue<File*> removals_;
+    std::thread remover_;
+    bool failed_ = false;
+    std::vector<std::string> paths_;
+    // guards cur_ against TakeWritePeak
+    std::mutex cur_mutex_;
+};
+
+} // namespace encoder
+} // namespace capsule
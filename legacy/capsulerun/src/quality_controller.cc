@@ -0,0 +1,77 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+
+#include "quality_controller.h"
+
+#include "logging.h"
+
+namespace capsule {
+namespace encoder {
+
+// CRF points per step
+static const int kCrfStep = 2;
+// consecutive samples needed to step quality down, or back up
+static const int kBehindSamples = 2;
+static const int kAheadSamples = 10;
+
+QualityController::QualityController(int min_crf, int max_crf) :
+  min_crf_(min_crf),
+  max_crf_(max_crf < min_crf ? min_crf : max_crf),
+  crf_(min_crf) {}
+
+int QualityController::Update(const QualitySample &sample) {
+  // the count starts over with a new receiver, eg. after a format change
+  uint32_t new_skips = has_skipped_ && sample.skipped >= last_skipped_ ?
+    sample.skipped - last_skipped_ : 0;
+  last_skipped_ = sample.skipped;
+  has_skipped_ = true;
+
+  bool behind = new_skips > 0 ||
+    sample.backlog * 2 > sample.capacity ||
+    sample.encode_ms > sample.frame_ms * 0.9;
+  bool ahead = !behind &&
+    sample.backlog * 4 <= sample.capacity &&
+    sample.encode_ms < sample.frame_ms * 0.6;
+
+  // anything in between resets both, that's the hysteresis
+  behind_ = behind ? behind_ + 1 : 0;
+  ahead_ = ahead ? ahead_ + 1 : 0;
+
+  int crf = crf_;
+  if (behind_ >= kBehindSamples && crf_ < max_crf_) {
+    crf = crf_ + kCrfStep > max_crf_ ? max_crf_ : crf_ + kCrfStep;
+  } else if (ahead_ >= kAheadSamples && crf_ > min_crf_) {
+    crf = crf_ - kCrfStep < min_crf_ ? min_crf_ : crf_ - kCrfStep;
+  }
+
+  if (crf != crf_) {
+    Log("Quality: crf %d -> %d (backlog %d/%d, %u new skips, %.1fms per frame out of %.1fms)",
+      crf_, crf, sample.backlog, sample.capacity, new_skips, sample.encode_ms, sample.frame_ms);
+    crf_ = crf;
+    behind_ = 0;
+    ahead_ = 0;
+  }
+  return crf_;
+}
+
+} // namespace encoder
+} // namespace capsule
@@ -0,0 +1,71 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+namespace capsule {
+namespace encoder {
+
+// What the encoder looked like over the last few frames
+struct QualitySample {
+  // see VideoStats
+  int backlog;
+  int capacity;
+  uint32_t skipped;
+  // mean time spent encoding a frame, and time between frames at the
+  // target framerate
+  double encode_ms;
+  double frame_ms;
+};
+
+/**
+ * Picks a CRF depending on whether the encoder keeps up with capture:
+ * when it falls behind, quality goes down a notch so frames don't get
+ * skipped, and when it's been comfortably ahead for a while, it goes back
+ * up. Falling behind has to show up twice in a row, and catching up for
+ * much longer, so it doesn't flip-flop around the threshold.
+ */
+class QualityController {
+  public:
+    // crf never goes below min_crf (what the user asked for), nor above max_crf
+    QualityController(int min_crf, int max_crf);
+
+    // returns the CRF to encode with from now on
+    int Update(const QualitySample &sample);
+    int Crf() const { return crf_; }
+
+  private:
+    int min_crf_;
+    int max_crf_;
+    int crf_;
+
+    bool has_skipped_ = false;
+    uint32_t last_skipped_ = 0;
+    // consecutive samples spent behind, or ahead
+    int behind_ = 0;
+    int ahead_ = 0;
+};
+
+} // namespace encoder
+} // namespace capsule
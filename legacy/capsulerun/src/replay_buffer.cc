@@ -0,0 +1,343 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+
+#include "replay_buffer.h"
+
+#if defined(WIN32)
+#pragma warning(push, 0)
+#endif // WIN32
+extern "C" {
+    #include <libavcodec/avcodec.h>
+
+    #include <libavformat/avformat.h>
+
+    #include <libavutil/mathematics.h>
+}
+#if defined(WIN32)
+#pragma warning(pop)
+#endif // WIN32
+
+#include <stdio.h>
+
+#include "logging.h"
+
+namespace capsule {
+namespace encoder {
+
+static const AVRational kMicroseconds = AVRational{1, 1000000};
+
+// Packets from one video keyframe up to the next one. When spilling, packet
+// data goes to an anonymous temporary file, and only timing info is kept
+// around: those packets are the ones without a buffer.
+class ReplayChunk {
+  public:
+    ReplayChunk(int64_t start_us, bool spill) :
+      start_us_(start_us) {
+      if (spill) {
+        file_ = tmpfile();
+        if (!file_) {
+          Log("Replay: could not create temporary file, keeping packets in RAM");
+        }
+      }
+    }
+
+    ~ReplayChunk() {
+      for (AVPacket *pkt: packets_) {
+        av_packet_free(&pkt);
+      }
+      if (file_) {
+        fclose(file_);
+      }
+    }
+
+    // takes ownership of pkt
+    void Add(AVPacket *pkt) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      int64_t offset = file_size_;
+      if (file_ && pkt->buf) {
+        if (fwrite(pkt->data, 1, pkt->size, file_) == (size_t) pkt->size) {
+          file_size_ += pkt->size;
+          // size stays, it's how much to read back
+          av_buffer_unref(&pkt->buf);
+          pkt->data = nullptr;
+        } else {
+          // disk full? this one stays in RAM then.
+          fseek(file_, file_size_, SEEK_SET);
+        }
+      }
+      packets_.push_back(pkt);
+      offsets_.push_back(offset);
+      bytes_ += pkt->size;
+    }
+
+    // Returns a new reference to packet i, with its data read back if it
+    // was spilled, or nullptr on error.
+    AVPacket *Get(size_t i) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      AVPacket *src = packets_[i];
+      if (src->buf) {
+        return av_packet_clone(src);
+      }
+
+      AVPacket *pkt = av_packet_alloc();
+      if (!pkt) {
+        return nullptr;
+      }
+      bool ok = av_new_packet(pkt, src->size) == 0 &&
+        av_packet_copy_props(pkt, src) == 0 &&
+        fseek(file_, offsets_[i], SEEK_SET) == 0 &&
+        fread(pkt->data, 1, src->size, file_) == (size_t) src->size;
+      // back to appending
+      fseek(file_, file_size_, SEEK_SET);
+      if (!ok) {
+        av_packet_free(&pkt);
+      }
+      return pkt;
+    }
+
+    size_t Size() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return packets_.size();
+    }
+
+    int64_t Bytes() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return bytes_;
+    }
+
+    // dts of the keyframe, in microseconds
+    const int64_t start_us_;
+
+  private:
+    std::mutex mutex_;
+    std::vector<AVPacket*> packets_;
+    // where spilled packets are in file_
+    std::vector<int64_t> offsets_;
+    int64_t bytes_ = 0;
+
+    FILE *file_ = nullptr;
+    int64_t file_size_ = 0;
+};
+
+// What a save works from: chunks stay alive as long as it needs them, and
+// only packets that were there when it was asked for are written.
+struct ReplaySnapshot {
+  std::string path;
+  std::vector<ReplayStream> streams;
+  std::vector<std::shared_ptr<ReplayChunk>> chunks;
+  std::vector<size_t> sizes;
+};
+
+static bool WritePackets(AVFormatContext *oc, const ReplaySnapshot &snap, int64_t *bytes, int64_t *end_us) {
+  int ret;
+  for (auto &s: snap.streams) {
+    AVStream *st = avformat_new_stream(oc, NULL);
+    if (!st) {
+      Log("Replay: could not allocate stream");
+      return false;
+    }
+    ret = avcodec_parameters_copy(st->codecpar, s.par);
+    if (ret < 0) {
+      Log("Replay: could not copy codec parameters");
+      return false;
+    }
+    st->time_base = AVRational{s.tb_num, s.tb_den};
+  }
+
+  ret = avio_open(&oc->pb, snap.path.c_str(), AVIO_FLAG_WRITE);
+  if (ret < 0) {
+    Log("Replay: could not open '%s'", snap.path.c_str());
+    return false;
+  }
+
+  // the muxer may pick other time bases
+  ret = avformat_write_header(oc, NULL);
+  if (ret < 0) {
+    Log("Replay: could not write header");
+    return false;
+  }
+
+  // everything is shifted so the first keyframe is at 0
+  int64_t start_us = snap.chunks.front()->start_us_;
+
+  for (size_t c = 0; c < snap.chunks.size(); c++) {
+    auto &chunk = snap.chunks[c];
+    for (size_t i = 0; i < snap.sizes[c]; i++) {
+      AVPacket *pkt = chunk->Get(i);
+      if (!pkt) {
+        Log("Replay: could not read back packet");
+        return false;
+      }
+
+      int index = -1;
+      for (size_t k = 0; k < snap.streams.size(); k++) {
+        if (snap.streams[k].index == pkt->stream_index) {
+          index = (int) k;
+        }
+      }
+      if (index < 0) {
+        av_packet_free(&pkt);
+        continue;
+      }
+
+      AVRational tb = AVRational{snap.streams[index].tb_num, snap.streams[index].tb_den};
+      int64_t start = av_rescale_q(start_us, kMicroseconds, tb);
+      if (pkt->pts != AV_NOPTS_VALUE) {
+        pkt->pts -= start;
+      }
+      pkt->dts -= start;
+      if (pkt->dts < 0) {
+        // audio from before the first keyframe
+        av_packet_free(&pkt);
+        continue;
+      }
+
+      *bytes += pkt->size;
+      if (index == 0) {
+        *end_us = av_rescale_q(pkt->dts + pkt->duration, tb, kMicroseconds);
+      }
+      av_packet_rescale_ts(pkt, tb, oc->streams[index]->time_base);
+      pkt->stream_index = index;
+
+      ret = av_interleaved_write_frame(oc, pkt);
+      av_packet_free(&pkt);
+      if (ret < 0) {
+        Log("Replay: error while writing packet");
+        return false;
+      }
+    }
+  }
+
+  ret = av_write_trailer(oc);
+  if (ret < 0) {
+    Log("Replay: could not write trailer");
+    return false;
+  }
+  return true;
+}
+
+static void WriteReplay(std::shared_ptr<ReplaySnapshot> snap) {
+  AVFormatContext *oc = nullptr;
+  avformat_alloc_output_context2(&oc, NULL, "mp4", snap->path.c_str());
+  if (!oc) {
+    Log("Replay: could not allocate output context");
+    return;
+  }
+
+  int64_t bytes = 0;
+  int64_t end_us = 0;
+  if (WritePackets(oc, *snap, &bytes, &end_us)) {
+    Log("Replay: saved %.1fs (%.1f MiB) to %s",
+      (double) end_us / 1000000.0, (double) bytes / (1024.0 * 1024.0), snap->path.c_str());
+  } else {
+    Log("Replay: could not save to %s", snap->path.c_str());
+  }
+
+  if (oc->pb) {
+    avio_closep(&oc->pb);
+  }
+  avformat_free_context(oc);
+}
+
+ReplayBuffer::ReplayBuffer(int64_t window_us, bool spill) :
+  window_us_(window_us),
+  spill_(spill) {}
+
+ReplayBuffer::~ReplayBuffer() {
+  Join();
+  for (auto &s: streams_) {
+    avcodec_parameters_free(&s.par);
+  }
+}
+
+void ReplayBuffer::AddStream(int index, const AVCodecParameters *par, int tb_num, int tb_den) {
+  AVCodecParameters *copy = avcodec_parameters_alloc();
+  if (!copy || avcodec_parameters_copy(copy, par) < 0) {
+    Log("Replay: could not copy codec parameters");
+    exit(1);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  streams_.push_back(ReplayStream{index, copy, tb_num, tb_den});
+}
+
+void ReplayBuffer::Add(AVPacket *pkt) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!streams_.empty() && pkt->stream_index == streams_[0].index) {
+    auto &video = streams_[0];
+    int64_t ts_us = av_rescale_q(pkt->dts, AVRational{video.tb_num, video.tb_den}, kMicroseconds);
+    if (pkt->flags & AV_PKT_FLAG_KEY) {
+      chunks_.push_back(std::make_shared<ReplayChunk>(ts_us, spill_));
+    }
+    Trim(ts_us);
+  }
+
+  if (chunks_.empty()) {
+    // nothing to decode this with until the first keyframe
+    av_packet_free(&pkt);
+    return;
+  }
+  chunks_.back()->Add(pkt);
+}
+
+void ReplayBuffer::Trim(int64_t now_us) {
+  // the oldest chunk can go once the next one covers the window on its own
+  while (chunks_.size() >= 2 && now_us - chunks_[1]->start_us_ >= window_us_) {
+    chunks_.pop_front();
+  }
+}
+
+bool ReplayBuffer::Save(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (chunks_.empty()) {
+    return false;
+  }
+
+  auto snap = std::make_shared<ReplaySnapshot>();
+  snap->path = path;
+  snap->streams = streams_;
+  int64_t bytes = 0;
+  for (auto &chunk: chunks_) {
+    snap->chunks.push_back(chunk);
+    snap->sizes.push_back(chunk->Size());
+    bytes += chunk->Bytes();
+  }
+  Log("Replay: saving %d chunks (%.1f MiB %s) to %s", (int) chunks_.size(),
+    (double) bytes / (1024.0 * 1024.0), spill_ ? "on disk" : "in RAM", path.c_str());
+
+  saves_.emplace_back(WriteReplay, snap);
+  return true;
+}
+
+void ReplayBuffer::Join() {
+  std::vector<std::thread> saves;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    saves.swap(saves_);
+  }
+  for (auto &t: saves) {
+    t.join();
+  }
+}
+
+} // namespace encoder
+} // namespace capsule
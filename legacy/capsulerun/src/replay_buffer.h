@@ -0,0 +1,93 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct AVPacket;
+struct AVCodecParameters;
+
+namespace capsule {
+namespace encoder {
+
+class ReplayChunk;
+
+struct ReplayStream {
+  int index;
+  AVCodecParameters *par;
+  int tb_num;
+  int tb_den;
+};
+
+/**
+ * Keeps the last few seconds of encoded packets around, so they can be
+ * saved to an .mp4 after the fact, without re-encoding anything.
+ *
+ * Packets are grouped in chunks that each start on a video keyframe, and
+ * only whole chunks are dropped once they're out of the window - so what's
+ * buffered always starts on a keyframe, and covers at least the window.
+ * Packet data is kept in RAM, or, when spilling, in a temporary file per
+ * chunk.
+ *
+ * Add is meant to be called by the encoder's mux stage, Save from any
+ * thread: it only takes references to buffered chunks, the actual muxing
+ * happens on a thread of its own.
+ */
+class ReplayBuffer {
+  public:
+    ReplayBuffer(int64_t window_us, bool spill);
+    // waits for saves in progress
+    ~ReplayBuffer();
+
+    // Registers the stream packets with the given index belong to. The
+    // first stream added is the one keyframes are looked for in.
+    void AddStream(int index, const AVCodecParameters *par, int tb_num, int tb_den);
+    // Takes ownership of pkt, whose timestamps are in its stream's time base.
+    void Add(AVPacket *pkt);
+    // Starts writing everything buffered so far to path. Returns false if
+    // there's nothing to save yet.
+    bool Save(const std::string &path);
+    // Waits for saves in progress
+    void Join();
+
+  private:
+    void Trim(int64_t now_us);
+
+    int64_t window_us_;
+    bool spill_;
+
+    std::mutex mutex_;
+    std::vector<ReplayStream> streams_;
+    std::deque<std::shared_ptr<ReplayChunk>> chunks_;
+    std::vector<std::thread> saves_;
+};
+
+} // namespace encoder
+} // namespace capsule
@@ -25,6 +25,7 @@
 #include "audio_receiver.h"
 #include "encoder.h"
 #include "logging.h"
+#include "replay_buffer.h"
 
 namespace capsule {
 
@@ -32,8 +33,20 @@ static int ReceiveVideoFormat(Session *s, encoder::VideoFormat *vfmt) {
   return s->video_->ReceiveFormat(vfmt);
 }
 
-static int64_t ReceiveVideoFrame(Session *s, uint8_t *buffer, size_t buffer_size, int64_t *timestamp) {
-  return s->video_->ReceiveFrame(buffer, buffer_size, timestamp);
+static int64_t ReceiveVideoFrame(Session *s, encoder::VideoFrame *frame) {
+  return s->video_->ReceiveFrame(frame);
+}
+
+static void ReleaseVideoFrame(Session *s, int slot) {
+  s->video_->ReleaseFrame(slot);
+}
+
+static void WaitVideoFrame(Session *s, int timeout_ms) {
+  s->video_->WaitFrame(timeout_ms);
+}
+
+static void ReceiveVideoStats(Session *s, encoder::VideoStats *stats) {
+  s->video_->ReceiveStats(stats);
 }
 
 static int ReceiveAudioFormat(Session *s, encoder::AudioFormat *afmt) {
@@ -44,20 +57,40 @@ static void *ReceiveAudioFrames(Session *s, int64_t *frames_received) {
   return s->audio_->ReceiveFrames(frames_received);
 }
 
+static void WaitAudioFrames(Session *s, int timeout_ms) {
+  s->audio_->WaitFrames(timeout_ms);
+}
+
+static void NotifyOutput(Session *s, const char *path) {
+  s->outputs_.push_back(path);
+}
+
 void Session::Start () {
   memset(&encoder_params_, 0, sizeof(encoder_params_));
   encoder_params_.private_data = this;
   encoder_params_.receive_video_format = reinterpret_cast<encoder::VideoFormatReceiver>(ReceiveVideoFormat);
   encoder_params_.receive_video_frame  = reinterpret_cast<encoder::VideoFrameReceiver>(ReceiveVideoFrame);
+  encoder_params_.release_video_frame  = reinterpret_cast<encoder::VideoFrameReleaser>(ReleaseVideoFrame);
+  encoder_params_.wait_video_frame     = reinterpret_cast<encoder::VideoFrameWaiter>(WaitVideoFrame);
+  encoder_params_.receive_video_stats  = reinterpret_cast<encoder::VideoStatsReceiver>(ReceiveVideoStats);
 
   if (audio_) {
     encoder_params_.has_audio = 1;
     encoder_params_.receive_audio_format = reinterpret_cast<encoder::AudioFormatReceiver>(ReceiveAudioFormat);
     encoder_params_.receive_audio_frames = reinterpret_cast<encoder::AudioFramesReceiver>(ReceiveAudioFrames);
+    encoder_params_.wait_audio_frames    = reinterpret_cast<encoder::AudioFramesWaiter>(WaitAudioFrames);
   } else {
     encoder_params_.has_audio = 0;  
   }
 
+  encoder_params_.notify_output = reinterpret_cast<encoder::OutputNotifier>(NotifyOutput);
+
+  if (args_->replay > 0) {
+    Log("Replay mode: keeping the last %ds%s", args_->replay, args_->replay_spill ? ", on disk" : "");
+    replay_ = new encoder::ReplayBuffer((int64_t) args_->replay * 1000000, args_->replay_spill);
+    encoder_params_.replay = replay_;
+  }
+
   encoder_thread_ = new std::thread(encoder::Run, args_, &encoder_params_);
 }
 
@@ -71,9 +104,19 @@ void Session::Stop () {
   }
 }
 
+void Session::SaveReplay (const std::string &path) {
+  if (!replay_ || !replay_->Save(path)) {
+    Log("Nothing to save yet");
+  }
+}
+
 void Session::Join () {
   Log("Waiting for encoder thread...");
   encoder_thread_->join();
+  if (replay_) {
+    Log("Waiting for replays to be saved...");
+    replay_->Join();
+  }
 }
 
 Session::~Session () {
@@ -83,6 +126,7 @@ Session::~Session () {
   if (audio_) {
     delete audio_;
   }
+  delete replay_;
   delete encoder_thread_;
 }
 
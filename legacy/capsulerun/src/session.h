@@ -24,7 +24,9 @@
 #include "audio_receiver.h"
 #include "video_receiver.h"
 
+#include <string>
 #include <thread>
+#include <vector>
 
 namespace capsule {
 
@@ -38,18 +40,23 @@ class Session {
     void Start();
     void Stop();
     void Join();
+    // in replay mode, starts saving what's buffered so far to path
+    void SaveReplay(const std::string &path);
 
     encoder::Params encoder_params_;
 
   private:
     std::thread *encoder_thread_;
     MainArgs *args_;
+    encoder::ReplayBuffer *replay_ = nullptr;
 
   public:
     // these need to be public for the C callbacks (to avoid
     // another level of indirection)
     video::VideoReceiver *video_;
     audio::AudioReceiver *audio_;
+    // files the encoder wrote, complete once joined
+    std::vector<std::string> outputs_;
 };
 
 } // namespace capsule
@@ -0,0 +1,95 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+
+#include "spool_codec.h"
+
+#if defined(WIN32)
+#pragma warning(push, 0)
+#endif // WIN32
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/opt.h>
+}
+#if defined(WIN32)
+#pragma warning(pop)
+#endif // WIN32
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace capsule {
+namespace encoder {
+
+// enough to keep a few cores busy, even with fewer threads
+static const int kMinSlices = 4;
+// older FFmpeg versions don't go past that
+static const int kMaxSlices = 32;
+
+void ConfigureSpool(AVCodecContext *vc) {
+  vc->gop_size = 1;
+  vc->max_b_frames = 0;
+  // version 3 has slices, which threads encode in parallel
+  vc->level = 3;
+  vc->slices = SpoolSlices(vc->thread_count);
+  // golomb-rice coding, small context model, no checksums: the fastest
+  av_opt_set_int(vc->priv_data, "coder", 0, 0);
+  av_opt_set_int(vc->priv_data, "context", 0, 0);
+  av_opt_set_int(vc->priv_data, "slicecrc", 0, 0);
+}
+
+int SpoolSlices(int thread_count) {
+  int wanted = std::min(std::max(kMinSlices, thread_count), kMaxSlices);
+
+  // slices are laid out in a grid of h columns by v rows, with
+  // v <= h < 2v: 4, 6, 9, 12, 15, 16, 20...
+  int slices = kMinSlices;
+  for (int v = 2; v * v <= wanted; v++) {
+    for (int h = v; h < 2 * v && h * v <= wanted; h++) {
+      slices = std::max(slices, h * v);
+    }
+  }
+  return slices;
+}
+
+messages::PixFmt GpuPixFmt(const MainArgs *args) {
+  auto pix_fmt = messages::PixFmt_UNKNOWN;
+  if (args->pix_fmt) {
+    if (0 == strcmp(args->pix_fmt, "yuv420p")) {
+      pix_fmt = messages::PixFmt_YUV420P;
+    } else if (0 == strcmp(args->pix_fmt, "yuv444p")) {
+      pix_fmt = messages::PixFmt_YUV444P;
+    } else if (0 == strcmp(args->pix_fmt, "nv12")) {
+      pix_fmt = messages::PixFmt_NV12;
+    }
+  }
+
+  // replay mode encodes as it goes, like normal mode
+  bool raw = args->raw && !args->replay;
+  if (raw && (pix_fmt == messages::PixFmt_UNKNOWN || pix_fmt == messages::PixFmt_NV12)) {
+    pix_fmt = messages::PixFmt_YUV420P;
+  }
+  return pix_fmt;
+}
+
+} // namespace encoder
+} // namespace capsule
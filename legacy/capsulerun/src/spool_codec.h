@@ -0,0 +1,49 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+
+#pragma once
+
+#include <capsule/messages_generated.h>
+
+#include "args.h"
+
+struct AVCodecContext;
+
+namespace capsule {
+namespace encoder {
+
+// Sets up FFV1 for raw mode: lossless and intra-only, so it costs little
+// more than a copy, and is re-encoded once capture is over. thread_count
+// must be set already.
+void ConfigureSpool(AVCodecContext *vc);
+
+// How many slices to split spool frames in, for that many threads: FFV1
+// only takes some counts, this rounds down to one of them.
+int SpoolSlices(int thread_count);
+
+// The format to ask GPU color converters for: the one picked with
+// --pix_fmt, except raw mode asks for yuv420p rather than nv12 (or
+// whatever the converter defaults to), since FFV1 only does planar.
+messages::PixFmt GpuPixFmt(const MainArgs *args);
+
+} // namespace encoder
+} // namespace capsule
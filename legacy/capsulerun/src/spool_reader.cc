@@ -0,0 +1,497 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "spool_reader.h"
+
+#if defined(WIN32)
+#pragma warning(push, 0)
+#endif // WIN32
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+    #include <libavutil/imgutils.h>
+    #include <libavutil/mem.h>
+}
+#if defined(WIN32)
+#pragma warning(pop)
+#endif // WIN32
+
+#include <lab/platform.h>
+#include <lab/strings.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "logging.h"
+
+namespace capsule {
+namespace encoder {
+
+// decoded frames, enough to cover what the encoder's convert and encode
+// queues hold on to, and then some
+static const int kSpoolFrames = 8;
+// decoded audio chunks, at most a few seconds' worth
+static const size_t kSpoolAudioFrames = 128;
+
+static const AVRational kMicroseconds = {1, 1000000};
+
+static int ReceiveVideoFormat(SpoolReader *r, VideoFormat *vfmt) {
+  return r->ReceiveVideoFormat(vfmt);
+}
+
+static int64_t ReceiveVideoFrame(SpoolReader *r, VideoFrame *frame) {
+  return r->ReceiveVideoFrame(frame);
+}
+
+static void ReleaseVideoFrame(SpoolReader *r, int slot) {
+  r->ReleaseVideoFrame(slot);
+}
+
+static void WaitVideoFrame(SpoolReader *r, int timeout_ms) {
+  r->WaitVideoFrame(timeout_ms);
+}
+
+static void ReceiveVideoStats(SpoolReader *r, VideoStats *stats) {
+  r->ReceiveVideoStats(stats);
+}
+
+static int ReceiveAudioFormat(SpoolReader *r, AudioFormat *afmt) {
+  return r->ReceiveAudioFormat(afmt);
+}
+
+static void *ReceiveAudioFrames(SpoolReader *r, int64_t *num_frames) {
+  return r->ReceiveAudioFrames(num_frames);
+}
+
+static void WaitAudioFrames(SpoolReader *r, int timeout_ms) {
+  r->WaitAudioFrames(timeout_ms);
+}
+
+static void NotifyOutput(SpoolReader *r, const char *path) {
+  r->NotifyOutput(path);
+}
+
+static AVCodecContext *OpenDecoder(AVStream *st) {
+  AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+  if (!codec) {
+    return nullptr;
+  }
+
+  AVCodecContext *c = avcodec_alloc_context3(codec);
+  if (!c) {
+    return nullptr;
+  }
+  if (avcodec_parameters_to_context(c, st->codecpar) < 0) {
+    avcodec_free_context(&c);
+    return nullptr;
+  }
+
+  // as many threads as it likes, we've got the machine to ourselves
+  c->thread_count = 0;
+  if (avcodec_open2(c, codec, nullptr) < 0) {
+    avcodec_free_context(&c);
+    return nullptr;
+  }
+  return c;
+}
+
+SpoolReader::SpoolReader() :
+  frames_(kSpoolFrames),
+  free_(kSpoolFrames),
+  audio_(kSpoolAudioFrames) {
+  memset(&vfmt_, 0, sizeof(vfmt_));
+  memset(&afmt_, 0, sizeof(afmt_));
+}
+
+SpoolReader *SpoolReader::Open(const std::string &path) {
+  auto reader = new SpoolReader();
+  if (!reader->OpenFile(path)) {
+    delete reader;
+    return nullptr;
+  }
+
+  for (int i = 0; i < kSpoolFrames; i++) {
+    reader->free_.Push(i);
+  }
+  reader->thread_ = std::thread(&SpoolReader::Run, reader);
+  return reader;
+}
+
+bool SpoolReader::OpenFile(const std::string &path) {
+  if (avformat_open_input(&ic_, path.c_str(), nullptr, nullptr) < 0) {
+    Log("Spool: could not open %s", path.c_str());
+    return false;
+  }
+  if (avformat_find_stream_info(ic_, nullptr) < 0) {
+    Log("Spool: could not find streams in %s", path.c_str());
+    return false;
+  }
+
+  video_index_ = av_find_best_stream(ic_, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+  if (video_index_ < 0) {
+    Log("Spool: no video in %s", path.c_str());
+    return false;
+  }
+  vdec_ = OpenDecoder(ic_->streams[video_index_]);
+  if (!vdec_) {
+    Log("Spool: could not open video decoder for %s", path.c_str());
+    return false;
+  }
+
+  // frames are handed out as-is, so they must be in a format the
+  // encoder takes without converting
+  AVPixelFormat pix_fmt = vdec_->pix_fmt;
+  switch (pix_fmt) {
+    case AV_PIX_FMT_YUV420P:
+      vfmt_.format = messages::PixFmt_YUV420P;
+      break;
+    case AV_PIX_FMT_YUV444P:
+      vfmt_.format = messages::PixFmt_YUV444P;
+      break;
+    default:
+      Log("Spool: unsupported pixel format %d in %s", (int) pix_fmt, path.c_str());
+      return false;
+  }
+  vfmt_.width = vdec_->width;
+  vfmt_.height = vdec_->height;
+  vfmt_.vflip = false;
+
+  int size = av_image_get_buffer_size(pix_fmt, vfmt_.width, vfmt_.height, 1);
+  if (size < 0) {
+    Log("Spool: could not compute frame size for %s", path.c_str());
+    return false;
+  }
+  vfmt_.frame_size = size;
+
+  buffers_.resize(kSpoolFrames, nullptr);
+  timestamps_.resize(kSpoolFrames, 0);
+  for (auto &buffer: buffers_) {
+    buffer = reinterpret_cast<uint8_t*>(av_malloc(size));
+    if (!buffer) {
+      Log("Spool: could not allocate frame buffers");
+      return false;
+    }
+  }
+
+  // planes are packed back to back, with no padding
+  uint8_t *data[4];
+  int linesize[4];
+  av_image_fill_arrays(data, linesize, buffers_[0], pix_fmt, vfmt_.width, vfmt_.height, 1);
+  int num_planes = video::NumPlanes(vfmt_.format);
+  for (int i = 0; i < num_planes; i++) {
+    vfmt_.offset[i] = data[i] - buffers_[0];
+    vfmt_.linesize[i] = linesize[i];
+  }
+
+  audio_index_ = av_find_best_stream(ic_, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+  if (audio_index_ >= 0) {
+    adec_ = OpenDecoder(ic_->streams[audio_index_]);
+    if (!adec_) {
+      Log("Spool: could not open audio decoder for %s, skipping audio", path.c_str());
+      audio_index_ = -1;
+    }
+  }
+
+  if (adec_) {
+    afmt_.channels = adec_->channels;
+    afmt_.rate = adec_->sample_rate;
+    switch (adec_->sample_fmt) {
+      case AV_SAMPLE_FMT_U8:
+        afmt_.format = messages::SampleFmt_U8;
+        break;
+      case AV_SAMPLE_FMT_S16:
+        afmt_.format = messages::SampleFmt_S16;
+        break;
+      case AV_SAMPLE_FMT_S32:
+        afmt_.format = messages::SampleFmt_S32;
+        break;
+      case AV_SAMPLE_FMT_FLT:
+        afmt_.format = messages::SampleFmt_F32;
+        break;
+      case AV_SAMPLE_FMT_DBL:
+        afmt_.format = messages::SampleFmt_F64;
+        break;
+      default:
+        // planar formats, mostly: the encoder wants interleaved samples
+        Log("Spool: unsupported sample format %d in %s, skipping audio",
+          (int) adec_->sample_fmt, path.c_str());
+        avcodec_free_context(&adec_);
+        audio_index_ = -1;
+        break;
+    }
+  }
+
+  Log("Spool: %s, %dx%d %s%s", path.c_str(), vfmt_.width, vfmt_.height,
+    messages::EnumNamePixFmt(vfmt_.format), adec_ ? ", with audio" : "");
+  return true;
+}
+
+SpoolReader::~SpoolReader() {
+  // unblocks the decoder, if the encoder gave up early
+  free_.Close();
+  frames_.Close();
+  audio_.Close();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+
+  AVFrame *aframe;
+  while (audio_.TryPop(aframe)) {
+    av_frame_free(&aframe);
+  }
+  av_frame_free(&cur_audio_);
+
+  for (auto buffer: buffers_) {
+    av_free(buffer);
+  }
+
+  avcodec_free_context(&vdec_);
+  avcodec_free_context(&adec_);
+  avformat_close_input(&ic_);
+}
+
+void SpoolReader::FillParams(Params *params) {
+  params->private_data = this;
+  params->receive_video_format = reinterpret_cast<VideoFormatReceiver>(encoder::ReceiveVideoFormat);
+  params->receive_video_frame  = reinterpret_cast<VideoFrameReceiver>(encoder::ReceiveVideoFrame);
+  params->release_video_frame  = reinterpret_cast<VideoFrameReleaser>(encoder::ReleaseVideoFrame);
+  params->wait_video_frame     = reinterpret_cast<VideoFrameWaiter>(encoder::WaitVideoFrame);
+  params->receive_video_stats  = reinterpret_cast<VideoStatsReceiver>(encoder::ReceiveVideoStats);
+
+  params->has_audio = adec_ != nullptr;
+  if (adec_) {
+    params->receive_audio_format = reinterpret_cast<AudioFormatReceiver>(encoder::ReceiveAudioFormat);
+    params->receive_audio_frames = reinterpret_cast<AudioFramesReceiver>(encoder::ReceiveAudioFrames);
+    params->wait_audio_frames    = reinterpret_cast<AudioFramesWaiter>(encoder::WaitAudioFrames);
+  }
+
+  params->notify_output = reinterpret_cast<OutputNotifier>(encoder::NotifyOutput);
+}
+
+int SpoolReader::ReceiveVideoFormat(VideoFormat *vfmt) {
+  *vfmt = vfmt_;
+  return 0;
+}
+
+int64_t SpoolReader::ReceiveVideoFrame(VideoFrame *frame) {
+  int slot;
+  if (!frames_.TryPop(slot)) {
+    return frames_.Drained() ? -1 : 0;
+  }
+
+  frame->data = buffers_[slot];
+  frame->timestamp = timestamps_[slot];
+  frame->slot = slot;
+  return vfmt_.frame_size;
+}
+
+void SpoolReader::ReleaseVideoFrame(int slot) {
+  free_.Push(slot);
+}
+
+void SpoolReader::WaitVideoFrame(int timeout_ms) {
+  frames_.WaitFor(timeout_ms);
+}
+
+void SpoolReader::ReceiveVideoStats(VideoStats *stats) {
+  // nothing's being captured, so nothing to keep up with
+  stats->backlog = 0;
+  stats->capacity = kSpoolFrames;
+  stats->skipped = 0;
+}
+
+int SpoolReader::ReceiveAudioFormat(AudioFormat *afmt) {
+  if (!adec_) {
+    return 1;
+  }
+  *afmt = afmt_;
+  return 0;
+}
+
+void *SpoolReader::ReceiveAudioFrames(int64_t *num_frames) {
+  // the encoder is done with the last chunk by now
+  av_frame_free(&cur_audio_);
+
+  if (!audio_.TryPop(cur_audio_)) {
+    *num_frames = 0;
+    return nullptr;
+  }
+  *num_frames = cur_audio_->nb_samples;
+  return cur_audio_->data[0];
+}
+
+void SpoolReader::WaitAudioFrames(int timeout_ms) {
+  if (audio_.Drained()) {
+    // audio ended before video did, don't spin
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+    return;
+  }
+  audio_.WaitFor(timeout_ms);
+}
+
+void SpoolReader::NotifyOutput(const char *path) {
+  outputs_.push_back(path);
+}
+
+void SpoolReader::Run() {
+  AVPacket *pkt = av_packet_alloc();
+  AVFrame *frame = av_frame_alloc();
+  if (!pkt || !frame) {
+    Log("Spool: could not allocate packet or frame");
+    exit(1);
+  }
+
+  bool ok = true;
+  while (ok && av_read_frame(ic_, pkt) >= 0) {
+    if (pkt->stream_index == video_index_) {
+      ok = Decode(vdec_, pkt, frame);
+    } else if (pkt->stream_index == audio_index_) {
+      ok = Decode(adec_, pkt, frame);
+    }
+    av_packet_unref(pkt);
+  }
+
+  if (ok) {
+    // whatever the decoders held back
+    ok = Decode(vdec_, nullptr, frame);
+    if (ok && adec_) {
+      Decode(adec_, nullptr, frame);
+    }
+  }
+
+  av_frame_free(&frame);
+  av_packet_free(&pkt);
+
+  // audio first, see SpoolReader
+  audio_.Close();
+  frames_.Close();
+}
+
+bool SpoolReader::Decode(AVCodecContext *c, AVPacket *pkt, AVFrame *frame) {
+  int ret = avcodec_send_packet(c, pkt);
+  if (ret < 0) {
+    Log("Spool: could not decode %s packet", c == vdec_ ? "video" : "audio");
+    // a damaged packet is no reason to give up on the rest
+    return true;
+  }
+
+  while ((ret = avcodec_receive_frame(c, frame)) >= 0) {
+    if (c == vdec_) {
+      bool pushed = PushVideo(frame);
+      av_frame_unref(frame);
+      if (!pushed) {
+        return false;
+      }
+    } else {
+      // the encoder may take its time, keep a reference instead of
+      // decoding into the same buffers over and over
+      AVFrame *aframe = av_frame_clone(frame);
+      av_frame_unref(frame);
+      if (!aframe) {
+        Log("Spool: could not allocate audio frame");
+        exit(1);
+      }
+      if (!audio_.Push(aframe)) {
+        av_frame_free(&aframe);
+        return false;
+      }
+    }
+  }
+
+  return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+}
+
+bool SpoolReader::PushVideo(AVFrame *frame) {
+  int slot;
+  if (!free_.Pop(slot)) {
+    return false;
+  }
+
+  int ret = av_image_copy_to_buffer(buffers_[slot], (int) vfmt_.frame_size,
+    (const uint8_t * const *) frame->data, frame->linesize, (AVPixelFormat) frame->format,
+    frame->width, frame->height, 1);
+  if (ret < 0) {
+    Log("Spool: could not copy video frame");
+    free_.Push(slot);
+    return true;
+  }
+
+  int64_t pts = frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->pkt_dts;
+  timestamps_[slot] = av_rescale_q(pts, ic_->streams[video_index_]->time_base, kMicroseconds);
+  return frames_.Push(slot);
+}
+
+static bool RemoveSpool(const std::string &path) {
+#if defined(LAB_WINDOWS)
+  return _wremove(lab::strings::ToWide(path).c_str()) == 0;
+#else // LAB_WINDOWS
+  return remove(path.c_str()) == 0;
+#endif // !LAB_WINDOWS
+}
+
+bool Transcode(MainArgs *args, const std::string &spool_path) {
+  auto reader = SpoolReader::Open(spool_path);
+  if (!reader) {
+    return false;
+  }
+
+  // named after the spool: same name, other extension
+  std::string name = spool_path;
+  size_t slash = name.find_last_of("/\\");
+  if (slash != std::string::npos) {
+    name = name.substr(slash + 1);
+  }
+  size_t dot = name.rfind('.');
+  if (dot != std::string::npos) {
+    name = name.substr(0, dot);
+  }
+
+  MainArgs transcode_args = *args;
+  transcode_args.raw = 0;
+  // the spool doesn't go anywhere, there's no falling behind
+  transcode_args.adaptive_quality = 0;
+
+  Params params;
+  memset(&params, 0, sizeof(params));
+  reader->FillParams(&params);
+  params.output_name = name.c_str();
+
+  Log("Transcode: encoding %s", spool_path.c_str());
+  Run(&transcode_args, &params);
+
+  bool ok = !reader->Outputs().empty();
+  delete reader;
+
+  if (!ok) {
+    Log("Transcode: nothing written, keeping %s", spool_path.c_str());
+    return false;
+  }
+
+  if (!RemoveSpool(spool_path)) {
+    Log("Transcode: could not remove %s", spool_path.c_str());
+  }
+  return true;
+}
+
+} // namespace encoder
+} // namespace capsule
@@ -0,0 +1,112 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.h"
+#include "encoder.h"
+
+struct AVCodecContext;
+struct AVFormatContext;
+struct AVFrame;
+struct AVPacket;
+
+namespace capsule {
+namespace encoder {
+
+/**
+ * Plays a raw mode spool back to the encoder, as if it was being
+ * captured: decoded video frames are lent out of a few local buffers,
+ * audio is handed out in whatever chunks it was stored in.
+ *
+ * Demuxing and decoding happen on a thread of their own. The video side
+ * only reports the end of the stream once all the audio is queued, so
+ * the encoder doesn't cut it short.
+ */
+class SpoolReader {
+  public:
+    // nullptr if path isn't a spool we can read
+    static SpoolReader *Open(const std::string &path);
+    ~SpoolReader();
+
+    // points params' receivers at this reader
+    void FillParams(Params *params);
+    // files encoded from the spool, see OutputNotifier
+    const std::vector<std::string> &Outputs() const { return outputs_; }
+
+    int ReceiveVideoFormat(VideoFormat *vfmt);
+    int64_t ReceiveVideoFrame(VideoFrame *frame);
+    void ReleaseVideoFrame(int slot);
+    void WaitVideoFrame(int timeout_ms);
+    void ReceiveVideoStats(VideoStats *stats);
+
+    int ReceiveAudioFormat(AudioFormat *afmt);
+    void *ReceiveAudioFrames(int64_t *num_frames);
+    void WaitAudioFrames(int timeout_ms);
+
+    void NotifyOutput(const char *path);
+
+  private:
+    SpoolReader();
+    bool OpenFile(const std::string &path);
+
+    void Run();
+    bool Decode(AVCodecContext *c, AVPacket *pkt, AVFrame *frame);
+    bool PushVideo(AVFrame *frame);
+
+    AVFormatContext *ic_ = nullptr;
+    int video_index_ = -1;
+    int audio_index_ = -1;
+    AVCodecContext *vdec_ = nullptr;
+    AVCodecContext *adec_ = nullptr;
+
+    VideoFormat vfmt_;
+    AudioFormat afmt_;
+
+    // one per slot, vfmt_.frame_size bytes each
+    std::vector<uint8_t*> buffers_;
+    std::vector<int64_t> timestamps_;
+    // decoded slots, in order
+    BoundedQueue<int> frames_;
+    // slots the decoder may fill, given back by ReleaseVideoFrame
+    BoundedQueue<int> free_;
+
+    BoundedQueue<AVFrame*> audio_;
+    // handed out last, only touched by the encoder's audio thread
+    AVFrame *cur_audio_ = nullptr;
+
+    std::vector<std::string> outputs_;
+    std::thread thread_;
+};
+
+// Encodes a raw mode spool into the usual output, named after it and
+// next to it, then removes it. Returns false, and leaves the spool
+// alone, if that didn't work out.
+bool Transcode(MainArgs *args, const std::string &spool_path);
+
+} // namespace encoder
+} // namespace capsule
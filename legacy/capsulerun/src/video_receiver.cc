@@ -19,37 +19,110 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
  */
 
-#include <lab/packet.h>
 #include <capsule/messages_generated.h>
 
 #include <microprofile.h>
+#include <lab/memory.h>
 
 #include "video_receiver.h"
 #include "logging.h"
 
 MICROPROFILE_DEFINE(VideoReceiverWait, "VideoReceiver", "VWait", MP_CHOCOLATE3);
-MICROPROFILE_DEFINE(VideoReceiverCopy1, "VideoReceiver", "VCopy1", MP_CORNSILK3);
-MICROPROFILE_DEFINE(VideoReceiverCopy2, "VideoReceiver", "VCopy2", MP_PINK3);
+MICROPROFILE_DEFINE(VideoReceiverCopy, "VideoReceiver", "VCopy", MP_CORNSILK3);
 
 namespace capsule {
 namespace video {
 
-VideoReceiver::VideoReceiver (Connection *conn, encoder::VideoFormat vfmt, shoom::Shm *shm, int num_frames) {
-  conn_ = conn;
+// how long the ring thread sleeps before checking whether we're stopped,
+// in case the wakeup from Stop was missed
+static const int kRingWaitMs = 100;
+
+// how often to log fill level & overruns, in frames
+static const uint32_t kStatsInterval = 300;
+
+// kDropPolicyEven: how often to reconsider the capture interval, in
+// frames, how far it may go, and how many times in a row we need to be
+// behind (or ahead) before it changes.
+static const uint32_t kThrottleInterval = 30;
+static const uint32_t kMaxThrottle = 4;
+static const int kBehindChecks = 2;
+static const int kAheadChecks = 10;
+
+VideoReceiver::VideoReceiver (encoder::VideoFormat vfmt, shoom::Shm *shm, int num_frames,
+                              shm_ring::DropPolicy drop_policy, int fps) {
   vfmt_ = vfmt;
   shm_ = shm;
+  ring_ = reinterpret_cast<shm_ring::Header*>(shm_->Data());
+  ring_signal::Open(&signal_, ring_->signal_name);
+  frame_size_ = static_cast<size_t>(vfmt_.frame_size);
+
+  drop_policy_ = drop_policy;
+  base_interval_us_ = fps > 0 ? (uint32_t) (1000000 / fps) : 0;
+  ring_->min_interval_us.store(0, std::memory_order_relaxed);
+  ring_->drop_policy.store((uint32_t) drop_policy, std::memory_order_relaxed);
+
+  stopped_.store(false);
+  read_.store(ring_->tail.load(std::memory_order_acquire));
+  lent_.store(0);
+  for (uint32_t i = 0; i < shm_ring::kMaxSlots; i++) {
+    released_[i].store(false);
+  }
+  fill_.store(0);
+  overruns_.store(0);
+
+  if (ring_->num_slots >= kDirectMinSlots) {
+    direct_ = true;
+    Log("VideoReceiver: initializing, reading frames straight from %u-slot ring", ring_->num_slots);
+    return;
+  }
 
   num_frames_ = num_frames;
-  frame_size_ = static_cast<size_t>(vfmt_.pitch * vfmt_.height);
   Log("VideoReceiver: initializing, buffer of %d frames", num_frames_);
   Log("VideoReceiver: total buffer size in RAM: %.2f MB", (float) (frame_size_ * num_frames_) / 1024.0f / 1024.0f);
-  buffer_ = (char *) calloc(num_frames_, frame_size_);
+  // huge pages where possible, and faulted in now rather than while
+  // the first frames come in
+  buffer_ = (char *) lab::memory::AllocLarge(num_frames_ * frame_size_);
+  if (!buffer_) {
+    Log("VideoReceiver: could not allocate buffer");
+    exit(1);
+  }
 
-  buffer_state_ = (int *) calloc(num_frames_, sizeof(int));
-  for (int i = 0; i < num_frames; i++) {
-    buffer_state_[i] = kFrameStateAvailable;
+  slots_ = new FrameSlot[num_frames_];
+  for (int i = 0; i < num_frames_; i++) {
+    slots_[i].state.store(kFrameStateAvailable);
+    slots_[i].timestamp = 0;
   }
-  commit_index_ = 0;
+
+  thread_ = std::thread(&VideoReceiver::Run, this);
+}
+
+void VideoReceiver::Run() {
+  Log("VideoReceiver: reading %u-slot ring, generation %u", ring_->num_slots, ring_->generation);
+
+  shm_ring::Descriptor desc;
+  while (!Stopped()) {
+    if (!shm_ring::Peek(ring_, &desc)) {
+      MICROPROFILE_SCOPE(VideoReceiverWait);
+      shm_ring::Wait(ring_, kRingWaitMs, &signal_);
+      continue;
+    }
+
+    if (drop_policy_ == shm_ring::kDropPolicyOldestWins &&
+        slots_[commit_index_].state.load(std::memory_order_acquire) != kFrameStateAvailable) {
+      // leave it in the ring: once that's full, libcapsule stops
+      // capturing frames we'd have no room for anyway
+      available_notifier_.Wait(kRingWaitMs);
+      continue;
+    }
+    FrameCommitted(desc);
+  }
+
+  Log("VideoReceiver: ring stopped, %u overruns on the capture side",
+    ring_->overruns.load(std::memory_order_relaxed));
+}
+
+bool VideoReceiver::Stopped() {
+  return stopped_.load(std::memory_order_acquire);
 }
 
 int VideoReceiver::ReceiveFormat(encoder::VideoFormat *vfmt) {
@@ -57,127 +130,291 @@ int VideoReceiver::ReceiveFormat(encoder::VideoFormat *vfmt) {
   return 0;
 }
 
-int64_t VideoReceiver::ReceiveFrame(uint8_t *buffer_out, size_t buffer_size_out, int64_t *timestamp_out) {
-  if (frame_size_ != buffer_size_out) {
-    Log("internal error: expected frame_size (%" PRIdS ") and buffer_size_out (%" PRIdS ") to match, but they didn't\n", frame_size_, buffer_size_out);
-    {
-      std::lock_guard<std::mutex> lock(stopped_mutex_);
-      stopped_ = true;
-    }
-    return -1;
+int64_t VideoReceiver::ReceiveFrame(encoder::VideoFrame *frame) {
+  if (direct_) {
+    return ReceiveDirect(frame);
   }
 
-  FrameInfo info {};
-
-  if (!queue_.TryPop(info)) {
-    // no frame waiting, oh well
+  FrameSlot *slot = &slots_[receive_index_];
+  // pairs with the release in FrameCommitted: the copy is done
+  if (slot->state.load(std::memory_order_acquire) != kFrameStateCommitted) {
+    // no frame waiting, oh well - are we stopped though?
+    return Stopped() ? -1 : 0;
+  }
 
-    // are we stopped though?
-    {
-      std::lock_guard<std::mutex> lock(stopped_mutex_);
-      if (stopped_) {
-        return -1;
+  if (drop_policy_ == shm_ring::kDropPolicyNewestWins) {
+    // frames are committed in order: if the next one's in, it's newer
+    while (num_frames_ > 1) {
+      int next_index = (receive_index_ + 1) % num_frames_;
+      FrameSlot *next = &slots_[next_index];
+      if (next->state.load(std::memory_order_acquire) != kFrameStateCommitted) {
+        break;
       }
+      fill_.fetch_sub(1, std::memory_order_relaxed);
+      overruns_.fetch_add(1, std::memory_order_relaxed);
+      slot->state.store(kFrameStateAvailable, std::memory_order_release);
+      receive_index_ = next_index;
+      slot = next;
     }
-    return 0;
   }
 
-  *timestamp_out = info.timestamp;
+  // until ReleaseFrame
+  slot->state.store(kFrameStateProcessing, std::memory_order_relaxed);
+  fill_.fetch_sub(1, std::memory_order_relaxed);
 
-  char *src = buffer_ + (info.index * frame_size_);
-  char *dst = (char *) buffer_out;
-  {
-    MICROPROFILE_SCOPE(VideoReceiverCopy2);
-    memcpy(dst, src, frame_size_);
-  }
+  frame->data = reinterpret_cast<const uint8_t*>(buffer_ + (receive_index_ * frame_size_));
+  frame->timestamp = slot->timestamp;
+  frame->slot = receive_index_;
+  receive_index_ = (receive_index_ + 1) % num_frames_;
+
+  LogStats(++received_);
+  Throttle(received_);
+  return static_cast<int64_t>(frame_size_);
+}
 
-  {
-    std::lock_guard<std::mutex> lock(buffer_mutex_);
+int64_t VideoReceiver::ReceiveDirect(encoder::VideoFrame *frame) {
+  // in case the last ReleaseFrame lost the race for popping_
+  Reclaim();
 
-    buffer_state_[info.index] = kFrameStateProcessing;
-    int prev_index = (info.index == 0) ? (num_frames_ - 1) : (info.index - 1);
-    if (buffer_state_[prev_index] == kFrameStateProcessing) {
-      buffer_state_[prev_index] = kFrameStateAvailable;
+  uint32_t num_slots = ring_->num_slots;
+  uint32_t max_lent = MaxLent();
+
+  shm_ring::Descriptor desc;
+  while (lent_.load(std::memory_order_acquire) < max_lent) {
+    uint32_t pos = read_.load(std::memory_order_relaxed);
+    if (!shm_ring::PeekAt(ring_, pos, &desc)) {
+      break;
+    }
+    int slot = (int) (pos % num_slots);
+
+    if (desc.generation != ring_->generation || desc.index != (uint32_t) slot) {
+      Log("VideoReceiver: skipping stale descriptor (generation %u, index %u)", desc.generation, desc.index);
+      released_[slot].store(true, std::memory_order_release);
+      read_.store(pos + 1, std::memory_order_release);
+      Reclaim();
+      continue;
     }
 
-    /////////////////////////////////
-    // <poor man's profiling>
-    /////////////////////////////////
-    if ((info.index % 10) == 0) {
-      int committed_frames = 0;
-      for (int i = 0; i < num_frames_; i++) {
-        if (buffer_state_[i] == kFrameStateCommitted) {
-          committed_frames++;
-        }
-      }
-      Log("buffer fill: %d/%d, skipped %d", committed_frames, num_frames_, overrun_);
+    shm_ring::Descriptor newer;
+    if (drop_policy_ == shm_ring::kDropPolicyNewestWins && shm_ring::PeekAt(ring_, pos + 1, &newer)) {
+      // skipped without ever being lent, so libcapsule gets it back sooner
+      overruns_.fetch_add(1, std::memory_order_relaxed);
+      released_[slot].store(true, std::memory_order_release);
+      read_.store(pos + 1, std::memory_order_release);
+      Reclaim();
+      continue;
     }
-    /////////////////////////////////
-    // </poor man's profiling>
-    /////////////////////////////////
+
+    lent_.fetch_add(1, std::memory_order_relaxed);
+    read_.store(pos + 1, std::memory_order_release);
+
+    frame->data = shm_->Data() + shm_ring::kHeaderSize + (frame_size_ * slot);
+    frame->timestamp = desc.timestamp;
+    frame->slot = slot;
+
+    LogStats(++received_);
+    Throttle(received_);
+    return static_cast<int64_t>(frame_size_);
   }
 
-  return buffer_size_out;
+  // no frame waiting, are we stopped though?
+  return Stopped() ? -1 : 0;
+}
+
+// always leave libcapsule a couple slots to write into, so it doesn't
+// start dropping frames just because the encoder is holding onto some
+uint32_t VideoReceiver::MaxLent() {
+  return ring_->num_slots - 2;
 }
 
-void VideoReceiver::FrameCommitted(int index, int64_t timestamp) {
-  {
-    std::lock_guard<std::mutex> lock(stopped_mutex_);
-    if (stopped_) {
-      // just ignore
-      return;
+void VideoReceiver::WaitFrame(int timeout_ms) {
+  if (Stopped()) {
+    return;
+  }
+
+  if (!direct_) {
+    committed_notifier_.Wait(timeout_ms);
+    return;
+  }
+
+  if (lent_.load(std::memory_order_acquire) >= MaxLent()) {
+    // there may be frames in the ring, but we can't lend any more
+    // until the encoder gives some back
+    released_notifier_.Wait(timeout_ms);
+    return;
+  }
+
+  MICROPROFILE_SCOPE(VideoReceiverWait);
+  shm_ring::WaitAt(ring_, read_.load(std::memory_order_relaxed), timeout_ms, &signal_);
+}
+
+void VideoReceiver::ReleaseFrame(int slot) {
+  if (direct_) {
+    released_[slot].store(true, std::memory_order_release);
+    uint32_t lent = lent_.fetch_sub(1, std::memory_order_release);
+    Reclaim();
+    if (lent == MaxLent()) {
+      released_notifier_.Notify();
     }
+    return;
   }
 
-  int commit = 0;
+  // pairs with the acquire in FrameCommitted: the encoder is done reading
+  slots_[slot].state.store(kFrameStateAvailable, std::memory_order_release);
+  if (drop_policy_ == shm_ring::kDropPolicyOldestWins) {
+    available_notifier_.Notify();
+  }
+}
 
-  {
-    std::lock_guard<std::mutex> lock(buffer_mutex_);
+// Gives released slots back to libcapsule. The encoder may release out of
+// order, but slots have to be popped in ring order.
+void VideoReceiver::Reclaim() {
+  // whoever holds popping_ may have looked at our slot before we
+  // released it, so wait our turn rather than leave it in the ring.
+  // the loop below is at most kMaxSlots pops long.
+  while (popping_.test_and_set(std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
 
-    if (buffer_state_[commit_index_] != kFrameStateAvailable) {
-      // no room, just skip it
-      overrun_++;
-    } else {
-      commit = 1;
+  uint32_t num_slots = ring_->num_slots;
+  uint32_t read = read_.load(std::memory_order_acquire);
+  uint32_t tail = ring_->tail.load(std::memory_order_relaxed);
+  while (tail != read) {
+    auto &released = released_[tail % num_slots];
+    if (!released.load(std::memory_order_acquire)) {
+      break;
     }
+    released.store(false, std::memory_order_relaxed);
+    shm_ring::Pop(ring_);
+    tail++;
   }
 
-  if (commit) {
-      // got room, copy it
-      char *src = reinterpret_cast<char*>(shm_->Data()) + (frame_size_ * index);
-      char *dst = buffer_ + (frame_size_ * commit_index_);
-      {
-        MICROPROFILE_SCOPE(VideoReceiverCopy1);
-        memcpy(dst, src, frame_size_);
-      }
+  popping_.clear(std::memory_order_release);
+}
 
-      FrameInfo info {commit_index_, timestamp};
-      queue_.Push(info);
+void VideoReceiver::ReceiveStats(encoder::VideoStats *stats) {
+  if (direct_) {
+    // lent or not, frames hold on to their ring slot until released
+    uint32_t head = ring_->head.load(std::memory_order_relaxed);
+    uint32_t tail = ring_->tail.load(std::memory_order_relaxed);
+    stats->backlog = (int) (head - tail);
+    stats->capacity = (int) ring_->num_slots;
+  } else {
+    stats->backlog = fill_.load(std::memory_order_relaxed);
+    stats->capacity = num_frames_;
+  }
+  // in copy mode, libcapsule only skips if the ring thread falls behind
+  stats->skipped = ring_->overruns.load(std::memory_order_relaxed) +
+    overruns_.load(std::memory_order_relaxed);
+}
 
-      {
-        std::lock_guard<std::mutex> lock(buffer_mutex_);
+void VideoReceiver::LogStats(uint32_t received) {
+  if ((received % kStatsInterval) != 0) {
+    return;
+  }
 
-        buffer_state_[commit_index_] = kFrameStateCommitted;
-        commit_index_ = (commit_index_ + 1) % num_frames_;
-      }
+  if (direct_) {
+    Log("VideoReceiver: %u frames, %u/%u lent, %u skipped by capture", received,
+      lent_.load(std::memory_order_relaxed), ring_->num_slots,
+      ring_->overruns.load(std::memory_order_relaxed));
+  } else {
+    Log("VideoReceiver: %u frames, buffer fill %d/%d, skipped %u", received,
+      fill_.load(std::memory_order_relaxed), num_frames_,
+      overruns_.load(std::memory_order_relaxed));
   }
+}
+
+// Stretches the capture interval while we're falling behind, so frames
+// are skipped evenly by libcapsule instead of in bursts, and never read
+// back in the first place. Relaxes it once we've caught up for a while.
+void VideoReceiver::Throttle(uint32_t received) {
+  if (drop_policy_ != shm_ring::kDropPolicyEven || (received % kThrottleInterval) != 0) {
+    return;
+  }
+
+  encoder::VideoStats stats;
+  ReceiveStats(&stats);
+  uint32_t new_skips = stats.skipped - throttle_skipped_;
+  throttle_skipped_ = stats.skipped;
+
+  bool behind = new_skips > 0 || stats.backlog * 2 > stats.capacity;
+  bool ahead = !behind && stats.backlog * 4 <= stats.capacity;
+  behind_ = behind ? behind_ + 1 : 0;
+  ahead_ = ahead ? ahead_ + 1 : 0;
+
+  uint32_t throttle = throttle_;
+  if (behind_ >= kBehindChecks && throttle_ < kMaxThrottle) {
+    throttle++;
+  } else if (ahead_ >= kAheadChecks && throttle_ > 1) {
+    throttle--;
+  }
+  if (throttle == throttle_) {
+    return;
+  }
+
+  Log("VideoReceiver: capturing 1 frame out of %u (backlog %d/%d, %u new skips)",
+    throttle, stats.backlog, stats.capacity, new_skips);
+  throttle_ = throttle;
+  behind_ = 0;
+  ahead_ = 0;
+  ring_->min_interval_us.store(throttle > 1 ? base_interval_us_ * throttle : 0, std::memory_order_relaxed);
+}
 
-  // in both cases, free up that index for the sender
-  flatbuffers::FlatBufferBuilder builder(1024);
-  auto vfp = messages::CreateVideoFrameProcessed(builder, index); 
-  auto opkt = messages::CreatePacket(builder, messages::Message_VideoFrameProcessed, vfp.Union());
-  builder.Finish(opkt);
-  conn_->Write(builder);
+void VideoReceiver::FrameCommitted(const shm_ring::Descriptor &desc) {
+  if (desc.generation != ring_->generation || desc.index >= ring_->num_slots) {
+    Log("VideoReceiver: skipping stale descriptor (generation %u, index %u)", desc.generation, desc.index);
+    shm_ring::Pop(ring_);
+    return;
+  }
+
+  FrameSlot &slot = slots_[commit_index_];
+  // pairs with the release in ReleaseFrame
+  if (slot.state.load(std::memory_order_acquire) != kFrameStateAvailable) {
+    // no room, just skip it
+    overruns_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    // got room, copy it
+    char *src = reinterpret_cast<char*>(shm_->Data()) + shm_ring::kHeaderSize + (frame_size_ * desc.index);
+    char *dst = buffer_ + (frame_size_ * commit_index_);
+    {
+      MICROPROFILE_SCOPE(VideoReceiverCopy);
+      memcpy(dst, src, frame_size_);
+    }
+
+    slot.timestamp = desc.timestamp;
+    fill_.fetch_add(1, std::memory_order_relaxed);
+    slot.state.store(kFrameStateCommitted, std::memory_order_release);
+    commit_index_ = (commit_index_ + 1) % num_frames_;
+    committed_notifier_.Notify();
+  }
+
+  // in both cases, free up that slot for the sender
+  shm_ring::Pop(ring_);
 }
 
 void VideoReceiver::Stop() {
-  std::lock_guard<std::mutex> lock(stopped_mutex_);
-  stopped_ = true;
+  stopped_.store(true, std::memory_order_release);
+
+  // whoever's in WaitFrame, ReceiveFrame has news for them
+  committed_notifier_.Notify();
+  released_notifier_.Notify();
+  available_notifier_.Notify();
+  // and so does the ring thread, in copy mode
+  shm_ring::Wake(ring_, &signal_);
 }
 
 VideoReceiver::~VideoReceiver () {
-  free(buffer_state_);
-  free(buffer_);
+  Stop();
+
+  if (direct_) {
+    Log("VideoReceiver: done, %u overruns on the capture side",
+      ring_->overruns.load(std::memory_order_relaxed));
+  } else {
+    thread_.join();
+    delete[] slots_;
+    lab::memory::FreeLarge(buffer_, num_frames_ * frame_size_);
+  }
+  ring_signal::Close(&signal_);
   delete shm_;
 }
 
@@ -21,13 +21,14 @@
 
 #pragma once
 
-#include <mutex>
+#include <atomic>
+#include <thread>
 
 #include <shoom.h>
+#include <capsule/shm_ring.h>
 
-#include "locking_queue.h"
-#include "connection.h"
 #include "encoder.h"
+#include "notifier.h"
 
 namespace capsule {
 namespace video {
@@ -38,38 +39,109 @@ enum FrameState {
   kFrameStateProcessing,
 };
 
-struct FrameInfo {
-  int index;
+// A local frame buffer, in copy mode. Committed by the ring thread,
+// received by the encoder thread, made available again by ReleaseFrame.
+struct FrameSlot {
+  std::atomic<int> state;
   int64_t timestamp;
 };
 
+// rings at least this deep are read from directly, see VideoReceiver
+static const uint32_t kDirectMinSlots = 4;
+
 class VideoReceiver {
   public:
-    VideoReceiver(Connection *conn, encoder::VideoFormat vfmt, shoom::Shm *shm, int num_frames);
+    // shm must start with an initialized shm_ring::Header.
+    //
+    // If the ring has at least kDirectMinSlots slots, frames are lent out
+    // straight from shm, and their slot goes back to libcapsule once
+    // released. Otherwise they're copied out of the ring as soon as they
+    // come in, into num_frames local buffers, so libcapsule isn't kept
+    // waiting on the encoder.
+    //
+    // Either way, frames themselves go through the ring and atomics
+    // only. The Notifiers used for waiting take a mutex, and concurrent
+    // ReleaseFrame calls take turns giving slots back to the ring.
+    // ReceiveFrame and WaitFrame must only be called from one thread,
+    // ReleaseFrame may be called from any.
+    //
+    // drop_policy is what happens once the encoder falls behind, see
+    // shm_ring::DropPolicy. fps is the capture rate we asked for.
+    VideoReceiver(encoder::VideoFormat vfmt, shoom::Shm *shm, int num_frames,
+      shm_ring::DropPolicy drop_policy, int fps);
     ~VideoReceiver();
-    void FrameCommitted(int index, int64_t timestamp);
     int ReceiveFormat(encoder::VideoFormat *vfmt);
-    int64_t ReceiveFrame(uint8_t *buffer, size_t buffer_size, int64_t *timestamp);
+    int64_t ReceiveFrame(encoder::VideoFrame *frame);
+    // blocks until ReceiveFrame has something new to return (a frame, or
+    // the end of the stream), or for at most timeout_ms
+    void WaitFrame(int timeout_ms);
+    void ReleaseFrame(int slot);
+    // may be called from any thread
+    void ReceiveStats(encoder::VideoStats *stats);
     void Stop();
 
   private:
-    Connection *conn_ = nullptr;
+    void Run();
+    void FrameCommitted(const shm_ring::Descriptor &desc);
+    bool Stopped();
+
+    int64_t ReceiveDirect(encoder::VideoFrame *frame);
+    void Reclaim();
+    uint32_t MaxLent();
+    void LogStats(uint32_t received);
+    void Throttle(uint32_t received);
+
     encoder::VideoFormat vfmt_;
     shoom::Shm *shm_ = nullptr;
+    shm_ring::Header *ring_ = nullptr;
+    ring_signal::Signal signal_;
+    size_t frame_size_ = 0;
 
-    LockingQueue<FrameInfo> queue_;
+    std::atomic<bool> stopped_;
+    // frames received by the encoder so far
+    uint32_t received_ = 0;
 
-    int num_frames_ = 0;
-    size_t frame_size_ = 0;
-    int commit_index_ = 0;
-    char *buffer_ = nullptr;
-    int *buffer_state_ = nullptr;
-    std::mutex buffer_mutex_;
+    shm_ring::DropPolicy drop_policy_ = shm_ring::kDropPolicyOldestWins;
+    // kDropPolicyEven: one frame out of throttle_ is captured, adjusted
+    // by Throttle with some hysteresis
+    uint32_t base_interval_us_ = 0;
+    uint32_t throttle_ = 1;
+    uint32_t throttle_skipped_ = 0;
+    int behind_ = 0;
+    int ahead_ = 0;
 
-    bool stopped_ = false;
-    std::mutex stopped_mutex_;
+    // direct mode
+    bool direct_ = false;
+    // ring position of the next frame to lend out, written by the
+    // encoder thread only
+    std::atomic<uint32_t> read_;
+    // frames with the encoder right now
+    std::atomic<uint32_t> lent_;
+    // per ring slot, set once the encoder is done with it. slots are
+    // popped in ring order, by whoever holds popping_, see Reclaim.
+    std::atomic<bool> released_[shm_ring::kMaxSlots];
+    std::atomic_flag popping_ = ATOMIC_FLAG_INIT;
+    // signaled by ReleaseFrame, when all lendable slots are out
+    Notifier released_notifier_;
 
-    int overrun_ = 0;
+    // copy mode
+    std::thread thread_;
+    int num_frames_ = 0;
+    char *buffer_ = nullptr;
+    FrameSlot *slots_ = nullptr;
+    // written by the ring thread only
+    int commit_index_ = 0;
+    // written by the encoder thread only
+    int receive_index_ = 0;
+    // committed but not received yet
+    std::atomic<int> fill_;
+    // frames we had no room for
+    std::atomic<uint32_t> overruns_;
+    // signaled by FrameCommitted
+    Notifier committed_notifier_;
+    // oldest-wins: signaled by ReleaseFrame, for the ring thread to
+    // wait on while there's no room
+    Notifier available_notifier_;
 };
 
 } // namespace video
@@ -0,0 +1,157 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <libavformat/avio.h>
+}
+
+#include "async_writer.h"
+
+#include "lest.hpp"
+
+using namespace capsule;
+
+namespace {
+
+static AsyncWriterOptions SmallBuffers () {
+  AsyncWriterOptions options;
+  options.buffer_size = 4096;
+  options.num_buffers = 2;
+  options.direct = false;
+  options.sync_bytes = 0;
+  return options;
+}
+
+static std::vector<uint8_t> Pattern (size_t size) {
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (uint8_t) (i * 7 + i / 251);
+  }
+  return data;
+}
+
+static std::vector<uint8_t> ReadFile (const std::string &path) {
+  std::vector<uint8_t> data;
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return data;
+  }
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data.insert(data.end(), buf, buf + n);
+  }
+  fclose(f);
+  return data;
+}
+
+// several times what's in flight, and not a multiple of anything
+static bool WriteAndCheck (const std::string &path, const AsyncWriterOptions &options) {
+  auto writer = AsyncWriter::Open(path, options);
+  if (!writer) {
+    return false;
+  }
+
+  auto data = Pattern(100 * 1000 + 13);
+  avio_write(writer->Avio(), data.data(), (int) data.size());
+  bool ok = writer->Close() && writer->Size() == (int64_t) data.size();
+  delete writer;
+
+  ok = ok && ReadFile(path) == data;
+  remove(path.c_str());
+  return ok;
+}
+
+} // namespace
+
+const lest::test specification[] = {
+  CASE("async_writer: writes everything, in order") {
+    EXPECT(WriteAndCheck("async_writer_test_order.bin", SmallBuffers()));
+  },
+
+  CASE("async_writer: syncs along the way") {
+    AsyncWriterOptions options = SmallBuffers();
+    options.sync_bytes = 10000;
+    EXPECT(WriteAndCheck("async_writer_test_sync.bin", options));
+  },
+
+  CASE("async_writer: direct I/O, or the page cache if it's not there") {
+    AsyncWriterOptions options = SmallBuffers();
+    options.direct = true;
+    EXPECT(WriteAndCheck("async_writer_test_direct.bin", options));
+  },
+
+  CASE("async_writer: seeking back patches what was written") {
+    std::string path = "async_writer_test_seek.bin";
+    auto writer = AsyncWriter::Open(path, SmallBuffers());
+    EXPECT(writer != nullptr);
+
+    auto data = Pattern(50 * 1000);
+    AVIOContext *avio = writer->Avio();
+    avio_write(avio, data.data(), (int) data.size());
+
+    // like a muxer filling in a header once it knows the sizes
+    const char patch[] = "patched";
+    avio_seek(avio, 100, SEEK_SET);
+    avio_write(avio, reinterpret_cast<const unsigned char*>(patch), (int) strlen(patch));
+    avio_seek(avio, 0, SEEK_END);
+    avio_write(avio, data.data(), 1000);
+
+    EXPECT(writer->Close());
+    EXPECT(writer->Size() == 51 * 1000);
+    delete writer;
+
+    std::vector<uint8_t> expected(data);
+    expected.insert(expected.end(), data.begin(), data.begin() + 1000);
+    memcpy(expected.data() + 100, patch, strlen(patch));
+    EXPECT(ReadFile(path) == expected);
+    remove(path.c_str());
+  },
+
+  CASE("async_writer: can't open a file in a folder that isn't there") {
+    auto writer = AsyncWriter::Open("async_writer_test_missing/out.bin", SmallBuffers());
+    EXPECT(writer == nullptr);
+  },
+
+  CASE("async_writer: gives up cleanly if the buffers can't be allocated") {
+    if (sizeof(size_t) < 8) {
+      return;
+    }
+
+    std::string path = "async_writer_test_alloc.bin";
+    AsyncWriterOptions options = SmallBuffers();
+    // more than any address space there is
+    options.buffer_size = (size_t) 1 << 60;
+    auto writer = AsyncWriter::Open(path, options);
+    EXPECT(writer == nullptr);
+    remove(path.c_str());
+  },
+};
+
+int main (int argc, char *argv[]) {
+  return lest::run(specification, argc, argv);
+}
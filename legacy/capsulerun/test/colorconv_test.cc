@@ -0,0 +1,253 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include <lab/env.h>
+
+#include "colorconv.h"
+#include "colorconv_kernels.h"
+
+#include "lest.hpp"
+
+using namespace capsule::colorconv;
+
+namespace capsule {
+namespace colorconv {
+
+#if defined(CAPSULE_COLORCONV_X86)
+extern const Kernels kKernelsSSE2;
+extern const Kernels kKernelsAVX2;
+extern const Kernels kKernelsAVX512;
+#endif // CAPSULE_COLORCONV_X86
+
+} // namespace colorconv
+} // namespace capsule
+
+namespace {
+
+// BT.601, BGRA input, like MakeCoefs would compute
+static const Coefs kCoefs = {
+  {{3208, 16519, 8414}},
+  {{14392, -9536, -4856}},
+  {{-2340, -12052, 14392}},
+};
+
+static std::vector<uint8_t> Noise (size_t size, uint32_t seed) {
+  std::vector<uint8_t> out(size);
+  for (size_t i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    out[i] = (uint8_t) (seed >> 16);
+  }
+  return out;
+}
+
+// every vector kernel set this CPU can run
+static std::vector<const Kernels*> VectorKernels () {
+  std::vector<const Kernels*> out;
+#if defined(CAPSULE_COLORCONV_X86)
+  // asking for everything gets us the best the CPU supports
+  Isa best = Converter(kInputBGRA, kOutputYUV420P, kMatrixBT601, 2, 2).GetIsa();
+  if (best >= kIsaSSE2) {
+    out.push_back(&kKernelsSSE2);
+  }
+  if (best >= kIsaAVX2) {
+    out.push_back(&kKernelsAVX2);
+  }
+  if (best >= kIsaAVX512) {
+    out.push_back(&kKernelsAVX512);
+  }
+#endif // CAPSULE_COLORCONV_X86
+  return out;
+}
+
+// guard bytes around every output, to catch kernels writing past width
+// (one more than a multiple of 16, so plane data is misaligned)
+static const int kGuard = 65;
+static const uint8_t kGuardByte = 0xa5;
+
+struct Plane {
+  Plane(int size) : bytes(size + 2 * kGuard, kGuardByte) {}
+  uint8_t *data() { return bytes.data() + kGuard; }
+  bool GuardsIntact(int size) {
+    for (int i = 0; i < kGuard; i++) {
+      if (bytes[i] != kGuardByte || bytes[kGuard + size + i] != kGuardByte) {
+        return false;
+      }
+    }
+    return true;
+  }
+  std::vector<uint8_t> bytes;
+};
+
+struct Frame {
+  Frame(int width, int height, OutputFormat out) {
+    int cw = out == kOutputYUV444P ? width : width / 2;
+    int ch = out == kOutputYUV444P ? height : height / 2;
+    // odd strides, wider than the picture
+    linesize[0] = width + 3;
+    linesize[1] = (out == kOutputNV12 ? width : cw) + 5;
+    linesize[2] = cw + 7;
+    sizes[0] = linesize[0] * height;
+    sizes[1] = linesize[1] * ch;
+    sizes[2] = out == kOutputNV12 ? 0 : linesize[2] * ch;
+    for (int i = 0; i < 3; i++) {
+      planes.push_back(Plane(sizes[i]));
+    }
+    for (int i = 0; i < 3; i++) {
+      data[i] = planes[i].data();
+    }
+  }
+
+  bool operator==(const Frame &other) const {
+    return planes[0].bytes == other.planes[0].bytes &&
+      planes[1].bytes == other.planes[1].bytes &&
+      planes[2].bytes == other.planes[2].bytes;
+  }
+
+  std::vector<Plane> planes;
+  uint8_t *data[3];
+  int linesize[3];
+  int sizes[3];
+};
+
+} // namespace
+
+const lest::test specification[] = {
+  CASE("colorconv: luma kernels match scalar, any width and alignment") {
+    auto sets = VectorKernels();
+    for (auto k : sets) {
+      for (int width = 1; width <= 150; width++) {
+        for (int misalign = 0; misalign < 4; misalign++) {
+          auto src = Noise(width * 4 + misalign, width * 4 + misalign);
+          const uint8_t *p = src.data() + misalign;
+
+          Plane expected(width);
+          Plane actual(width);
+          LumaRowScalar(p, expected.data(), width, &kCoefs);
+          k->luma(p, actual.data(), width, &kCoefs);
+          EXPECT(expected.bytes == actual.bytes);
+        }
+      }
+    }
+  },
+
+  CASE("colorconv: 444 chroma kernels match scalar, any width and alignment") {
+    auto sets = VectorKernels();
+    for (auto k : sets) {
+      for (int width = 1; width <= 150; width++) {
+        for (int misalign = 0; misalign < 4; misalign++) {
+          auto src = Noise(width * 4 + misalign, width + misalign);
+          const uint8_t *p = src.data() + misalign;
+
+          Plane expected_u(width), expected_v(width);
+          Plane actual_u(width), actual_v(width);
+          Chroma444RowScalar(p, expected_u.data(), expected_v.data(), width, &kCoefs);
+          k->chroma444(p, actual_u.data(), actual_v.data(), width, &kCoefs);
+          EXPECT(expected_u.bytes == actual_u.bytes);
+          EXPECT(expected_v.bytes == actual_v.bytes);
+        }
+      }
+    }
+  },
+
+  CASE("colorconv: 420 chroma kernels match scalar, planar and interleaved") {
+    auto sets = VectorKernels();
+    for (auto k : sets) {
+      for (int width = 2; width <= 150; width += 2) {
+        for (int misalign = 0; misalign < 4; misalign++) {
+          // rows a stride apart that isn't a multiple of anything
+          int stride = width * 4 + 4 + misalign;
+          auto src = Noise(stride * 2 + misalign, width);
+          const uint8_t *p0 = src.data() + misalign;
+          const uint8_t *p1 = p0 + stride;
+
+          Plane expected_u(width / 2), expected_v(width / 2);
+          Plane actual_u(width / 2), actual_v(width / 2);
+          Chroma420RowScalar(p0, p1, expected_u.data(), expected_v.data(), width, &kCoefs);
+          k->chroma420(p0, p1, actual_u.data(), actual_v.data(), width, &kCoefs);
+          EXPECT(expected_u.bytes == actual_u.bytes);
+          EXPECT(expected_v.bytes == actual_v.bytes);
+
+          Plane expected_uv(width);
+          Plane actual_uv(width);
+          Chroma420RowScalar(p0, p1, expected_uv.data(), nullptr, width, &kCoefs);
+          k->chroma420(p0, p1, actual_uv.data(), nullptr, width, &kCoefs);
+          EXPECT(expected_uv.bytes == actual_uv.bytes);
+        }
+      }
+    }
+  },
+
+  CASE("colorconv: every Converter matches scalar, odd strides, flipped or not") {
+    // heights with an odd number of row pairs, widths that leave
+    // a remainder for every vector size
+    const int sizes[][2] = {{2, 2}, {6, 6}, {18, 10}, {34, 14}, {66, 2}, {130, 6}, {254, 22}};
+    const InputFormat inputs[] = {kInputBGRA, kInputRGBA};
+    const OutputFormat outputs[] = {kOutputYUV420P, kOutputNV12, kOutputYUV444P};
+    const Isa isas[] = {kIsaSSE2, kIsaAVX2, kIsaAVX512};
+
+    for (auto &size : sizes) {
+      int width = size[0];
+      int height = size[1];
+      int src_linesize = width * 4 + 12;
+      auto src = Noise(src_linesize * height + 1, width * height);
+      const uint8_t *p = src.data() + 1;
+
+      for (auto in : inputs) {
+        for (auto out : outputs) {
+          for (int vflip = 0; vflip < 2; vflip++) {
+            Converter scalar(in, out, kMatrixBT709, width, height, kIsaScalar);
+            Frame expected(width, height, out);
+            scalar.Convert(p, src_linesize, !!vflip, expected.data, expected.linesize, 0, height);
+
+            for (auto isa : isas) {
+              Converter conv(in, out, kMatrixBT709, width, height, isa);
+              if (conv.GetIsa() != isa) {
+                // not supported here
+                continue;
+              }
+
+              Frame actual(width, height, out);
+              // in two bands, like ConversionStage does
+              int mid = (height / 4) * 2;
+              conv.Convert(p, src_linesize, !!vflip, actual.data, actual.linesize, 0, mid);
+              conv.Convert(p, src_linesize, !!vflip, actual.data, actual.linesize, mid, height);
+              EXPECT(expected == actual);
+              for (int i = 0; i < 3; i++) {
+                EXPECT(actual.planes[i].GuardsIntact(actual.sizes[i]));
+              }
+            }
+          }
+        }
+      }
+    }
+  },
+};
+
+int main (int argc, char *argv[]) {
+  // kernels are picked by the test, not the environment
+  lab::env::Set("CAPSULE_COLORCONV_ISA", "");
+  return lest::run(specification, argc, argv);
+}
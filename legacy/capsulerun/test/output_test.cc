@@ -0,0 +1,222 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include "output.h"
+#include "test_media.h"
+
+#include "lest.hpp"
+
+using namespace capsule::encoder;
+using namespace capsule::test;
+
+namespace {
+
+static const int kFrameSize = 10000;
+
+static AVFormatContext *Template () {
+  AVFormatContext *tmpl = nullptr;
+  avformat_alloc_output_context2(&tmpl, nullptr, "mp4", nullptr);
+  AVStream *st = avformat_new_stream(tmpl, nullptr);
+  FillVideoParameters(st->codecpar);
+  st->time_base = AVRational{1, kTimeBase};
+  return tmpl;
+}
+
+static OutputOptions Options (const std::string &base) {
+  OutputOptions options;
+  options.dir = ".";
+  options.base = base;
+  options.extension = "mp4";
+  options.fmp4 = false;
+  options.writer.buffer_size = 64 * 1024;
+  options.writer.num_buffers = 4;
+  options.writer.direct = false;
+  options.writer.sync_bytes = 0;
+  options.segment_us = 0;
+  options.segment_bytes = 0;
+  options.budget_bytes = 0;
+  return options;
+}
+
+// writes frames [0, count) and closes
+static std::vector<std::string> WriteFrames (const OutputOptions &options, int count) {
+  AVFormatContext *tmpl = Template();
+  std::vector<std::string> paths;
+  {
+    Output output(tmpl, 0, options);
+    if (output.Open()) {
+      bool ok = true;
+      for (int n = 0; n < count; n++) {
+        ok = output.Write(VideoPacket(n, kFrameSize)) && ok;
+      }
+      if (output.Close() && ok) {
+        paths = output.Paths();
+      }
+    }
+  }
+  avformat_free_context(tmpl);
+  return paths;
+}
+
+static bool Exists (const std::string &path) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  fclose(f);
+  return true;
+}
+
+static void Touch (const std::string &path) {
+  FILE *f = fopen(path.c_str(), "wb");
+  if (f) {
+    fclose(f);
+  }
+}
+
+static std::vector<std::string> Segments (const std::string &base, int first, int last) {
+  std::vector<std::string> out;
+  for (int n = first; n <= last; n++) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "-%04d", n);
+    out.push_back("./" + base + suffix + ".mp4");
+  }
+  return out;
+}
+
+static void RemoveAll (const std::vector<std::string> &paths) {
+  for (auto &path: paths) {
+    remove(path.c_str());
+  }
+}
+
+} // namespace
+
+const lest::test specification[] = {
+  CASE("output: timestamped names are prefix-YYYYMMDD-HHMMSS") {
+    std::string name = TimestampedName("capsule");
+    EXPECT(name.size() == strlen("capsule-YYYYMMDD-HHMMSS"));
+    EXPECT(name.compare(0, 8, "capsule-") == 0);
+    EXPECT(name[16] == '-');
+    for (size_t i = 8; i < name.size(); i++) {
+      if (i != 16) {
+        EXPECT(isdigit((unsigned char) name[i]));
+      }
+    }
+  },
+
+  CASE("output: names in --dir get a number once taken") {
+    std::string name = TimestampedName("output_test");
+    std::string first = "./" + name + ".mp4";
+    std::string second = "./" + name + "-2.mp4";
+    std::string third = "./" + name + "-3.mp4";
+
+    EXPECT(first == UniquePath(".", name));
+    Touch(first);
+    EXPECT(second == UniquePath(".", name));
+    Touch(second);
+    EXPECT(third == UniquePath(".", name));
+    EXPECT("./" + name + ".mkv" == UniquePath(".", name, "mkv"));
+
+    remove(first.c_str());
+    remove(second.c_str());
+  },
+
+  CASE("output: a single file without segment limits") {
+    auto paths = WriteFrames(Options("output_test_single"), 35);
+    EXPECT(std::vector<std::string>{"./output_test_single.mp4"} == paths);
+    EXPECT(Exists(paths.front()));
+    RemoveAll(paths);
+  },
+
+  CASE("output: segments roll over on the first keyframe past the duration") {
+    OutputOptions options = Options("output_test_duration");
+    options.segment_us = 1000 * 1000;
+
+    // keyframes at 1s, 2s and 3s each start a segment
+    auto paths = WriteFrames(options, 35);
+    EXPECT(Segments("output_test_duration", 1, 4) == paths);
+    for (auto &path: paths) {
+      EXPECT(Exists(path));
+    }
+    RemoveAll(paths);
+  },
+
+  CASE("output: segments roll over on the first keyframe past the size") {
+    OutputOptions options = Options("output_test_size");
+    // reached within the first GOP, so every keyframe rolls over
+    options.segment_bytes = 5 * kFrameSize;
+
+    auto paths = WriteFrames(options, 35);
+    EXPECT(Segments("output_test_size", 1, 4) == paths);
+    RemoveAll(paths);
+  },
+
+  CASE("output: segments over the budget are deleted, oldest first") {
+    OutputOptions options = Options("output_test_budget");
+    options.segment_us = 1000 * 1000;
+    // about two and a half segments' worth
+    options.budget_bytes = 25 * kFrameSize;
+
+    auto paths = WriteFrames(options, 60);
+    EXPECT(Segments("output_test_budget", 4, 6) == paths);
+    for (auto &path: Segments("output_test_budget", 1, 3)) {
+      EXPECT_NOT(Exists(path));
+    }
+    for (auto &path: paths) {
+      EXPECT(Exists(path));
+    }
+    RemoveAll(paths);
+  },
+
+  CASE("output: a budget without segment limits still segments") {
+    OutputOptions options = Options("output_test_budget_only");
+    // segments of a quarter of that, about a second each
+    options.budget_bytes = 40 * kFrameSize;
+
+    auto paths = WriteFrames(options, 100);
+    EXPECT(paths.size() > 1u);
+    EXPECT(paths.front() != Segments("output_test_budget_only", 1, 1).front());
+    EXPECT_NOT(Exists(Segments("output_test_budget_only", 1, 1).front()));
+    for (auto &path: paths) {
+      EXPECT(Exists(path));
+    }
+    RemoveAll(paths);
+  },
+};
+
+int main (int argc, char *argv[]) {
+  av_register_all();
+  av_log_set_level(AV_LOG_ERROR);
+  return lest::run(specification, argc, argv);
+}
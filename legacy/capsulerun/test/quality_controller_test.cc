@@ -0,0 +1,174 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "quality_controller.h"
+
+#include "lest.hpp"
+
+using namespace capsule::encoder;
+
+namespace {
+
+// 60fps, 4 frames of room
+static QualitySample Behind () {
+  return QualitySample{3, 4, 0, 20.0, 16.6};
+}
+
+static QualitySample Middle () {
+  return QualitySample{1, 4, 0, 12.0, 16.6};
+}
+
+static QualitySample Ahead () {
+  return QualitySample{0, 4, 0, 5.0, 16.6};
+}
+
+} // namespace
+
+const lest::test specification[] = {
+  CASE("quality_controller: starts at the crf that was asked for") {
+    QualityController q(20, 30);
+    EXPECT(20 == q.Crf());
+  },
+
+  CASE("quality_controller: steps down after falling behind twice in a row") {
+    QualityController q(20, 30);
+    EXPECT(20 == q.Update(Behind()));
+    EXPECT(22 == q.Update(Behind()));
+
+    // the count starts over after a step
+    EXPECT(22 == q.Update(Behind()));
+    EXPECT(24 == q.Update(Behind()));
+  },
+
+  CASE("quality_controller: a sample in between resets the count") {
+    QualityController q(20, 30);
+    for (int i = 0; i < 10; i++) {
+      EXPECT(20 == q.Update(Behind()));
+      EXPECT(20 == q.Update(Middle()));
+    }
+  },
+
+  CASE("quality_controller: steps back up after being ahead for a while") {
+    QualityController q(20, 30);
+    q.Update(Behind());
+    q.Update(Behind());
+    EXPECT(22 == q.Crf());
+
+    for (int i = 0; i < 9; i++) {
+      EXPECT(22 == q.Update(Ahead()));
+    }
+    EXPECT(20 == q.Update(Ahead()));
+  },
+
+  CASE("quality_controller: an interrupted streak doesn't step up") {
+    QualityController q(20, 30);
+    q.Update(Behind());
+    q.Update(Behind());
+
+    for (int i = 0; i < 5; i++) {
+      for (int j = 0; j < 9; j++) {
+        EXPECT(22 == q.Update(Ahead()));
+      }
+      EXPECT(22 == q.Update(Middle()));
+    }
+  },
+
+  CASE("quality_controller: skipped frames count as falling behind") {
+    QualityController q(20, 30);
+    QualitySample sample = Ahead();
+    sample.skipped = 5;
+    // nothing to compare the first count to
+    EXPECT(20 == q.Update(sample));
+
+    sample.skipped = 8;
+    EXPECT(20 == q.Update(sample));
+    sample.skipped = 9;
+    EXPECT(22 == q.Update(sample));
+
+    // no new skips
+    for (int i = 0; i < 9; i++) {
+      EXPECT(22 == q.Update(sample));
+    }
+    EXPECT(20 == q.Update(sample));
+  },
+
+  CASE("quality_controller: never goes past max_crf") {
+    QualityController q(20, 25);
+    for (int i = 0; i < 20; i++) {
+      q.Update(Behind());
+    }
+    EXPECT(25 == q.Crf());
+
+    // steps from there are still whole, just not past the bound
+    for (int i = 0; i < 10; i++) {
+      q.Update(Ahead());
+    }
+    EXPECT(23 == q.Crf());
+  },
+
+  CASE("quality_controller: never goes below min_crf") {
+    QualityController q(20, 25);
+    q.Update(Behind());
+    q.Update(Behind());
+    q.Update(Behind());
+    q.Update(Behind());
+    EXPECT(24 == q.Crf());
+
+    for (int i = 0; i < 100; i++) {
+      q.Update(Ahead());
+    }
+    EXPECT(20 == q.Crf());
+  },
+
+  CASE("quality_controller: max_crf below min_crf pins it") {
+    QualityController q(28, 20);
+    for (int i = 0; i < 20; i++) {
+      EXPECT(28 == q.Update(Behind()));
+    }
+    for (int i = 0; i < 20; i++) {
+      EXPECT(28 == q.Update(Ahead()));
+    }
+  },
+
+  CASE("quality_controller: missing stats don't lower quality") {
+    QualityController q(20, 30);
+
+    // a receiver that can't tell how full it is, nothing timed yet
+    QualitySample empty = QualitySample{0, 0, 0, 0.0, 16.6};
+    for (int i = 0; i < 20; i++) {
+      EXPECT(20 == q.Update(empty));
+    }
+
+    // a new receiver starts counting skips from zero again
+    QualitySample sample = Middle();
+    sample.skipped = 100;
+    q.Update(sample);
+    sample.skipped = 0;
+    EXPECT(20 == q.Update(sample));
+    EXPECT(20 == q.Update(sample));
+    sample.skipped = 1;
+    EXPECT(20 == q.Update(sample));
+  },
+};
+
+int main (int argc, char *argv[]) {
+  return lest::run(specification, argc, argv);
+}
@@ -0,0 +1,200 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include "replay_buffer.h"
+#include "test_media.h"
+
+#include "lest.hpp"
+
+using namespace capsule::encoder;
+using namespace capsule::test;
+
+namespace {
+
+// filler of varying length
+static int FrameSize (int n) {
+  return 16 + (n * 37) % 500;
+}
+
+static AVPacket *Frame (int n) {
+  return VideoPacket(n, FrameSize(n));
+}
+
+static bool FrameIntact (const AVPacket *pkt, int n) {
+  return VideoPacketIntact(pkt, n, FrameSize(n));
+}
+
+// frame numbers of everything in a saved file, -1 for a damaged frame
+static std::vector<int> ReadBack (const std::string &path) {
+  std::vector<int> frames;
+  AVFormatContext *ic = nullptr;
+  if (avformat_open_input(&ic, path.c_str(), nullptr, nullptr) < 0) {
+    return frames;
+  }
+
+  AVPacket *pkt = av_packet_alloc();
+  while (av_read_frame(ic, pkt) >= 0) {
+    int n = -1;
+    if (pkt->size >= (int) sizeof(n)) {
+      memcpy(&n, pkt->data, sizeof(n));
+      if (!FrameIntact(pkt, n)) {
+        n = -1;
+      }
+    }
+    frames.push_back(n);
+    av_packet_unref(pkt);
+  }
+  av_packet_free(&pkt);
+  avformat_close_input(&ic);
+  return frames;
+}
+
+static std::vector<int> Range (int first, int last) {
+  std::vector<int> out;
+  for (int n = first; n <= last; n++) {
+    out.push_back(n);
+  }
+  return out;
+}
+
+static void AddVideoStream (ReplayBuffer &buffer) {
+  AVCodecParameters *par = avcodec_parameters_alloc();
+  FillVideoParameters(par);
+  buffer.AddStream(0, par, 1, kTimeBase);
+  avcodec_parameters_free(&par);
+}
+
+} // namespace
+
+const lest::test specification[] = {
+  CASE("replay_buffer: keeps from the last keyframe before the window") {
+    ReplayBuffer buffer(2000 * 1000, false);
+    AddVideoStream(buffer);
+
+    for (int n = 0; n <= 54; n++) {
+      buffer.Add(Frame(n));
+    }
+
+    // at 5.4s with a 2s window: keyframes at 3s, 4s and 5s are kept, the
+    // one at 3s because 4s alone wouldn't cover the whole window
+    std::string path = "replay_buffer_test_trim.mp4";
+    EXPECT(buffer.Save(path));
+    buffer.Join();
+    EXPECT(Range(30, 54) == ReadBack(path));
+    remove(path.c_str());
+  },
+
+  CASE("replay_buffer: nothing to save before the first keyframe") {
+    ReplayBuffer buffer(2000 * 1000, false);
+    AddVideoStream(buffer);
+    EXPECT(false == buffer.Save("replay_buffer_test_empty.mp4"));
+
+    // a stream picked up mid-gop
+    AVPacket *pkt = Frame(3);
+    pkt->flags &= ~AV_PKT_FLAG_KEY;
+    buffer.Add(pkt);
+    EXPECT(false == buffer.Save("replay_buffer_test_empty.mp4"));
+  },
+
+  CASE("replay_buffer: spilled packets come back from disk intact") {
+    ReplayBuffer buffer(3000 * 1000, true);
+    AddVideoStream(buffer);
+
+    for (int n = 0; n <= 79; n++) {
+      buffer.Add(Frame(n));
+    }
+
+    std::string path = "replay_buffer_test_spill.mp4";
+    EXPECT(buffer.Save(path));
+    buffer.Join();
+    // ReadBack marks frames with a bad payload as -1
+    EXPECT(Range(40, 79) == ReadBack(path));
+    remove(path.c_str());
+  },
+
+  CASE("replay_buffer: saves taken while packets come in are consistent") {
+    static const int kSaves = 8;
+    static const int kFrames = 600;
+
+    for (int spill = 0; spill < 2; spill++) {
+      ReplayBuffer buffer(1000 * 1000, !!spill);
+      AddVideoStream(buffer);
+
+      std::atomic<int> added(0);
+      std::thread mux([&]() {
+        for (int n = 0; n < kFrames; n++) {
+          buffer.Add(Frame(n));
+          added.store(n + 1);
+          if (n % 20 == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }
+        }
+      });
+
+      std::vector<std::string> paths;
+      while ((int) paths.size() < kSaves) {
+        int before = added.load();
+        if (before < 1 + (int) paths.size() * (kFrames / kSaves)) {
+          std::this_thread::yield();
+          continue;
+        }
+        std::string path = "replay_buffer_test_live_" + std::to_string(spill) +
+          "_" + std::to_string(paths.size()) + ".mp4";
+        EXPECT(buffer.Save(path));
+        paths.push_back(path);
+      }
+      mux.join();
+      buffer.Join();
+
+      for (auto &path: paths) {
+        auto frames = ReadBack(path);
+        EXPECT(!frames.empty());
+        if (frames.empty()) {
+          continue;
+        }
+        // starts on a keyframe, no gaps, nothing damaged
+        EXPECT(frames.front() % kGop == 0);
+        EXPECT(Range(frames.front(), frames.front() + (int) frames.size() - 1) == frames);
+        remove(path.c_str());
+      }
+    }
+  },
+};
+
+int main (int argc, char *argv[]) {
+  av_register_all();
+  av_log_set_level(AV_LOG_ERROR);
+  return lest::run(specification, argc, argv);
+}
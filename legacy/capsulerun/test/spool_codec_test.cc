@@ -0,0 +1,145 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <algorithm>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include "spool_codec.h"
+
+#include "lest.hpp"
+
+using namespace capsule;
+using namespace capsule::encoder;
+
+namespace {
+
+static const int kThreadCounts[] = {1, 2, 3, 4, 5, 6, 8, 12, 16, 24, 32, 48, 64};
+
+// what the oldest FFmpeg we build against takes for level 3
+static bool ValidSlices (int slices) {
+  if (slices > 32) {
+    return false;
+  }
+  for (int v = 1; v * v <= slices; v++) {
+    int h = slices / v;
+    if (h * v == slices && v <= h && h < 2 * v) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// opens FFV1 the way raw mode does, returns false if it won't
+static bool OpenSpool (int thread_count) {
+  AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
+  if (!codec) {
+    return false;
+  }
+
+  AVCodecContext *vc = avcodec_alloc_context3(codec);
+  vc->width = 320;
+  vc->height = 180;
+  vc->pix_fmt = AV_PIX_FMT_YUV420P;
+  vc->time_base = AVRational{1, 1000000};
+  vc->thread_count = thread_count;
+  if (thread_count > 1) {
+    vc->thread_type = FF_THREAD_SLICE;
+  }
+  ConfigureSpool(vc);
+
+  bool ok = avcodec_open2(vc, codec, nullptr) >= 0;
+  avcodec_free_context(&vc);
+  return ok;
+}
+
+// capsulerun's defaults, as far as GpuPixFmt is concerned
+static MainArgs DefaultArgs () {
+  MainArgs args = {};
+  args.gpu_color_conv = true;
+  return args;
+}
+
+} // namespace
+
+const lest::test specification[] = {
+  CASE("spool_codec: slice counts are ones FFV1 takes") {
+    for (int threads = 0; threads <= 64; threads++) {
+      int slices = SpoolSlices(threads);
+      EXPECT(ValidSlices(slices));
+      // rounded down, never past what was asked for
+      EXPECT(slices <= std::max(4, threads));
+    }
+  },
+
+  CASE("spool_codec: slice counts round down to the nearest valid one") {
+    EXPECT(4 == SpoolSlices(1));
+    EXPECT(4 == SpoolSlices(4));
+    EXPECT(4 == SpoolSlices(5));
+    EXPECT(6 == SpoolSlices(8));
+    EXPECT(12 == SpoolSlices(12));
+    EXPECT(16 == SpoolSlices(16));
+    EXPECT(24 == SpoolSlices(24));
+    EXPECT(30 == SpoolSlices(32));
+    EXPECT(30 == SpoolSlices(64));
+  },
+
+  CASE("spool_codec: raw mode asks GPU converters for yuv420p by default") {
+    MainArgs args = DefaultArgs();
+    args.raw = 1;
+    EXPECT(messages::PixFmt_YUV420P == GpuPixFmt(&args));
+
+    args.pix_fmt = "nv12";
+    EXPECT(messages::PixFmt_YUV420P == GpuPixFmt(&args));
+
+    // planar already
+    args.pix_fmt = "yuv444p";
+    EXPECT(messages::PixFmt_YUV444P == GpuPixFmt(&args));
+  },
+
+  CASE("spool_codec: other modes leave the GPU converter's format alone") {
+    MainArgs args = DefaultArgs();
+    EXPECT(messages::PixFmt_UNKNOWN == GpuPixFmt(&args));
+
+    args.pix_fmt = "nv12";
+    EXPECT(messages::PixFmt_NV12 == GpuPixFmt(&args));
+
+    // replay mode wins over raw mode
+    args.raw = 1;
+    args.replay = 1;
+    EXPECT(messages::PixFmt_NV12 == GpuPixFmt(&args));
+  },
+
+  CASE("spool_codec: the encoder opens with any thread count") {
+    for (int threads: kThreadCounts) {
+      EXPECT(OpenSpool(threads));
+    }
+  },
+};
+
+int main (int argc, char *argv[]) {
+  av_register_all();
+  av_log_set_level(AV_LOG_ERROR);
+  return lest::run(specification, argc, argv);
+}
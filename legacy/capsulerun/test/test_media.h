@@ -0,0 +1,80 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+}
+
+namespace capsule {
+namespace test {
+
+// A video stream for muxing tests: milliseconds, a frame every 100, a
+// keyframe every second
+static const int kTimeBase = 1000;
+static const int kFrameMs = 100;
+static const int kGop = 10;
+
+// 64x64 MJPEG: no extradata needed, any payload goes
+static inline void FillVideoParameters (AVCodecParameters *par) {
+  par->codec_type = AVMEDIA_TYPE_VIDEO;
+  par->codec_id = AV_CODEC_ID_MJPEG;
+  par->width = 64;
+  par->height = 64;
+}
+
+// Frame n of the stream, size bytes long: the payload starts with n,
+// then filler that depends on it
+static inline AVPacket *VideoPacket (int n, int size) {
+  AVPacket *pkt = av_packet_alloc();
+  av_new_packet(pkt, size);
+  for (int i = 0; i < size; i++) {
+    pkt->data[i] = (uint8_t) (n + i);
+  }
+  memcpy(pkt->data, &n, sizeof(n));
+  pkt->pts = pkt->dts = (int64_t) n * kFrameMs;
+  pkt->duration = kFrameMs;
+  if (n % kGop == 0) {
+    pkt->flags |= AV_PKT_FLAG_KEY;
+  }
+  pkt->stream_index = 0;
+  return pkt;
+}
+
+// Whether pkt's payload is what VideoPacket(n, size) made
+static inline bool VideoPacketIntact (const AVPacket *pkt, int n, int size) {
+  if (pkt->size != size) {
+    return false;
+  }
+  for (int i = (int) sizeof(n); i < size; i++) {
+    if (pkt->data[i] != (uint8_t) (n + i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace test
+} // namespace capsule
@@ -0,0 +1,175 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h> // memset, memcpy
+
+#include <atomic>
+
+#include "ring_signal.h"
+
+namespace capsule {
+namespace audio_ring {
+
+// Single-producer, single-consumer ring of audio frames, living at the
+// front of the audio shm area. libcapsule writes from the game's audio
+// thread, capsulerun reads straight from shm. Neither side blocks: when
+// the ring is full, new frames are dropped and counted in overruns. The
+// producer only makes a syscall to wake up a sleeping consumer, see
+// ring_signal.
+//
+// Cursors run from 0 to 2 * capacity, so that a full ring can be told
+// apart from an empty one without a separate counter.
+
+static const uint32_t kMagic = 0x52415043; // "CPAR"
+
+// frames start at that offset in the shm area
+static const int64_t kHeaderSize = 4096;
+
+struct Header {
+  uint32_t magic;
+  // in bytes
+  uint32_t frame_size;
+  // in frames
+  uint32_t capacity;
+  uint32_t reserved;
+  // see ring_signal
+  char signal_name[ring_signal::kNameSize];
+
+  // written by the producer only
+  alignas(64) std::atomic<uint32_t> write_pos;
+  // frames dropped because the consumer was behind
+  std::atomic<uint32_t> overruns;
+
+  // written by the consumer only
+  alignas(64) std::atomic<uint32_t> read_pos;
+  // non-zero while the consumer is (about to be) waiting on write_pos
+  std::atomic<uint32_t> sleeping;
+};
+
+static_assert(sizeof(Header) <= kHeaderSize, "audio ring header too large");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "audio ring needs lock-free atomics");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "audio ring needs plain atomics");
+
+static inline void Init (Header *h, uint32_t frame_size, uint32_t capacity) {
+  memset(static_cast<void*>(h), 0, sizeof(*h));
+  h->magic = kMagic;
+  h->frame_size = frame_size;
+  h->capacity = capacity;
+  ring_signal::MakeName(h->signal_name, "audio");
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+static inline bool Valid (const Header *h) {
+  return h->magic == kMagic && h->frame_size > 0 &&
+    h->capacity > 0 && h->capacity <= (UINT32_MAX / 2);
+}
+
+static inline uint32_t Used (const Header *h, uint32_t write_pos, uint32_t read_pos) {
+  uint32_t span = h->capacity * 2;
+  return (write_pos + span - read_pos) % span;
+}
+
+static inline char *Data (Header *h) {
+  return reinterpret_cast<char*>(h) + kHeaderSize;
+}
+
+/////////////////////////////////
+// producer
+/////////////////////////////////
+
+// Copy as many frames as fit, returns how many were written. signal must
+// have been opened with the header's signal_name.
+static inline uint32_t Write (Header *h, const char *src, uint32_t frames, ring_signal::Signal *signal) {
+  uint32_t write_pos = h->write_pos.load(std::memory_order_relaxed);
+  uint32_t read_pos = h->read_pos.load(std::memory_order_acquire);
+
+  uint32_t avail = h->capacity - Used(h, write_pos, read_pos);
+  uint32_t n = frames < avail ? frames : avail;
+
+  uint32_t index = write_pos % h->capacity;
+  uint32_t first = h->capacity - index;
+  if (first > n) {
+    first = n;
+  }
+
+  char *data = Data(h);
+  memcpy(data + (int64_t) index * h->frame_size, src, (int64_t) first * h->frame_size);
+  memcpy(data, src + (int64_t) first * h->frame_size, (int64_t) (n - first) * h->frame_size);
+
+  h->write_pos.store((write_pos + n) % (h->capacity * 2), std::memory_order_release);
+
+  if (n < frames) {
+    h->overruns.fetch_add(frames - n, std::memory_order_relaxed);
+  }
+
+  // pairs with the fence in Wait: either we see sleeping, or it sees write_pos
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (n > 0 && h->sleeping.load(std::memory_order_relaxed)) {
+    ring_signal::Notify(signal, &h->write_pos);
+  }
+  return n;
+}
+
+/////////////////////////////////
+// consumer
+/////////////////////////////////
+
+// Return how many frames can be read contiguously, starting at
+// frame *index of the data area
+static inline uint32_t Peek (Header *h, uint32_t *index) {
+  uint32_t read_pos = h->read_pos.load(std::memory_order_relaxed);
+  uint32_t write_pos = h->write_pos.load(std::memory_order_acquire);
+
+  uint32_t used = Used(h, write_pos, read_pos);
+  *index = read_pos % h->capacity;
+  uint32_t contiguous = h->capacity - *index;
+  return used < contiguous ? used : contiguous;
+}
+
+// Give frames returned by Peek back to the producer
+static inline void Consume (Header *h, uint32_t frames) {
+  uint32_t read_pos = h->read_pos.load(std::memory_order_relaxed);
+  h->read_pos.store((read_pos + frames) % (h->capacity * 2), std::memory_order_release);
+}
+
+// Wait for the producer to write something, for at most timeout_ms
+static inline void Wait (Header *h, int timeout_ms, ring_signal::Signal *signal) {
+  uint32_t read_pos = h->read_pos.load(std::memory_order_relaxed);
+
+  h->sleeping.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint32_t write_pos = h->write_pos.load(std::memory_order_relaxed);
+  if (write_pos == read_pos) {
+    ring_signal::Wait(signal, &h->write_pos, write_pos, timeout_ms);
+  }
+  h->sleeping.store(0, std::memory_order_relaxed);
+}
+
+// Wake up a consumer thread sleeping in Wait, from the consumer's side
+static inline void Wake (Header *h, ring_signal::Signal *signal) {
+  ring_signal::Notify(signal, &h->write_pos);
+}
+
+} // namespace audio_ring
+} // namespace capsule
@@ -41,8 +41,10 @@ enum PixFmt {
   PixFmt_BGRA = 2,
   PixFmt_RGB10_A2 = 3,
   PixFmt_YUV444P = 4,
+  PixFmt_NV12 = 5,
+  PixFmt_YUV420P = 6,
   PixFmt_MIN = PixFmt_UNKNOWN,
-  PixFmt_MAX = PixFmt_YUV444P
+  PixFmt_MAX = PixFmt_YUV420P
 };
 
 inline const char **EnumNamesPixFmt() {
@@ -52,6 +54,8 @@ inline const char **EnumNamesPixFmt() {
     "BGRA",
     "RGB10_A2",
     "YUV444P",
+    "NV12",
+    "YUV420P",
     nullptr
   };
   return names;
@@ -445,7 +449,9 @@ struct CaptureStart FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_FPS = 4,
     VT_SIZE_DIVIDER = 6,
-    VT_GPU_COLOR_CONV = 8
+    VT_GPU_COLOR_CONV = 8,
+    VT_PIX_FMT = 10,
+    VT_SHM_BUDGET = 12
   };
   uint32_t fps() const {
     return GetField<uint32_t>(VT_FPS, 0);
@@ -456,11 +462,19 @@ struct CaptureStart FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   bool gpu_color_conv() const {
     return GetField<uint8_t>(VT_GPU_COLOR_CONV, 0) != 0;
   }
+  PixFmt pix_fmt() const {
+    return static_cast<PixFmt>(GetField<int32_t>(VT_PIX_FMT, 0));
+  }
+  uint64_t shm_budget() const {
+    return GetField<uint64_t>(VT_SHM_BUDGET, 0);
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint32_t>(verifier, VT_FPS) &&
            VerifyField<uint32_t>(verifier, VT_SIZE_DIVIDER) &&
            VerifyField<uint8_t>(verifier, VT_GPU_COLOR_CONV) &&
+           VerifyField<int32_t>(verifier, VT_PIX_FMT) &&
+           VerifyField<uint64_t>(verifier, VT_SHM_BUDGET) &&
            verifier.EndTable();
   }
 };
@@ -477,13 +491,19 @@ struct CaptureStartBuilder {
   void add_gpu_color_conv(bool gpu_color_conv) {
     fbb_.AddElement<uint8_t>(CaptureStart::VT_GPU_COLOR_CONV, static_cast<uint8_t>(gpu_color_conv), 0);
   }
+  void add_pix_fmt(PixFmt pix_fmt) {
+    fbb_.AddElement<int32_t>(CaptureStart::VT_PIX_FMT, static_cast<int32_t>(pix_fmt), 0);
+  }
+  void add_shm_budget(uint64_t shm_budget) {
+    fbb_.AddElement<uint64_t>(CaptureStart::VT_SHM_BUDGET, shm_budget, 0);
+  }
   CaptureStartBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   CaptureStartBuilder &operator=(const CaptureStartBuilder &);
   flatbuffers::Offset<CaptureStart> Finish() {
-    const auto end = fbb_.EndTable(start_, 3);
+    const auto end = fbb_.EndTable(start_, 5);
     auto o = flatbuffers::Offset<CaptureStart>(end);
     return o;
   }
@@ -493,8 +513,12 @@ inline flatbuffers::Offset<CaptureStart> CreateCaptureStart(
     flatbuffers::FlatBufferBuilder &_fbb,
     uint32_t fps = 0,
     uint32_t size_divider = 0,
-    bool gpu_color_conv = false) {
+    bool gpu_color_conv = false,
+    PixFmt pix_fmt = PixFmt_UNKNOWN,
+    uint64_t shm_budget = 0) {
   CaptureStartBuilder builder_(_fbb);
+  builder_.add_shm_budget(shm_budget);
+  builder_.add_pix_fmt(pix_fmt);
   builder_.add_size_divider(size_divider);
   builder_.add_fps(fps);
   builder_.add_gpu_color_conv(gpu_color_conv);
@@ -538,7 +562,8 @@ struct VideoSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
     VT_OFFSET = 12,
     VT_LINESIZE = 14,
     VT_SHMEM = 16,
-    VT_AUDIO = 18
+    VT_AUDIO = 18,
+    VT_NUM_BUFFERS = 20
   };
   uint32_t width() const {
     return GetField<uint32_t>(VT_WIDTH, 0);
@@ -564,6 +589,9 @@ struct VideoSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const AudioSetup *audio() const {
     return GetPointer<const AudioSetup *>(VT_AUDIO);
   }
+  uint32_t num_buffers() const {
+    return GetField<uint32_t>(VT_NUM_BUFFERS, 0);
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint32_t>(verifier, VT_WIDTH) &&
@@ -578,6 +606,7 @@ struct VideoSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
            verifier.VerifyTable(shmem()) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_AUDIO) &&
            verifier.VerifyTable(audio()) &&
+           VerifyField<uint32_t>(verifier, VT_NUM_BUFFERS) &&
            verifier.EndTable();
   }
 };
@@ -609,13 +638,16 @@ struct VideoSetupBuilder {
   void add_audio(flatbuffers::Offset<AudioSetup> audio) {
     fbb_.AddOffset(VideoSetup::VT_AUDIO, audio);
   }
+  void add_num_buffers(uint32_t num_buffers) {
+    fbb_.AddElement<uint32_t>(VideoSetup::VT_NUM_BUFFERS, num_buffers, 0);
+  }
   VideoSetupBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   VideoSetupBuilder &operator=(const VideoSetupBuilder &);
   flatbuffers::Offset<VideoSetup> Finish() {
-    const auto end = fbb_.EndTable(start_, 8);
+    const auto end = fbb_.EndTable(start_, 9);
     auto o = flatbuffers::Offset<VideoSetup>(end);
     return o;
   }
@@ -630,8 +662,10 @@ inline flatbuffers::Offset<VideoSetup> CreateVideoSetup(
     flatbuffers::Offset<flatbuffers::Vector<int64_t>> offset = 0,
     flatbuffers::Offset<flatbuffers::Vector<int64_t>> linesize = 0,
     flatbuffers::Offset<Shmem> shmem = 0,
-    flatbuffers::Offset<AudioSetup> audio = 0) {
+    flatbuffers::Offset<AudioSetup> audio = 0,
+    uint32_t num_buffers = 0) {
   VideoSetupBuilder builder_(_fbb);
+  builder_.add_num_buffers(num_buffers);
   builder_.add_audio(audio);
   builder_.add_shmem(shmem);
   builder_.add_linesize(linesize);
@@ -652,7 +686,8 @@ inline flatbuffers::Offset<VideoSetup> CreateVideoSetupDirect(
     const std::vector<int64_t> *offset = nullptr,
     const std::vector<int64_t> *linesize = nullptr,
     flatbuffers::Offset<Shmem> shmem = 0,
-    flatbuffers::Offset<AudioSetup> audio = 0) {
+    flatbuffers::Offset<AudioSetup> audio = 0,
+    uint32_t num_buffers = 0) {
   return capsule::messages::CreateVideoSetup(
       _fbb,
       width,
@@ -662,7 +697,8 @@ inline flatbuffers::Offset<VideoSetup> CreateVideoSetupDirect(
       offset ? _fbb.CreateVector<int64_t>(*offset) : 0,
       linesize ? _fbb.CreateVector<int64_t>(*linesize) : 0,
       shmem,
-      audio);
+      audio,
+      num_buffers);
 }
 
 struct AudioSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
@@ -739,7 +775,8 @@ inline flatbuffers::Offset<AudioSetup> CreateAudioSetup(
 struct Shmem FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_PATH = 4,
-    VT_SIZE = 6
+    VT_SIZE = 6,
+    VT_FD_INDEX = 8
   };
   const flatbuffers::String *path() const {
     return GetPointer<const flatbuffers::String *>(VT_PATH);
@@ -747,11 +784,15 @@ struct Shmem FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   uint64_t size() const {
     return GetField<uint64_t>(VT_SIZE, 0);
   }
+  int32_t fd_index() const {
+    return GetField<int32_t>(VT_FD_INDEX, -1);
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_PATH) &&
            verifier.Verify(path()) &&
            VerifyField<uint64_t>(verifier, VT_SIZE) &&
+           VerifyField<int32_t>(verifier, VT_FD_INDEX) &&
            verifier.EndTable();
   }
 };
@@ -765,13 +806,16 @@ struct ShmemBuilder {
   void add_size(uint64_t size) {
     fbb_.AddElement<uint64_t>(Shmem::VT_SIZE, size, 0);
   }
+  void add_fd_index(int32_t fd_index) {
+    fbb_.AddElement<int32_t>(Shmem::VT_FD_INDEX, fd_index, -1);
+  }
   ShmemBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   ShmemBuilder &operator=(const ShmemBuilder &);
   flatbuffers::Offset<Shmem> Finish() {
-    const auto end = fbb_.EndTable(start_, 2);
+    const auto end = fbb_.EndTable(start_, 3);
     auto o = flatbuffers::Offset<Shmem>(end);
     return o;
   }
@@ -780,9 +824,11 @@ struct ShmemBuilder {
 inline flatbuffers::Offset<Shmem> CreateShmem(
     flatbuffers::FlatBufferBuilder &_fbb,
     flatbuffers::Offset<flatbuffers::String> path = 0,
-    uint64_t size = 0) {
+    uint64_t size = 0,
+    int32_t fd_index = -1) {
   ShmemBuilder builder_(_fbb);
   builder_.add_size(size);
+  builder_.add_fd_index(fd_index);
   builder_.add_path(path);
   return builder_.Finish();
 }
@@ -790,11 +836,13 @@ inline flatbuffers::Offset<Shmem> CreateShmem(
 inline flatbuffers::Offset<Shmem> CreateShmemDirect(
     flatbuffers::FlatBufferBuilder &_fbb,
     const char *path = nullptr,
-    uint64_t size = 0) {
+    uint64_t size = 0,
+    int32_t fd_index = -1) {
   return capsule::messages::CreateShmem(
       _fbb,
       path ? _fbb.CreateString(path) : 0,
-      size);
+      size,
+      fd_index);
 }
 
 struct AudioFramesCommitted FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
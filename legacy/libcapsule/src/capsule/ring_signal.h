@@ -0,0 +1,142 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h> // snprintf
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <lab/platform.h>
+
+#if defined(LAB_LINUX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#elif defined(LAB_WINDOWS)
+#include <windows.h>
+#endif // LAB_WINDOWS
+
+namespace capsule {
+namespace ring_signal {
+
+// Cross-process wakeup for the shm rings, so the consumer can sleep until
+// the producer moves one of the ring's cursors.
+//
+// On Linux, that's a shared futex on the cursor itself. On Windows, each
+// ring gets an auto-reset named event: its name is stored in the ring
+// header so both processes agree on it, and each side opens its own
+// handle. macOS has neither, so the consumer polls.
+
+static const int kNameSize = 64;
+
+struct Signal {
+#if defined(LAB_WINDOWS)
+  HANDLE event = nullptr;
+#endif // LAB_WINDOWS
+};
+
+// Pick a name for a new ring's event, called by the producer when
+// initializing the ring header
+static inline void MakeName (char *name, const char *kind) {
+#if defined(LAB_WINDOWS)
+  static std::atomic<uint32_t> counter(0);
+  snprintf(name, kNameSize, "Local\\capsule_%s_%lu_%u", kind,
+    (unsigned long) GetCurrentProcessId(), (unsigned) ++counter);
+#else
+  snprintf(name, kNameSize, "%s", kind);
+#endif // !LAB_WINDOWS
+}
+
+// Get a handle on the event named in a ring header, creating it if
+// the other side hasn't yet
+static inline void Open (Signal *s, const char *name) {
+#if defined(LAB_WINDOWS)
+  char safe_name[kNameSize];
+  snprintf(safe_name, kNameSize, "%s", name);
+  s->event = CreateEventA(nullptr, FALSE /* auto-reset */, FALSE, safe_name);
+#else
+  (void) s;
+  (void) name;
+#endif // !LAB_WINDOWS
+}
+
+static inline void Close (Signal *s) {
+#if defined(LAB_WINDOWS)
+  if (s->event) {
+    CloseHandle(s->event);
+    s->event = nullptr;
+  }
+#else
+  (void) s;
+#endif // !LAB_WINDOWS
+}
+
+// Wake up whoever is sleeping in Wait on word
+static inline void Notify (Signal *s, std::atomic<uint32_t> *word) {
+#if defined(LAB_LINUX)
+  (void) s;
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+#elif defined(LAB_WINDOWS)
+  (void) word;
+  if (s->event) {
+    SetEvent(s->event);
+  }
+#else
+  (void) s;
+  (void) word;
+#endif // LAB_LINUX
+}
+
+// Sleep until Notify is called, as long as word is still equal to
+// expected, for at most timeout_ms. May return early.
+static inline void Wait (Signal *s, std::atomic<uint32_t> *word, uint32_t expected, int timeout_ms) {
+#if defined(LAB_LINUX)
+  (void) s;
+  // shared (not private) futex, the producer lives in another process
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+#elif defined(LAB_WINDOWS)
+  // a Notify that came in since the caller last looked at word left
+  // the event set, so this returns right away
+  (void) word;
+  (void) expected;
+  if (s->event) {
+    WaitForSingleObject(s->event, (DWORD) timeout_ms);
+  } else {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+#else
+  (void) s;
+  (void) word;
+  (void) expected;
+  std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms < 1 ? timeout_ms : 1));
+#endif // LAB_LINUX
+}
+
+} // namespace ring_signal
+} // namespace capsule
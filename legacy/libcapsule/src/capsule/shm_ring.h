@@ -0,0 +1,207 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h> // memset
+
+#include <atomic>
+
+#include "ring_signal.h"
+
+namespace capsule {
+namespace shm_ring {
+
+// Single-producer, single-consumer ring of frame descriptors, living at
+// the front of the video shm area. libcapsule fills a slot and pushes its
+// descriptor, capsulerun pops it once it's done with the slot. Neither
+// side takes a lock or makes a syscall, except to wake up a sleeping
+// consumer, see ring_signal.
+
+static const uint32_t kMagic = 0x52535043; // "CPSR"
+
+// upper bound for num_slots, so the header has a fixed size
+static const uint32_t kMaxSlots = 16;
+
+// frame slots start at that offset in the shm area
+static const int64_t kHeaderSize = 4096;
+
+// What to do with frames once the consumer falls behind
+enum DropPolicy {
+  // frames already in the ring win: new ones aren't captured until
+  // there's room for them
+  kDropPolicyOldestWins = 0,
+  // new frames win: the consumer skips the ones it hasn't started on
+  kDropPolicyNewestWins = 1,
+  // the consumer raises min_interval_us, so frames are skipped evenly
+  kDropPolicyEven = 2,
+};
+
+struct Descriptor {
+  int64_t timestamp;
+  uint32_t index;
+  // format generation the frame was written with, see Header
+  uint32_t generation;
+};
+
+struct Header {
+  uint32_t magic;
+  uint32_t num_slots;
+  // bumped every time libcapsule sends a new VideoSetup
+  uint32_t generation;
+  uint32_t reserved;
+  // see ring_signal
+  char signal_name[ring_signal::kNameSize];
+
+  // written by the producer only
+  alignas(64) std::atomic<uint32_t> head;
+  std::atomic<uint32_t> overruns;
+
+  // written by the consumer only
+  alignas(64) std::atomic<uint32_t> tail;
+  // non-zero while the consumer is (about to be) waiting on head
+  std::atomic<uint32_t> sleeping;
+
+  // capture control, written by the consumer, read by the producer
+  // before it captures a frame at all. zero means no constraint.
+  alignas(64) std::atomic<uint32_t> min_interval_us;
+  // a DropPolicy
+  std::atomic<uint32_t> drop_policy;
+
+  alignas(64) Descriptor descriptors[kMaxSlots];
+};
+
+static_assert(sizeof(Header) <= kHeaderSize, "shm ring header too large");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shm ring needs lock-free atomics");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "shm ring needs plain atomics");
+
+static inline void Init (Header *h, uint32_t num_slots, uint32_t generation) {
+  memset(static_cast<void*>(h), 0, sizeof(*h));
+  h->magic = kMagic;
+  h->num_slots = num_slots;
+  h->generation = generation;
+  ring_signal::MakeName(h->signal_name, "video");
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+static inline bool Valid (const Header *h) {
+  return h->magic == kMagic && h->num_slots > 0 && h->num_slots <= kMaxSlots;
+}
+
+/////////////////////////////////
+// producer
+/////////////////////////////////
+
+// Return the slot to fill next, or -1 if the consumer still holds all of them
+static inline int NextSlot (Header *h) {
+  uint32_t head = h->head.load(std::memory_order_relaxed);
+  uint32_t tail = h->tail.load(std::memory_order_acquire);
+  if (head - tail >= h->num_slots) {
+    return -1;
+  }
+  return (int) (head % h->num_slots);
+}
+
+// Whether a frame captured right now should be, as far as the consumer
+// is concerned
+static inline bool WantFrame (Header *h) {
+  if (h->drop_policy.load(std::memory_order_relaxed) != kDropPolicyOldestWins) {
+    return true;
+  }
+  return NextSlot(h) >= 0;
+}
+
+// Hand the slot returned by NextSlot over to the consumer. signal must
+// have been opened with the header's signal_name.
+static inline void Push (Header *h, int64_t timestamp, ring_signal::Signal *signal) {
+  uint32_t head = h->head.load(std::memory_order_relaxed);
+  auto &desc = h->descriptors[head % h->num_slots];
+  desc.timestamp = timestamp;
+  desc.index = head % h->num_slots;
+  desc.generation = h->generation;
+  h->head.store(head + 1, std::memory_order_release);
+
+  // pairs with the fence in Wait: either we see sleeping, or it sees head
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (h->sleeping.load(std::memory_order_relaxed)) {
+    ring_signal::Notify(signal, &h->head);
+  }
+}
+
+/////////////////////////////////
+// consumer
+/////////////////////////////////
+
+// Read the oldest descriptor without releasing its slot, returns false
+// if there's none
+static inline bool Peek (Header *h, Descriptor *out) {
+  uint32_t tail = h->tail.load(std::memory_order_relaxed);
+  uint32_t head = h->head.load(std::memory_order_acquire);
+  if (head == tail) {
+    return false;
+  }
+  *out = h->descriptors[tail % h->num_slots];
+  return true;
+}
+
+// Like Peek, but for the descriptor at position pos (counting pushes from
+// the start), for consumers that hold on to several slots at once. pos
+// must be between tail and head. Slots are still given back in order, by Pop.
+static inline bool PeekAt (Header *h, uint32_t pos, Descriptor *out) {
+  uint32_t head = h->head.load(std::memory_order_acquire);
+  if (head == pos) {
+    return false;
+  }
+  *out = h->descriptors[pos % h->num_slots];
+  return true;
+}
+
+// Give the slot of the oldest descriptor back to the producer
+static inline void Pop (Header *h) {
+  uint32_t tail = h->tail.load(std::memory_order_relaxed);
+  h->tail.store(tail + 1, std::memory_order_release);
+}
+
+// Wait for the producer to push past position pos, for at most timeout_ms
+static inline void WaitAt (Header *h, uint32_t pos, int timeout_ms, ring_signal::Signal *signal) {
+  h->sleeping.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint32_t head = h->head.load(std::memory_order_relaxed);
+  if (head == pos) {
+    ring_signal::Wait(signal, &h->head, head, timeout_ms);
+  }
+  h->sleeping.store(0, std::memory_order_relaxed);
+}
+
+// Wait for the producer to push something, for at most timeout_ms
+static inline void Wait (Header *h, int timeout_ms, ring_signal::Signal *signal) {
+  WaitAt(h, h->tail.load(std::memory_order_relaxed), timeout_ms, signal);
+}
+
+// Wake up a consumer thread sleeping in Wait, from the consumer's side
+// (when it's being stopped, for example)
+static inline void Wake (Header *h, ring_signal::Signal *signal) {
+  ring_signal::Notify(signal, &h->head);
+}
+
+} // namespace shm_ring
+} // namespace capsule
@@ -0,0 +1,77 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include "messages_generated.h"
+
+namespace capsule {
+namespace video {
+
+// Maximum number of planes in any of the formats we support
+static const int kMaxPlanes = 3;
+
+// Return the number of planes for a given format, or 0 on error
+static inline int NumPlanes (messages::PixFmt format) {
+  switch (format) {
+    case messages::PixFmt_RGBA:
+    case messages::PixFmt_BGRA:
+    case messages::PixFmt_RGB10_A2:
+      return 1;
+    case messages::PixFmt_NV12:
+      return 2;
+    case messages::PixFmt_YUV444P:
+    case messages::PixFmt_YUV420P:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+// Return the number of rows in a given plane, for a frame of the given height
+static inline int64_t PlaneHeight (messages::PixFmt format, int plane, int64_t height) {
+  switch (format) {
+    case messages::PixFmt_NV12:
+    case messages::PixFmt_YUV420P:
+      return plane == 0 ? height : (height + 1) / 2;
+    default:
+      return height;
+  }
+}
+
+// Return the number of bytes spanned by a single frame, given the offset
+// and linesize of each of its planes. Planes may be laid out side by side
+// (sharing rows) or one after the other.
+static inline int64_t FrameSize (messages::PixFmt format, int64_t height,
+                                 const int64_t *offset, const int64_t *linesize) {
+  int64_t size = 0;
+  int num_planes = NumPlanes(format);
+  for (int i = 0; i < num_planes; i++) {
+    int64_t plane_end = offset[i] + linesize[i] * PlaneHeight(format, i, height);
+    if (plane_end > size) {
+      size = plane_end;
+    }
+  }
+  return size;
+}
+
+} // namespace video
+} // namespace capsule
@@ -90,6 +90,11 @@ static inline bool FrameReady () {
   }
 
   auto interval = frame_interval;
+  // capsulerun may ask for frames further apart, when it can't keep up
+  auto min_interval = std::chrono::microseconds(io::VideoMinInterval());
+  if (min_interval > interval) {
+    interval = min_interval;
+  }
 
   if (first_frame) {
     first_frame = false;
@@ -112,7 +117,10 @@ static inline bool FrameReady () {
   } else {
     last_ts = last_ts + interval;
   }
-  return true;
+
+  // that frame's turn has passed either way, but if it would only be
+  // skipped once read back, don't bother reading it back.
+  return io::WantVideoFrame();
 }
 
 int64_t FrameTimestamp () {
@@ -121,6 +129,32 @@ int64_t FrameTimestamp () {
   return (int64_t) micro_timestamp.count();
 }
 
+// How many frames of frame_size fit in the shm budget capsulerun asked
+// for. Used for both the shm ring and the GPU readback ring, so that
+// every readback has a slot to land in.
+int BufferCount (int64_t frame_size) {
+  int64_t budget;
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    budget = state.settings.shm_budget;
+  }
+
+  if (budget <= 0 || frame_size <= 0) {
+    return kNumBuffers;
+  }
+
+  int64_t count = budget / frame_size;
+  if (count < kMinBuffers) {
+    Log("BufferCount: budget of %" PRId64 " bytes too small for %" PRId64 " byte frames, using %d buffers",
+      budget, frame_size, kMinBuffers);
+    return kMinBuffers;
+  }
+  if (count > kMaxBuffers) {
+    return kMaxBuffers;
+  }
+  return (int) count;
+}
+
 bool Ready () {
   return FrameReady();
 }
@@ -27,13 +27,19 @@
 namespace capsule {
 namespace capture {
 
-// numbers of buffers used for async GPU download
+// numbers of buffers used for async GPU download, when not negotiated
 static const int kNumBuffers = 3;
 
+// bounds for negotiated ring depths, see BufferCount
+static const int kMinBuffers = 2;
+static const int kMaxBuffers = 16;
+
 struct Settings {
   int fps;
   int size_divider;
   bool gpu_color_conv;
+  messages::PixFmt pix_fmt; // for gpu_color_conv, UNKNOWN = backend's choice
+  int64_t shm_budget; // in bytes, 0 = kNumBuffers frames
 };
 
 struct State {
@@ -63,6 +69,7 @@ void Start(Settings *settings);
 void Stop();
 
 int64_t FrameTimestamp();
+int BufferCount(int64_t frame_size);
 
 void SawBackend(Backend backend);
 void HasAudioIntercept(messages::SampleFmt format, int rate, int channels);
@@ -28,6 +28,14 @@
 #include "logging.h"
 
 #if defined(LAB_LINUX)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <string.h> // memset, strncpy
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
 #elif defined(LAB_MACOS)
 #else // !(LAB_LINUX || LAB_MACOS)
 #define WIN32_LEAN_AND_MEAN
@@ -37,12 +45,22 @@
 
 namespace capsule {
 
+#if defined(LAB_LINUX)
+// how long Connect keeps trying while capsulerun sets up its socket
+static const int kConnectAttempts = 500;
+static const auto kConnectInterval = std::chrono::milliseconds(10);
+#endif // LAB_LINUX
+
 Connection::Connection(std::string pipe_name) {
   pipe_name_ = pipe_name;
+#if defined(LAB_LINUX)
+  sock_path_ = lab::paths::PipePath(pipe_name + ".sock");
+#else // LAB_LINUX
   // sic - swapped on purpose!
   // we read from what capsulerun-writes and vice versa.
   r_path_ = lab::paths::PipePath(pipe_name + ".runwrite");
   w_path_ = lab::paths::PipePath(pipe_name + ".runread");
+#endif // !LAB_LINUX
 }
 
 enum OpenMode {
@@ -82,7 +100,39 @@ void Connection::Connect() {
     return;
   }
   Log("Read end opened!");
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (sock_path_.size() >= sizeof(addr.sun_path)) {
+    Log("Socket path too long: %s", sock_path_.c_str());
+    return;
+  }
+  strncpy(addr.sun_path, sock_path_.c_str(), sizeof(addr.sun_path) - 1);
+
+  sock_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock_ < 0) {
+    Log("Could not create socket (errno %d), bailing out...", errno);
+    return;
+  }
+
+  // opening a fifo blocks until the other end shows up,
+  // do the same with the socket
+  int ret = -1;
+  for (int i = 0; i < kConnectAttempts; i++) {
+    ret = connect(sock_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    if (ret == 0 || (errno != ENOENT && errno != ECONNREFUSED)) {
+      break;
+    }
+    std::this_thread::sleep_for(kConnectInterval);
+  }
+  if (ret != 0) {
+    Log("Could not connect to %s (errno %d), bailing out...", sock_path_.c_str(), errno);
+    close(sock_);
+    sock_ = -1;
+    return;
+  }
+#else // LAB_MACOS
   fifo_w_ = lab::io::Fopen(w_path_, "wb");
   if (!fifo_w_) {
     Log("Could not connect write end, bailing out...");
@@ -102,10 +152,17 @@ void Connection::Close() {
 #if defined(LAB_WINDOWS)
   CloseHandle(pipe_w_);
   CloseHandle(pipe_r_);
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+  if (sock_ >= 0) {
+    // wakes up our own reader, if any
+    shutdown(sock_, SHUT_RDWR);
+    close(sock_);
+    sock_ = -1;
+  }
+#else // LAB_MACOS
   fclose(fifo_w_);
   fclose(fifo_r_);
-#endif // !LAB_WINDOWS
+#endif
   connected_ = false;
 }
 
@@ -150,10 +207,24 @@ void Connection::Write(const flatbuffers::FlatBufferBuilder &builder) {
               (LPOVERLAPPED)message, /* lpOverlapped */
               WriteComplete          /* lpCompletionRoutine */
               );
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+  lab::packet::Send(builder, sock_);
+#else // LAB_MACOS
   lab::packet::Fwrite(builder, fifo_w_);
-#endif // !LAB_WINDOWS
+#endif
+}
+
+#if defined(LAB_LINUX)
+void Connection::Write(const flatbuffers::FlatBufferBuilder &builder, const std::vector<int> &fds) {
+  if (!connected_) {
+    return;
+  }
+
+  if (!lab::packet::Send(builder, sock_, fds.data(), (int) fds.size())) {
+    Log("Could not send packet with %d fds (errno %d)", (int) fds.size(), errno);
+  }
 }
+#endif // LAB_LINUX
 
 #if defined(LAB_WINDOWS)
 static void WINAPI ReadComplete(DWORD dwErrorCode,
@@ -198,9 +269,12 @@ char *Connection::Read() {
   Log("Just read message of %d bytes, addr = %P", msg_size, buf);
 
   return buf;
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+  // we never expect fds from capsulerun
+  return lab::packet::Recv(sock_, nullptr);
+#else // LAB_MACOS
   return lab::packet::Fread(fifo_r_);
-#endif // !LAB_WINDOWS
+#endif
 }
 
 } // namespace capsule
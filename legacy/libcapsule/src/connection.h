@@ -24,6 +24,8 @@
 #include <lab/platform.h>
 #include <lab/packet.h>
 
+#include <vector>
+
 namespace capsule {
 
 class Connection {
@@ -33,6 +35,10 @@ class Connection {
     void Close();
 
     void Write(const flatbuffers::FlatBufferBuilder &builder);
+#if defined(LAB_LINUX)
+    // passes fds along with the packet, see lab::packet::Send
+    void Write(const flatbuffers::FlatBufferBuilder &builder, const std::vector<int> &fds);
+#endif // LAB_LINUX
     char *Read();
 
     bool IsConnected() { return connected_; };
@@ -40,15 +46,21 @@ class Connection {
   
   private:
     std::string pipe_name_;
+#if defined(LAB_WINDOWS)
     std::string r_path_;
     std::string w_path_;
-#if defined(LAB_WINDOWS)
     HANDLE pipe_r_ = INVALID_HANDLE_VALUE;
     HANDLE pipe_w_ = INVALID_HANDLE_VALUE;
-#else // LAB_WINDOWS
+#elif defined(LAB_LINUX)
+    // a single SOCK_SEQPACKET unix socket, capsulerun listens
+    std::string sock_path_;
+    int sock_ = -1;
+#else // LAB_MACOS
+    std::string r_path_;
+    std::string w_path_;
     FILE *fifo_r_ = nullptr;
     FILE *fifo_w_ = nullptr;
-#endif // !LAB_WINDOWS
+#endif
 
     bool connected_ = false;
 };
@@ -0,0 +1,109 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "frame_copier.h"
+
+#include "io.h"
+#include "logging.h"
+
+namespace capsule {
+
+FrameCopier::FrameCopier(int num_slots, FrameSource *source) :
+  source_(source),
+  busy_(num_slots, false) {
+  thread_ = std::thread(&FrameCopier::Run, this);
+}
+
+FrameCopier::~FrameCopier() {
+  std::deque<Job> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    dropped.swap(jobs_);
+  }
+  cond_.notify_one();
+  thread_.join();
+
+  for (auto &job : dropped) {
+    source_->Drop(job.slot, job.ticket);
+  }
+}
+
+void FrameCopier::Submit(int slot, size_t size, int64_t timestamp, void *ticket) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    busy_[slot] = true;
+    jobs_.push_back(Job{slot, size, timestamp, ticket});
+  }
+  cond_.notify_one();
+}
+
+bool FrameCopier::Busy(int slot) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return busy_[slot];
+}
+
+bool FrameCopier::Failed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return failed_;
+}
+
+void FrameCopier::Run() {
+  Log("FrameCopier: started");
+
+  if (!source_->ThreadStart()) {
+    Log("FrameCopier: could not start");
+    // leave submitted jobs alone, they'll be dropped on destruction
+    std::unique_lock<std::mutex> lock(mutex_);
+    failed_ = true;
+    cond_.wait(lock, [this] { return stopped_; });
+    return;
+  }
+
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stopped_ || !jobs_.empty(); });
+      if (stopped_) {
+        break;
+      }
+      job = jobs_.front();
+      jobs_.pop_front();
+    }
+
+    auto data = source_->Acquire(job.slot, job.ticket);
+    if (data) {
+      io::WriteVideoFrame(job.timestamp, data, job.size);
+      source_->Release(job.slot);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      busy_[job.slot] = false;
+    }
+  }
+
+  source_->ThreadStop();
+  Log("FrameCopier: stopped");
+}
+
+} // namespace capsule
@@ -0,0 +1,96 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <lab/types.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+namespace capsule {
+
+/**
+ * Where a FrameCopier gets pixel data from. Apart from Drop, all
+ * methods are called on the copier thread.
+ */
+class FrameSource {
+  public:
+    virtual ~FrameSource() {}
+
+    // called before the first frame, eg. to make a GL context current
+    virtual bool ThreadStart() { return true; }
+    virtual void ThreadStop() {}
+
+    // returns the pixel data for a slot, waiting for it if needed, or
+    // nullptr if the frame should be skipped. ticket is whatever was
+    // passed to Submit.
+    virtual const char *Acquire(int slot, void *ticket) = 0;
+    virtual void Release(int /*slot*/) {}
+
+    // called from the thread destroying the copier, for frames that
+    // were submitted but never copied
+    virtual void Drop(int /*slot*/, void * /*ticket*/) {}
+};
+
+/**
+ * Copies captured frames out of GPU buffers and into the shm ring,
+ * on its own thread, so that the render thread never touches pixel data.
+ *
+ * Each slot (one per GPU buffer) is owned by the copier from the
+ * moment it's submitted until its copy is done - the render thread
+ * must not queue another readback into it before then.
+ */
+class FrameCopier {
+  public:
+    FrameCopier(int num_slots, FrameSource *source);
+    // waits for the copy in progress, if any, and drops pending ones
+    ~FrameCopier();
+
+    void Submit(int slot, size_t size, int64_t timestamp, void *ticket = nullptr);
+    bool Busy(int slot);
+    // true if the source couldn't start, in which case nothing gets copied
+    bool Failed();
+
+  private:
+    struct Job {
+      int slot;
+      size_t size;
+      int64_t timestamp;
+      void *ticket;
+    };
+
+    void Run();
+
+    FrameSource *source_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<Job> jobs_;
+    std::vector<bool> busy_;
+    bool stopped_ = false;
+    bool failed_ = false;
+};
+
+} // namespace capsule
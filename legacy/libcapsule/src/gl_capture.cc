@@ -21,13 +21,18 @@
 
 #include "gl_capture.h"
 
-#include <string.h> // memset
+#include <stdio.h> // sscanf
+#include <string.h> // memset, strstr
+
+#include <chrono>
 
 #include <lab/strings.h>
 
 #include "dynlib.h"
 #include "io.h"
+#include "frame_copier.h"
 #include "capture.h"
+#include "capsule/video_math.h"
 
 #include "gl_shaders.h"
 
@@ -45,19 +50,106 @@ const char *kDefaultOpengl = "/System/Library/Frameworks/OpenGL.framework/Librar
 const char *kDefaultOpengl = "libGL.so.1";
 #endif
 
+// BT.601 limited range: rgb weights, then offset
+#define CONV_Y     0.2568f,  0.5041f,  0.0979f, 0.0627f
+#define CONV_U    -0.1482f, -0.2910f,  0.4392f, 0.5020f
+#define CONV_V     0.4392f, -0.3678f, -0.0714f, 0.5020f
+#define CONV_NONE  0.0f,     0.0f,     0.0f,    0.0f
+
+// one plane of a GPU-converted frame, rendered in its own texture
+struct ConvPlane {
+  GLenum  internal_format;
+  GLenum  format;
+  int     components;
+  int     subsampling; // 1 = full size, 2 = half width & height
+  GLfloat coeffs[8];   // for the first and second output channels
+};
+
+struct ConvLayout {
+  messages::PixFmt pix_fmt;
+  int              num_planes;
+  ConvPlane        planes[video::kMaxPlanes];
+};
+
+static const ConvLayout kConvLayouts[] = {
+  {messages::PixFmt_NV12, 2, {
+    {GL_R8,  GL_RED, 1, 1, {CONV_Y, CONV_NONE}},
+    {GL_RG8, GL_RG,  2, 2, {CONV_U, CONV_V}},
+  }},
+  {messages::PixFmt_YUV420P, 3, {
+    {GL_R8, GL_RED, 1, 1, {CONV_Y, CONV_NONE}},
+    {GL_R8, GL_RED, 1, 2, {CONV_U, CONV_NONE}},
+    {GL_R8, GL_RED, 1, 2, {CONV_V, CONV_NONE}},
+  }},
+  {messages::PixFmt_YUV444P, 3, {
+    {GL_R8, GL_RED, 1, 1, {CONV_Y, CONV_NONE}},
+    {GL_R8, GL_RED, 1, 1, {CONV_U, CONV_NONE}},
+    {GL_R8, GL_RED, 1, 1, {CONV_V, CONV_NONE}},
+  }},
+};
+
+#undef CONV_Y
+#undef CONV_U
+#undef CONV_V
+#undef CONV_NONE
+
+// capabilities that would mess with the conversion pass
+static const GLenum kConvDisabledCaps[] = {
+  GL_BLEND,
+  GL_CULL_FACE,
+  GL_DEPTH_TEST,
+  GL_SCISSOR_TEST,
+  GL_STENCIL_TEST,
+  GL_FRAMEBUFFER_SRGB,
+};
+static const int kNumConvDisabledCaps = sizeof(kConvDisabledCaps) / sizeof(kConvDisabledCaps[0]);
+
+// size_divider can be 1, 2 or 4: each halving step is one 2:1 blit
+static const int kMaxScaleSteps = 2;
+
 struct State {
+  // backbuffer size
   int                     cx;
   int                     cy;
+  // captured frame size (after size_divider)
+  int                     out_cx;
+  int                     out_cy;
   int64_t                 pitch;
+  int64_t                 frame_size;
   GLuint                  fbo;
 
+  // glReadPixels straight into pbos, see ProbeReadback
+  bool                    readback_probed;
+  bool                    direct_readback;
+  int                     probe_frames;
+  int64_t                 probe_us[2];
+
+  // downscaling, see InitScale
+  int                     num_scale_steps;
+  GLuint                  scale_fbo;
+  GLuint                  scale_textures[kMaxScaleSteps];
+
+  // readback ring depth, see capture::BufferCount
+  int                     num_buffers;
   int                     cur_tex;
-  int                     copy_wait;
-  GLuint                  pbos[capture::kNumBuffers];
-  GLuint                  textures[capture::kNumBuffers];
-  bool                    texture_ready[capture::kNumBuffers];
-  bool                    texture_mapped[capture::kNumBuffers];
-  int64_t                 timestamps[capture::kNumBuffers];
+  int64_t                 num_frames;
+  GLuint                  pbos[capture::kMaxBuffers];
+  GLuint                  textures[capture::kMaxBuffers];
+  GLsync                  fences[capture::kMaxBuffers];
+  // persistently mapped pbos (ARB_buffer_storage), copied out by copier
+  bool                    persistent;
+  // copier waits on fences & maps pbos itself, in shared_ctx
+  bool                    threaded;
+  void                    *shared_ctx;
+  void                    *pbo_data[capture::kMaxBuffers];
+  bool                    texture_ready[capture::kMaxBuffers];
+  int64_t                 issued_at[capture::kMaxBuffers];
+  int64_t                 timestamps[capture::kMaxBuffers];
+
+  // readback statistics, see LogReadbackStats
+  int64_t                 frames_ready;
+  int64_t                 frames_not_ready;
+  int64_t                 frames_dropped;
 
   int                     overlay_width;  
   int                     overlay_height;  
@@ -70,11 +162,47 @@ struct State {
   GLuint                  overlay_shader_program;
   GLuint                  overlay_pbo;
 
+  // gpu color conversion, see InitConv
+  const ConvLayout        *conv;
+  GLuint                  plane_textures[video::kMaxPlanes];
+  int                     plane_width[video::kMaxPlanes];
+  int                     plane_height[video::kMaxPlanes];
+  int64_t                 plane_offset[video::kMaxPlanes];
+  int64_t                 plane_linesize[video::kMaxPlanes];
+  GLuint                  conv_vao;
+  GLuint                  conv_vbo;
+  GLuint                  conv_vertex_shader;
+  GLuint                  conv_fragment_shader;
+  GLuint                  conv_shader_program;
+  GLint                   conv_coeffs_loc;
+
   int 			  avoid_apple_gl;
 };
 
 static State state = {0};
 
+// whether fences (GL 3.2 or ARB_sync) are available. when they're not,
+// we fall back to assuming a readback is done after a full trip around
+// the ring, which may stall the driver if the GPU is behind.
+static bool has_sync = false;
+
+// whether pbos can be persistently mapped (GL 4.4 or ARB_buffer_storage),
+// in which case frames are copied into shm off the render thread
+static bool has_buffer_storage = false;
+
+// lives outside of state because state gets memset
+static FrameCopier *copier = nullptr;
+
+// how long the copier thread waits on a single fence before giving up
+// on that frame (in nanoseconds)
+static const GLuint64 kFenceTimeout = 1000 * 1000 * 1000;
+
+// how often (in captured frames) readback statistics are logged
+static const int64_t kReadbackStatsInterval = 60 * 10;
+
+// number of timed frames of each readback path in ProbeReadback
+static const int kReadbackProbeRuns = 3;
+
 LibHandle handle;
 
 static inline bool ErrorEx(const char *func, const char *str, GLenum error) {
@@ -102,6 +230,58 @@ bool EnsureOpengl() {
   return true;
 }
 
+static bool VersionAtLeast(int want_major, int want_minor) {
+  const char *version = _glGetString(GL_VERSION);
+  if (!version) {
+    return false;
+  }
+
+  // GL_VERSION starts with "major.minor", with an optional
+  // "OpenGL ES " prefix that we don't care about here.
+  int major = 0;
+  int minor = 0;
+  if (sscanf(version, "%d.%d", &major, &minor) != 2) {
+    return false;
+  }
+
+  return major > want_major || (major == want_major && minor >= want_minor);
+}
+
+static bool HasExtension(const char *name) {
+  if (_glGetStringi) {
+    GLint num_extensions = 0;
+    _glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+    if (_glGetError() == 0) {
+      for (GLint i = 0; i < num_extensions; i++) {
+        const char *ext = _glGetStringi(GL_EXTENSIONS, i);
+        if (ext && !strcmp(ext, name)) {
+          return true;
+        }
+      }
+      return false;
+    }
+  }
+
+  // legacy contexts: one big space-separated string
+  const char *extensions = _glGetString(GL_EXTENSIONS);
+  if (!extensions) {
+    _glGetError();
+    return false;
+  }
+
+  size_t name_len = strlen(name);
+  const char *p = extensions;
+  while ((p = strstr(p, name)) != nullptr) {
+    bool starts = (p == extensions || p[-1] == ' ');
+    bool ends = (p[name_len] == ' ' || p[name_len] == '\0');
+    if (starts && ends) {
+      return true;
+    }
+    p += name_len;
+  }
+  return false;
+}
+
 bool InitFunctions() {
   if (!EnsureOpengl()) {
     return false;
@@ -110,6 +290,7 @@ bool InitFunctions() {
   GLSYM(glGetError)
   GLSYM(glGetIntegerv)
   GLSYM(glGetString)
+  GLSYM_OPT(glGetStringi)
 
   GLSYM(glGenTextures)
   GLSYM(glBindTexture)
@@ -121,10 +302,12 @@ bool InitFunctions() {
 
   GLSYM(glGenVertexArrays)
   GLSYM(glBindVertexArray)
+  GLSYM(glDeleteVertexArrays)
 
 #if defined(LAB_MACOS)
   GLSYM(glGenVertexArraysAPPLE)
   GLSYM(glBindVertexArrayAPPLE)
+  GLSYM(glDeleteVertexArraysAPPLE)
 #endif
 
   GLSYM(glGenBuffers)
@@ -142,6 +325,29 @@ bool InitFunctions() {
   GLSYM(glFramebufferTexture2D)
   GLSYM(glDeleteFramebuffers)
 
+  // glXGetProcAddress happily returns pointers for functions the
+  // driver doesn't implement, so check the version/extensions too
+  GLSYM_OPT(glFenceSync)
+  GLSYM_OPT(glClientWaitSync)
+  GLSYM_OPT(glDeleteSync)
+  has_sync = _glFenceSync && _glClientWaitSync && _glDeleteSync &&
+             (VersionAtLeast(3, 2) || HasExtension("GL_ARB_sync"));
+  if (has_sync) {
+    Log("gl: using fences for asynchronous readback");
+  } else {
+    Log("gl: fences not available, readback may stall");
+  }
+
+  // persistent mapping is only safe when we can tell (with fences)
+  // that the GPU is done writing to a buffer
+  GLSYM_OPT(glBufferStorage)
+  GLSYM_OPT(glMapBufferRange)
+  has_buffer_storage = has_sync && _glBufferStorage && _glMapBufferRange &&
+                       (VersionAtLeast(4, 4) || HasExtension("GL_ARB_buffer_storage"));
+  if (has_buffer_storage) {
+    Log("gl: using persistently mapped buffers");
+  }
+
   GLSYM(glCreateShader)
   GLSYM(glShaderSource)
   GLSYM(glCompileShader)
@@ -160,23 +366,105 @@ bool InitFunctions() {
   GLSYM(glVertexAttribPointer)
   GLSYM(glGetUniformLocation)
   GLSYM(glUniform1i)
+  GLSYM(glUniform4fv)
+  GLSYM(glDeleteShader)
+  GLSYM(glDeleteProgram)
 
   GLSYM(glDrawArrays)
   GLSYM(glClearColor)
   GLSYM(glClear)
+  GLSYM(glViewport)
+  GLSYM(glReadPixels)
+  GLSYM(glFinish)
+  GLSYM(glFlush)
+
+  GLSYM(glActiveTexture)
+  GLSYM(glEnable)
+  GLSYM(glDisable)
+  GLSYM(glIsEnabled)
+  GLSYM(glPixelStorei)
 
   return true;
 }
 
+static void LogReadbackStats() {
+  Log("gl: readback stats: %" PRId64 " ready, %" PRId64 " not ready, %" PRId64 " dropped",
+    state.frames_ready, state.frames_not_ready, state.frames_dropped);
+}
+
+static inline void DeleteFence(int i) {
+  if (state.fences[i]) {
+    _glDeleteSync(state.fences[i]);
+    state.fences[i] = nullptr;
+  }
+}
+
+static inline void safeGlDeleteVertexArrays(GLsizei n, const GLuint *arrays) {
+#if defined(LAB_MACOS)
+  if (state.avoid_apple_gl) {
+    _glDeleteVertexArrays(n, arrays);
+  } else {
+    _glDeleteVertexArraysAPPLE(n, arrays);
+  }
+#else
+  _glDeleteVertexArrays(n, arrays);
+#endif // LAB_MACOS
+}
+
+// Deletes whatever InitConv managed to create, so it can fail partway
+static void FreeConv() {
+  for (int i = 0; i < video::kMaxPlanes; i++) {
+    if (state.plane_textures[i]) {
+      _glDeleteTextures(1, &state.plane_textures[i]);
+      state.plane_textures[i] = 0;
+    }
+  }
+
+  if (state.conv_vao) {
+    safeGlDeleteVertexArrays(1, &state.conv_vao);
+    state.conv_vao = 0;
+  }
+
+  if (state.conv_vbo) {
+    _glDeleteBuffers(1, &state.conv_vbo);
+    state.conv_vbo = 0;
+  }
+
+  if (state.conv_shader_program) {
+    _glDeleteProgram(state.conv_shader_program);
+    state.conv_shader_program = 0;
+  }
+
+  if (state.conv_vertex_shader) {
+    _glDeleteShader(state.conv_vertex_shader);
+    state.conv_vertex_shader = 0;
+  }
+
+  if (state.conv_fragment_shader) {
+    _glDeleteShader(state.conv_fragment_shader);
+    state.conv_fragment_shader = 0;
+  }
+}
+
 static void Free() {
-  for (size_t i = 0; i < capture::kNumBuffers; i++) {
-    if (state.pbos[i]) {
-      if (state.texture_mapped[i]) {
-        _glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pbos[i]);
-        _glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
-        _glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-      }
+  if (state.num_frames > 0) {
+    LogReadbackStats();
+  }
+
+  // the copier may be reading from our pbos, stop it first
+  if (copier) {
+    delete copier;
+    copier = nullptr;
+  }
 
+  if (state.shared_ctx) {
+    DestroySharedContext(state.shared_ctx);
+  }
+
+  for (size_t i = 0; i < capture::kMaxBuffers; i++) {
+    DeleteFence(i);
+
+    if (state.pbos[i]) {
       _glDeleteBuffers(1, &state.pbos[i]);
     }
 
@@ -188,6 +476,18 @@ static void Free() {
 		_glDeleteFramebuffers(1, &state.fbo);
   }
 
+  if (state.scale_fbo) {
+    _glDeleteFramebuffers(1, &state.scale_fbo);
+  }
+
+  for (int i = 0; i < kMaxScaleSteps; i++) {
+    if (state.scale_textures[i]) {
+      _glDeleteTextures(1, &state.scale_textures[i]);
+    }
+  }
+
+  FreeConv();
+
 	Error("Free", "GL error occurred on free");
 
   memset(&state, 0, sizeof(state));
@@ -200,28 +500,92 @@ static inline bool InitFbo(void) {
 	return !Error("InitFbo", "failed to initialize FBO");
 }
 
-static inline bool ShmemInitData(size_t idx, size_t size) {
-	_glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pbos[idx]);
-	if (Error("ShmemInitData", "failed to bind pbo")) {
+/**
+ * Try to allocate all pbos as persistently & coherently mapped storage.
+ * Returns false (and leaves pbos unusable) if the driver doesn't play along.
+ */
+static bool ShmemInitPersistentPbos(size_t size) {
+  const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+  for (int i = 0; i < state.num_buffers; i++) {
+    _glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pbos[i]);
+    if (Error("ShmemInitPersistentPbos", "failed to bind pbo")) {
+      return false;
+    }
+
+    _glBufferStorage(GL_PIXEL_PACK_BUFFER, size, nullptr, flags);
+    if (Error("ShmemInitPersistentPbos", "failed to allocate pbo storage")) {
+      return false;
+    }
+
+    state.pbo_data[i] = _glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags);
+    if (Error("ShmemInitPersistentPbos", "failed to map pbo") || !state.pbo_data[i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool ShmemInitPbos(size_t size) {
+	_glGenBuffers(state.num_buffers, state.pbos);
+	if (Error("ShmemInitPbos", "failed to generate buffers")) {
 		return false;
 	}
 
-	_glBufferData(GL_PIXEL_PACK_BUFFER, size, 0, GL_STREAM_READ);
-	if (Error("ShmemInitData", "failed to set pbo data")) {
-		return false;
+  if (has_buffer_storage) {
+    if (ShmemInitPersistentPbos(size)) {
+      state.persistent = true;
+      return true;
+    }
+
+    // storage is immutable, start over with fresh buffers
+    Log("gl: could not set up persistently mapped buffers, falling back");
+    _glDeleteBuffers(state.num_buffers, state.pbos);
+    memset(state.pbo_data, 0, sizeof(state.pbo_data));
+    _glGenBuffers(state.num_buffers, state.pbos);
+    if (Error("ShmemInitPbos", "failed to generate buffers")) {
+      return false;
+    }
+  }
+
+	for (int i = 0; i < state.num_buffers; i++) {
+		_glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pbos[i]);
+		if (Error("ShmemInitPbos", "failed to bind pbo")) {
+			return false;
+		}
+
+		_glBufferData(GL_PIXEL_PACK_BUFFER, size, 0, GL_STREAM_READ);
+		if (Error("ShmemInitPbos", "failed to set pbo data")) {
+			return false;
+		}
 	}
 
+	return true;
+}
+
+static inline bool ShmemInitData(size_t idx) {
 	_glBindTexture(GL_TEXTURE_2D, state.textures[idx]);
 	if (Error("ShmemInitData", "failed to set bind texture")) {
 		return false;
 	}
 
-	_glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, state.cx, state.cy,
+	_glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, state.out_cx, state.out_cy,
 			0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
 	if (Error("ShmemInitData", "failed to set texture data")) {
 		return false;
 	}
 
+	// sampled from when doing color conversion: needs to be complete
+	// without mipmaps, and filtered for chroma subsampling
+	_glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	_glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	_glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	_glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	if (Error("ShmemInitData", "failed to set texture parameters")) {
+		return false;
+	}
+
 	return true;
 }
 
@@ -329,36 +693,6 @@ static inline void safeGlBindVertexArray(GLuint buffer) {
 #endif // LAB_MACOS
 }
 
-static bool InitOverlayVbo(void) {
-  Log("OpenGL vendor: %s", _glGetString(GL_VENDOR));
-  Log("OpenGL renderer: %s", _glGetString(GL_RENDERER));
-  Log("OpenGL version: %s", _glGetString(GL_VERSION));
-  Log("OpenGL shading language version: %s", _glGetString(GL_SHADING_LANGUAGE_VERSION));
-
-  // gl coordinate system: (0, 0) = bottom-left
-  float cx = (float) state.cx;
-  float cy = (float) state.cy;
-  float width = (float) state.overlay_width;
-  float height = (float) state.overlay_height;
-  float x = cx - width;
-  float y = 0;
-
-  float l = x / cx * 2.0f - 1.0f;
-  float r = (x + width) / cx * 2.0f - 1.0f;
-  float b = y / cy * 2.0f - 1.0f;
-  float t = (y + height) / cy * 2.0f - 1.0f;
-
-  Log("Overlay vbo: left = %.2f, right = %.2f, top = %.2f, bottom = %.2f", l, r, t, b);
-
-  const GLfloat verts[] = {
-    // pos    texcoord
-    l, t,     0.0f, 0.0f,
-    l, b,     0.0f, 1.0f,
-    r, t,     1.0f, 0.0f,
-    r, b,     1.0f, 1.0f
-  };
-
-#define GLCHECK(msg) if (Error("InitOverlayVbo", msg)) { break; }
 #define GLSHADERCHECK(sh) { \
   GLint shader_status = 0; \
   _glGetShaderiv(sh, GL_COMPILE_STATUS, &shader_status); \
@@ -410,6 +744,36 @@ static bool InitOverlayVbo(void) {
   } \
 }
 
+static bool InitOverlayVbo(void) {
+  Log("OpenGL vendor: %s", _glGetString(GL_VENDOR));
+  Log("OpenGL renderer: %s", _glGetString(GL_RENDERER));
+  Log("OpenGL version: %s", _glGetString(GL_VERSION));
+  Log("OpenGL shading language version: %s", _glGetString(GL_SHADING_LANGUAGE_VERSION));
+
+  // gl coordinate system: (0, 0) = bottom-left
+  float cx = (float) state.cx;
+  float cy = (float) state.cy;
+  float width = (float) state.overlay_width;
+  float height = (float) state.overlay_height;
+  float x = cx - width;
+  float y = 0;
+
+  float l = x / cx * 2.0f - 1.0f;
+  float r = (x + width) / cx * 2.0f - 1.0f;
+  float b = y / cy * 2.0f - 1.0f;
+  float t = (y + height) / cy * 2.0f - 1.0f;
+
+  Log("Overlay vbo: left = %.2f, right = %.2f, top = %.2f, bottom = %.2f", l, r, t, b);
+
+  const GLfloat verts[] = {
+    // pos    texcoord
+    l, t,     0.0f, 0.0f,
+    l, b,     0.0f, 1.0f,
+    r, t,     1.0f, 0.0f,
+    r, b,     1.0f, 1.0f
+  };
+
+#define GLCHECK(msg) if (Error("InitOverlayVbo", msg)) { break; }
   GLint last_vao = 0;
   GLint last_vbo = 0;
   GLint last_program = 0;
@@ -510,8 +874,6 @@ static bool InitOverlayVbo(void) {
   } while (false);
 
 #undef GLCHECK
-#undef GLSHADERCHECK
-#undef GLPROGRAMCHECK
 
   safeGlBindVertexArray(last_vao);
   _glBindBuffer(GL_ARRAY_BUFFER, last_vbo);
@@ -520,64 +882,333 @@ static bool InitOverlayVbo(void) {
   return success;
 }
 
-static inline bool ShmemInitBuffers(void) {
-	size_t size = state.cx * state.cy * 4;
-	GLint last_pbo;
-	GLint last_tex;
+static const ConvLayout *FindConvLayout(messages::PixFmt pix_fmt) {
+  for (auto &layout : kConvLayouts) {
+    if (layout.pix_fmt == pix_fmt) {
+      return &layout;
+    }
+  }
+  return nullptr;
+}
 
-	_glGenBuffers(capture::kNumBuffers, state.pbos);
-	if (Error("ShmemInitBuffers", "failed to generate buffers")) {
-		return false;
-	}
+/**
+ * Set up the textures & shader program used to convert frames
+ * from RGB to planar YUV on the GPU. Plane offsets and linesizes
+ * are tightly packed, one plane after the other.
+ */
+static bool InitConv(const ConvLayout *layout) {
+  int64_t offset = 0;
+  for (int i = 0; i < layout->num_planes; i++) {
+    auto &plane = layout->planes[i];
+    state.plane_width[i] = state.out_cx / plane.subsampling;
+    state.plane_height[i] = state.out_cy / plane.subsampling;
+    state.plane_linesize[i] = state.plane_width[i] * plane.components;
+    state.plane_offset[i] = offset;
+    offset += state.plane_linesize[i] * state.plane_height[i];
+  }
 
-	_glGenTextures(capture::kNumBuffers, state.textures);
-	if (Error("ShmemInitBuffers", "failed to generate textures")) {
-		return false;
-	}
+  // gl coordinate system: (0, 0) = bottom-left. flipping texcoords
+  // vertically gives us top-down rows on readback.
+  const GLfloat verts[] = {
+    // pos         texcoord
+    -1.0f,  1.0f,  0.0f, 0.0f,
+    -1.0f, -1.0f,  0.0f, 1.0f,
+     1.0f,  1.0f,  1.0f, 0.0f,
+     1.0f, -1.0f,  1.0f, 1.0f
+  };
 
-	_glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &last_pbo);
-	if (Error("ShmemInitBuffers",
-				"failed to save pixel pack buffer")) {
-		return false;
-	}
+#define GLCHECK(msg) if (Error("InitConv", msg)) { break; }
 
-	_glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
-	if (Error("ShmemInitBuffers", "failed to save texture")) {
-		return false;
-	}
+  GLint last_tex = 0;
+  GLint last_vao = 0;
+  GLint last_vbo = 0;
+  GLint last_program = 0;
 
-	for (size_t i = 0; i < capture::kNumBuffers; i++) {
-		if (!ShmemInitData(i, size)) {
-			return false;
-		}
-	}
+  // save the state we change
+  auto success = false;
+  do {
+    _glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+    GLCHECK("get last tex");
 
-	_glBindBuffer(GL_PIXEL_PACK_BUFFER, last_pbo);
-	_glBindTexture(GL_TEXTURE_2D, last_tex);
-	return true;
-}
+    _glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &last_vao);
+    GLCHECK("get last vao");
 
-static bool ShmemInit() {
-	if (!ShmemInitBuffers()) {
-		return false;
-	}
-	if (!InitFbo()) {
-		return false;
-	}
+    _glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &last_vbo);
+    GLCHECK("get last vbo");
 
-	Log("gl memory capture successful");
-	return true;
-}
+    _glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
+    GLCHECK("get last program");
 
-static inline void FixWidthHeight(int &width, int &height) {
-  if (width == 0 || height == 0) {
-    int viewport[4];
-    _glGetIntegerv(GL_VIEWPORT, viewport);
+    success = true;
+  } while(false);
+  if (!success) {
+    return false;
+  }
 
-    if (viewport[2] > 0 && viewport[3] > 0) {
-      width = viewport[2];
-      height = viewport[3];
-    } else {
+  success = false;
+  do {
+    _glGenTextures(layout->num_planes, state.plane_textures);
+    GLCHECK("gen plane textures");
+
+    bool planes_ok = true;
+    for (int i = 0; i < layout->num_planes; i++) {
+      auto &plane = layout->planes[i];
+      _glBindTexture(GL_TEXTURE_2D, state.plane_textures[i]);
+      _glTexImage2D(GL_TEXTURE_2D, 0, plane.internal_format,
+        state.plane_width[i], state.plane_height[i], 0,
+        plane.format, GL_UNSIGNED_BYTE, nullptr);
+      _glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      _glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      if (Error("InitConv", "plane texture")) {
+        planes_ok = false;
+        break;
+      }
+    }
+    if (!planes_ok) {
+      break;
+    }
+
+    safeGlGenVertexArrays(1, &state.conv_vao);
+    GLCHECK("vao gen");
+    safeGlBindVertexArray(state.conv_vao);
+    GLCHECK("vao bind");
+
+    _glGenBuffers(1, &state.conv_vbo);
+    GLCHECK("vbo gen");
+    _glBindBuffer(GL_ARRAY_BUFFER, state.conv_vbo);
+    GLCHECK("vbo bind");
+    _glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
+    GLCHECK("vbo upload");
+
+    state.conv_vertex_shader = _glCreateShader(GL_VERTEX_SHADER);
+    GLCHECK("vshader create");
+    _glShaderSource(state.conv_vertex_shader, 1, &kVertexSource, nullptr);
+    GLCHECK("vshader source");
+    _glCompileShader(state.conv_vertex_shader);
+    GLCHECK("vshader compile");
+    GLSHADERCHECK(state.conv_vertex_shader);
+
+    state.conv_fragment_shader = _glCreateShader(GL_FRAGMENT_SHADER);
+    GLCHECK("fshader create");
+    _glShaderSource(state.conv_fragment_shader, 1, &kConvFragmentSource, nullptr);
+    GLCHECK("fshader source");
+    _glCompileShader(state.conv_fragment_shader);
+    GLCHECK("fshader compile");
+    GLSHADERCHECK(state.conv_fragment_shader);
+
+    state.conv_shader_program = _glCreateProgram();
+    GLCHECK("program create");
+    _glAttachShader(state.conv_shader_program, state.conv_vertex_shader);
+    GLCHECK("vshader attach");
+    _glAttachShader(state.conv_shader_program, state.conv_fragment_shader);
+    GLCHECK("fshader attach");
+    _glLinkProgram(state.conv_shader_program);
+    GLCHECK("program link");
+    GLPROGRAMCHECK(state.conv_shader_program);
+    _glUseProgram(state.conv_shader_program);
+    GLCHECK("program use");
+
+    GLint pos_attrib = _glGetAttribLocation(state.conv_shader_program, "position");
+    GLCHECK("pos attrib: get location");
+    _glEnableVertexAttribArray(pos_attrib);
+    GLCHECK("pos attrib: enable");
+    _glVertexAttribPointer(pos_attrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), 0);
+    GLCHECK("pos attrib: pointer");
+
+    GLint tex_attrib = _glGetAttribLocation(state.conv_shader_program, "texcoord");
+    GLCHECK("tex attrib: get location");
+    _glEnableVertexAttribArray(tex_attrib);
+    GLCHECK("tex attrib: enable");
+    _glVertexAttribPointer(tex_attrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (void*)(2 * sizeof(GLfloat)));
+    GLCHECK("tex attrib: pointer");
+
+    GLint tex_loc = _glGetUniformLocation(state.conv_shader_program, "source");
+    GLCHECK("tex loc");
+    _glUniform1i(tex_loc, 0);
+    GLCHECK("tex uniform");
+
+    state.conv_coeffs_loc = _glGetUniformLocation(state.conv_shader_program, "coeffs");
+    GLCHECK("coeffs loc");
+
+    success = true;
+  } while (false);
+
+#undef GLCHECK
+
+  _glBindTexture(GL_TEXTURE_2D, last_tex);
+  safeGlBindVertexArray(last_vao);
+  _glBindBuffer(GL_ARRAY_BUFFER, last_vbo);
+  _glUseProgram(last_program);
+
+  if (success) {
+    state.conv = layout;
+    state.frame_size = offset;
+    Log("gl: converting to %s on the GPU, %" PRId64 " bytes per frame",
+      messages::EnumNamePixFmt(layout->pix_fmt), state.frame_size);
+  } else {
+    FreeConv();
+  }
+  return success;
+}
+
+#undef GLSHADERCHECK
+#undef GLPROGRAMCHECK
+
+static inline bool ShmemInitBuffers(void) {
+	size_t size = state.frame_size;
+	GLint last_pbo;
+	GLint last_tex;
+
+	_glGenTextures(state.num_buffers, state.textures);
+	if (Error("ShmemInitBuffers", "failed to generate textures")) {
+		return false;
+	}
+
+	_glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &last_pbo);
+	if (Error("ShmemInitBuffers",
+				"failed to save pixel pack buffer")) {
+		return false;
+	}
+
+	_glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+	if (Error("ShmemInitBuffers", "failed to save texture")) {
+		return false;
+	}
+
+	if (!ShmemInitPbos(size)) {
+		return false;
+	}
+
+	for (int i = 0; i < state.num_buffers; i++) {
+		if (!ShmemInitData(i)) {
+			return false;
+		}
+	}
+
+	_glBindBuffer(GL_PIXEL_PACK_BUFFER, last_pbo);
+	_glBindTexture(GL_TEXTURE_2D, last_tex);
+	return true;
+}
+
+/**
+ * Hands pbos over to the copier. In threaded mode, it runs in a context
+ * shared with the game's, waits on the readback fence and maps the pbo
+ * itself. Otherwise the render thread already waited, and only
+ * persistently mapped pbos are ever submitted.
+ */
+class PboFrameSource : public FrameSource {
+  public:
+    bool ThreadStart() override {
+      if (!state.threaded) {
+        return true;
+      }
+      return MakeSharedContextCurrent(state.shared_ctx);
+    }
+
+    void ThreadStop() override {
+      if (state.threaded) {
+        ReleaseSharedContext(state.shared_ctx);
+      }
+    }
+
+    const char *Acquire(int slot, void *ticket) override {
+      auto fence = (GLsync) ticket;
+      if (fence) {
+        // the render thread flushed after inserting the fence, so
+        // there's no need for GL_SYNC_FLUSH_COMMANDS_BIT here
+        GLenum ret = _glClientWaitSync(fence, 0, kFenceTimeout);
+        _glDeleteSync(fence);
+        if (ret != GL_ALREADY_SIGNALED && ret != GL_CONDITION_SATISFIED) {
+          Log("gl: readback %d did not complete in time, skipping", slot);
+          return nullptr;
+        }
+      }
+
+      if (state.persistent) {
+        return (const char *) state.pbo_data[slot];
+      }
+
+      _glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pbos[slot]);
+      auto buffer = _glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+      Error("PboFrameSource", "failed to map pbo");
+      return (const char *) buffer;
+    }
+
+    void Release(int /*slot*/) override {
+      if (!state.persistent) {
+        _glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        _glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      }
+    }
+
+    void Drop(int /*slot*/, void *ticket) override {
+      if (ticket) {
+        _glDeleteSync((GLsync) ticket);
+      }
+    }
+};
+
+static PboFrameSource pbo_source;
+
+static void InitCopier() {
+#if defined(CAPSULE_THREADED_COPY)
+  // waiting on fences from another thread needs ARB_sync, obviously
+  if (has_sync) {
+    state.shared_ctx = CreateSharedContext();
+    state.threaded = (state.shared_ctx != nullptr);
+  }
+#endif // CAPSULE_THREADED_COPY
+
+  if (state.threaded || state.persistent) {
+    copier = new FrameCopier(state.num_buffers, &pbo_source);
+  }
+  if (state.threaded) {
+    Log("gl: reading back on the capture thread");
+  }
+}
+
+/**
+ * Called when the copier thread couldn't make the shared context
+ * current. Go back to polling fences on the render thread.
+ */
+static void FallBackFromCopier() {
+  Log("gl: capture thread failed, reading back on the render thread");
+
+  // drops any pending fences
+  delete copier;
+  copier = nullptr;
+
+  DestroySharedContext(state.shared_ctx);
+  state.shared_ctx = nullptr;
+  state.threaded = false;
+
+  if (state.persistent) {
+    copier = new FrameCopier(state.num_buffers, &pbo_source);
+  }
+}
+
+static bool ShmemInit() {
+	if (!ShmemInitBuffers()) {
+		return false;
+	}
+	if (!InitFbo()) {
+		return false;
+	}
+	InitCopier();
+
+	Log("gl memory capture successful");
+	return true;
+}
+
+static inline void FixWidthHeight(int &width, int &height) {
+  if (width == 0 || height == 0) {
+    int viewport[4];
+    _glGetIntegerv(GL_VIEWPORT, viewport);
+
+    if (viewport[2] > 0 && viewport[3] > 0) {
+      width = viewport[2];
+      height = viewport[3];
+    } else {
       Log("gl_init: 0x0 viewport");
       // TODO: how do we handle that error?
     }
@@ -595,21 +1226,118 @@ static inline void FixWidthHeight(int &width, int &height) {
   }
 }
 
+/**
+ * Set up the intermediate textures used to downscale the backbuffer
+ * by size_divider. Every step is an exact 2:1 linear blit, which
+ * averages 2x2 blocks - so dividing by 4 is a 4x4 box filter rather
+ * than a single blit that would skip 3 pixels out of 4.
+ */
+static bool InitScale(int size_divider) {
+  int steps = 0;
+  switch (size_divider) {
+    case 0:
+    case 1:
+      steps = 0;
+      break;
+    case 2:
+      steps = 1;
+      break;
+    case 4:
+      steps = 2;
+      break;
+    default:
+      Log("gl: invalid size divider %d (must be 1, 2 or 4), ignoring", size_divider);
+      steps = 0;
+      break;
+  }
+
+  // keep output dimensions even, the encoder wants them that way
+  state.num_scale_steps = steps;
+  state.out_cx = (state.cx >> steps) & ~1;
+  state.out_cy = (state.cy >> steps) & ~1;
+
+  if (steps < 2) {
+    // the last step blits straight into the ring textures
+    return true;
+  }
+
+  GLint last_tex;
+  _glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+  if (Error("InitScale", "failed to save texture")) {
+    return false;
+  }
+
+  _glGenFramebuffers(1, &state.scale_fbo);
+  if (Error("InitScale", "failed to generate fbo")) {
+    return false;
+  }
+
+  _glGenTextures(steps - 1, state.scale_textures);
+  if (Error("InitScale", "failed to generate textures")) {
+    return false;
+  }
+
+  for (int i = 0; i < steps - 1; i++) {
+    _glBindTexture(GL_TEXTURE_2D, state.scale_textures[i]);
+    _glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+        state.out_cx << (steps - 1 - i), state.out_cy << (steps - 1 - i),
+        0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+    if (Error("InitScale", "failed to set texture data")) {
+      _glBindTexture(GL_TEXTURE_2D, last_tex);
+      return false;
+    }
+  }
+
+  _glBindTexture(GL_TEXTURE_2D, last_tex);
+  return true;
+}
+
 static bool Init (int width, int height) {
   FixWidthHeight(width, height);
 
-  const int components = 4; // BGRA
-  const size_t pitch = width * components;
-
   state.cx = width;
   state.cy = height;
-  state.pitch = pitch;
 
   if (!InitOverlayTexture() || !InitOverlayVbo()) {
     Free();
     return false;
   }
 
+  auto settings = &capture::GetState()->settings;
+  if (!InitScale(settings->size_divider)) {
+    Free();
+    return false;
+  }
+
+  const int components = 4; // BGRA
+  const size_t pitch = state.out_cx * components;
+
+  state.pitch = pitch;
+  state.frame_size = state.out_cy * pitch;
+  Log("gl: capturing %dx%d out of %dx%d", state.out_cx, state.out_cy, state.cx, state.cy);
+
+  if (settings->gpu_color_conv) {
+    auto pix_fmt = settings->pix_fmt;
+    if (pix_fmt == messages::PixFmt_UNKNOWN) {
+      pix_fmt = messages::PixFmt_NV12;
+    }
+
+    auto layout = FindConvLayout(pix_fmt);
+    if (!layout) {
+      Log("gl: can't convert to %s on the GPU, using NV12", messages::EnumNamePixFmt(pix_fmt));
+      layout = FindConvLayout(messages::PixFmt_NV12);
+    }
+
+    if (!InitConv(layout)) {
+      // not fatal, the encoder can still convert on the CPU
+      Log("gl: could not set up GPU color conversion, capturing BGRA");
+      state.frame_size = state.out_cy * pitch;
+    }
+  }
+
+  state.num_buffers = capture::BufferCount(state.frame_size);
+  Log("gl: using %d readback buffers", state.num_buffers);
+
   bool success = ShmemInit();
   if (!success) {
     Free();
@@ -620,19 +1348,19 @@ static bool Init (int width, int height) {
 }
 
 static void CopyBackbuffer(GLuint dst) {
-	_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state.fbo);
-	if (Error("gl_copy_backbuffer", "failed to bind FBO")) {
+	GLint last_read_fbo;
+	_glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &last_read_fbo);
+	if (Error("gl_copy_backbuffer", "failed to get last read FBO")) {
 		return;
 	}
 
-	_glBindTexture(GL_TEXTURE_2D, dst);
-	if (Error("gl_copy_backbuffer", "failed to bind texture")) {
+	_glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	if (Error("gl_copy_backbuffer", "failed to bind default read FBO")) {
 		return;
 	}
 
-	_glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-			GL_TEXTURE_2D, dst, 0);
-	if (Error("gl_copy_backbuffer", "failed to set frame buffer")) {
+	_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state.fbo);
+	if (Error("gl_copy_backbuffer", "failed to bind FBO")) {
 		return;
 	}
 
@@ -643,35 +1371,268 @@ static void CopyBackbuffer(GLuint dst) {
 		return;
 	}
 
-	_glBlitFramebuffer(0, 0, state.cx, state.cy,
-			0, 0, state.cx, state.cy, GL_COLOR_BUFFER_BIT, GL_LINEAR);
-	Error("gl_copy_backbuffer", "failed to blit");
+  // halve into intermediate textures, then into dst. each blit reads
+  // exactly twice the size it writes, so rows/columns that don't fit
+  // (at most a few) are cropped off the top & right.
+  int steps = state.num_scale_steps;
+  for (int i = 0; i < steps || i == 0; i++) {
+    bool last = (i >= steps - 1);
+    GLuint target = last ? dst : state.scale_textures[i];
+    int shift = last ? 0 : (steps - 1 - i);
+    int dst_cx = state.out_cx << shift;
+    int dst_cy = state.out_cy << shift;
+    int src_cx = steps > 0 ? dst_cx * 2 : dst_cx;
+    int src_cy = steps > 0 ? dst_cy * 2 : dst_cy;
+
+    _glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D, target, 0);
+    if (Error("gl_copy_backbuffer", "failed to set frame buffer")) {
+      break;
+    }
+
+    _glBlitFramebuffer(0, 0, src_cx, src_cy,
+        0, 0, dst_cx, dst_cy, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    if (Error("gl_copy_backbuffer", "failed to blit")) {
+      break;
+    }
+
+    if (!last) {
+      // next step reads from what we just drew
+      _glBindFramebuffer(GL_READ_FRAMEBUFFER, state.scale_fbo);
+      _glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+          GL_TEXTURE_2D, target, 0);
+      _glReadBuffer(GL_COLOR_ATTACHMENT0);
+      if (Error("gl_copy_backbuffer", "failed to set read frame buffer")) {
+        break;
+      }
+    }
+  }
+
+	_glBindFramebuffer(GL_READ_FRAMEBUFFER, last_read_fbo);
+}
+
+/**
+ * Returns true if the readback queued in slot i has completed, ie. if
+ * its pbo can be mapped without stalling.
+ */
+static inline bool ReadbackDone(int i) {
+  if (!has_sync) {
+    return state.num_frames - state.issued_at[i] >= state.num_buffers - 1;
+  }
+
+  GLenum ret = _glClientWaitSync(state.fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+  switch (ret) {
+    case GL_ALREADY_SIGNALED:
+    case GL_CONDITION_SATISFIED:
+      return true;
+    case GL_TIMEOUT_EXPIRED:
+      return false;
+    default:
+      // GL_WAIT_FAILED - mapping will block, but at least we'll get the frame
+      Error("ReadbackDone", "failed to wait on fence");
+      return true;
+  }
 }
 
 static inline void ShmemCaptureQueueCopy(void) {
-	for (int i = 0; i < capture::kNumBuffers; i++) {
-		if (state.texture_ready[i]) {
-			GLvoid *buffer;
-      auto timestamp = state.timestamps[i];
-
-			state.texture_ready[i] = false;
-
-			_glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pbos[i]);
-			if (Error("gl_shmem_capture_queue_copy", "failed to bind pbo")) {
-				return;
-			}
-
-			buffer = _glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
-			if (buffer) {
-				state.texture_mapped[i] = true;
-        io::WriteVideoFrame(timestamp, (char*) buffer, state.cy * state.pitch);
-			}
-			break;
-		}
+  // oldest slot first, so frames are sent in order
+  for (int n = 1; n <= state.num_buffers; n++) {
+    int i = (state.cur_tex + n) % state.num_buffers;
+    if (!state.texture_ready[i]) {
+      continue;
+    }
+
+    if (!ReadbackDone(i)) {
+      // fences signal in order, so no newer readback is done either
+      state.frames_not_ready++;
+      break;
+    }
+
+    GLvoid *buffer;
+    auto timestamp = state.timestamps[i];
+
+    state.texture_ready[i] = false;
+    DeleteFence(i);
+
+    if (state.persistent) {
+      // coherent mapping + signaled fence: the data's all there,
+      // the copier owns that pbo until it's done copying it.
+      state.frames_ready++;
+      copier->Submit(i, state.frame_size, timestamp);
+      continue;
+    }
+
+    _glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pbos[i]);
+    if (Error("gl_shmem_capture_queue_copy", "failed to bind pbo")) {
+      return;
+    }
+
+    buffer = _glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (buffer) {
+      state.frames_ready++;
+      io::WriteVideoFrame(timestamp, (char*) buffer, state.frame_size);
+      _glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+  }
+}
+
+/**
+ * Render src_tex into each YUV plane, then queue the readback of all
+ * planes into dst_pbo. Restores all the state it touches.
+ */
+static inline void ShmemConvStage(GLuint dst_pbo, GLuint src_tex) {
+  auto layout = state.conv;
+
+#define GLCHECK(msg) if (Error("ShmemConvStage", msg)) { break; }
+
+  GLint last_active_tex = 0;
+  GLint last_tex = 0;
+  GLint last_vao = 0;
+  GLint last_program = 0;
+  GLint last_pack_alignment = 0;
+  GLint last_viewport[4] = {0};
+  GLboolean last_caps[kNumConvDisabledCaps] = {0};
+
+  // save the state we change
+  auto success = false;
+  do {
+    _glGetIntegerv(GL_ACTIVE_TEXTURE, &last_active_tex);
+    GLCHECK("get last active texture");
+
+    _glActiveTexture(GL_TEXTURE0);
+    GLCHECK("set active texture");
+
+    _glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+    GLCHECK("get last tex");
+
+    _glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &last_vao);
+    GLCHECK("get last vao");
+
+    _glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
+    GLCHECK("get last program");
+
+    _glGetIntegerv(GL_PACK_ALIGNMENT, &last_pack_alignment);
+    GLCHECK("get last pack alignment");
+
+    _glGetIntegerv(GL_VIEWPORT, last_viewport);
+    GLCHECK("get last viewport");
+
+    for (int i = 0; i < kNumConvDisabledCaps; i++) {
+      last_caps[i] = _glIsEnabled(kConvDisabledCaps[i]);
+    }
+    GLCHECK("get enabled caps");
+
+    success = true;
+  } while (false);
+  if (!success) {
+    _glActiveTexture(last_active_tex);
+    return;
+  }
+
+  success = false;
+  do {
+    for (int i = 0; i < kNumConvDisabledCaps; i++) {
+      if (last_caps[i]) {
+        _glDisable(kConvDisabledCaps[i]);
+      }
+    }
+
+    // CopyBackbuffer left our fbo bound for drawing
+    _glBindTexture(GL_TEXTURE_2D, src_tex);
+    GLCHECK("bind src_tex");
+
+    safeGlBindVertexArray(state.conv_vao);
+    GLCHECK("bind vao");
+
+    _glUseProgram(state.conv_shader_program);
+    GLCHECK("use program");
+
+    bool drawn = true;
+    for (int i = 0; i < layout->num_planes; i++) {
+      _glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D, state.plane_textures[i], 0);
+      _glViewport(0, 0, state.plane_width[i], state.plane_height[i]);
+      _glUniform4fv(state.conv_coeffs_loc, 2, layout->planes[i].coeffs);
+      _glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+      if (Error("ShmemConvStage", "draw plane")) {
+        drawn = false;
+        break;
+      }
+    }
+    if (!drawn) {
+      break;
+    }
+
+    _glBindBuffer(GL_PIXEL_PACK_BUFFER, dst_pbo);
+    GLCHECK("bind dst_pbo");
+
+    // planes are tightly packed
+    _glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    GLCHECK("set pack alignment");
+
+    for (int i = 0; i < layout->num_planes; i++) {
+      _glBindTexture(GL_TEXTURE_2D, state.plane_textures[i]);
+      _glGetTexImage(GL_TEXTURE_2D, 0, layout->planes[i].format, GL_UNSIGNED_BYTE,
+        reinterpret_cast<void*>(state.plane_offset[i]));
+    }
+    GLCHECK("read planes");
+
+    success = true;
+  } while (false);
+
+#undef GLCHECK
+
+  for (int i = 0; i < kNumConvDisabledCaps; i++) {
+    if (last_caps[i]) {
+      _glEnable(kConvDisabledCaps[i]);
+    }
+  }
+  _glViewport(last_viewport[0], last_viewport[1], last_viewport[2], last_viewport[3]);
+  _glPixelStorei(GL_PACK_ALIGNMENT, last_pack_alignment);
+  _glUseProgram(last_program);
+  safeGlBindVertexArray(last_vao);
+  _glBindTexture(GL_TEXTURE_2D, last_tex);
+  _glActiveTexture(last_active_tex);
+
+  if (!success) {
+    Log("gl: color conversion failed");
+  }
+}
+
+/**
+ * Read the backbuffer straight into dst_pbo, skipping the blit
+ * into an intermediate texture.
+ */
+static void ShmemReadPixels(GLuint dst_pbo) {
+	GLint last_read_fbo;
+	_glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &last_read_fbo);
+	if (Error("ShmemReadPixels", "failed to get last read FBO")) {
+		return;
+	}
+
+	_glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	_glReadBuffer(GL_BACK);
+	if (Error("ShmemReadPixels", "failed to bind backbuffer")) {
+		return;
 	}
+
+	_glBindBuffer(GL_PIXEL_PACK_BUFFER, dst_pbo);
+	if (Error("ShmemReadPixels", "failed to bind dst_pbo")) {
+		return;
+	}
+
+	_glReadPixels(0, 0, state.out_cx, state.out_cy, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+	Error("ShmemReadPixels", "failed to read pixels");
+
+	_glBindFramebuffer(GL_READ_FRAMEBUFFER, last_read_fbo);
 }
 
 static inline void ShmemCaptureStage(GLuint dst_pbo, GLuint src_tex) {
+  if (state.conv) {
+    ShmemConvStage(dst_pbo, src_tex);
+    return;
+  }
+
 	_glBindTexture(GL_TEXTURE_2D, src_tex);
 	if (Error("ShmemCaptureStage", "failed to bind src_tex")) {
 		return;
@@ -688,14 +1649,63 @@ static inline void ShmemCaptureStage(GLuint dst_pbo, GLuint src_tex) {
 	}
 }
 
+/**
+ * Pick between blit + glGetTexImage and a plain glReadPixels into
+ * the pbo. Some drivers turn glReadPixels into a synchronous download,
+ * others handle it just as well as the blit - and it saves a full-frame
+ * copy.
+ *
+ * Both paths end up with the same pixels in the pbo, so the first
+ * captured frames alternate between them, and we time how long each
+ * takes to issue: a driver that stalls on glReadPixels stalls right
+ * there. Nothing waits on the GPU, so the game doesn't hitch.
+ */
+static bool ProbeDirect() {
+  if (state.conv || state.num_scale_steps > 0) {
+    // those need the frame in a texture anyway
+    state.readback_probed = true;
+    return false;
+  }
+  return state.probe_frames % 2 == 1;
+}
+
+static void ProbeReadback(bool direct, int64_t us) {
+  int frame = state.probe_frames++;
+  // first run of each path pays for lazy allocations, don't count it
+  if (frame >= 2) {
+    state.probe_us[direct ? 1 : 0] += us;
+  }
+  if (state.probe_frames < 2 + 2 * kReadbackProbeRuns) {
+    return;
+  }
+
+  state.readback_probed = true;
+  auto blit_us = state.probe_us[0];
+  auto direct_us = state.probe_us[1];
+  Log("gl: readback probe: blit %" PRId64 "us, direct %" PRId64 "us (%d runs)",
+    blit_us, direct_us, kReadbackProbeRuns);
+
+  if (Error("ProbeReadback", "probe failed") || direct_us >= blit_us) {
+    return;
+  }
+
+  Log("gl: using direct readback");
+  state.direct_readback = true;
+
+  // ring textures are dead weight now
+  _glDeleteTextures(state.num_buffers, state.textures);
+  memset(state.textures, 0, sizeof(state.textures));
+}
+
 void ShmemCapture () {
   int next_tex;
   GLint last_fbo;
   GLint last_tex;
+  GLint last_pbo;
 
   auto timestamp = capture::FrameTimestamp();
 
-  // save last fbo & texture to restore them after capture
+  // save last fbo, texture & pbo to restore them after capture
   {
     _glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &last_fbo);
     if (Error("ShmemCapture", "failed to get last fbo")) {
@@ -706,30 +1716,81 @@ void ShmemCapture () {
     if (Error("ShmemCapture", "failed to get last texture")) {
       return;
     }
+
+    _glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &last_pbo);
+    if (Error("ShmemCapture", "failed to get last pbo")) {
+      return;
+    }
   }
 
-  // try to map & send all the textures that are ready
-  ShmemCaptureQueueCopy();
+  if (state.threaded && copier->Failed()) {
+    FallBackFromCopier();
+  }
 
-  next_tex = (state.cur_tex + 1) % capture::kNumBuffers;
+  if (!state.threaded) {
+    // map & send all the readbacks that have completed
+    ShmemCaptureQueueCopy();
+  }
 
-  state.timestamps[next_tex] = timestamp;
-  CopyBackbuffer(state.textures[next_tex]);
+  next_tex = (state.cur_tex + 1) % state.num_buffers;
 
-  if (state.copy_wait < capture::kNumBuffers - 1) {
-    state.copy_wait++;
-  } else {
-    GLuint src = state.textures[next_tex];
-    GLuint dst = state.pbos[next_tex];
+  if (copier && copier->Busy(next_tex)) {
+    // still owned by the copier, can't read into it - skip this frame
+    state.frames_dropped++;
+    _glBindBuffer(GL_PIXEL_PACK_BUFFER, last_pbo);
+    _glBindTexture(GL_TEXTURE_2D, last_tex);
+    _glBindFramebuffer(GL_DRAW_FRAMEBUFFER, last_fbo);
+    return;
+  }
 
-    // TODO: look into - obs has some locking here
-    _glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
-    state.texture_mapped[next_tex] = false;
+  if (state.texture_ready[next_tex]) {
+    // a full trip around the ring and that readback still isn't done,
+    // the GPU is way behind: give up on that frame rather than wait.
+    state.frames_dropped++;
+    state.texture_ready[next_tex] = false;
+    DeleteFence(next_tex);
+  }
+
+  state.timestamps[next_tex] = timestamp;
+  bool probing = !state.readback_probed;
+  bool direct = probing ? ProbeDirect() : state.direct_readback;
+  auto issue_start = std::chrono::steady_clock::now();
+  if (direct) {
+    ShmemReadPixels(state.pbos[next_tex]);
+  } else {
+    CopyBackbuffer(state.textures[next_tex]);
+    ShmemCaptureStage(state.pbos[next_tex], state.textures[next_tex]);
+  }
+  if (probing && !state.readback_probed) {
+    auto elapsed = std::chrono::steady_clock::now() - issue_start;
+    ProbeReadback(direct, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+  }
 
-    ShmemCaptureStage(dst, src);
+  if (state.threaded) {
+    // the fence travels with the job, the copier waits on it. flush so
+    // it actually gets to the GPU - the copier's context can't do that.
+    GLsync fence = _glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    _glFlush();
+    if (!Error("ShmemCapture", "failed to insert fence")) {
+      state.frames_ready++;
+      copier->Submit(next_tex, state.frame_size, timestamp, fence);
+    }
+  } else {
+    if (has_sync) {
+      state.fences[next_tex] = _glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      Error("ShmemCapture", "failed to insert fence");
+    }
+    state.issued_at[next_tex] = state.num_frames;
     state.texture_ready[next_tex] = true;
   }
+  state.cur_tex = next_tex;
 
+  state.num_frames++;
+  if (state.num_frames % kReadbackStatsInterval == 0) {
+    LogReadbackStats();
+  }
+
+  _glBindBuffer(GL_PIXEL_PACK_BUFFER, last_pbo);
   _glBindTexture(GL_TEXTURE_2D, last_tex);
   _glBindFramebuffer(GL_DRAW_FRAMEBUFFER, last_fbo);
 }
@@ -896,13 +1957,24 @@ void Capture(int width, int height) {
 
   if (state.cx) {
     if (first_frame) {
-      io::WriteVideoFormat(
-        state.cx,
-        state.cy,
-        messages::PixFmt_BGRA,
-        true /* vflip */,
-        state.pitch
-      );
+      if (state.conv) {
+        io::WriteVideoFormat(
+          state.out_cx,
+          state.out_cy,
+          state.conv->pix_fmt,
+          false /* flipped by the conversion shader */,
+          state.plane_offset,
+          state.plane_linesize
+        );
+      } else {
+        io::WriteVideoFormat(
+          state.out_cx,
+          state.out_cy,
+          messages::PixFmt_BGRA,
+          true /* vflip */,
+          state.pitch
+        );
+      }
       first_frame = false;
     }
 
@@ -921,6 +1993,7 @@ void Capture(int width, int height) {
 glGetError_t _glGetError;
 glGetIntegerv_t _glGetIntegerv;
 glGetString_t _glGetString;
+glGetStringi_t _glGetStringi;
 
 glGenTextures_t _glGenTextures;
 glBindTexture_t _glBindTexture;
@@ -932,10 +2005,12 @@ glDeleteTextures_t _glDeleteTextures;
 
 glGenVertexArrays_t _glGenVertexArrays;
 glBindVertexArray_t _glBindVertexArray;
+glDeleteVertexArrays_t _glDeleteVertexArrays;
 
 #if defined(LAB_MACOS)
 glGenVertexArraysAPPLE_t _glGenVertexArraysAPPLE;
 glBindVertexArrayAPPLE_t _glBindVertexArrayAPPLE;
+glDeleteVertexArraysAPPLE_t _glDeleteVertexArraysAPPLE;
 #endif
 
 glGenBuffers_t _glGenBuffers;
@@ -953,6 +2028,13 @@ glBlitFramebuffer_t _glBlitFramebuffer;
 glFramebufferTexture2D_t _glFramebufferTexture2D;
 glDeleteFramebuffers_t _glDeleteFramebuffers;
 
+glBufferStorage_t _glBufferStorage;
+glMapBufferRange_t _glMapBufferRange;
+
+glFenceSync_t _glFenceSync;
+glClientWaitSync_t _glClientWaitSync;
+glDeleteSync_t _glDeleteSync;
+
 glCreateShader_t _glCreateShader;
 glShaderSource_t _glShaderSource;
 glCompileShader_t _glCompileShader;
@@ -971,10 +2053,23 @@ glEnableVertexAttribArray_t _glEnableVertexAttribArray;
 glVertexAttribPointer_t _glVertexAttribPointer;
 glGetUniformLocation_t _glGetUniformLocation;
 glUniform1i_t _glUniform1i;
+glUniform4fv_t _glUniform4fv;
+glDeleteShader_t _glDeleteShader;
+glDeleteProgram_t _glDeleteProgram;
 
 glDrawArrays_t _glDrawArrays;
 glClearColor_t _glClearColor;
 glClear_t _glClear;
+glViewport_t _glViewport;
+glReadPixels_t _glReadPixels;
+glFinish_t _glFinish;
+glFlush_t _glFlush;
+
+glActiveTexture_t _glActiveTexture;
+glEnable_t _glEnable;
+glDisable_t _glDisable;
+glIsEnabled_t _glIsEnabled;
+glPixelStorei_t _glPixelStorei;
 /////////////////////////////////
 // GL functions end
 /////////////////////////////////
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <lab/platform.h>
 #include "logging.h"
@@ -47,6 +48,8 @@ typedef double GLclampd;
 typedef void GLvoid;
 typedef ptrdiff_t GLintptrARB;
 typedef ptrdiff_t GLsizeiptrARB;
+typedef uint64_t GLuint64;
+typedef struct __GLsync *GLsync;
 
 // one possible reference for these:
 // https://code.woboq.org/qt5/include/GLES2/gl2.h.html
@@ -72,9 +75,36 @@ typedef ptrdiff_t GLsizeiptrARB;
 
 #define GL_RGBA8 0x8058
 
+#define GL_RED 0x1903
+#define GL_RG 0x8227
+#define GL_R8 0x8229
+#define GL_RG8 0x822B
+
 #define GL_NEAREST 0x2600
 #define GL_LINEAR 0x2601
 
+#define GL_TEXTURE_MAG_FILTER 0x2800
+#define GL_TEXTURE_MIN_FILTER 0x2801
+#define GL_TEXTURE_WRAP_S 0x2802
+#define GL_TEXTURE_WRAP_T 0x2803
+#define GL_CLAMP_TO_EDGE 0x812F
+
+#define GL_PACK_ALIGNMENT 0x0D05
+
+#define GL_TEXTURE0 0x84C0
+#define GL_ACTIVE_TEXTURE 0x84E0
+
+#define GL_CULL_FACE 0x0B44
+#define GL_DEPTH_TEST 0x0B71
+#define GL_STENCIL_TEST 0x0B90
+#define GL_BLEND 0x0BE2
+#define GL_SCISSOR_TEST 0x0C11
+#define GL_FRAMEBUFFER_SRGB 0x8DB9
+
+#define GL_MAP_READ_BIT 0x0001
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+
 #define GL_READ_ONLY 0x88B8
 #define GL_WRITE_ONLY 0x88B9
 #define GL_READ_WRITE 0x88BA
@@ -105,6 +135,7 @@ typedef ptrdiff_t GLsizeiptrARB;
 #define GL_TEXTURE_2D 0x0DE1
 #define GL_TEXTURE_BINDING_2D 0x8069
 #define GL_DRAW_FRAMEBUFFER_BINDING 0x8CA6
+#define GL_READ_FRAMEBUFFER_BINDING 0x8CAA
 
 #define GL_TEXTURE_BASE_LEVEL 0x813C
 #define GL_TEXTURE_MAX_LEVEL 0x813D
@@ -133,6 +164,18 @@ typedef ptrdiff_t GLsizeiptrARB;
 #define GL_VALIDATE_STATUS 0x8B83
 #define GL_INFO_LOG_LENGTH 0x8B84
 
+#define GL_EXTENSIONS 0x1F03
+#define GL_MAJOR_VERSION 0x821B
+#define GL_MINOR_VERSION 0x821C
+#define GL_NUM_EXTENSIONS 0x821D
+
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#define GL_ALREADY_SIGNALED 0x911A
+#define GL_TIMEOUT_EXPIRED 0x911B
+#define GL_CONDITION_SATISFIED 0x911C
+#define GL_WAIT_FAILED 0x911D
+
 // state getters
 
 typedef GLenum(LAB_STDCALL *glGetError_t)();
@@ -144,6 +187,9 @@ extern glGetIntegerv_t _glGetIntegerv;
 typedef char *(LAB_STDCALL *glGetString_t)(GLenum pname);
 extern glGetString_t _glGetString;
 
+typedef char *(LAB_STDCALL *glGetStringi_t)(GLenum pname, GLuint index);
+extern glGetStringi_t _glGetStringi;
+
 // textures
 
 typedef void(LAB_STDCALL *glGenTextures_t)(GLsizei n, GLuint *buffers);
@@ -186,12 +232,18 @@ extern glGenVertexArrays_t _glGenVertexArrays;
 typedef void(LAB_STDCALL *glBindVertexArray_t)(GLuint buffer);
 extern glBindVertexArray_t _glBindVertexArray;
 
+typedef void(LAB_STDCALL *glDeleteVertexArrays_t)(GLsizei n, const GLuint *arrays);
+extern glDeleteVertexArrays_t _glDeleteVertexArrays;
+
 #if defined(LAB_MACOS)
 typedef glGenVertexArrays_t glGenVertexArraysAPPLE_t;
 extern glGenVertexArraysAPPLE_t _glGenVertexArraysAPPLE;
 
 typedef glBindVertexArray_t glBindVertexArrayAPPLE_t;
 extern glBindVertexArrayAPPLE_t _glBindVertexArrayAPPLE;
+
+typedef glDeleteVertexArrays_t glDeleteVertexArraysAPPLE_t;
+extern glDeleteVertexArraysAPPLE_t _glDeleteVertexArraysAPPLE;
 #endif
 
 // buffers
@@ -215,6 +267,15 @@ extern glBufferData_t _glBufferData;
 typedef GLvoid *(LAB_STDCALL *glMapBuffer_t)(GLenum target, GLenum access);
 extern glMapBuffer_t _glMapBuffer;
 
+typedef void *(LAB_STDCALL *glMapBufferRange_t)(GLenum target, GLintptrARB offset,
+                                               GLsizeiptrARB length, GLbitfield access);
+extern glMapBufferRange_t _glMapBufferRange;
+
+// GL 4.4 or ARB_buffer_storage
+typedef void(LAB_STDCALL *glBufferStorage_t)(GLenum target, GLsizeiptrARB size,
+                                             const void *data, GLbitfield flags);
+extern glBufferStorage_t _glBufferStorage;
+
 typedef GLboolean(LAB_STDCALL *glUnmapBuffer_t)(GLenum target);
 extern glUnmapBuffer_t _glUnmapBuffer;
 
@@ -247,6 +308,17 @@ typedef void(LAB_STDCALL *glDeleteFramebuffers_t)(GLsizei n,
                                                       GLuint *framebuffers);
 extern glDeleteFramebuffers_t _glDeleteFramebuffers;
 
+// sync objects (GL 3.2 or ARB_sync)
+
+typedef GLsync(LAB_STDCALL *glFenceSync_t)(GLenum condition, GLbitfield flags);
+extern glFenceSync_t _glFenceSync;
+
+typedef GLenum(LAB_STDCALL *glClientWaitSync_t)(GLsync sync, GLbitfield flags, GLuint64 timeout);
+extern glClientWaitSync_t _glClientWaitSync;
+
+typedef void(LAB_STDCALL *glDeleteSync_t)(GLsync sync);
+extern glDeleteSync_t _glDeleteSync;
+
 // shaders
 
 typedef GLuint(LAB_STDCALL *glCreateShader_t)(GLenum target);
@@ -307,6 +379,15 @@ extern glGetUniformLocation_t _glGetUniformLocation;
 typedef void(LAB_STDCALL *glUniform1i_t)(GLint location, GLint v0);
 extern glUniform1i_t _glUniform1i;
 
+typedef void(LAB_STDCALL *glUniform4fv_t)(GLint location, GLsizei count, const GLfloat *value);
+extern glUniform4fv_t _glUniform4fv;
+
+typedef void(LAB_STDCALL *glDeleteShader_t)(GLuint shader);
+extern glDeleteShader_t _glDeleteShader;
+
+typedef void(LAB_STDCALL *glDeleteProgram_t)(GLuint program);
+extern glDeleteProgram_t _glDeleteProgram;
+
 // drawing stuff
 
 typedef void(LAB_STDCALL *glDrawArrays_t)(GLenum mode, GLint fist, GLsizei count);
@@ -318,6 +399,36 @@ extern glClearColor_t _glClearColor;
 typedef void(LAB_STDCALL *glClear_t)(GLbitfield mask);
 extern glClear_t _glClear;
 
+typedef void(LAB_STDCALL *glViewport_t)(GLint x, GLint y, GLsizei width, GLsizei height);
+extern glViewport_t _glViewport;
+
+typedef void(LAB_STDCALL *glReadPixels_t)(GLint x, GLint y, GLsizei width, GLsizei height,
+                                          GLenum format, GLenum type, GLvoid *data);
+extern glReadPixels_t _glReadPixels;
+
+typedef void(LAB_STDCALL *glFinish_t)();
+extern glFinish_t _glFinish;
+
+typedef void(LAB_STDCALL *glFlush_t)();
+extern glFlush_t _glFlush;
+
+// misc. state, saved & restored around color conversion
+
+typedef void(LAB_STDCALL *glActiveTexture_t)(GLenum texture);
+extern glActiveTexture_t _glActiveTexture;
+
+typedef void(LAB_STDCALL *glEnable_t)(GLenum cap);
+extern glEnable_t _glEnable;
+
+typedef void(LAB_STDCALL *glDisable_t)(GLenum cap);
+extern glDisable_t _glDisable;
+
+typedef GLboolean(LAB_STDCALL *glIsEnabled_t)(GLenum cap);
+extern glIsEnabled_t _glIsEnabled;
+
+typedef void(LAB_STDCALL *glPixelStorei_t)(GLenum pname, GLint param);
+extern glPixelStorei_t _glPixelStorei;
+
 namespace capsule {
 namespace gl {
 
@@ -329,6 +440,11 @@ namespace gl {
   } \
 }
 
+// like GLSYM, but for functions we can do without
+#define GLSYM_OPT(sym) { \
+  _ ## sym = (sym ## _t) GetProcAddress(#sym);\
+}
+
 extern const char *kDefaultOpengl;
 
 bool EnsureOpengl();
@@ -34,6 +34,23 @@ bool LoadOpengl (const char *path);
 // Must have platform-specific implementation
 void *GetProcAddress(const char *symbol);
 
+// Must have platform-specific implementation. Creates a context sharing
+// objects with the current one, for use by the capture thread, or
+// returns nullptr if that's not supported.
+void *CreateSharedContext();
+
+// Must have platform-specific implementation. Binds ctx to the calling
+// thread.
+bool MakeSharedContextCurrent(void *ctx);
+
+// Must have platform-specific implementation. Unbinds ctx from the
+// calling thread, which must have made it current.
+void ReleaseSharedContext(void *ctx);
+
+// Must have platform-specific implementation. ctx must not be current
+// on any thread.
+void DestroySharedContext(void *ctx);
+
 } // namespace gl
 } // namespace capsule
 
@@ -44,3 +44,19 @@ static const char* kFragmentSource = R"glsl(
         gl_FragColor.a = 0.4;
     }
 )glsl";
+
+// renders one or two channels of a YUV plane: each output channel is
+// the dot product of the source color with a row of coefficients
+// (rgb weights + offset). chroma planes are rendered at half size,
+// letting linear filtering average 2x2 blocks of source pixels.
+static const char* kConvFragmentSource = R"glsl(
+    #version 120
+    varying vec2 texcoordOut;
+
+    uniform sampler2D source;
+    uniform vec4 coeffs[2];
+    void main() {
+        vec4 rgb = vec4(texture2D(source, texcoordOut).rgb, 1.0);
+        gl_FragColor = vec4(dot(rgb, coeffs[0]), dot(rgb, coeffs[1]), 0.0, 1.0);
+    }
+)glsl";
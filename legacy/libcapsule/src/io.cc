@@ -19,9 +19,11 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
  */
 
+#include <atomic>
 #include <string>
 #include <thread>
 #include <mutex>
+#include <vector>
 
 #include <shoom.h>
 
@@ -32,6 +34,9 @@
 #include <lab/io.h>
 
 #include "capsule/audio_math.h"
+#include "capsule/video_math.h"
+#include "capsule/shm_ring.h"
+#include "capsule/audio_ring.h"
 #include "capture.h"
 #include "logging.h"
 #include "ensure.h"
@@ -45,34 +50,61 @@ namespace io {
 
 static Connection *connection = nullptr;
 
-bool frame_locked[capture::kNumBuffers];
-std::mutex frame_locked_mutex;
-int next_frame_index = 0;
+static_assert(capture::kMaxBuffers <= shm_ring::kMaxSlots, "video ring can't hold kMaxBuffers");
 
 shoom::Shm *shm = nullptr;
+int64_t video_frame_size = 0;
+uint32_t video_generation = 0;
+ring_signal::Signal video_signal;
 shoom::Shm *audio_shm = nullptr;
+ring_signal::Signal audio_signal;
 int64_t audio_frame_size = 0;
 int64_t audio_shm_num_frames = 0;
-int64_t audio_shm_committed_offset = 0;
-int64_t audio_shm_processed_offset = 0;
 
 std::mutex out_mutex;
 std::mutex shm_mutex;
 std::mutex audio_shm_mutex;
 
-static bool IsFrameLocked(int i) {
-    std::lock_guard<std::mutex> lock(frame_locked_mutex);
-    return frame_locked[i];
+static inline shm_ring::Header *VideoRing() {
+    return reinterpret_cast<shm_ring::Header*>(shm->Data());
 }
 
-static void LockFrame(int i) {
-    std::lock_guard<std::mutex> lock(frame_locked_mutex);
-    frame_locked[i] = true;
+// The video ring's header, for the render thread's per-frame queries.
+// They can't take shm_mutex, which WriteVideoFrame holds for a whole
+// frame's copy: they borrow it with VideoRingRef instead, and whoever
+// unmaps the ring retires it first.
+static std::atomic<shm_ring::Header*> video_ring{nullptr};
+static std::atomic<int> video_ring_readers{0};
+
+class VideoRingRef {
+  public:
+    VideoRingRef() {
+        // seq_cst on both sides: either RetireVideoRing sees us
+        // reading, or we see the ring gone.
+        video_ring_readers.fetch_add(1);
+        ring_ = video_ring.load();
+    }
+    ~VideoRingRef() {
+        video_ring_readers.fetch_sub(1);
+    }
+
+    shm_ring::Header *Get() const { return ring_; }
+
+  private:
+    shm_ring::Header *ring_;
+};
+
+// With shm_mutex held, before shm is deleted. Only waits on queries that
+// got the ring already, a handful of instructions each.
+static void RetireVideoRing() {
+    video_ring.store(nullptr);
+    while (video_ring_readers.load() != 0) {
+        std::this_thread::yield();
+    }
 }
 
-static void UnlockFrame(int i) {
-    std::lock_guard<std::mutex> lock(frame_locked_mutex);
-    frame_locked[i] = false;
+static inline audio_ring::Header *AudioRing() {
+    return reinterpret_cast<audio_ring::Header*>(audio_shm->Data());
 }
 
 static void HandlePacket(char *buf) {
@@ -85,7 +117,9 @@ static void HandlePacket(char *buf) {
             settings.fps = cps->fps();
             settings.size_divider = cps->size_divider();
             settings.gpu_color_conv = cps->gpu_color_conv();
-            Log("poll_infile: capture settings: %d fps, %d divider, %d gpu_color_conv", settings.fps, settings.size_divider, settings.gpu_color_conv);
+            settings.pix_fmt = cps->pix_fmt();
+            settings.shm_budget = (int64_t) cps->shm_budget();
+            Log("poll_infile: capture settings: %d fps, %d divider, %d gpu_color_conv, %s pix_fmt, %" PRId64 " shm budget", settings.fps, settings.size_divider, settings.gpu_color_conv, messages::EnumNamePixFmt(settings.pix_fmt), settings.shm_budget);
             capture::Start(&settings);
             break;
         }
@@ -94,26 +128,19 @@ static void HandlePacket(char *buf) {
             capture::Stop();
             if (shm) {
                 std::lock_guard<std::mutex> lock(shm_mutex);
+                RetireVideoRing();
                 delete shm;
                 shm = nullptr;
+                ring_signal::Close(&video_signal);
             }
             if (audio_shm) {
                 std::lock_guard<std::mutex> lock(audio_shm_mutex);
                 delete audio_shm;
                 audio_shm = nullptr;
+                ring_signal::Close(&audio_signal);
             }
             break;
         }
-        case messages::Message_VideoFrameProcessed: {
-            auto vfp = pkt->message_as_VideoFrameProcessed();
-            UnlockFrame(vfp->index());
-            break;
-        }
-        case messages::Message_AudioFramesProcessed: {
-            auto afp = pkt->message_as_AudioFramesProcessed();
-            Log("AudioFramesProcessed: offset %d frames %d", afp->offset(), afp->frames());
-            break;
-        }
         default:
             Log("poll_infile: unknown message type %s", EnumNameMessage(pkt->message_type()));
     }
@@ -121,8 +148,56 @@ static void HandlePacket(char *buf) {
     delete[] buf;
 }
 
-void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pitch) {
+// smaller areas would waste most of a huge page
+static const int64_t kHugePagesThreshold = 16 * 1024 * 1024;
+
+// Create a shared memory area for capsulerun. On linux, it's an anonymous
+// memfd when possible: its fd is added to fds, and must be passed along
+// with the packet describing it. Returns nullptr on failure.
+//
+// Areas are prefaulted, so that the first frames don't stall on page
+// faults, and big ones go on huge pages when the system has any to spare
+// (unless CAPSULE_NO_HUGE_PAGES=1).
+static shoom::Shm *CreateShm(const std::string &name, int64_t size,
+                             std::vector<int> &fds, int32_t *fd_index) {
+    *fd_index = -1;
+
+    int flags = shoom::kFlagPrefault;
+    if (size >= kHugePagesThreshold && lab::env::Get("CAPSULE_NO_HUGE_PAGES") != "1") {
+        flags |= shoom::kFlagHugePages;
+    }
+
+#if defined(LAB_LINUX)
+    {
+        auto area = new shoom::Shm(name, static_cast<size_t>(size));
+        if (area->CreateAnonymous(flags) == shoom::kOK) {
+            *fd_index = (int32_t) fds.size();
+            fds.push_back(area->Fd());
+            if (area->HugePages()) {
+                Log("%s is on huge pages", name.c_str());
+            }
+            return area;
+        }
+        Log("Could not create anonymous %s, falling back to named shm", name.c_str());
+        delete area;
+    }
+#endif // LAB_LINUX
+
+    auto area = new shoom::Shm(name, static_cast<size_t>(size));
+    int ret = area->Create(flags);
+    if (ret != shoom::kOK) {
+        Log("Could not create %s: code %d", name.c_str(), ret);
+        delete area;
+        return nullptr;
+    }
+    return area;
+}
+
+void WriteVideoFormat(int width, int height, int format, bool vflip,
+                      const int64_t *offset, const int64_t *linesize) {
     flatbuffers::FlatBufferBuilder builder(1024);
+    // memfds to pass along, see CreateShm
+    std::vector<int> fds;
 
     Log("Writing video format");
     auto state = capture::GetState();
@@ -141,22 +216,27 @@ void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pit
 
         audio_frame_size = sample_size * (int64_t) state->audio_intercept_channels;
         audio_shm_num_frames = seconds * (int64_t) state->audio_intercept_rate;
-        audio_shm_committed_offset = 0;
-        audio_shm_processed_offset = audio_shm_num_frames;
 
-        int64_t audio_shmem_size = audio_shm_num_frames * audio_frame_size;
+        // ring header first, then the frames
+        int64_t audio_shmem_size = audio_ring::kHeaderSize + audio_shm_num_frames * audio_frame_size;
         std::string audio_shmem_path = "capsule_audio.shm";
-        audio_shm = new shoom::Shm(audio_shmem_path, static_cast<size_t>(audio_shmem_size));
-
-        int ret = audio_shm->Create();
-        if (ret != shoom::kOK) {
-            Log("Could not create audio shared memory area: code %d", ret);
+        int32_t audio_fd_index;
+        {
+            std::lock_guard<std::mutex> lock(audio_shm_mutex);
+            delete audio_shm;
+            ring_signal::Close(&audio_signal);
+            audio_shm = CreateShm(audio_shmem_path, audio_shmem_size, fds, &audio_fd_index);
+            if (audio_shm) {
+                audio_ring::Init(AudioRing(), (uint32_t) audio_frame_size, (uint32_t) audio_shm_num_frames);
+                ring_signal::Open(&audio_signal, AudioRing()->signal_name);
+            }
         }
 
         auto audio_shmem = messages::CreateShmem(
             builder,
             builder.CreateString(audio_shmem_path),
-            audio_shmem_size
+            audio_shmem_size,
+            audio_fd_index
         );
 
         audio_setup = messages::CreateAudioSetup(
@@ -168,42 +248,48 @@ void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pit
         );
     }
 
-    for (int i = 0; i < capture::kNumBuffers; i++) {
-        frame_locked[i] = false;
-    }
+    auto pix_fmt = (messages::PixFmt) format;
+    int num_planes = video::NumPlanes(pix_fmt);
+    Ensure("video format is valid", num_planes != 0);
+
+    int64_t frame_size = video::FrameSize(pix_fmt, height, offset, linesize);
+    video_frame_size = frame_size;
+    int num_buffers = capture::BufferCount(frame_size);
+    Log("Frame size: %" PRId64 " bytes, %d planes, %d buffers", frame_size, num_planes, num_buffers);
 
-    int64_t frame_size = height * pitch;
-    Log("Frame size: %" PRId64 " bytes", frame_size);
-    int64_t shmem_size = frame_size * capture::kNumBuffers;
+    // descriptor ring header first, then the frames
+    int64_t shmem_size = shm_ring::kHeaderSize + frame_size * num_buffers;
     Log("Should allocate %" PRId64 " bytes of shmem area", shmem_size);
 
     std::string shmem_path = "capsule_video.shm";
-    shm = new shoom::Shm(shmem_path, static_cast<size_t>(shmem_size));
-    int ret = shm->Create();
-    if (ret != shoom::kOK) {
-        Log("Could not create video shared memory area: code %d", ret);
+    int32_t fd_index;
+    {
+        std::lock_guard<std::mutex> lock(shm_mutex);
+        RetireVideoRing();
+        delete shm;
+        ring_signal::Close(&video_signal);
+        shm = CreateShm(shmem_path, shmem_size, fds, &fd_index);
+        if (shm) {
+            shm_ring::Init(VideoRing(), num_buffers, ++video_generation);
+            ring_signal::Open(&video_signal, VideoRing()->signal_name);
+            video_ring.store(VideoRing());
+        }
     }
 
     auto shmem = messages::CreateShmem(
         builder,
         builder.CreateString(shmem_path),
-        shmem_size
+        shmem_size,
+        fd_index
     );
 
-    // TODO: support multiple linesizes (for planar formats)
-    int64_t linesize[1];
-    linesize[0] = pitch;
-    auto linesize_vec = builder.CreateVector(linesize, 1);
-
-    // TODO: support multiple offsets (for planar formats)
-    int64_t offset[1];
-    offset[0] = 0;
-    auto offset_vec = builder.CreateVector(offset, 1);
+    auto linesize_vec = builder.CreateVector(linesize, num_planes);
+    auto offset_vec = builder.CreateVector(offset, num_planes);
 
     messages::VideoSetupBuilder vs_builder(builder);
     vs_builder.add_width(width);
     vs_builder.add_height(height);
-    vs_builder.add_pix_fmt((messages::PixFmt) format);
+    vs_builder.add_pix_fmt(pix_fmt);
     vs_builder.add_vflip(vflip);
 
     vs_builder.add_offset(offset_vec);
@@ -212,6 +298,7 @@ void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pit
     vs_builder.add_shmem(shmem);
 
     vs_builder.add_audio(audio_setup);
+    vs_builder.add_num_buffers(num_buffers);
     auto vs = vs_builder.Finish();
 
     messages::PacketBuilder pkt_builder(builder);
@@ -222,16 +309,39 @@ void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pit
     builder.Finish(pkt);
     {
         std::lock_guard<std::mutex> lock(out_mutex);
+#if defined(LAB_LINUX)
+        // the kernel dups fds in flight, we keep ours open for the mapping
+        connection->Write(builder, fds);
+#else // LAB_LINUX
         connection->Write(builder);
+#endif // !LAB_LINUX
     }
 }
 
+void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pitch) {
+    // packed formats: single plane
+    int64_t offset[1] = {0};
+    int64_t linesize[1] = {pitch};
+    WriteVideoFormat(width, height, format, vflip, offset, linesize);
+}
+
 int is_skipping;
 
-void WriteVideoFrame(int64_t timestamp, char *frame_data, size_t frame_data_size) {
-    if (IsFrameLocked(next_frame_index)) {
+void WriteVideoFrame(int64_t timestamp, const char *frame_data, size_t frame_data_size) {
+    // only contended when capture starts or stops: the render thread's
+    // per-frame queries go through VideoRingRef
+    std::lock_guard<std::mutex> lock(shm_mutex);
+    if (!shm) {
+        Log("SHM is gone, not writing video frame");
+        return;
+    }
+
+    auto ring = VideoRing();
+    int slot = shm_ring::NextSlot(ring);
+    if (slot < 0) {
+        ring->overruns.fetch_add(1, std::memory_order_relaxed);
         if (!is_skipping) {
-            Log("frame buffer overrun (at %d)! skipping until further notice", next_frame_index);
+            Log("frame buffer overrun! skipping until further notice");
             is_skipping = true;
         }
         return;
@@ -241,85 +351,51 @@ void WriteVideoFrame(int64_t timestamp, char *frame_data, size_t frame_data_size
         is_skipping = false;
     }
 
-    flatbuffers::FlatBufferBuilder builder(64);
+    if (frame_data_size > (size_t) video_frame_size) {
+        frame_data_size = (size_t) video_frame_size;
+    }
 
-    int64_t offset = (frame_data_size * next_frame_index);
+    int64_t offset = shm_ring::kHeaderSize + (video_frame_size * slot);
+    char *target = reinterpret_cast<char*>(shm->Data() + offset);
+    memcpy(target, frame_data, frame_data_size);
 
-    {
-        std::lock_guard<std::mutex> lock(shm_mutex);
-        if (!shm) {
-            Log("SHM is gone, not writing video frame");
-            return;
-        }
+    shm_ring::Push(ring, timestamp, &video_signal);
+}
 
-        char *target = reinterpret_cast<char*>(shm->Data() + offset);
-        memcpy(target, frame_data, frame_data_size);
+int64_t VideoMinInterval() {
+    VideoRingRef ref;
+    auto ring = ref.Get();
+    if (!ring) {
+        return 0;
     }
+    return (int64_t) ring->min_interval_us.load(std::memory_order_relaxed);
+}
 
-    auto vfc = messages::CreateVideoFrameCommitted(builder, timestamp,
-                                                   next_frame_index);
-    auto pkt = messages::CreatePacket(
-        builder, messages::Message_VideoFrameCommitted, vfc.Union());
-    builder.Finish(pkt);
-
-    LockFrame(next_frame_index);
-    {
-        std::lock_guard<std::mutex> lock(out_mutex);
-        connection->Write(builder);
+bool WantVideoFrame() {
+    VideoRingRef ref;
+    auto ring = ref.Get();
+    if (!ring) {
+        return true;
     }
 
-    next_frame_index = (next_frame_index + 1) % capture::kNumBuffers;
+    if (shm_ring::WantFrame(ring)) {
+        return true;
+    }
+    // same as skipping it in WriteVideoFrame, minus the readback & copy
+    ring->overruns.fetch_add(1, std::memory_order_relaxed);
+    return false;
 }
 
 void WriteAudioFrames(char *src_data, int64_t src_frames) {
-    std::lock_guard<std::mutex> lock(audio_shm_mutex);
-    if (!audio_shm) {
-        Log("Audio SHM is gone, not writing audio frame");
+    // called from the game's audio thread: never wait, never make
+    // a syscall. if capture is being stopped, drop those frames.
+    std::unique_lock<std::mutex> lock(audio_shm_mutex, std::try_to_lock);
+    if (!lock.owns_lock() || !audio_shm) {
         return;
     }
 
-    auto dst_data = (char*) audio_shm->Data();
- 
-    int64_t src_offset = 0;
-    while (src_offset < src_frames) {
-      if (audio_shm_committed_offset == audio_shm_num_frames) {
-        DebugLog("io: Wrapping!");
-        // wrap around!
-        audio_shm_committed_offset = 0;
-      }
-
-      int64_t write_frames = src_frames - src_offset;
-      int64_t avail_frames = audio_shm_num_frames - audio_shm_committed_offset;
-
-      if (write_frames > avail_frames) {
-        write_frames = avail_frames;
-      }
-
-      {
-        DebugLog("io: putting %" PRIdS " frames at %d", write_frames,
-            audio_shm_committed_offset);
-        char *src = src_data + (src_offset * audio_frame_size);
-        char *dst = dst_data + (audio_shm_committed_offset * audio_frame_size);
-        int64_t copy_size = write_frames * audio_frame_size;
-        memcpy(dst, src, copy_size);
-
-        flatbuffers::FlatBufferBuilder builder(64);
-        auto afc = messages::CreateAudioFramesCommitted(
-            builder, audio_shm_committed_offset,
-            write_frames);
-        auto pkt = messages::CreatePacket(
-            builder, messages::Message_AudioFramesCommitted, afc.Union());
-        builder.Finish(pkt);
-
-        {
-          std::lock_guard<std::mutex> lock(out_mutex);
-          connection->Write(builder);
-        }
-
-        audio_shm_committed_offset += write_frames;
-        src_offset += write_frames;
-      }
-    }
+    // overruns are counted in the ring header, capsulerun reports them
+    audio_ring::Write(AudioRing(), src_data, (uint32_t) src_frames, &audio_signal);
 }
 
 void WriteHotkeyPressed() {
@@ -32,7 +32,14 @@ namespace io {
 void Init();
 void Cleanup();
 void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pitch);
-void WriteVideoFrame(int64_t timestamp, char *frame_data, size_t frame_data_size);
+void WriteVideoFormat(int width, int height, int format, bool vflip,
+                      const int64_t *offset, const int64_t *linesize);
+void WriteVideoFrame(int64_t timestamp, const char *frame_data, size_t frame_data_size);
+// Minimum time between frames capsulerun asked for, in microseconds, or 0
+int64_t VideoMinInterval();
+// Whether capsulerun has room for a frame captured now - counted as
+// skipped if it doesn't, see shm_ring::DropPolicy
+bool WantVideoFrame();
 void WriteAudioFrames(char *data, int64_t frames);
 void WriteHotkeyPressed();
 void WriteCaptureStop();
@@ -65,6 +65,253 @@ void *GetProcAddress (const char *symbol) {
   return addr;
 }
 
+/////////////////////////////////
+// shared context for the capture thread
+/////////////////////////////////
+
+#define GLX_SCREEN 0x800C
+#define GLX_FBCONFIG_ID 0x8013
+#define GLX_RGBA_TYPE 0x8014
+#define GLX_PBUFFER_HEIGHT 0x8040
+#define GLX_PBUFFER_WIDTH 0x8041
+
+typedef void* (*glXGetCurrentContext_t)();
+static glXGetCurrentContext_t _glXGetCurrentContext = nullptr;
+
+typedef void* (*glXGetCurrentDisplay_t)();
+static glXGetCurrentDisplay_t _glXGetCurrentDisplay = nullptr;
+
+typedef int (*glXQueryContext_t)(void*, void*, int, int*);
+static glXQueryContext_t _glXQueryContext = nullptr;
+
+typedef int (*glXIsDirect_t)(void*, void*);
+static glXIsDirect_t _glXIsDirect = nullptr;
+
+typedef void** (*glXChooseFBConfig_t)(void*, int, const int*, int*);
+static glXChooseFBConfig_t _glXChooseFBConfig = nullptr;
+
+typedef void* (*glXCreateNewContext_t)(void*, void*, int, void*, int);
+static glXCreateNewContext_t _glXCreateNewContext = nullptr;
+
+typedef unsigned long (*glXCreatePbuffer_t)(void*, void*, const int*);
+static glXCreatePbuffer_t _glXCreatePbuffer = nullptr;
+
+typedef int (*glXMakeContextCurrent_t)(void*, unsigned long, unsigned long, void*);
+static glXMakeContextCurrent_t _glXMakeContextCurrent = nullptr;
+
+typedef void (*glXDestroyContext_t)(void*, void*);
+static glXDestroyContext_t _glXDestroyContext = nullptr;
+
+typedef void (*glXDestroyPbuffer_t)(void*, unsigned long);
+static glXDestroyPbuffer_t _glXDestroyPbuffer = nullptr;
+
+typedef int (*XFree_t)(void*);
+static XFree_t _XFree = nullptr;
+
+typedef char* (*XDisplayString_t)(void*);
+static XDisplayString_t _XDisplayString = nullptr;
+
+typedef void* (*XOpenDisplay_t)(const char*);
+static XOpenDisplay_t _XOpenDisplay = nullptr;
+
+typedef int (*XCloseDisplay_t)(void*);
+static XCloseDisplay_t _XCloseDisplay = nullptr;
+
+typedef int (*XSync_t)(void*, int);
+static XSync_t _XSync = nullptr;
+
+// the event is an XErrorEvent, which we only pass along
+typedef int (*XErrorHandler_t)(void*, void*);
+typedef XErrorHandler_t (*XSetErrorHandler_t)(XErrorHandler_t);
+static XSetErrorHandler_t _XSetErrorHandler = nullptr;
+
+struct SharedContext {
+  // our own connection, see CreateSharedContext
+  void *dpy;
+  void *ctx;
+  unsigned long pbuffer;
+};
+
+#define XSYM(name) \
+  _##name = (name##_t) dlsym(RTLD_DEFAULT, #name); \
+  if (!_##name) { \
+    Log("Could not find " #name); \
+    return false; \
+  }
+
+static bool LoadSharedContextFunctions () {
+  GLSYM(glXGetCurrentContext)
+  GLSYM(glXGetCurrentDisplay)
+  GLSYM(glXQueryContext)
+  GLSYM(glXIsDirect)
+  GLSYM(glXChooseFBConfig)
+  GLSYM(glXCreateNewContext)
+  GLSYM(glXCreatePbuffer)
+  GLSYM(glXMakeContextCurrent)
+  GLSYM(glXDestroyContext)
+  GLSYM(glXDestroyPbuffer)
+
+  // libX11 is already loaded by whoever gave us a GLX context
+  XSYM(XFree)
+  XSYM(XDisplayString)
+  XSYM(XOpenDisplay)
+  XSYM(XCloseDisplay)
+  XSYM(XSync)
+  XSYM(XSetErrorHandler)
+
+  return true;
+}
+
+// Xlib's default error handler exits the process: while setting up the
+// shared context, errors on our connection are noted instead, so we can
+// fall back to copying on the render thread. The handler is global, so
+// errors on the game's connections still go to the one it had.
+static void *trap_dpy = nullptr;
+static bool trapped_error = false;
+static XErrorHandler_t prev_error_handler = nullptr;
+
+static int TrapError (void *dpy, void *event) {
+  if (dpy == trap_dpy) {
+    trapped_error = true;
+    return 0;
+  }
+  return prev_error_handler ? prev_error_handler(dpy, event) : 0;
+}
+
+static void TrapErrors (void *dpy) {
+  trap_dpy = dpy;
+  trapped_error = false;
+  prev_error_handler = _XSetErrorHandler(TrapError);
+}
+
+// Returns true if any request since TrapErrors failed
+static bool UntrapErrors (void *dpy) {
+  // errors come back asynchronously, make sure they're all in
+  _XSync(dpy, 0 /* False */);
+  _XSetErrorHandler(prev_error_handler);
+  trap_dpy = nullptr;
+  return trapped_error;
+}
+
+void *CreateSharedContext () {
+  static bool functions_loaded = LoadSharedContextFunctions();
+  if (!functions_loaded) {
+    return nullptr;
+  }
+
+  void *game_dpy = _glXGetCurrentDisplay();
+  void *share = _glXGetCurrentContext();
+  if (!game_dpy || !share) {
+    Log("CreateSharedContext: no current context");
+    return nullptr;
+  }
+
+  // GLX lets contexts share objects if they live in the same address
+  // space: both direct and in the same process, whichever connection
+  // they were made on. we check ours is direct once it's created.
+  if (!_glXIsDirect(game_dpy, share)) {
+    Log("CreateSharedContext: game context is indirect, can't share it");
+    return nullptr;
+  }
+
+  // same fbconfig as the game's context, so the share can't be rejected
+  // as a mismatch
+  int screen = 0;
+  int fbconfig_id = 0;
+  if (_glXQueryContext(game_dpy, share, GLX_SCREEN, &screen) != 0 /* Success */ ||
+      _glXQueryContext(game_dpy, share, GLX_FBCONFIG_ID, &fbconfig_id) != 0 /* Success */) {
+    Log("CreateSharedContext: could not query game context");
+    return nullptr;
+  }
+
+  // the capture thread can't use the game's connection: unless the game
+  // called XInitThreads, Xlib isn't safe to use from two threads at once.
+  void *dpy = _XOpenDisplay(_XDisplayString(game_dpy));
+  if (!dpy) {
+    Log("CreateSharedContext: could not open display");
+    return nullptr;
+  }
+
+  TrapErrors(dpy);
+
+  // fbconfig IDs are the server's, they mean the same on our connection
+  const int config_attribs[] = {
+    GLX_FBCONFIG_ID, fbconfig_id,
+    0
+  };
+  int num_configs = 0;
+  void *config = nullptr;
+  void **configs = _glXChooseFBConfig(dpy, screen, config_attribs, &num_configs);
+  if (configs && num_configs > 0) {
+    config = configs[0];
+  }
+  if (configs) {
+    _XFree(configs);
+  }
+
+  // we never draw anything, but need a drawable to make current
+  const int pbuffer_attribs[] = {
+    GLX_PBUFFER_WIDTH, 1,
+    GLX_PBUFFER_HEIGHT, 1,
+    0
+  };
+  unsigned long pbuffer = 0;
+  void *ctx = nullptr;
+  if (config) {
+    pbuffer = _glXCreatePbuffer(dpy, config, pbuffer_attribs);
+  }
+  if (pbuffer) {
+    ctx = _glXCreateNewContext(dpy, config, GLX_RGBA_TYPE, share, 1 /* direct */);
+  }
+
+  bool failed = UntrapErrors(dpy);
+  if (failed || !ctx || !_glXIsDirect(dpy, ctx)) {
+    if (!config) {
+      Log("CreateSharedContext: fbconfig %d not found", fbconfig_id);
+    } else if (!pbuffer) {
+      Log("CreateSharedContext: could not create pbuffer for fbconfig %d", fbconfig_id);
+    } else {
+      Log("CreateSharedContext: could not create direct shared context");
+    }
+
+    // those may fail too, if they were never really created
+    TrapErrors(dpy);
+    if (ctx) {
+      _glXDestroyContext(dpy, ctx);
+    }
+    if (pbuffer) {
+      _glXDestroyPbuffer(dpy, pbuffer);
+    }
+    UntrapErrors(dpy);
+    _XCloseDisplay(dpy);
+    return nullptr;
+  }
+
+  Log("CreateSharedContext: created shared context");
+  return new SharedContext{dpy, ctx, pbuffer};
+}
+
+bool MakeSharedContextCurrent (void *ctx) {
+  auto shared = reinterpret_cast<SharedContext*>(ctx);
+  return !!_glXMakeContextCurrent(shared->dpy, shared->pbuffer, shared->pbuffer, shared->ctx);
+}
+
+void ReleaseSharedContext (void *ctx) {
+  auto shared = reinterpret_cast<SharedContext*>(ctx);
+  _glXMakeContextCurrent(shared->dpy, 0 /* None */, 0 /* None */, nullptr);
+}
+
+void DestroySharedContext (void *ctx) {
+  auto shared = reinterpret_cast<SharedContext*>(ctx);
+  if (!shared) {
+    return;
+  }
+  _glXDestroyContext(shared->dpy, shared->ctx);
+  _glXDestroyPbuffer(shared->dpy, shared->pbuffer);
+  _XCloseDisplay(shared->dpy);
+  delete shared;
+}
+
 } // namespace gl
 } // namespace capsule
 
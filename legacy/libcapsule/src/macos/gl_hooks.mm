@@ -24,6 +24,7 @@
 
 #include "interpose.h"
 #include "../capture.h"
+#include "../logging.h"
 #include "../gl_capture_callback.h"
 
 namespace capsule {
@@ -40,6 +41,23 @@ void *GetProcAddress(const char *symbol) {
   return dlsym(handle, symbol);
 }
 
+// only built with CAPSULE_THREADED_COPY on Linux for now, everything
+// here reads back on the render thread.
+void *CreateSharedContext() {
+  Log("CreateSharedContext: not supported on this platform");
+  return nullptr;
+}
+
+bool MakeSharedContextCurrent(void * /*ctx*/) {
+  return false;
+}
+
+void ReleaseSharedContext(void * /*ctx*/) {
+}
+
+void DestroySharedContext(void * /*ctx*/) {
+}
+
 } // namespace gl
 } // namespace capsule
 
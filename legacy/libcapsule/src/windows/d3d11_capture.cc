@@ -1010,19 +1010,30 @@ void Capture(void *swap_ptr, void *backbuffer_ptr) {
   }
 
   if (first_frame) {
-    messages::PixFmt pix_fmt;
+    int width = state.cx / state.size_divider;
+    int height = state.cy / state.size_divider;
     if (state.gpu_color_conv) {
-      pix_fmt = messages::PixFmt_YUV444P;
+      // the conversion shader lays out Y, U and V side by side
+      // on each row of a single texture
+      int64_t offset[3] = {0, width, width * 2};
+      int64_t linesize[3] = {state.pitch, state.pitch, state.pitch};
+      io::WriteVideoFormat(
+        width,
+        height,
+        messages::PixFmt_YUV444P,
+        false /* no vflip */,
+        offset,
+        linesize
+      );
     } else {
-      pix_fmt = dxgi::FormatToPixFmt(state.format);
+      io::WriteVideoFormat(
+        width,
+        height,
+        dxgi::FormatToPixFmt(state.format),
+        false /* no vflip */,
+        state.pitch
+      );
     }
-    io::WriteVideoFormat(
-      state.cx / state.size_divider,
-      state.cy / state.size_divider,
-      pix_fmt,
-      false /* no vflip */,
-      state.pitch
-    );
     first_frame = false;
   }
 
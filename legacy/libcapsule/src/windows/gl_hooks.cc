@@ -55,5 +55,22 @@ void *GetProcAddress (const char *symbol) {
   return addr;
 }
 
+// only built with CAPSULE_THREADED_COPY on Linux for now, everything
+// here reads back on the render thread.
+void *CreateSharedContext () {
+  Log("CreateSharedContext: not supported on this platform");
+  return nullptr;
+}
+
+bool MakeSharedContextCurrent (void * /*ctx*/) {
+  return false;
+}
+
+void ReleaseSharedContext (void * /*ctx*/) {
+}
+
+void DestroySharedContext (void * /*ctx*/) {
+}
+
 } // namespace gl
 } // namespace capsule
@@ -0,0 +1,231 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <thread>
+#include <vector>
+
+#include <capsule/audio_ring.h>
+
+#include "lest.hpp"
+
+using namespace capsule;
+
+namespace {
+
+// header first, then capacity frames, like the audio shm area
+struct Ring {
+  Ring(uint32_t frame_size, uint32_t capacity) :
+      storage((audio_ring::kHeaderSize + frame_size * capacity) / sizeof(uint64_t) + 1) {
+    header = reinterpret_cast<audio_ring::Header*>(storage.data());
+    audio_ring::Init(header, frame_size, capacity);
+    ring_signal::Open(&signal, header->signal_name);
+  }
+  ~Ring() {
+    ring_signal::Close(&signal);
+  }
+
+  std::vector<uint64_t> storage;
+  audio_ring::Header *header;
+  ring_signal::Signal signal;
+};
+
+// frames of one int32 sample, numbered from first
+static std::vector<int32_t> Frames (int32_t first, int count) {
+  std::vector<int32_t> frames(count);
+  for (int i = 0; i < count; i++) {
+    frames[i] = first + i;
+  }
+  return frames;
+}
+
+static uint32_t Write (Ring &r, const std::vector<int32_t> &frames) {
+  return audio_ring::Write(r.header, reinterpret_cast<const char*>(frames.data()),
+    (uint32_t) frames.size(), &r.signal);
+}
+
+// read everything there is, the way AudioInterceptReceiver does
+static std::vector<int32_t> ReadAll (Ring &r) {
+  std::vector<int32_t> out;
+  uint32_t index;
+  uint32_t n;
+  while ((n = audio_ring::Peek(r.header, &index)) > 0) {
+    auto data = reinterpret_cast<int32_t*>(audio_ring::Data(r.header)) + index;
+    out.insert(out.end(), data, data + n);
+    audio_ring::Consume(r.header, n);
+  }
+  return out;
+}
+
+} // namespace
+
+const lest::test specification[] = {
+  CASE("audio_ring: writes and reads wrap around the end of the buffer") {
+    Ring r(sizeof(int32_t), 10);
+    auto h = r.header;
+    EXPECT(audio_ring::Valid(h));
+
+    // move the cursors close to the end first
+    EXPECT(7u == Write(r, Frames(0, 7)));
+    EXPECT(Frames(0, 7) == ReadAll(r));
+
+    EXPECT(6u == Write(r, Frames(100, 6)));
+
+    // the first Peek stops at the end of the buffer, the rest is at the front
+    uint32_t index;
+    EXPECT(3u == audio_ring::Peek(h, &index));
+    EXPECT(7u == index);
+    EXPECT(Frames(100, 6) == ReadAll(r));
+
+    // many more times around, through the cursors' own wrap at 2 * capacity
+    int32_t next = 1000;
+    for (int i = 0; i < 50; i++) {
+      int count = 1 + (i * 7) % 10;
+      EXPECT((uint32_t) count == Write(r, Frames(next, count)));
+      EXPECT(Frames(next, count) == ReadAll(r));
+      next += count;
+    }
+    EXPECT(0u == h->overruns.load());
+  },
+
+  CASE("audio_ring: a full ring is told apart from an empty one") {
+    Ring r(sizeof(int32_t), 4);
+    auto h = r.header;
+
+    EXPECT(4u == Write(r, Frames(0, 4)));
+    uint32_t index;
+    EXPECT(4u == audio_ring::Peek(h, &index));
+    EXPECT(Frames(0, 4) == ReadAll(r));
+
+    EXPECT(0u == audio_ring::Peek(h, &index));
+  },
+
+  CASE("audio_ring: a slow reader drops new frames, counted as overruns") {
+    Ring r(sizeof(int32_t), 8);
+    auto h = r.header;
+
+    EXPECT(5u == Write(r, Frames(0, 5)));
+    // only 3 of those fit
+    EXPECT(3u == Write(r, Frames(5, 6)));
+    EXPECT(3u == h->overruns.load());
+    EXPECT(0u == Write(r, Frames(11, 2)));
+    EXPECT(5u == h->overruns.load());
+
+    // what made it in is intact, and in order
+    EXPECT(Frames(0, 8) == ReadAll(r));
+
+    // room again once the reader catches up
+    EXPECT(2u == Write(r, Frames(20, 2)));
+    EXPECT(Frames(20, 2) == ReadAll(r));
+    EXPECT(5u == h->overruns.load());
+  },
+
+  CASE("audio_ring: new format, new ring") {
+    Ring r(sizeof(int32_t), 8);
+    auto h = r.header;
+    Write(r, Frames(0, 5));
+    ReadAll(r);
+    Write(r, Frames(5, 2));
+
+    // libcapsule re-initializes the header when the audio format
+    // changes, here from mono s32 to stereo f32
+    audio_ring::Init(h, 2 * sizeof(float), 4);
+    EXPECT(audio_ring::Valid(h));
+    EXPECT(2 * sizeof(float) == h->frame_size);
+    EXPECT(0u == h->write_pos.load());
+    EXPECT(0u == h->read_pos.load());
+    EXPECT(0u == h->overruns.load());
+
+    uint32_t index;
+    EXPECT(0u == audio_ring::Peek(h, &index));
+
+    const float stereo[] = {0.25f, -0.25f, 0.5f, -0.5f};
+    EXPECT(2u == audio_ring::Write(h, reinterpret_cast<const char*>(stereo), 2, &r.signal));
+    EXPECT(2u == audio_ring::Peek(h, &index));
+    EXPECT(0u == index);
+    EXPECT(0 == memcmp(audio_ring::Data(h), stereo, sizeof(stereo)));
+  },
+
+  CASE("audio_ring: invalid headers are rejected") {
+    Ring r(sizeof(int32_t), 8);
+    auto h = r.header;
+
+    h->frame_size = 0;
+    EXPECT(false == audio_ring::Valid(h));
+    h->frame_size = 4;
+    h->capacity = 0;
+    EXPECT(false == audio_ring::Valid(h));
+    h->capacity = UINT32_MAX;
+    EXPECT(false == audio_ring::Valid(h));
+    h->capacity = 8;
+    h->magic = 0;
+    EXPECT(false == audio_ring::Valid(h));
+  },
+
+  CASE("audio_ring: a waiting reader gets every frame from a writer thread") {
+    static const int kFrames = 200000;
+    Ring r(sizeof(int32_t), 64);
+
+    std::thread writer([&]() {
+      int32_t next = 0;
+      while (next < kFrames) {
+        int count = 1 + next % 37;
+        if (count > kFrames - next) {
+          count = kFrames - next;
+        }
+        // never overrun, so the reader can check for every single frame
+        uint32_t read_pos = r.header->read_pos.load(std::memory_order_acquire);
+        uint32_t write_pos = r.header->write_pos.load(std::memory_order_relaxed);
+        if (audio_ring::Used(r.header, write_pos, read_pos) + count > r.header->capacity) {
+          std::this_thread::yield();
+          continue;
+        }
+        Write(r, Frames(next, count));
+        next += count;
+      }
+    });
+
+    int32_t expected = 0;
+    int mismatches = 0;
+    while (expected < kFrames) {
+      auto frames = ReadAll(r);
+      if (frames.empty()) {
+        audio_ring::Wait(r.header, 100, &r.signal);
+        continue;
+      }
+      for (auto frame : frames) {
+        if (frame != expected++) {
+          mismatches++;
+        }
+      }
+    }
+    writer.join();
+
+    EXPECT(0 == mismatches);
+    EXPECT(0u == r.header->overruns.load());
+  },
+};
+
+int main (int argc, char *argv[]) {
+  return lest::run(specification, argc, argv);
+}
@@ -0,0 +1,324 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <capsule/shm_ring.h>
+
+#include "lest.hpp"
+
+using namespace capsule;
+
+namespace {
+
+// the ring header lives at the front of a shm area in real life
+struct Ring {
+  Ring(uint32_t num_slots, uint32_t generation) : storage(shm_ring::kHeaderSize / sizeof(uint64_t)) {
+    header = reinterpret_cast<shm_ring::Header*>(storage.data());
+    shm_ring::Init(header, num_slots, generation);
+    ring_signal::Open(&signal, header->signal_name);
+  }
+  ~Ring() {
+    ring_signal::Close(&signal);
+  }
+
+  std::vector<uint64_t> storage;
+  shm_ring::Header *header;
+  ring_signal::Signal signal;
+};
+
+} // namespace
+
+const lest::test specification[] = {
+  CASE("shm_ring: slots are handed out in order and wrap around") {
+    Ring r(3, 1);
+    auto h = r.header;
+    EXPECT(shm_ring::Valid(h));
+
+    shm_ring::Descriptor desc;
+    EXPECT(false == shm_ring::Peek(h, &desc));
+
+    for (int i = 0; i < 10; i++) {
+      int slot = shm_ring::NextSlot(h);
+      EXPECT(i % 3 == slot);
+      shm_ring::Push(h, 1000 + i, &r.signal);
+
+      EXPECT(true == shm_ring::Peek(h, &desc));
+      EXPECT((uint32_t) slot == desc.index);
+      EXPECT(1000 + i == desc.timestamp);
+      EXPECT(1u == desc.generation);
+      shm_ring::Pop(h);
+      EXPECT(false == shm_ring::Peek(h, &desc));
+    }
+  },
+
+  CASE("shm_ring: consumers holding several slots peek ahead, pop in order") {
+    Ring r(4, 1);
+    auto h = r.header;
+
+    // start near the end so holding on to slots straddles the wrap
+    for (int i = 0; i < 3; i++) {
+      shm_ring::Push(h, i, &r.signal);
+      shm_ring::Pop(h);
+    }
+    for (int i = 3; i < 7; i++) {
+      EXPECT(shm_ring::NextSlot(h) >= 0);
+      shm_ring::Push(h, i, &r.signal);
+    }
+
+    uint32_t tail = h->tail.load();
+    shm_ring::Descriptor desc;
+    for (uint32_t pos = tail; pos < tail + 4; pos++) {
+      EXPECT(true == shm_ring::PeekAt(h, pos, &desc));
+      EXPECT((int64_t) pos == desc.timestamp);
+      EXPECT(pos % 4 == desc.index);
+    }
+    EXPECT(false == shm_ring::PeekAt(h, tail + 4, &desc));
+
+    shm_ring::Pop(h);
+    EXPECT(3 == shm_ring::NextSlot(h));
+  },
+
+  CASE("shm_ring: full ring, oldest frames win") {
+    Ring r(3, 1);
+    auto h = r.header;
+    h->drop_policy.store(shm_ring::kDropPolicyOldestWins);
+
+    for (int i = 0; i < 3; i++) {
+      EXPECT(true == shm_ring::WantFrame(h));
+      shm_ring::Push(h, i, &r.signal);
+    }
+    EXPECT(-1 == shm_ring::NextSlot(h));
+    EXPECT(false == shm_ring::WantFrame(h));
+
+    // what's in the ring stays untouched
+    shm_ring::Descriptor desc;
+    EXPECT(true == shm_ring::Peek(h, &desc));
+    EXPECT(0 == desc.timestamp);
+
+    shm_ring::Pop(h);
+    EXPECT(true == shm_ring::WantFrame(h));
+    EXPECT(0 == shm_ring::NextSlot(h));
+  },
+
+  CASE("shm_ring: full ring, newest frames win") {
+    Ring r(3, 1);
+    auto h = r.header;
+    h->drop_policy.store(shm_ring::kDropPolicyNewestWins);
+
+    for (int i = 0; i < 3; i++) {
+      shm_ring::Push(h, i, &r.signal);
+    }
+    // still captured, the consumer skips what it hasn't started on
+    EXPECT(-1 == shm_ring::NextSlot(h));
+    EXPECT(true == shm_ring::WantFrame(h));
+
+    shm_ring::Descriptor newest;
+    uint32_t tail = h->tail.load();
+    EXPECT(true == shm_ring::PeekAt(h, tail + 2, &newest));
+    EXPECT(2 == newest.timestamp);
+    shm_ring::Pop(h);
+    shm_ring::Pop(h);
+
+    shm_ring::Descriptor desc;
+    EXPECT(true == shm_ring::Peek(h, &desc));
+    EXPECT(newest.timestamp == desc.timestamp);
+  },
+
+  CASE("shm_ring: full ring, even drops go through min_interval_us") {
+    Ring r(3, 1);
+    auto h = r.header;
+    h->drop_policy.store(shm_ring::kDropPolicyEven);
+    EXPECT(0u == h->min_interval_us.load());
+
+    for (int i = 0; i < 3; i++) {
+      shm_ring::Push(h, i, &r.signal);
+    }
+    EXPECT(-1 == shm_ring::NextSlot(h));
+    EXPECT(true == shm_ring::WantFrame(h));
+
+    // the consumer throttles the producer rather than the ring
+    h->min_interval_us.store(2 * 16666);
+    EXPECT(33332u == h->min_interval_us.load());
+
+    // Init resets capture control along with everything else
+    shm_ring::Init(h, 3, 2);
+    EXPECT(0u == h->min_interval_us.load());
+    EXPECT((uint32_t) shm_ring::kDropPolicyOldestWins == h->drop_policy.load());
+  },
+
+  CASE("shm_ring: descriptors from a previous format are told apart") {
+    Ring r(3, 1);
+    auto h = r.header;
+    shm_ring::Push(h, 42, &r.signal);
+
+    shm_ring::Descriptor before;
+    EXPECT(true == shm_ring::Peek(h, &before));
+    EXPECT(before.generation == h->generation);
+
+    // new VideoSetup: libcapsule re-initializes the header in place,
+    // a stale copy of the old descriptor no longer matches
+    shm_ring::Init(h, 4, h->generation + 1);
+    EXPECT(before.generation != h->generation);
+    shm_ring::Descriptor desc;
+    EXPECT(false == shm_ring::Peek(h, &desc));
+
+    shm_ring::Push(h, 43, &r.signal);
+    EXPECT(true == shm_ring::Peek(h, &desc));
+    EXPECT(desc.generation == h->generation);
+    EXPECT(0u == desc.index);
+  },
+
+  CASE("shm_ring: invalid headers are rejected") {
+    Ring r(3, 1);
+    auto h = r.header;
+    EXPECT(true == shm_ring::Valid(h));
+
+    h->num_slots = 0;
+    EXPECT(false == shm_ring::Valid(h));
+    h->num_slots = shm_ring::kMaxSlots + 1;
+    EXPECT(false == shm_ring::Valid(h));
+    h->num_slots = 3;
+    h->magic = 0;
+    EXPECT(false == shm_ring::Valid(h));
+  },
+
+  CASE("shm_ring: Wait times out, or doesn't sleep at all") {
+    Ring r(3, 1);
+    auto h = r.header;
+
+    auto start = std::chrono::steady_clock::now();
+    shm_ring::Wait(h, 20, &r.signal);
+    EXPECT(0u == h->sleeping.load());
+    EXPECT(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+
+    // nothing to wait for if there's already something in the ring
+    shm_ring::Push(h, 1, &r.signal);
+    start = std::chrono::steady_clock::now();
+    shm_ring::Wait(h, 5000, &r.signal);
+    EXPECT(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+  },
+
+  CASE("shm_ring: Wake gets the consumer out of Wait") {
+    Ring r(3, 1);
+    auto h = r.header;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread waker([&]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      shm_ring::Wake(h, &r.signal);
+    });
+    shm_ring::Wait(h, 10000, &r.signal);
+    waker.join();
+    EXPECT(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+  },
+
+  CASE("shm_ring: Push wakes a consumer waiting past a given position") {
+    Ring r(4, 1);
+    auto h = r.header;
+    h->drop_policy.store(shm_ring::kDropPolicyEven);
+
+    // the encoder holds on to a frame and waits for the one after it
+    shm_ring::Push(h, 0, &r.signal);
+    uint32_t pos = h->head.load();
+
+    std::thread producer([&]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      shm_ring::Push(h, 1, &r.signal);
+    });
+    auto start = std::chrono::steady_clock::now();
+    while (h->head.load() == pos) {
+      shm_ring::WaitAt(h, pos, 10000, &r.signal);
+    }
+    EXPECT(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    producer.join();
+
+    shm_ring::Descriptor desc;
+    EXPECT(true == shm_ring::PeekAt(h, pos, &desc));
+    EXPECT(1 == desc.timestamp);
+  },
+
+  CASE("shm_ring: producer and consumer threads agree on every frame") {
+    static const uint32_t kSlots = 3;
+    static const int kFrames = 20000;
+    static const int kFrameSize = 256;
+
+    Ring r(kSlots, 1);
+    auto h = r.header;
+    std::vector<int64_t> frames(kSlots * kFrameSize / sizeof(int64_t));
+    auto slot_data = [&](int slot) {
+      return &frames[slot * kFrameSize / sizeof(int64_t)];
+    };
+    auto per_slot = kFrameSize / sizeof(int64_t);
+
+    std::thread producer([&]() {
+      for (int i = 0; i < kFrames; i++) {
+        int slot;
+        while ((slot = shm_ring::NextSlot(h)) < 0) {
+          std::this_thread::yield();
+        }
+        auto data = slot_data(slot);
+        for (size_t j = 0; j < per_slot; j++) {
+          data[j] = i;
+        }
+        shm_ring::Push(h, i, &r.signal);
+      }
+    });
+
+    int received = 0;
+    int torn = 0;
+    int out_of_order = 0;
+    while (received < kFrames) {
+      shm_ring::Descriptor desc;
+      if (!shm_ring::Peek(h, &desc)) {
+        shm_ring::Wait(h, 100, &r.signal);
+        continue;
+      }
+      if (desc.timestamp != received) {
+        out_of_order++;
+      }
+      auto data = slot_data((int) desc.index);
+      for (size_t j = 0; j < per_slot; j++) {
+        if (data[j] != desc.timestamp) {
+          torn++;
+          break;
+        }
+      }
+      shm_ring::Pop(h);
+      received++;
+    }
+    producer.join();
+
+    EXPECT(0 == torn);
+    EXPECT(0 == out_of_order);
+    EXPECT((uint32_t) kFrames == h->head.load());
+    EXPECT(h->head.load() == h->tail.load());
+  },
+};
+
+int main (int argc, char *argv[]) {
+  return lest::run(specification, argc, argv);
+}